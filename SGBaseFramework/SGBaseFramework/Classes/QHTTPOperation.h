@@ -47,9 +47,28 @@
       (used to size the response buffer) and a maximum response size 
       (to prevent unbounded memory use).
     
+    o For in-memory responses, you can give the operation an SGBufferPool, 
+      in which case the response buffer is borrowed from the pool and goes 
+      back to it when responseBody is released.
+    
+    o You can process the response as it arrives, by giving the operation a 
+      chain of QHTTPResponseConsumer objects.  See QHTTPResponseConsumer.h.
+    
     o You can get at the last request and the last response, to track 
       redirects.
 
+    o You can give it an SGURLCache, in which case GET requests are revalidated 
+      against the cache.  If the cache has the body of a previous response, 
+      the operation adds If-None-Match and If-Modified-Since headers built from 
+      that response's validators.  If the server replies 304 (Not Modified), 
+      the operation finishes successfully with the cached body in responseBody. 
+      Otherwise, an acceptable response is stored in the cache, along with its 
+      validators, for next time.  The cache is only used for in-memory responses; 
+      it's ignored if responseOutputStream is set.  It's also ignored for requests 
+      with an Authorization header, and responses marked Cache-Control no-store 
+      or private aren't stored.  The cache does its file I/O on its own queue, 
+      so the run loop thread never waits for the disk.
+
     o There are a variety of funky debugging options to simulator errors 
       and delays.
       
@@ -60,6 +79,9 @@
 */
 
 @protocol QHTTPOperationAuthenticationDelegate;
+@class SGURLCache;
+@class QHTTPResponseConsumer;
+@class SGBufferPool;
 
 @interface QHTTPOperation : QRunLoopOperation /* <NSURLConnectionDelegate> */
 {
@@ -67,7 +89,17 @@
     NSIndexSet *        _acceptableStatusCodes;
     NSSet *             _acceptableContentTypes;
     id<QHTTPOperationAuthenticationDelegate>    _authenticationDelegate;
+    SGURLCache *        _cache;
+    SGBufferPool *      _bufferPool;
+    QHTTPOperation *    _leaderOperation;
+    volatile BOOL       _hasFollowers;
+    NSData *            _cachedResponseBody;
+    NSDictionary *      _cachedValidators;
+    BOOL                _responseFromCache;
     NSOutputStream *    _responseOutputStream;
+    QHTTPResponseConsumer * _responseConsumer;
+    BOOL                _responseConsumerStarted;
+    NSUInteger          _responseConsumerPauseCount;
     NSUInteger          _defaultResponseSize;
     NSUInteger          _maximumResponseSize;
     NSURLConnection *   _connection;
@@ -76,6 +108,10 @@
     NSURLRequest *      _lastRequest;
     NSHTTPURLResponse * _lastResponse;
     NSData *            _responseBody;
+    CFAbsoluteTime      _connectionStartTime;
+    NSTimeInterval      _timeToFirstByte;
+    NSTimeInterval      _transferDuration;
+    long long           _bytesReceived;
 #if ! defined(NDEBUG)
     NSError *           _debugError;
     NSTimeInterval      _debugDelay;
@@ -100,6 +136,17 @@
 @property (nonatomic, copy, readwrite) NSIndexSet * acceptableStatusCodes;  // default is nil, implying 200..299
 @property (nonatomic, copy, readwrite) NSSet * acceptableContentTypes; // default is nil, implying anything is acceptable
 @property (nonatomic, assign, readwrite) id<QHTTPOperationAuthenticationDelegate> authenticationDelegate;
+@property (nonatomic, retain, readwrite) SGURLCache * cache;            // default is nil, implying no revalidation
+@property (nonatomic, retain, readwrite) SGBufferPool * bufferPool;     // default is nil, implying a fresh buffer for each response
+@property (nonatomic, retain, readwrite) QHTTPOperation * leaderOperation; // default is nil; see below
+
+// If leaderOperation is set, this operation doesn't hit the network.  Instead, it must 
+// also depend on the leader and, when it starts, it takes the leader's response as its 
+// own, applying its own acceptableStatusCodes, acceptableContentTypes and 
+// maximumResponseSize.  If the leader was cancelled, it runs its request as normal. 
+// SGNetworkManager uses this to coalesce identical concurrent GETs; it only starts a 
+// follower once the leader has finished and, if the leader was cancelled, it clears 
+// leaderOperation and queues the follower as an ordinary transfer.
 
 #if ! defined(NDEBUG)
 @property (nonatomic, copy, readwrite) NSError * debugError; // default is nil
@@ -117,6 +164,7 @@
 // not work well for other types of streams (like a bound pair).
 
 @property (nonatomic, retain, readwrite) NSOutputStream *      responseOutputStream;   // defaults to nil, which puts response into responseBody
+@property (nonatomic, retain, readwrite) QHTTPResponseConsumer * responseConsumer;   // defaults to nil; if set, takes precedence over responseOutputStream
 @property (nonatomic, assign, readwrite) NSUInteger            defaultResponseSize;    // default is 1 MB, ignored if responseOutputStream is set
 @property (nonatomic, assign, readwrite) NSUInteger            maximumResponseSize;    // default is 4 MB, ignored if responseOutputStream is set
                                                                             // defaults are 1/4 of the above on embedded
@@ -134,6 +182,23 @@
 
 @property (nonatomic, copy, readonly) NSData * responseBody;   
 
+- (NSData *)detachResponseBody;
+    // Returns responseBody and clears the operation's reference to it, so that the 
+    // caller is its only owner.  There's no copy.  This matters if responseBody comes 
+    // from a bufferPool: the buffer goes back to the pool as soon as the caller is 
+    // done with it, rather than when the operation is deallocated.  The cache, if 
+    // any, stores a copy of the body, so it doesn't share the buffer.  If other 
+    // operations have been coalesced with this one (see leaderOperation), they 
+    // do share the body, so the operation keeps its reference.
+@property (nonatomic, assign, readonly, getter=isResponseFromCache) BOOL responseFromCache;  // YES if the server said 304 and responseBody came from the cache
+
+// Transfer metrics.  These are zero if the operation never started a connection (for 
+// example, if it was cancelled, or took its results from a leaderOperation).
+
+@property (nonatomic, assign, readonly) NSTimeInterval timeToFirstByte;    // from starting the connection to getting the response
+@property (nonatomic, assign, readonly) NSTimeInterval transferDuration;   // from starting the connection to finishing
+@property (nonatomic, assign, readonly) long long bytesReceived;           // body bytes, after any decoding
+
 @end
 
 @interface QHTTPOperation (NSURLConnectionDelegate)
@@ -197,5 +262,8 @@ extern NSString * kQHTTPOperationErrorDomain;
 enum {
     kQHTTPOperationErrorResponseTooLarge = -1, 
     kQHTTPOperationErrorOnOutputStream   = -2, 
-    kQHTTPOperationErrorBadContentType   = -3
+    kQHTTPOperationErrorBadContentType   = -3, 
+    kQHTTPOperationErrorOnResponseConsumer = -4, 
+    kQHTTPOperationErrorBadDigest        = -5, 
+    kQHTTPOperationErrorLeaderBodyDetached = -6
 };
@@ -7,7 +7,11 @@
 
 #import "QHTTPOperation.h"
 
-@interface QHTTPOperation ()
+#import "SGURLCache.h"
+#import "QHTTPResponseConsumer.h"
+#import "SGBufferPool.h"
+
+@interface QHTTPOperation () <QHTTPResponseConsumerFlowControl>
 
 // Read/write versions of public properties
 
@@ -19,6 +23,8 @@
 @property (nonatomic, retain, readwrite) NSURLConnection * connection;
 @property (nonatomic, assign, readwrite) BOOL firstData;
 @property (nonatomic, retain, readwrite) NSMutableData * dataAccumulator;
+@property (nonatomic, retain, readwrite) NSData * cachedResponseBody;
+@property (nonatomic, copy,   readwrite) NSDictionary * cachedValidators;
 
 #if ! defined(NDEBUG)
 @property (nonatomic, retain, readwrite) NSTimer * debugDelayTimer;
@@ -72,6 +78,12 @@
     [self->_acceptableStatusCodes release];
     [self->_acceptableContentTypes release];
     [self->_responseOutputStream release];
+    [self->_responseConsumer release];
+    [self->_cache release];
+    [self->_bufferPool release];
+    [self->_leaderOperation release];
+    [self->_cachedResponseBody release];
+    [self->_cachedValidators release];
     assert(self->_connection == nil);               // should have been shut down by now
     [self->_dataAccumulator release];
     [self->_lastRequest release];
@@ -113,6 +125,88 @@
     }
 }
 
+@synthesize cache = _cache;
+
++ (BOOL)automaticallyNotifiesObserversOfCache
+{
+    return NO;
+}
+
+- (SGURLCache *)cache
+{
+    return [[self->_cache retain] autorelease];
+}
+
+- (void)setCache:(SGURLCache *)newValue
+{
+    if (self.state != kQRunLoopOperationStateInited) {
+        assert(NO);
+    } else {
+        if (newValue != self->_cache) {
+            [self willChangeValueForKey:@"cache"];
+            [self->_cache autorelease];
+            self->_cache = [newValue retain];
+            [self didChangeValueForKey:@"cache"];
+        }
+    }
+}
+
+@synthesize bufferPool = _bufferPool;
+
++ (BOOL)automaticallyNotifiesObserversOfBufferPool
+{
+    return NO;
+}
+
+- (SGBufferPool *)bufferPool
+{
+    return [[self->_bufferPool retain] autorelease];
+}
+
+- (void)setBufferPool:(SGBufferPool *)newValue
+{
+    if (self.state != kQRunLoopOperationStateInited) {
+        assert(NO);
+    } else {
+        if (newValue != self->_bufferPool) {
+            [self willChangeValueForKey:@"bufferPool"];
+            [self->_bufferPool autorelease];
+            self->_bufferPool = [newValue retain];
+            [self didChangeValueForKey:@"bufferPool"];
+        }
+    }
+}
+
+@synthesize leaderOperation = _leaderOperation;
+
++ (BOOL)automaticallyNotifiesObserversOfLeaderOperation
+{
+    return NO;
+}
+
+- (QHTTPOperation *)leaderOperation
+{
+    return [[self->_leaderOperation retain] autorelease];
+}
+
+- (void)setLeaderOperation:(QHTTPOperation *)newValue
+{
+    if (self.state != kQRunLoopOperationStateInited) {
+        assert(NO);
+    } else {
+        assert(newValue != self);
+        if (newValue != self->_leaderOperation) {
+            [self willChangeValueForKey:@"leaderOperation"];
+            [self->_leaderOperation autorelease];
+            self->_leaderOperation = [newValue retain];
+            if (newValue != nil) {
+                newValue->_hasFollowers = YES;      // see -detachResponseBody
+            }
+            [self didChangeValueForKey:@"leaderOperation"];
+        }
+    }
+}
+
 @synthesize acceptableStatusCodes = _acceptableStatusCodes;
 
 + (BOOL)automaticallyNotifiesObserversOfAcceptableStatusCodes
@@ -191,6 +285,32 @@
     }
 }
 
+@synthesize responseConsumer = _responseConsumer;
+
++ (BOOL)automaticallyNotifiesObserversOfResponseConsumer
+{
+    return NO;
+}
+
+- (QHTTPResponseConsumer *)responseConsumer
+{
+    return [[self->_responseConsumer retain] autorelease];
+}
+
+- (void)setResponseConsumer:(QHTTPResponseConsumer *)newValue
+{
+    if ( ! self.firstData ) {
+        assert(NO);
+    } else {
+        if (newValue != self->_responseConsumer) {
+            [self willChangeValueForKey:@"responseConsumer"];
+            [self->_responseConsumer autorelease];
+            self->_responseConsumer = [newValue retain];
+            [self didChangeValueForKey:@"responseConsumer"];
+        }
+    }
+}
+
 @synthesize defaultResponseSize   = _defaultResponseSize;
 
 + (BOOL)automaticallyNotifiesObserversOfDefaultResponseSize
@@ -244,16 +364,45 @@
 @synthesize lastRequest     = _lastRequest;
 @synthesize lastResponse    = _lastResponse;
 @synthesize responseBody    = _responseBody;
+@synthesize responseFromCache = _responseFromCache;
+@synthesize timeToFirstByte   = _timeToFirstByte;
+@synthesize transferDuration  = _transferDuration;
+@synthesize bytesReceived     = _bytesReceived;
 
 @synthesize connection      = _connection;
 @synthesize firstData       = _firstData;
 @synthesize dataAccumulator = _dataAccumulator;
+@synthesize cachedResponseBody = _cachedResponseBody;
+@synthesize cachedValidators = _cachedValidators;
+
+- (NSData *)detachResponseBody
+    // See comment in header.
+{
+    NSData *    result;
+
+    if (self->_hasFollowers) {
+        result = [[self->_responseBody retain] autorelease];
+    } else {
+        result = [self->_responseBody autorelease];
+        self->_responseBody = nil;
+    }
+    return result;
+}
 
 - (NSURL *)URL
 {
     return [self.request URL];
 }
 
+- (BOOL)isNotModifiedResponse
+    // Returns YES if the server said that the body we have in the cache is still 
+    // good.  We only ever send a conditional request if we have a cached body, but 
+    // a client might have added its own conditional headers, so we check for both.
+{
+    assert(self.lastResponse != nil);
+    return ([self.lastResponse statusCode] == 304) && (self.cachedResponseBody != nil);
+}
+
 - (BOOL)isStatusCodeAcceptable
 {
     NSIndexSet *    acceptableStatusCodes;
@@ -261,6 +410,10 @@
     
     assert(self.lastResponse != nil);
     
+    if (self.isNotModifiedResponse) {
+        return YES;
+    }
+    
     acceptableStatusCodes = self.acceptableStatusCodes;
     if (acceptableStatusCodes == nil) {
         acceptableStatusCodes = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(200, 100)];
@@ -276,10 +429,354 @@
     NSString *  contentType;
     
     assert(self.lastResponse != nil);
+    if (self.isNotModifiedResponse) {
+        return YES;             // we checked the content type when we cached the body
+    }
     contentType = [self.lastResponse MIMEType];
     return (self.acceptableContentTypes == nil) || ((contentType != nil) && [self.acceptableContentTypes containsObject:contentType]);
 }
 
+#pragma mark * Revalidation
+
+static NSString * HeaderValue(NSHTTPURLResponse * response, NSString * name)
+    // Returns the value of the named header in the response.  Header names are 
+    // case insensitive, but -allHeaderFields preserves whatever case the server 
+    // used, so we can't just look the name up.
+{
+    NSDictionary *  headers;
+    NSString *      result;
+
+    assert(response != nil);
+    assert(name != nil);
+
+    headers = [response allHeaderFields];
+    result = [headers objectForKey:name];
+    if (result == nil) {
+        for (NSString * key in headers) {
+            if ([key caseInsensitiveCompare:name] == NSOrderedSame) {
+                result = [headers objectForKey:key];
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+- (NSString *)cacheURLString
+{
+    return [[self.request URL] absoluteString];
+}
+
+- (BOOL)shouldUseCache
+    // Returns YES if the response should be revalidated against, and stored in, 
+    // the cache.  A request with credentials gets a response meant for one user, 
+    // which has no business in a shared cache, nor should it be answered from one.
+{
+    return (self.cache != nil) 
+        && (self.responseOutputStream == nil) 
+        && (self.responseConsumer == nil) 
+        && [[self.request HTTPMethod] isEqual:@"GET"] 
+        && ([self.request valueForHTTPHeaderField:@"Authorization"] == nil);
+}
+
+- (BOOL)isResponseStorable
+    // Returns YES if the response may be kept in the cache.  The rules are shared 
+    // with QHTTPCacheResponseConsumer; see +[SGURLCache canStoreResponse:toRequest:].
+{
+    assert(self.lastResponse != nil);
+    return [SGURLCache canStoreResponse:self.lastResponse toRequest:self.lastRequest];
+}
+
+- (NSURLRequest *)conditionalRequestWithCachedBody:(NSData *)body validators:(NSDictionary *)validators
+    // Returns the request to send, given what the cache has for our URL.  If it has 
+    // a body and validators, this is a copy of the request with If-None-Match and 
+    // If-Modified-Since set, and the cached body and validators are latched for when 
+    // the 304 comes back.  If the cache has no body, we strip any conditional headers 
+    // the client added; otherwise the server could say 304 and we'd have nothing to show.
+{
+    NSMutableURLRequest *   result;
+
+    assert(self.shouldUseCache);
+
+    if (body == nil) {
+        validators = nil;
+    }
+
+    result = [[self.request mutableCopy] autorelease];
+    assert(result != nil);
+    [result setValue:[validators objectForKey:kSGCValidatorETagKey]         forHTTPHeaderField:@"If-None-Match"];
+    [result setValue:[validators objectForKey:kSGCValidatorLastModifiedKey] forHTTPHeaderField:@"If-Modified-Since"];
+    if (validators != nil) {
+        self.cachedResponseBody = body;
+        self.cachedValidators   = validators;
+
+        // Keep NSURLCache out of it; we want to see the 304 ourselves.
+
+        [result setCachePolicy:NSURLRequestReloadIgnoringLocalCacheData];
+    }
+    return result;
+}
+
+- (void)updateCache
+    // Called when the operation finishes successfully.  Stores a fresh response, and 
+    // its validators, in the cache.  For a 304, the cached body stays put, but the 
+    // server may have sent new validators, and the entry's freshness is renewed. 
+    // The disk writes happen on the cache's queue.
+{
+    NSMutableDictionary *   validators;
+    NSString *              value;
+
+    assert(self.shouldUseCache);
+    assert(self.responseBody != nil);
+
+    if ( ! self.isResponseStorable ) {
+        return;
+    }
+
+    validators = [NSMutableDictionary dictionary];
+    assert(validators != nil);
+    value = HeaderValue(self.lastResponse, @"ETag");
+    if (value != nil) {
+        [validators setObject:value forKey:kSGCValidatorETagKey];
+    }
+    value = HeaderValue(self.lastResponse, @"Last-Modified");
+    if (value != nil) {
+        [validators setObject:value forKey:kSGCValidatorLastModifiedKey];
+    }
+
+    if (self.isResponseFromCache) {
+        NSMutableDictionary *   merged;
+
+        // A 304 need not repeat the validators, but it does make the entry fresh again.
+
+        merged = [NSMutableDictionary dictionaryWithDictionary:self.cachedValidators];
+        assert(merged != nil);
+        [merged addEntriesFromDictionary:validators];
+        [self.cache storeValidatorsInBackground:merged forURL:self.cacheURLString];
+    } else {
+
+        // The cache gets its own copy.  The body may be a pooled buffer, and the cache 
+        // holding on to it would keep it out of the pool for as long as the entry lives, 
+        // and stop -detachResponseBody handing over the only reference.
+
+        [self.cache storeDataInBackground:[[self.responseBody copy] autorelease] validators:validators forURL:self.cacheURLString];
+    }
+}
+
+- (void)finishWithLeaderResults
+    // Called at start if we're coalesced with a leader operation that has finished. 
+    // We adopt its request, response and body, and then judge them by our own rules, 
+    // just as -connectionDidFinishLoading: would have done had we run the transfer.
+{
+    QHTTPOperation *    leader;
+
+    leader = self.leaderOperation;
+    assert(leader != nil);
+    assert([leader isFinished]);
+
+    self.lastRequest  = leader.lastRequest;
+    self.lastResponse = leader.lastResponse;
+
+    if ( (leader.lastResponse == nil) || (leader.responseBody == nil) ) {
+        if (leader.error != nil) {
+        
+            // The transfer itself failed, so there's nothing for us to judge.
+            
+            [self finishWithError:leader.error];
+        } else {
+        
+            // The leader succeeded, but its owner has already taken the body with 
+            // -detachResponseBody.  SGNetworkManager links followers before the leader 
+            // can finish, so this only happens if leaderOperation was set late by hand.
+            
+            [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorLeaderBodyDetached userInfo:nil]];
+        }
+    } else {
+        assert(self->_responseBody == nil);
+        self->_responseBody = [leader.responseBody retain];
+        if (leader.isResponseFromCache) {
+            self.cachedResponseBody = leader.responseBody;      // makes isNotModifiedResponse work
+            self->_responseFromCache = YES;
+        }
+        
+        if ( [self->_responseBody length] > self.maximumResponseSize ) {
+            [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorResponseTooLarge userInfo:nil]];
+        } else if ( ! self.isStatusCodeAcceptable ) {
+            [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:self.lastResponse.statusCode userInfo:nil]];
+        } else if ( ! self.isContentTypeAcceptable ) {
+            [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorBadContentType userInfo:nil]];
+        } else {
+            [self finishWithError:nil];
+        }
+    }
+}
+
+#pragma mark * Response consumers
+
+- (BOOL)shouldUseResponseConsumer
+    // Returns YES if the body should go to the response consumer chain.  Error 
+    // responses are accumulated in memory, so the client can look at them.
+{
+    assert(self.lastResponse != nil);
+    return (self.responseConsumer != nil) && self.isStatusCodeAcceptable && ! self.isNotModifiedResponse;
+}
+
+- (BOOL)startResponseConsumer
+    // Starts the response consumer chain.  If that fails, this finishes the operation 
+    // and returns NO.  We check the content type first, since there's no point 
+    // streaming a body that we're going to reject.
+{
+    NSError *   error;
+
+    assert(self.responseConsumer != nil);
+    assert( ! self->_responseConsumerStarted );
+
+    if ( ! self.isContentTypeAcceptable ) {
+        [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorBadContentType userInfo:nil]];
+        return NO;
+    }
+
+    for (QHTTPResponseConsumer * consumer = self.responseConsumer; consumer != nil; consumer = consumer.nextConsumer) {
+        consumer.flowControl = self;
+        consumer.request     = self.lastRequest;
+    }
+
+    error = nil;
+    if ( ! [self.responseConsumer startWithResponse:self.lastResponse error:&error] ) {
+        [self.responseConsumer abortConsuming];
+        [self finishWithError:(error != nil) ? error : [NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorOnResponseConsumer userInfo:nil]];
+        return NO;
+    }
+    self->_responseConsumerStarted = YES;
+    return YES;
+}
+
+- (void)responseConsumerDidPause:(QHTTPResponseConsumer *)consumer
+    // See comment in QHTTPResponseConsumer.h.  We stop the connection's callbacks by 
+    // taking it off our run loop; it stops reading and TCP pushes back on the server. 
+    // Other connections on this thread carry on regardless.
+{
+    assert(self.isActualRunLoopThread);
+    #pragma unused(consumer)
+
+    self->_responseConsumerPauseCount += 1;
+    if ( (self->_responseConsumerPauseCount == 1) && (self.connection != nil) ) {
+        for (NSString * mode in self.actualRunLoopModes) {
+            [self.connection unscheduleFromRunLoop:[NSRunLoop currentRunLoop] forMode:mode];
+        }
+    }
+}
+
+- (void)responseConsumerDidResume:(QHTTPResponseConsumer *)consumer
+    // See comment in QHTTPResponseConsumer.h.
+{
+    // any thread
+    #pragma unused(consumer)
+    [self performSelector:@selector(resumeResponseConsumer) onThread:self.actualRunLoopThread withObject:nil waitUntilDone:NO modes:[self.actualRunLoopModes allObjects]];
+}
+
+- (void)resumeResponseConsumer
+    // Called on the run loop thread when a paused consumer resumes.  Once no consumer 
+    // is paused, we put the connection back on the run loop.  If we've finished in 
+    // the meantime, the connection is gone and there's nothing to do.
+{
+    assert(self.isActualRunLoopThread);
+    assert(self->_responseConsumerPauseCount != 0);
+
+    self->_responseConsumerPauseCount -= 1;
+    if ( (self->_responseConsumerPauseCount == 0) && (self.connection != nil) ) {
+        for (NSString * mode in self.actualRunLoopModes) {
+            [self.connection scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:mode];
+        }
+    }
+}
+
+- (void)finishResponseConsumer
+    // Called when the connection finishes loading, to finish the response consumer 
+    // chain and then the operation.
+{
+    NSError *   error;
+
+    assert(self.responseConsumer != nil);
+
+    if ( ! self->_responseConsumerStarted ) {       // empty body, so we never got any data
+        if ( ! [self startResponseConsumer] ) {
+            return;
+        }
+    }
+
+    error = nil;
+    self->_responseConsumerStarted = NO;            // the chain has had its -finishConsuming:, so no -abortConsuming
+    if ( ! [self.responseConsumer finishConsuming:&error] ) {
+        [self finishWithError:(error != nil) ? error : [NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorOnResponseConsumer userInfo:nil]];
+    } else {
+        [self finishWithError:nil];
+    }
+}
+
+#pragma mark * Connection start
+
+- (void)startConnectionWithRequest:(NSURLRequest *)request
+    // Starts the NSURLConnection for request.
+{
+    assert(self.isActualRunLoopThread);
+    assert(request != nil);
+
+    // Create a connection that's scheduled in the required run loop modes.
+        
+    assert(self.connection == nil);
+    self.connection = [[[NSURLConnection alloc] initWithRequest:request delegate:self startImmediately:NO] autorelease];
+    assert(self.connection != nil);
+    
+    for (NSString * mode in self.actualRunLoopModes) {
+        [self.connection scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:mode];
+    }
+    
+    self->_connectionStartTime = CFAbsoluteTimeGetCurrent();
+    [self.connection start];
+}
+
+- (void)startCacheLookup
+    // Asks the cache for the body and validators of our URL.  The answer comes back 
+    // to -cacheLookupDone: on our run loop thread.  The block retains us until then.
+{
+    NSThread *  thread;
+    NSArray *   modes;
+
+    assert(self.isActualRunLoopThread);
+    
+    thread = self.actualRunLoopThread;
+    modes  = [self.actualRunLoopModes allObjects];
+    [self.cache lookUpDataAndValidatorsForURL:self.cacheURLString completionBlock:^(NSData * data, NSDictionary * validators) {
+        NSMutableDictionary *   entry;
+
+        entry = [NSMutableDictionary dictionaryWithCapacity:2];
+        assert(entry != nil);
+        if (data != nil) {
+            [entry setObject:data forKey:@"data"];
+        }
+        if (validators != nil) {
+            [entry setObject:validators forKey:@"validators"];
+        }
+        [self performSelector:@selector(cacheLookupDone:) onThread:thread withObject:entry waitUntilDone:NO modes:modes];
+    }];
+}
+
+- (void)cacheLookupDone:(NSDictionary *)entry
+    // Called on the run loop thread when the cache has looked up our URL.
+{
+    assert(self.isActualRunLoopThread);
+    assert(entry != nil);
+
+    // If we were cancelled while the cache was busy, we've already finished (or, with 
+    // a debug delay, are about to).
+    
+    if ( (self.state != kQRunLoopOperationStateExecuting) || [self isCancelled] ) {
+        return;
+    }
+    [self startConnectionWithRequest:[self conditionalRequestWithCachedBody:[entry objectForKey:@"data"] validators:[entry objectForKey:@"validators"]]];
+}
+
 #pragma mark * Start and finish overrides
 
 - (void)operationDidStart
@@ -304,17 +801,28 @@
         }
     #endif
 
-    // Create a connection that's scheduled in the required run loop modes.
-        
-    assert(self.connection == nil);
-    self.connection = [[[NSURLConnection alloc] initWithRequest:self.request delegate:self startImmediately:NO] autorelease];
-    assert(self.connection != nil);
+    // If we're coalesced with a leader, take its results.  If its owner cancelled 
+    // it, that doesn't apply to us, so we fall through and do the transfer ourselves. 
+    // SGNetworkManager never lets that happen; it unlinks orphaned followers and 
+    // sends them back to their lanes, so that they don't run outside its limits.
     
-    for (NSString * mode in self.actualRunLoopModes) {
-        [self.connection scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:mode];
+    if (self.leaderOperation != nil) {
+        assert([self.leaderOperation isFinished]);
+        if ( ! [self.leaderOperation isCancelled] ) {
+            [self finishWithLeaderResults];
+            return;
+        }
     }
+
+    // If we have a cache, ask it what it has for our URL, so that we can turn the 
+    // request into a conditional one.  The cache reads the disk on its own queue; we 
+    // carry on in -cacheLookupDone:.
     
-    [self.connection start];
+    if (self.shouldUseCache) {
+        [self startCacheLookup];
+    } else {
+        [self startConnectionWithRequest:self.request];
+    }
 }
 
 - (void)operationWillFinish
@@ -335,6 +843,9 @@
         }
     #endif
 
+    if (self.connection != nil) {
+        self->_transferDuration = CFAbsoluteTimeGetCurrent() - self->_connectionStartTime;
+    }
     [self.connection cancel];
     self.connection = nil;
 
@@ -345,6 +856,21 @@
     if (self.responseOutputStream != nil) {
         [self.responseOutputStream close];
     }
+    
+    // If the response consumer chain was started but never finished, tell it to 
+    // clean up.
+    
+    if (self->_responseConsumerStarted) {
+        self->_responseConsumerStarted = NO;
+        [self.responseConsumer abortConsuming];
+    }
+    
+    // By now the chain has waited for its pending work, so it won't pause or resume 
+    // us again; it mustn't keep a pointer to us, either.
+    
+    for (QHTTPResponseConsumer * consumer = self.responseConsumer; consumer != nil; consumer = consumer.nextConsumer) {
+        consumer.flowControl = nil;
+    }
 }
 
 - (void)finishWithError:(NSError *)error
@@ -462,6 +988,9 @@
     assert([response isKindOfClass:[NSHTTPURLResponse class]]);
 
     self.lastResponse = (NSHTTPURLResponse *) response;
+    if (self->_timeToFirstByte == 0.0) {
+        self->_timeToFirstByte = CFAbsoluteTimeGetCurrent() - self->_connectionStartTime;
+    }
     
     // We don't check the status code here because we want to give the client an opportunity 
     // to get the data of the error message.  Perhaps we /should/ check the content type 
@@ -478,6 +1007,8 @@
     #pragma unused(connection)
     assert(data != nil);
     
+    self->_bytesReceived += (long long) [data length];
+
     // If we don't yet have a destination for the data, calculate one.  Note that, even 
     // if there is an output stream, we don't use it for error responses.
     
@@ -485,7 +1016,9 @@
     if (self.firstData) {
         assert(self.dataAccumulator == nil);
         
-        if ( (self.responseOutputStream == nil) || ! self.isStatusCodeAcceptable ) {
+        if ( self.shouldUseResponseConsumer ) {
+            success = [self startResponseConsumer];
+        } else if ( (self.responseOutputStream == nil) || ! self.isStatusCodeAcceptable ) {
             long long   length;
             
             assert(self.dataAccumulator == nil);
@@ -495,7 +1028,11 @@
                 length = self.defaultResponseSize;
             }
             if (length <= (long long) self.maximumResponseSize) {
-                self.dataAccumulator = [NSMutableData dataWithCapacity:(NSUInteger)length];
+                if (self.bufferPool != nil) {
+                    self.dataAccumulator = [self.bufferPool mutableDataWithCapacity:(NSUInteger)length];
+                } else {
+                    self.dataAccumulator = [NSMutableData dataWithCapacity:(NSUInteger)length];
+                }
             } else {
                 [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorResponseTooLarge userInfo:nil]];
                 success = NO;
@@ -505,7 +1042,7 @@
         // If the data is going to an output stream, open it.
         
         if (success) {
-            if (self.dataAccumulator == nil) {
+            if ( (self.dataAccumulator == nil) && ! self->_responseConsumerStarted ) {
                 assert(self.responseOutputStream != nil);
                 [self.responseOutputStream open];
             }
@@ -517,7 +1054,14 @@
     // Write the data to its destination.
 
     if (success) {
-        if (self.dataAccumulator != nil) {
+        if (self->_responseConsumerStarted) {
+            NSError *   error;
+            
+            error = nil;
+            if ( ! [self.responseConsumer consumeData:data error:&error] ) {
+                [self finishWithError:(error != nil) ? error : [NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorOnResponseConsumer userInfo:nil]];
+            }
+        } else if (self.dataAccumulator != nil) {
             if ( ([self.dataAccumulator length] + [data length]) <= self.maximumResponseSize ) {
                 [self.dataAccumulator appendData:data];
             } else {
@@ -568,11 +1112,29 @@
     
     assert(self.lastResponse != nil);
 
-    // Swap the data accumulator over to the response data so that we don't trigger a copy.
+    // If the body went to the response consumer chain, it's up to the chain to say 
+    // whether things worked.  responseBody is empty, as with responseOutputStream.
+    
+    if ( self.shouldUseResponseConsumer ) {
+        assert(self->_responseBody == nil);
+        self->_responseBody = [[NSData alloc] init];
+        assert(self->_responseBody != nil);
+        [self finishResponseConsumer];
+        return;
+    }
+
+    // Swap the data accumulator over to the response data so that we don't trigger a copy. 
+    // If the server said our cached body is still good, use that instead.
     
     assert(self->_responseBody == nil);
-    self->_responseBody = self->_dataAccumulator;
-    self->_dataAccumulator = nil;
+    if (self.isNotModifiedResponse) {
+        self->_responseBody = [self->_cachedResponseBody retain];
+        self->_responseFromCache = YES;
+        self.dataAccumulator = nil;
+    } else {
+        self->_responseBody = self->_dataAccumulator;
+        self->_dataAccumulator = nil;
+    }
     
     // Because we fill out _dataAccumulator lazily, an empty body will leave _dataAccumulator 
     // set to nil.  That's not what our clients expect, so we fix it here.
@@ -587,6 +1149,9 @@
     } else if ( ! self.isContentTypeAcceptable ) {
         [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorBadContentType userInfo:nil]];
     } else {
+        if (self.shouldUseCache) {
+            [self updateCache];
+        }
         [self finishWithError:nil];
     }
 }
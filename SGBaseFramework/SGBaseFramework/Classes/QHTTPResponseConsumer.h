@@ -0,0 +1,229 @@
+/*
+    File:       QHTTPResponseConsumer.h
+
+    Contains:   Objects that process an HTTP response body chunk by chunk, as it arrives.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+@class SGURLCache;
+
+/*
+    QHTTPResponseConsumer is the base class of a chain of objects that process the 
+    body of an HTTP response as it arrives.  You give the head of the chain to 
+    QHTTPOperation's responseConsumer property and, instead of accumulating the body 
+    in memory (or writing it to responseOutputStream), the operation passes each 
+    chunk down the chain.  So a large body is never held in memory in full, and 
+    work like parsing and hashing overlaps with the transfer.  Some important 
+    points:
+
+    o Each consumer either passes data on unchanged (a tee, like 
+      QHTTPDigestResponseConsumer), transforms it and passes on the result (like 
+      QHTTPInflateResponseConsumer), or swallows it (a sink, like 
+      QHTTPCacheResponseConsumer).  The base class implementations of all the 
+      methods just forward to nextConsumer, so a subclass only has to override 
+      what it cares about, and should call super to keep the chain going.
+
+    o The chain is only used for acceptable responses.  An error response is 
+      accumulated in responseBody, as usual, so that you can look at the error 
+      message.
+
+    o The methods are called on the operation's run loop thread.  A consumer that 
+      does a lot of work per chunk slows down the transfer; that's the point, to 
+      some extent, but keep it in mind.
+
+    o If any method returns NO, the operation stops and finishes with that error. 
+      If the method doesn't set *errorPtr, the operation uses 
+      kQHTTPOperationErrorOnResponseConsumer.
+
+    o After -startWithResponse:error:, the chain gets exactly one of 
+      -finishConsuming: or -abortConsuming.  -abortConsuming is how a consumer 
+      finds out that the operation failed or was cancelled, so it can clean up 
+      partial results.
+
+    o A consumer that can't keep up, like QHTTPFileResponseConsumer when the disk 
+      falls behind, must not block the run loop thread, which is shared with other 
+      operations.  Instead it tells its flowControl to pause, and to resume once 
+      it has caught up.  QHTTPOperation sets itself as the flowControl of every 
+      consumer in the chain, and pauses by unscheduling its connection, so TCP 
+      pushes back on the server while other connections carry on.
+
+    o Each consumer can only be used once.
+
+    Streaming parsers fit in by subclassing QHTTPResponseConsumer, or by wrapping 
+    the parser's "feed bytes" call in a QHTTPBlockResponseConsumer.
+*/
+
+@protocol QHTTPResponseConsumerFlowControl;
+
+@interface QHTTPResponseConsumer : NSObject
+{
+    QHTTPResponseConsumer *     _nextConsumer;
+    id<QHTTPResponseConsumerFlowControl>    _flowControl;
+    NSURLRequest *              _request;
+}
+
++ (id)chainWithConsumers:(NSArray *)consumers;
+    // Links the consumers, in order, through their nextConsumer properties and 
+    // returns the first one.  consumers must not be empty.
+
+@property (nonatomic, retain, readwrite) QHTTPResponseConsumer * nextConsumer;   // default is nil, implying the end of the chain
+@property (nonatomic, assign, readwrite) id<QHTTPResponseConsumerFlowControl> flowControl;  // default is nil; set before -startWithResponse:error:
+@property (nonatomic, copy,   readwrite) NSURLRequest * request;                  // default is nil; the request the response answers, set before -startWithResponse:error:
+
+- (BOOL)startWithResponse:(NSHTTPURLResponse *)response error:(NSError **)errorPtr;
+    // Called before the first chunk of data, or before -finishConsuming: if the 
+    // body is empty.
+
+- (BOOL)consumeData:(NSData *)data error:(NSError **)errorPtr;
+    // Called for each chunk of data.  Don't hold on to data beyond this call 
+    // unless you retain it.
+
+- (BOOL)finishConsuming:(NSError **)errorPtr;
+    // Called once all the data has been consumed.
+
+- (void)abortConsuming;
+    // Called if the operation fails, or is cancelled, after -startWithResponse:error:.
+
+@end
+
+@protocol QHTTPResponseConsumerFlowControl <NSObject>
+
+@required
+
+- (void)responseConsumerDidPause:(QHTTPResponseConsumer *)consumer;
+    // Called on the run loop thread, from within -consumeData:error:, when the 
+    // consumer has taken all the data it can for now.  The chunk it was given has 
+    // been accepted; the receiver should stop delivering more until the consumer 
+    // resumes.
+
+- (void)responseConsumerDidResume:(QHTTPResponseConsumer *)consumer;
+    // Called on any thread when a paused consumer has caught up.  Each pause is 
+    // matched by exactly one resume, unless the consumer is aborted first.
+
+@end
+
+// QHTTPBlockResponseConsumer calls blocks for each chunk and at the end.  It passes 
+// the data on to the next consumer unchanged.
+
+typedef BOOL (^QHTTPResponseConsumerDataBlock)(NSData * data, NSError ** errorPtr);
+typedef BOOL (^QHTTPResponseConsumerFinishBlock)(NSError ** errorPtr);
+
+@interface QHTTPBlockResponseConsumer : QHTTPResponseConsumer
+{
+    QHTTPResponseConsumerDataBlock      _dataBlock;
+    QHTTPResponseConsumerFinishBlock    _finishBlock;
+}
+
+- (id)initWithDataBlock:(QHTTPResponseConsumerDataBlock)dataBlock finishBlock:(QHTTPResponseConsumerFinishBlock)finishBlock;
+    // Either block may be nil.
+
+@end
+
+// QHTTPDigestResponseConsumer computes the SHA-1 digest of the body as it goes by, 
+// passing the data on unchanged.  If expectedDigest is set, a mismatch fails the 
+// operation with kQHTTPOperationErrorBadDigest.
+
+@interface QHTTPDigestResponseConsumer : QHTTPResponseConsumer
+{
+    void *                      _context;
+    NSData *                    _expectedDigest;
+    NSData *                    _digest;
+}
+
+@property (nonatomic, copy,   readwrite) NSData *   expectedDigest;     // default is nil, implying no check
+@property (nonatomic, copy,   readonly ) NSData *   digest;             // nil until the consumer finishes
+
+@end
+
+// QHTTPInflateResponseConsumer decompresses a zlib or gzip body and passes on the 
+// decompressed data.  Note that NSURLConnection already undoes any Content-Encoding; 
+// this is for resources that are themselves compressed, like a .gz file.
+
+@interface QHTTPInflateResponseConsumer : QHTTPResponseConsumer
+{
+    void *                      _stream;
+    BOOL                        _streamEnded;
+}
+
+@end
+
+// QHTTPCacheResponseConsumer writes the body to a temporary file and, when the 
+// response is complete, moves it into the disk tier of an SGURLCache, along with the 
+// response's validators.  The move happens on the cache's disk queue.  If the operation 
+// fails, the temporary file is deleted and the cache is left alone.  A response that 
+// +[SGURLCache canStoreResponse:toRequest:] rules out isn't written at all.  The data 
+// is not passed on.
+
+@interface QHTTPCacheResponseConsumer : QHTTPResponseConsumer
+{
+    SGURLCache *                _cache;
+    NSString *                  _URL;
+    NSString *                  _temporaryPath;
+    int                         _fd;
+    NSDictionary *              _validators;
+}
+
+- (id)initWithCache:(SGURLCache *)cache URL:(NSString *)URL;
+
+@property (nonatomic, retain, readonly ) SGURLCache *   cache;
+@property (nonatomic, copy,   readonly ) NSString *     URL;
+
+@end
+
+// QHTTPFileResponseConsumer writes the body straight to a file.  Unlike 
+// responseOutputStream, the writes don't happen on the run loop thread: each chunk 
+// is retained (not copied) and written with pwrite on a private serial queue, so 
+// the chunks land in order while the run loop thread gets on with the transfer. 
+// Some important points:
+//
+// o maximumBytesInFlight bounds the memory held by chunks waiting to be written. 
+//   If the disk falls that far behind, the consumer pauses its flowControl until 
+//   the writes are down to half the limit, which pushes back on the network.  So 
+//   at most about one chunk past the limit is ever queued.  Without a flowControl 
+//   there's no way to push back, so a chunk that would take the queue past the 
+//   limit fails with ENOBUFS.  A single chunk bigger than the limit is still 
+//   accepted when nothing else is in flight.  -consumeData:error: never waits; 
+//   -finishConsuming: and -abortConsuming wait for the writes still queued.
+//
+// o If the response has a Content-Length, the consumer preallocates the space, so 
+//   a download that's going to run out of disk fails at the start rather than at 
+//   the end.  Preallocation doesn't change the file's length, which always 
+//   reflects the bytes actually written.
+//
+// o To resume a download, set resumeOffset to the length of the partial file and 
+//   send a matching Range request.  If the server answers 206, the consumer checks 
+//   the Content-Range and appends; if it answers 200, it starts the file afresh. 
+//   A 206 for some other range fails with kQHTTPOperationErrorOnResponseConsumer.
+//
+// o If the operation fails, the consumer waits for the queued writes and leaves the 
+//   partial file in place; fileLength says how much of it is good.  That's what 
+//   makes the next attempt's resumeOffset.
+//
+// o Consumers ahead of this one in the chain must not modify a chunk after passing 
+//   it on, because the write happens later.  The data is not passed on.
+
+@interface QHTTPFileResponseConsumer : QHTTPResponseConsumer
+{
+    NSString *                  _path;
+    unsigned long long          _resumeOffset;
+    NSUInteger                  _maximumBytesInFlight;
+    int                         _fd;
+    dispatch_queue_t            _queue;
+    NSLock *                    _lock;
+    NSUInteger                  _bytesInFlight;                 // protected by _lock
+    BOOL                        _paused;                        // protected by _lock
+    NSError *                   _writeError;                    // protected by _lock
+    unsigned long long          _nextOffset;                    // run loop thread only
+    volatile int64_t            _fileLength;                    // any thread, atomic
+}
+
+- (id)initWithPath:(NSString *)path;
+
+@property (nonatomic, copy,   readonly ) NSString *             path;
+@property (nonatomic, assign, readwrite) unsigned long long     resumeOffset;           // default is 0, implying a fresh file
+@property (nonatomic, assign, readwrite) NSUInteger             maximumBytesInFlight;   // default is 1 MB (256 KB on embedded)
+@property (nonatomic, assign, readonly ) unsigned long long     fileLength;             // bytes written so far, counting resumeOffset
+
+@end
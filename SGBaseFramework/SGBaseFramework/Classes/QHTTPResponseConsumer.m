@@ -0,0 +1,726 @@
+/*
+    File:       QHTTPResponseConsumer.m
+
+    Contains:   Objects that process an HTTP response body chunk by chunk, as it arrives.
+
+*/
+
+#import "QHTTPResponseConsumer.h"
+
+#import "QHTTPOperation.h"
+#import "SGURLCache.h"
+
+#import <CommonCrypto/CommonDigest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <libkern/OSAtomic.h>
+
+#include "zlib.h"
+
+static BOOL SetError(NSError ** errorPtr, NSError * error)
+    // Sets *errorPtr, if errorPtr is not NULL, and returns NO, so that a 
+    // failing method can just return SetError(...).
+{
+    assert(error != nil);
+    if (errorPtr != NULL) {
+        *errorPtr = error;
+    }
+    return NO;
+}
+
+static NSError * POSIXError(int err)
+{
+    assert(err != 0);
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:nil];
+}
+
+#pragma mark * QHTTPResponseConsumer
+
+@implementation QHTTPResponseConsumer
+
++ (id)chainWithConsumers:(NSArray *)consumers
+    // See comment in header.
+{
+    QHTTPResponseConsumer * previous;
+
+    assert([consumers count] != 0);
+
+    previous = nil;
+    for (QHTTPResponseConsumer * consumer in consumers) {
+        assert([consumer isKindOfClass:[QHTTPResponseConsumer class]]);
+        previous.nextConsumer = consumer;
+        previous = consumer;
+    }
+    return [consumers objectAtIndex:0];
+}
+
+- (void)dealloc
+{
+    [self->_nextConsumer release];
+    [self->_request release];
+    [super dealloc];
+}
+
+@synthesize nextConsumer = _nextConsumer;
+@synthesize flowControl  = _flowControl;
+@synthesize request      = _request;
+
+- (BOOL)startWithResponse:(NSHTTPURLResponse *)response error:(NSError **)errorPtr
+    // See comment in header.
+{
+    assert(response != nil);
+    return (self.nextConsumer == nil) || [self.nextConsumer startWithResponse:response error:errorPtr];
+}
+
+- (BOOL)consumeData:(NSData *)data error:(NSError **)errorPtr
+    // See comment in header.
+{
+    assert(data != nil);
+    return (self.nextConsumer == nil) || [self.nextConsumer consumeData:data error:errorPtr];
+}
+
+- (BOOL)finishConsuming:(NSError **)errorPtr
+    // See comment in header.
+{
+    return (self.nextConsumer == nil) || [self.nextConsumer finishConsuming:errorPtr];
+}
+
+- (void)abortConsuming
+    // See comment in header.
+{
+    [self.nextConsumer abortConsuming];
+}
+
+@end
+
+#pragma mark * QHTTPBlockResponseConsumer
+
+@implementation QHTTPBlockResponseConsumer
+
+- (id)initWithDataBlock:(QHTTPResponseConsumerDataBlock)dataBlock finishBlock:(QHTTPResponseConsumerFinishBlock)finishBlock
+    // See comment in header.
+{
+    self = [super init];
+    if (self != nil) {
+        self->_dataBlock   = [dataBlock copy];
+        self->_finishBlock = [finishBlock copy];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_dataBlock release];
+    [self->_finishBlock release];
+    [super dealloc];
+}
+
+- (BOOL)consumeData:(NSData *)data error:(NSError **)errorPtr
+{
+    if ( (self->_dataBlock != nil) && ! self->_dataBlock(data, errorPtr) ) {
+        return NO;
+    }
+    return [super consumeData:data error:errorPtr];
+}
+
+- (BOOL)finishConsuming:(NSError **)errorPtr
+{
+    if ( (self->_finishBlock != nil) && ! self->_finishBlock(errorPtr) ) {
+        [super abortConsuming];
+        return NO;
+    }
+    return [super finishConsuming:errorPtr];
+}
+
+@end
+
+#pragma mark * QHTTPDigestResponseConsumer
+
+@implementation QHTTPDigestResponseConsumer
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        self->_context = malloc(sizeof(CC_SHA1_CTX));
+        assert(self->_context != NULL);
+        (void) CC_SHA1_Init((CC_SHA1_CTX *) self->_context);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(self->_context);
+    [self->_expectedDigest release];
+    [self->_digest release];
+    [super dealloc];
+}
+
+@synthesize expectedDigest = _expectedDigest;
+@synthesize digest         = _digest;
+
+- (BOOL)consumeData:(NSData *)data error:(NSError **)errorPtr
+{
+    assert(self->_digest == nil);
+    (void) CC_SHA1_Update((CC_SHA1_CTX *) self->_context, [data bytes], (CC_LONG) [data length]);
+    return [super consumeData:data error:errorPtr];
+}
+
+- (BOOL)finishConsuming:(NSError **)errorPtr
+{
+    unsigned char   digest[CC_SHA1_DIGEST_LENGTH];
+
+    assert(self->_digest == nil);
+    (void) CC_SHA1_Final(digest, (CC_SHA1_CTX *) self->_context);
+    self->_digest = [[NSData alloc] initWithBytes:digest length:sizeof(digest)];
+    assert(self->_digest != nil);
+
+    // We check the digest before letting the rest of the chain finish, so that, for 
+    // example, a corrupt body never makes it into the cache.
+
+    if ( (self.expectedDigest != nil) && ! [self.expectedDigest isEqual:self->_digest] ) {
+        [super abortConsuming];
+        return SetError(errorPtr, [NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorBadDigest userInfo:nil]);
+    }
+    return [super finishConsuming:errorPtr];
+}
+
+@end
+
+#pragma mark * QHTTPInflateResponseConsumer
+
+@implementation QHTTPInflateResponseConsumer
+
+enum {
+    kInflateBufferSize = 32 * 1024
+};
+
+- (void)dealloc
+{
+    if (self->_stream != NULL) {
+        (void) inflateEnd((z_stream *) self->_stream);
+        free(self->_stream);
+    }
+    [super dealloc];
+}
+
+- (BOOL)startWithResponse:(NSHTTPURLResponse *)response error:(NSError **)errorPtr
+{
+    int     err;
+
+    assert(self->_stream == NULL);
+    self->_stream = calloc(1, sizeof(z_stream));
+    assert(self->_stream != NULL);
+
+    // 15 is the largest window, and adding 32 tells zlib to detect zlib and gzip 
+    // headers automatically.
+
+    err = inflateInit2((z_stream *) self->_stream, 15 + 32);
+    if (err != Z_OK) {
+        free(self->_stream);
+        self->_stream = NULL;
+        return SetError(errorPtr, POSIXError(ENOMEM));
+    }
+    return [super startWithResponse:response error:errorPtr];
+}
+
+- (BOOL)consumeData:(NSData *)data error:(NSError **)errorPtr
+{
+    z_stream *      stream;
+    NSMutableData * output;
+    int             err;
+
+    stream = (z_stream *) self->_stream;
+    assert(stream != NULL);
+
+    // Trailing garbage after the end of the compressed stream is ignored, as gunzip does.
+
+    if (self->_streamEnded) {
+        return YES;
+    }
+
+    // Each pass gets a fresh output buffer, because a consumer further down the 
+    // chain (like QHTTPFileResponseConsumer) may hold on to what we pass it.
+
+    stream->next_in  = (Bytef *) [data bytes];
+    stream->avail_in = (uInt) [data length];
+    do {
+        output = [NSMutableData dataWithLength:kInflateBufferSize];
+        assert(output != nil);
+        stream->next_out  = [output mutableBytes];
+        stream->avail_out = (uInt) [output length];
+        err = inflate(stream, Z_NO_FLUSH);
+        if ( (err != Z_OK) && (err != Z_STREAM_END) && (err != Z_BUF_ERROR) ) {
+            return SetError(errorPtr, [NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorOnResponseConsumer userInfo:nil]);
+        }
+        if (stream->avail_out != [output length]) {
+            [output setLength:[output length] - stream->avail_out];
+            if ( ! [super consumeData:output error:errorPtr] ) {
+                return NO;
+            }
+        }
+        if (err == Z_STREAM_END) {
+            self->_streamEnded = YES;
+            break;
+        }
+    } while ( (stream->avail_in != 0) || (stream->avail_out == 0) );
+    return YES;
+}
+
+- (BOOL)finishConsuming:(NSError **)errorPtr
+{
+    if ( ! self->_streamEnded ) {
+        [super abortConsuming];
+        return SetError(errorPtr, [NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorOnResponseConsumer userInfo:nil]);
+    }
+    return [super finishConsuming:errorPtr];
+}
+
+@end
+
+#pragma mark * QHTTPCacheResponseConsumer
+
+@interface QHTTPCacheResponseConsumer ()
+
+- (void)closeAndRemoveFile;
+
+@end
+
+@implementation QHTTPCacheResponseConsumer
+
+- (id)initWithCache:(SGURLCache *)cache URL:(NSString *)URL
+    // See comment in header.
+{
+    assert(cache != nil);
+    assert(URL != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_cache = [cache retain];
+        self->_URL = [URL copy];
+        self->_fd = -1;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self closeAndRemoveFile];
+    [self->_cache release];
+    [self->_URL release];
+    [self->_validators release];
+    [super dealloc];
+}
+
+@synthesize cache = _cache;
+@synthesize URL   = _URL;
+
+- (void)closeAndRemoveFile
+    // Closes and deletes the temporary file, if there is one.
+{
+    if (self->_fd >= 0) {
+        (void) close(self->_fd);
+        self->_fd = -1;
+    }
+    if (self->_temporaryPath != nil) {
+        (void) unlink([self->_temporaryPath fileSystemRepresentation]);
+        [self->_temporaryPath release];
+        self->_temporaryPath = nil;
+    }
+}
+
+- (BOOL)startWithResponse:(NSHTTPURLResponse *)response error:(NSError **)errorPtr
+{
+    char                    path[PATH_MAX];
+    NSMutableDictionary *   validators;
+    NSDictionary *          headers;
+
+    assert(self->_fd < 0);
+
+    // If the response can't be cached, we just swallow the body.
+
+    if ( ! [SGURLCache canStoreResponse:response toRequest:self.request] ) {
+        return [super startWithResponse:response error:errorPtr];
+    }
+
+    // Latch the validators now; we store them once the body is safely in the cache.
+
+    validators = [NSMutableDictionary dictionary];
+    assert(validators != nil);
+    headers = [response allHeaderFields];
+    for (NSString * name in headers) {
+        if ([name caseInsensitiveCompare:@"ETag"] == NSOrderedSame) {
+            [validators setObject:[headers objectForKey:name] forKey:kSGCValidatorETagKey];
+        } else if ([name caseInsensitiveCompare:@"Last-Modified"] == NSOrderedSame) {
+            [validators setObject:[headers objectForKey:name] forKey:kSGCValidatorLastModifiedKey];
+        }
+    }
+    self->_validators = [validators copy];
+
+    if ( ! [[NSTemporaryDirectory() stringByAppendingPathComponent:@"QHTTPCacheResponseConsumer.XXXXXX"] getFileSystemRepresentation:path maxLength:sizeof(path)] ) {
+        return SetError(errorPtr, POSIXError(ENAMETOOLONG));
+    }
+    self->_fd = mkstemp(path);
+    if (self->_fd < 0) {
+        return SetError(errorPtr, POSIXError(errno));
+    }
+    self->_temporaryPath = [[[NSFileManager defaultManager] stringWithFileSystemRepresentation:path length:strlen(path)] copy];
+    return [super startWithResponse:response error:errorPtr];
+}
+
+- (BOOL)consumeData:(NSData *)data error:(NSError **)errorPtr
+{
+    const uint8_t * bytes;
+    size_t          offset;
+    ssize_t         bytesWritten;
+
+    #pragma unused(errorPtr)
+
+    // We're a sink, so we don't pass the data on.
+
+    if (self->_fd < 0) {
+        return YES;
+    }
+    bytes = [data bytes];
+    offset = 0;
+    while (offset < [data length]) {
+        bytesWritten = write(self->_fd, &bytes[offset], [data length] - offset);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return SetError(errorPtr, POSIXError(errno));
+        }
+        offset += (size_t) bytesWritten;
+    }
+    return YES;
+}
+
+- (BOOL)finishConsuming:(NSError **)errorPtr
+{
+    int     err;
+
+    if (self->_fd >= 0) {
+        err = close(self->_fd);
+        self->_fd = -1;
+        if (err != 0) {
+            err = errno;
+            [self closeAndRemoveFile];
+            return SetError(errorPtr, POSIXError(err));
+        }
+
+        // Hand the file over to the cache, which moves it into place on its disk 
+        // queue rather than on our run loop thread.  Failing to cache isn't fatal; 
+        // the response is still good, so we don't wait to find out.
+
+        [self.cache storeFileInBackgroundAtPath:self->_temporaryPath validators:self->_validators forURL:self.URL];
+        [self->_temporaryPath release];
+        self->_temporaryPath = nil;
+    }
+    return [super finishConsuming:errorPtr];
+}
+
+- (void)abortConsuming
+{
+    [self closeAndRemoveFile];
+    [super abortConsuming];
+}
+
+@end
+
+#pragma mark * QHTTPFileResponseConsumer
+
+static NSString * HeaderField(NSHTTPURLResponse * response, NSString * name)
+    // Looks up a header field, ignoring the case of its name.
+{
+    NSDictionary *  headers;
+
+    headers = [response allHeaderFields];
+    for (NSString * key in headers) {
+        if ([key caseInsensitiveCompare:name] == NSOrderedSame) {
+            return [headers objectForKey:key];
+        }
+    }
+    return nil;
+}
+
+@implementation QHTTPFileResponseConsumer
+
+- (id)initWithPath:(NSString *)path
+    // See comment in header.
+{
+    #if TARGET_OS_EMBEDDED || TARGET_IPHONE_SIMULATOR
+        static const NSUInteger kPlatformReductionFactor = 4;
+    #else
+        static const NSUInteger kPlatformReductionFactor = 1;
+    #endif
+    assert(path != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_path = [path copy];
+        self->_maximumBytesInFlight = 1 * 1024 * 1024 / kPlatformReductionFactor;
+        self->_fd = -1;
+        self->_lock = [[NSLock alloc] init];
+        assert(self->_lock != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // Each queued write retains us, so there can't be any left by now.
+
+    assert(self->_bytesInFlight == 0);
+    if (self->_fd >= 0) {
+        (void) close(self->_fd);
+    }
+    if (self->_queue != NULL) {
+        dispatch_release(self->_queue);
+    }
+    [self->_path release];
+    [self->_lock release];
+    [self->_writeError release];
+    [super dealloc];
+}
+
+@synthesize path                 = _path;
+@synthesize resumeOffset         = _resumeOffset;
+@synthesize maximumBytesInFlight = _maximumBytesInFlight;
+
+- (unsigned long long)fileLength
+    // See comment in header.
+{
+    // any thread
+    return (unsigned long long) OSAtomicAdd64Barrier(0, &self->_fileLength);
+}
+
+- (NSError *)writeError
+    // Returns the first error from the write queue, if any.
+{
+    NSError *   result;
+
+    // any thread
+    [self->_lock lock];
+    result = [[self->_writeError retain] autorelease];
+    [self->_lock unlock];
+    return result;
+}
+
+- (void)waitForWrites
+    // Waits for all the queued writes to complete.
+{
+    if (self->_queue != NULL) {
+        dispatch_sync(self->_queue, ^{ });
+    }
+}
+
+- (void)closeFile
+{
+    [self waitForWrites];
+    if (self->_fd >= 0) {
+        (void) close(self->_fd);
+        self->_fd = -1;
+    }
+}
+
+- (BOOL)startWithResponse:(NSHTTPURLResponse *)response error:(NSError **)errorPtr
+{
+    unsigned long long  offset;
+    long long           length;
+
+    assert(self->_fd < 0);
+
+    // Work out where the body goes.  A 206 must start exactly where we asked it to.
+
+    offset = 0;
+    if ([response statusCode] == 206) {
+        NSString *          contentRange;
+        unsigned long long  first;
+        unsigned long long  last;
+
+        contentRange = HeaderField(response, @"Content-Range");
+        if ( (contentRange == nil) 
+          || (sscanf([contentRange UTF8String], "bytes %llu-%llu", &first, &last) != 2) 
+          || (first != self.resumeOffset) ) {
+            return SetError(errorPtr, [NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorOnResponseConsumer userInfo:nil]);
+        }
+        offset = first;
+    }
+
+    self->_fd = open([self.path fileSystemRepresentation], O_WRONLY | O_CREAT, 0644);
+    if (self->_fd < 0) {
+        return SetError(errorPtr, POSIXError(errno));
+    }
+
+    // Cut the file back to where the body starts; on a 200 that's the start of the file.
+
+    if (ftruncate(self->_fd, (off_t) offset) != 0) {
+        return SetError(errorPtr, POSIXError(errno));
+    }
+
+    // Reserve the space for the rest of the body.  Failing to preallocate isn't fatal, 
+    // except that running out of space means the download can't work.
+
+    length = [response expectedContentLength];
+    #if defined(F_PREALLOCATE)
+        if (length > 0) {
+            fstore_t    store;
+
+            store.fst_flags      = F_ALLOCATECONTIG | F_ALLOCATEALL;
+            store.fst_posmode    = F_PEOFPOSMODE;
+            store.fst_offset     = 0;
+            store.fst_length     = (off_t) length;
+            store.fst_bytesalloc = 0;
+            if (fcntl(self->_fd, F_PREALLOCATE, &store) < 0) {
+                store.fst_flags = F_ALLOCATEALL;
+                if ( (fcntl(self->_fd, F_PREALLOCATE, &store) < 0) && (errno == ENOSPC) ) {
+                    return SetError(errorPtr, POSIXError(ENOSPC));
+                }
+            }
+        }
+    #else
+        #pragma unused(length)
+    #endif
+
+    self->_nextOffset = offset;
+    self->_fileLength = (int64_t) offset;
+    self->_queue = dispatch_queue_create("com.vaseltior.sg.QHTTPFileResponseConsumer", NULL);
+    assert(self->_queue != NULL);
+
+    return [super startWithResponse:response error:errorPtr];
+}
+
+- (BOOL)consumeData:(NSData *)data error:(NSError **)errorPtr
+{
+    NSUInteger          length;
+    unsigned long long  offset;
+    NSError *           error;
+    BOOL                shouldPause;
+
+    assert(self->_fd >= 0);
+    assert(self->_queue != NULL);
+
+    length = [data length];
+    if (length == 0) {
+        return YES;
+    }
+
+    // Take the chunk, unless the write queue has already failed.  We mustn't wait for 
+    // room: we're on the run loop thread, which other connections share.  If this 
+    // takes us over the limit, ask our flowControl to stop delivering until the writes 
+    // catch up.  Without one, we can't push back, so we fail instead.
+
+    shouldPause = NO;
+    [self->_lock lock];
+    error = [[self->_writeError retain] autorelease];
+    if (error == nil) {
+        if ( (self.flowControl == nil) && (self->_bytesInFlight != 0) && ((self->_bytesInFlight + length) > self.maximumBytesInFlight) ) {
+            error = POSIXError(ENOBUFS);
+        } else {
+            self->_bytesInFlight += length;
+            if ( (self.flowControl != nil) && ! self->_paused && (self->_bytesInFlight > self.maximumBytesInFlight) ) {
+                self->_paused = YES;
+                shouldPause = YES;
+            }
+        }
+    }
+    [self->_lock unlock];
+    if (error != nil) {
+        return SetError(errorPtr, error);
+    }
+
+    // Pause before queueing the write, so that the matching resume can't come first.
+
+    if (shouldPause) {
+        [self.flowControl responseConsumerDidPause:self];
+    }
+
+    // Queue the write.  The block retains data (and self) until it's done.  We're a 
+    // sink, so we don't pass the data on.
+
+    offset = self->_nextOffset;
+    self->_nextOffset += length;
+    dispatch_async(self->_queue, ^{
+        const uint8_t * bytes;
+        size_t          bytesDone;
+        ssize_t         bytesWritten;
+        int             err;
+        BOOL            shouldResume;
+
+        err = 0;
+        if ([self writeError] == nil) {
+            bytes = [data bytes];
+            bytesDone = 0;
+            while (bytesDone < length) {
+                bytesWritten = pwrite(self->_fd, &bytes[bytesDone], length - bytesDone, (off_t) (offset + bytesDone));
+                if (bytesWritten < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    err = errno;
+                    break;
+                }
+                bytesDone += (size_t) bytesWritten;
+            }
+            if (err == 0) {
+                (void) OSAtomicAdd64Barrier((int64_t) length, &self->_fileLength);
+            }
+        }
+
+        // Resume at half the limit, rather than as soon as there's room for a chunk, 
+        // so that we don't pause and resume on every write.  A write error resumes 
+        // too, so that the next chunk can report it.
+        
+        shouldResume = NO;
+        [self->_lock lock];
+        if ( (err != 0) && (self->_writeError == nil) ) {
+            self->_writeError = [POSIXError(err) retain];
+        }
+        self->_bytesInFlight -= length;
+        if ( self->_paused && ( (self->_bytesInFlight <= (self.maximumBytesInFlight / 2)) || (self->_writeError != nil) ) ) {
+            self->_paused = NO;
+            shouldResume = YES;
+        }
+        [self->_lock unlock];
+        if (shouldResume) {
+            [self.flowControl responseConsumerDidResume:self];
+        }
+    });
+    return YES;
+}
+
+- (BOOL)finishConsuming:(NSError **)errorPtr
+{
+    NSError *   error;
+    int         err;
+
+    assert(self->_fd >= 0);
+
+    [self waitForWrites];
+    error = [self writeError];
+    if (error != nil) {
+        [self closeFile];
+        [super abortConsuming];
+        return SetError(errorPtr, error);
+    }
+    err = close(self->_fd);
+    self->_fd = -1;
+    if (err != 0) {
+        [super abortConsuming];
+        return SetError(errorPtr, POSIXError(errno));
+    }
+    return [super finishConsuming:errorPtr];
+}
+
+- (void)abortConsuming
+{
+    // We keep what's been written, so the download can be resumed.
+
+    [self closeFile];
+    [super abortConsuming];
+}
+
+@end
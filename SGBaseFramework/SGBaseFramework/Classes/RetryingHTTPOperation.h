@@ -6,6 +6,7 @@
 */
 
 #import "QRunLoopOperation.h"
+#import "SGNetworkManager.h"
 
 /*
     RetryingHTTPOperation is a run loop based concurrent operation that initiates 
@@ -21,11 +22,18 @@
       there's no point retrying after an HTTP 404 status code.  The (private) method 
       -shouldRetryAfterError: controls what will and won't be retried.
 
-    o The fundamental retry mechanism is a random expotential back-off algorithm. 
-      After a failure it choose a random delay between the 0 and the max delay. 
-      Each failure increases the maximum delay up to some overall limit.  The current 
-      max delay sequence is one second, one minute, one hour, and six hours. 
-      You can tweak this by changing kRetryDelays.
+    o The fundamental retry mechanism is exponential back-off with decorrelated 
+      jitter.  After a failure it chooses a random delay between minimumRetryDelay 
+      and three times the previous delay, capped at maximumRetryDelay.  Because each 
+      operation's delays wander independently, operations that failed together 
+      don't retry together.
+
+    o Before each retry it asks the host's SGRetryBudget for permission.  The budget 
+      limits the rate of retries to the host however many operations are waiting, 
+      and stops them altogether (apart from an occasional probe) while most 
+      attempts are failing.  If permission is refused, the operation waits as long 
+      as the budget says, plus some jitter, and asks again; that doesn't count as 
+      a retry.
 
     o In addition to this it does a fast retry if one of the following things happens:
 
@@ -37,6 +45,16 @@
       - Some other request to that host succeeds, which is a good indication that 
         other requests will succeed as well.
 
+    o If responseFilePath is set, the body is written by a QHTTPFileResponseConsumer, 
+      off the run loop thread.  A retry after a failure part way through the body 
+      resumes from the end of the partial file, using a Range request guarded by 
+      If-Range with the failed response's validator (a strong ETag or Last-Modified). 
+      If the server doesn't do ranges, or the resource has changed, it answers 200 
+      and the file starts afresh.  The URL and validator are also saved next to the 
+      file (responseFilePath with ".resume" appended), so a new operation for the same 
+      URL and file, perhaps after a cancel or a relaunch, resumes as well.  That 
+      information is deleted when the operation finishes, unless it was cancelled.
+
     o The operation runs out of the run loop associated with the actualRunLoopThread 
       inherited from QRunLoopOperation.  If you observe any properties, expect them 
       to be changed by that thread.
@@ -48,6 +66,8 @@
 
 @class QHTTPOperation;
 @class QReachabilityOperation;
+@class SGURLCache;
+@class SGRetryBudget;
 
 enum RetryingHTTPOperationState {
     kRetryingHTTPOperationStateNotStarted, 
@@ -64,6 +84,9 @@ typedef enum RetryingHTTPOperationState RetryingHTTPOperationState;
     NSURLRequest *              _request;
     NSSet *                     _acceptableContentTypes;
     NSString *                  _responseFilePath;
+    NSString *                  _resumeValidator;
+    SGURLCache *                _cache;
+    SGNetworkTransferPriority   _transferPriority;
     NSHTTPURLResponse *         _response;
     NSData *                    _responseContent;
     RetryingHTTPOperationState  _retryState;
@@ -71,6 +94,10 @@ typedef enum RetryingHTTPOperationState RetryingHTTPOperationState;
     QHTTPOperation *            _networkOperation;
     BOOL                        _hasHadRetryableFailure;
     NSUInteger                  _retryCount;
+    NSTimeInterval              _minimumRetryDelay;
+    NSTimeInterval              _maximumRetryDelay;
+    NSTimeInterval              _lastRetryDelay;
+    SGRetryBudget *             _retryBudget;
     NSTimer *                   _retryTimer;
     QReachabilityOperation *    _reachabilityOperation;
     BOOL                        _notificationInstalled;
@@ -88,6 +115,11 @@ typedef enum RetryingHTTPOperationState RetryingHTTPOperationState;
 // runLoopThread and runLoopModes inherited from QRunLoopOperation
 @property (nonatomic, copy,   readwrite) NSSet *                       acceptableContentTypes; // default is nil, implying anything is acceptable
 @property (nonatomic, retain, readwrite) NSString *                    responseFilePath;       // defaults to nil, which puts response into responseContent
+@property (nonatomic, retain, readwrite) SGURLCache *                  cache;                  // defaults to nil, which uses -[SGNetworkManager URLCache]; see QHTTPOperation
+@property (nonatomic, assign, readwrite) SGNetworkTransferPriority     transferPriority;       // defaults to kSGNetworkTransferPriorityDefault; the lane for each attempt
+@property (nonatomic, assign, readwrite) NSTimeInterval                minimumRetryDelay;      // defaults to 1 second
+@property (nonatomic, assign, readwrite) NSTimeInterval                maximumRetryDelay;      // defaults to 6 hours
+@property (nonatomic, retain, readwrite) SGRetryBudget *               retryBudget;            // defaults to nil, which uses +[SGRetryBudget budgetForHost:]
 
 // Things that change as part of the progress of the operation.
 
@@ -12,7 +12,12 @@
 #import "Logging.h"
 
 #import "QHTTPOperation.h"
+#import "QHTTPResponseConsumer.h"
 #import "QReachabilityOperation.h"
+#import "SGRetryBudget.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 // When one operation completes it posts the following notification.  Other operations 
 // listen for that notification and, if the host name matches, expedite their retry. 
@@ -21,6 +26,120 @@
 static NSString * kRetryingHTTPOperationTransferDidSucceedNotification = @"com.vaseltior.sg.kRetryingHTTPOperationTransferDidSucceedNotification";
 static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 
+// When the body goes to a file, we keep a small property list next to it recording 
+// how to resume it: the URL and the validator to send in If-Range.  This lets a new 
+// operation for the same file, perhaps in a later run of the app, pick up where an 
+// earlier one left off.
+
+static NSString * kRetryingHTTPOperationResumeURLKey = @"URL";
+static NSString * kRetryingHTTPOperationResumeValidatorKey = @"validator";
+
+static NSString * ResumeInfoPathForFilePath(NSString * filePath)
+{
+    return [filePath stringByAppendingString:@".resume"];
+}
+
+static NSString * ResumeValidatorForResponse(NSHTTPURLResponse * response, NSString * previousValidator)
+    // Returns the validator to send in If-Range when resuming the body of response, 
+    // or nil if there isn't one.  If-Range only works with a strong ETag or a date. 
+    // A 206 without validators is still part of the body we were resuming, so it 
+    // keeps previousValidator.
+{
+    NSString *      result;
+    NSDictionary *  headers;
+    NSString *      eTag;
+    NSString *      lastModified;
+
+    result = nil;
+    if ( (response != nil) && (([response statusCode] == 200) || ([response statusCode] == 206)) ) {
+        eTag = nil;
+        lastModified = nil;
+        headers = [response allHeaderFields];
+        for (NSString * name in headers) {
+            if ([name caseInsensitiveCompare:@"ETag"] == NSOrderedSame) {
+                eTag = [headers objectForKey:name];
+            } else if ([name caseInsensitiveCompare:@"Last-Modified"] == NSOrderedSame) {
+                lastModified = [headers objectForKey:name];
+            }
+        }
+        if ( (eTag != nil) && ! [eTag hasPrefix:@"W/"] ) {
+            result = eTag;
+        } else {
+            result = lastModified;
+        }
+        if ( (result == nil) && ([response statusCode] == 206) ) {
+            result = previousValidator;
+        }
+    }
+    return result;
+}
+
+#pragma mark * RetryingHTTPFileResponseConsumer
+
+// RetryingHTTPFileResponseConsumer is the file consumer we use for responseFilePath. 
+// It records the resume information as soon as the response starts, before any of 
+// the body is on disk, so that even if the app dies part way through the body, the 
+// next attempt can resume.
+
+@interface RetryingHTTPFileResponseConsumer : QHTTPFileResponseConsumer
+{
+    NSString *  _URLString;
+    NSString *  _previousValidator;
+}
+
+- (id)initWithPath:(NSString *)path URLString:(NSString *)URLString previousValidator:(NSString *)previousValidator;
+
+@end
+
+@implementation RetryingHTTPFileResponseConsumer
+
+- (id)initWithPath:(NSString *)path URLString:(NSString *)URLString previousValidator:(NSString *)previousValidator
+{
+    assert(URLString != nil);
+    self = [super initWithPath:path];
+    if (self != nil) {
+        self->_URLString = [URLString copy];
+        self->_previousValidator = [previousValidator copy];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_URLString release];
+    [self->_previousValidator release];
+    [super dealloc];
+}
+
+- (BOOL)startWithResponse:(NSHTTPURLResponse *)response error:(NSError **)errorPtr
+{
+    NSString *  validator;
+    NSString *  resumeInfoPath;
+
+    if ( ! [super startWithResponse:response error:errorPtr] ) {
+        return NO;
+    }
+
+    // Failing to save the resume information isn't fatal; it just means that we can't resume.
+
+    resumeInfoPath = ResumeInfoPathForFilePath(self.path);
+    validator = ResumeValidatorForResponse(response, self->_previousValidator);
+    if (validator != nil) {
+        (void) [[NSDictionary dictionaryWithObjectsAndKeys:
+            self->_URLString, kRetryingHTTPOperationResumeURLKey, 
+            validator,        kRetryingHTTPOperationResumeValidatorKey, 
+            nil
+        ] writeToFile:resumeInfoPath atomically:YES];
+    } else {
+        (void) unlink([resumeInfoPath fileSystemRepresentation]);
+    }
+    return YES;
+}
+
+@end
+
+#pragma mark * RetryingHTTPOperation
+
 @interface RetryingHTTPOperation ()
 
 // read/write versions of public properties
@@ -34,6 +153,7 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 // private properties
 
 @property (nonatomic, copy,   readwrite) NSHTTPURLResponse *           response;
+@property (nonatomic, copy,   readwrite) NSString *                    resumeValidator;
 @property (nonatomic, retain, readwrite) QHTTPOperation *              networkOperation;
 @property (nonatomic, retain, readwrite) NSTimer *                     retryTimer;
 @property (nonatomic, retain, readwrite) QReachabilityOperation *      reachabilityOperation;
@@ -81,6 +201,9 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
             sSequenceNumber += 1;
         }
         self->_request = [request copy];
+        self->_transferPriority = kSGNetworkTransferPriorityDefault;
+        self->_minimumRetryDelay = 1.0;
+        self->_maximumRetryDelay = 6.0 * 60.0 * 60.0;
         assert(self->_retryState       == kRetryingHTTPOperationStateNotStarted);
     }
     return self;
@@ -91,6 +214,9 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     [self->_request release];
     [self->_acceptableContentTypes release];
     [self->_responseFilePath release];
+    [self->_resumeValidator release];
+    [self->_cache release];
+    [self->_retryBudget release];
     [self->_response release];
     [self->_responseContent release];
     assert(self->_networkOperation == nil);
@@ -131,7 +257,13 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 @synthesize hasHadRetryableFailure = _hasHadRetryableFailure;
 @synthesize acceptableContentTypes = _acceptableContentTypes;
 @synthesize responseFilePath       = _responseFilePath;
+@synthesize cache                  = _cache;
+@synthesize transferPriority       = _transferPriority;
+@synthesize minimumRetryDelay      = _minimumRetryDelay;
+@synthesize maximumRetryDelay      = _maximumRetryDelay;
+@synthesize retryBudget            = _retryBudget;
 @synthesize response               = _response;
+@synthesize resumeValidator        = _resumeValidator;
 @synthesize networkOperation       = _networkOperation;
 @synthesize retryTimer             = _retryTimer;
 @synthesize retryCount             = _retryCount;
@@ -175,7 +307,12 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
         // We can easily understand the consequence of coming directly from 
         // QHTTPOperation.
         
-        if ( [error code] > 0 ) {
+        if ( [error code] == 416 ) {
+            // "Requested Range Not Satisfiable" means that the partial file doesn't match 
+            // the resource.  -networkOperationDone: has dropped the resume information, 
+            // so the retry fetches the whole thing.
+            shouldRetry = YES;
+        } else if ( [error code] > 0 ) {
             // The request made it to the server, which failed it.  We consider that to be 
             // fatal.  It might make sense to handle error 503 "Service Unavailable" as a 
             // special case here but, realistically, how common is that?
@@ -187,9 +324,17 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
                     // fall through
                 case kQHTTPOperationErrorResponseTooLarge:
                 case kQHTTPOperationErrorOnOutputStream:
-                case kQHTTPOperationErrorBadContentType: {
+                case kQHTTPOperationErrorBadContentType:
+                case kQHTTPOperationErrorOnResponseConsumer:
+                case kQHTTPOperationErrorBadDigest: {
                     shouldRetry = NO;   // all of these conditions are unlikely to fail
                 } break;
+                case kQHTTPOperationErrorLeaderBodyDetached: {
+                    // We were coalesced with a leader whose owner took the body before 
+                    // we could share it.  Nothing's wrong with the resource, so it's 
+                    // worth another go.
+                    shouldRetry = YES;
+                } break;
             }
         }
     } else {
@@ -203,36 +348,63 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     return shouldRetry;
 }
 
-// This isn't a crypto system, so we don't care about mod bias, so we just calculate 
-// the random time interval by taking the random number, mod'ing it by the number 
-// of milliseconds of the delay range, and then converting that number of milliseconds 
-// to an NSTimeInterval.
-
-- (NSTimeInterval)retryDelayWithinRangeAtIndex:(NSUInteger)rangeIndex
-    // Helper method for -shortRetryDelay and -randomRetryDelay.
+- (SGRetryBudget *)actualRetryBudget
+    // Returns the effective retry budget, that is, the one set by the user or, 
+    // if that's not set, the one shared by everyone talking to our host.
 {
-    // First retry is after one second; next retry is after one minute; next retry 
-    // is after one hour; next retry (and all subsequent retries) is after six hours.
-    static const NSUInteger kRetryDelays[] = { 1, 60, 60 * 60, 6 * 60 * 60 };
+    SGRetryBudget * result;
 
-    if (rangeIndex >= (sizeof(kRetryDelays) / sizeof(kRetryDelays[0]))) {
-        rangeIndex = (sizeof(kRetryDelays) / sizeof(kRetryDelays[0])) - 1;
+    result = self.retryBudget;
+    if (result == nil) {
+        result = [SGRetryBudget budgetForHost:[[self.request URL] host]];
     }
-    return ((NSTimeInterval) (((NSUInteger) arc4random()) % (kRetryDelays[rangeIndex] * 1000))) / 1000.0;
+    return result;
+}
+
+// This isn't a crypto system, so we don't care about mod bias, so we just calculate 
+// a random fraction by taking the random number mod a million.
+
+static NSTimeInterval RandomDelayBetween(NSTimeInterval lower, NSTimeInterval upper)
+{
+    assert(lower <= upper);
+    return lower + ((upper - lower) * ((double) (arc4random() % 1000000) / 1000000.0));
 }
 
 - (NSTimeInterval)shortRetryDelay
-    // Returns a random short delay (that is, within the next second).
+    // Returns a random short delay (that is, within minimumRetryDelay).
 {
-    return [self retryDelayWithinRangeAtIndex:0];
+    return RandomDelayBetween(0.0, self.minimumRetryDelay);
 }
 
 - (NSTimeInterval)randomRetryDelay
-    // Returns a random delay that's based on the retryCount; the delay range grows 
-    // rapidly with the number of retries, thereby ensuring that we don't continuously 
-    // thrash the device doing unsuccessful retries.
+    // Returns the next delay in the decorrelated jitter sequence: a random delay 
+    // between the minimum and three times the last delay, capped at the maximum. 
+    // The delays grow roughly exponentially, thereby ensuring that we don't 
+    // continuously thrash the device doing unsuccessful retries, but, unlike a 
+    // fixed schedule, operations that failed at the same time drift apart.
 {
-    return [self retryDelayWithinRangeAtIndex:self.retryCount];
+    NSTimeInterval  delay;
+
+    delay = RandomDelayBetween(self.minimumRetryDelay, MAX(self.minimumRetryDelay, self->_lastRetryDelay * 3.0));
+    delay = MIN(delay, self.maximumRetryDelay);
+    self->_lastRetryDelay = delay;
+    return delay;
+}
+
+- (NSURLRequest *)requestResumingAtOffset:(unsigned long long)offset
+    // Returns our request, modified to ask for the body from offset onwards, provided
+    // the resource hasn't changed.
+{
+    NSMutableURLRequest *   result;
+
+    assert(offset != 0);
+    assert(self.resumeValidator != nil);
+
+    result = [[self.request mutableCopy] autorelease];
+    assert(result != nil);
+    [result setValue:[NSString stringWithFormat:@"bytes=%llu-", offset] forHTTPHeaderField:@"Range"];
+    [result setValue:self.resumeValidator forHTTPHeaderField:@"If-Range"];
+    return result;
 }
 
 #pragma mark * Core state transitions
@@ -248,6 +420,22 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     
     //[[SGQLog log] logOption:kLogOptionNetworkDetails withFormat:@"http %zu start %@", (size_t) self->_sequenceNumber, [self.request URL]];
 
+    // If an earlier operation left part of our file behind, pick up its resume information.
+    
+    if (self.responseFilePath != nil) {
+        NSDictionary *  resumeInfo;
+        
+        resumeInfo = [NSDictionary dictionaryWithContentsOfFile:ResumeInfoPathForFilePath(self.responseFilePath)];
+        if ( [[resumeInfo objectForKey:kRetryingHTTPOperationResumeURLKey] isEqual:[[self.request URL] absoluteString]] ) {
+            self.resumeValidator = [resumeInfo objectForKey:kRetryingHTTPOperationResumeValidatorKey];
+        }
+    }
+
+    // Seed the jitter sequence with the minimum, so that the first retry waits 
+    // between one and three times the minimum, rather than exactly the minimum.
+    
+    self->_lastRetryDelay = self.minimumRetryDelay;
+
     self.retryState = kRetryingHTTPOperationStateGetting;
     [self startRequest];
 }
@@ -255,35 +443,49 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 - (void)startRequest
     // Starts the HTTP request.  This might be the first request or a retry.
 {
+    NSURLRequest *              request;
+    QHTTPFileResponseConsumer * consumer;
+
     assert([self isActualRunLoopThread]);
     assert( (self.retryState == kRetryingHTTPOperationStateGetting) || (self.retryState == kRetryingHTTPOperationStateRetrying) );
     assert(self.networkOperation == nil);
 
     //[[SGQLog log] logOption:kLogOptionNetworkDetails withFormat:@"http %zu request start", (size_t) self->_sequenceNumber];
     
+    // If we're downloading to a file, set up a consumer that writes to that file.  If 
+    // an earlier attempt got part of the body, and we know how to check that it's still 
+    // the same body, ask for the rest.
+    
+    request = self.request;
+    consumer = nil;
+    if (self.responseFilePath != nil) {
+        struct stat     sb;
+
+        consumer = [[[RetryingHTTPFileResponseConsumer alloc] initWithPath:self.responseFilePath URLString:[[self.request URL] absoluteString] previousValidator:self.resumeValidator] autorelease];
+        assert(consumer != nil);
+        if ( (self.resumeValidator != nil) && (stat([self.responseFilePath fileSystemRepresentation], &sb) == 0) && (sb.st_size > 0) ) {
+            consumer.resumeOffset = (unsigned long long) sb.st_size;
+            request = [self requestResumingAtOffset:consumer.resumeOffset];
+        }
+    }
+    
     // Create the network operation.
     
-    self.networkOperation = [[[QHTTPOperation alloc] initWithRequest:self.request] autorelease];
+    self.networkOperation = [[[QHTTPOperation alloc] initWithRequest:request] autorelease];
     assert(self.networkOperation != nil);
     
     // Copy our properties over to the network operation.
     
     [self.networkOperation setQueuePriority:[self queuePriority]];
     self.networkOperation.acceptableContentTypes = self.acceptableContentTypes;
+    self.networkOperation.cache = self.cache;
     self.networkOperation.runLoopThread = self.runLoopThread;
     self.networkOperation.runLoopModes  = self.runLoopModes;
     
-    // If we're downloading to a file, set up an output stream that points to that file. 
-    // 
-    // Note that we pass NO to the append parameter; if we wanted to support resumeable 
-    // downloads, we could do it here (but we'd have to mess around with etags and so on).
-    
-    if (self.responseFilePath != nil) {
-        self.networkOperation.responseOutputStream = [NSOutputStream outputStreamToFileAtPath:self.responseFilePath append:NO];
-        assert(self.networkOperation.responseOutputStream != nil);
-    }
+    self.networkOperation.responseConsumer = consumer;
     
     [[SGNetworkManager sharedManager] addNetworkTransferOperation:self.networkOperation 
+                                                         priority:self.transferPriority 
                                                    finishedTarget:self 
                                                            action:@selector(networkOperationDone:)];
 }
@@ -296,6 +498,11 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     assert(operation == self.networkOperation);
     self.networkOperation = nil;
 
+    // Tell the retry budget how the host is doing.  Only retryable errors count against 
+    // it; a 404, say, means the host is working fine.
+    
+    [self.actualRetryBudget recordAttemptFailed:(operation.error != nil) && [self shouldRetryAfterError:operation.error]];
+
     if (operation.error == nil) {
     
         // The request was successful; let's complete the operation.
@@ -313,6 +520,16 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
         
         //[[SGQLog log] logOption:kLogOptionNetworkDetails withFormat:@"http %zu request error %@", (size_t) self->_sequenceNumber, operation.error];
     
+        // Remember how to resume the body, if we got any of it.  If we didn't even get 
+        // a response, the file is as the previous attempt left it.
+        
+        if (operation.lastResponse != nil) {
+            self.resumeValidator = ResumeValidatorForResponse(operation.lastResponse, self.resumeValidator);
+            if ( (self.resumeValidator == nil) && (self.responseFilePath != nil) ) {
+                (void) unlink([ResumeInfoPathForFilePath(self.responseFilePath) fileSystemRepresentation]);
+            }
+        }
+
         if ( ! [self shouldRetryAfterError:operation.error] ) {
             
             // If the error is fatal, we just fail the overall operation.
@@ -414,8 +631,11 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 }
 
 - (void)retryTimerDone:(NSTimer *)timer
-    // Called when the retry timer expires.  It just starts the actual retry.
+    // Called when the retry timer expires.  It starts the actual retry, if the 
+    // retry budget allows.
 {
+    NSTimeInterval  budgetDelay;
+
     assert([self isActualRunLoopThread]);
     assert(timer == self.retryTimer);
     #pragma unused(timer)
@@ -426,6 +646,16 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     self.retryTimer = nil;
     
     assert(self.retryState == kRetryingHTTPOperationStateWaitingToRetry);
+    
+    // If the host's budget won't let us retry yet, wait as long as it says, plus some 
+    // jitter so that all the refused operations don't come back at once.
+    
+    budgetDelay = [self.actualRetryBudget reserveRetry];
+    if (budgetDelay > 0.0) {
+        [self startRetryAfterTimeInterval:budgetDelay + [self shortRetryDelay]];
+        return;
+    }
+    
     self.retryState = kRetryingHTTPOperationStateRetrying;
     self.retryCount += 1;
     [self startRequest];
@@ -524,6 +754,13 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     }
     self.retryState = kRetryingHTTPOperationStateFinished;
 
+    // Unless we were cancelled, in which case someone might want to try again later, 
+    // the resume information is no longer useful.
+    
+    if ( (self.responseFilePath != nil) && ! ( [[self.error domain] isEqual:NSCocoaErrorDomain] && ([self.error code] == NSUserCancelledError) ) ) {
+        (void) unlink([ResumeInfoPathForFilePath(self.responseFilePath) fileSystemRepresentation]);
+    }
+
     if (self.error == nil) {
         //[[SGQLog log] logOption:kLogOptionNetworkDetails withFormat:@"http %zu success", (size_t) self->_sequenceNumber];
         
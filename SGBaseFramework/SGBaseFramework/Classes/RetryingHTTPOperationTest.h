@@ -0,0 +1,20 @@
+//
+//  RetryingHTTPOperationTest.h
+//  SGBaseFramework
+//
+//  Unit tests for resuming downloads in RetryingHTTPOperation.
+
+#define USE_APPLICATION_UNIT_TEST 0
+
+#import <SenTestingKit/SenTestingKit.h>
+#import <UIKit/UIKit.h>
+
+
+@interface RetryingHTTPOperationTest : SenTestCase {
+}
+
+- (void)testRetryResumesAfterMidStreamDisconnect;
+- (void)testRetryFetchesEverythingWhenResourceChanges;
+- (void)testNewOperationResumesWhereCancelledOneStopped;
+
+@end
@@ -0,0 +1,217 @@
+//
+//  RetryingHTTPOperationTest.m
+//  SGBaseFramework
+//
+
+#import "RetryingHTTPOperationTest.h"
+#import "RetryingHTTPOperation.h"
+#import "SGTestHTTPServer.h"
+
+static const NSUInteger kSGRangeServerBodyLength = 256 * 1024;
+static const NSUInteger kSGRangeServerDropLength = 100 * 1000;
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static NSData * BodyForVersion(NSUInteger version)
+{
+    NSMutableData * result = [NSMutableData dataWithLength:kSGRangeServerBodyLength];
+    uint8_t * bytes = [result mutableBytes];
+
+    // Every byte depends on its offset, so a body stitched together at the wrong place
+    // won't match.
+
+    for (NSUInteger i = 0; i < kSGRangeServerBodyLength; i++) {
+        bytes[i] = (uint8_t) ((i * 31) + (i >> 8) + version);
+    }
+    return result;
+}
+
+
+static SGTestHTTPServer * StartRangeServer(NSUInteger dropCount, BOOL changesAfterFirstRequest)
+    // Starts a loopback server for one resource that understands Range and If-Range, and
+    // that drops the connection part way through the body of the first dropCount responses,
+    // after kSGRangeServerDropLength bytes.  If changesAfterFirstRequest is set, the
+    // resource (and its ETag) changes after the first request.  The server keeps the
+    // headers of each request, and counts the body bytes it sends, so that the test can
+    // see how much was fetched twice.
+{
+    __block NSUInteger version = 1;
+    SGTestHTTPServer * server;
+
+    server = [[[SGTestHTTPServer alloc] initWithResponder:^(NSString * request, NSUInteger requestIndex) {
+        NSString * eTag;
+        NSData * body;
+        NSRange rangeHeader;
+        NSRange ifRangeHeader;
+        unsigned long long first;
+        BOOL partial;
+        SGTestHTTPResponse * response;
+
+        request = [request lowercaseString];
+        if (changesAfterFirstRequest && requestIndex == 1) {
+            version += 1;
+        }
+        eTag = [NSString stringWithFormat:@"\"v%lu\"", (unsigned long) version];
+        body = BodyForVersion(version);
+
+        // Honour the Range only if the If-Range matches.
+
+        first = 0;
+        partial = NO;
+        rangeHeader = [request rangeOfString:@"\r\nrange: bytes="];
+        if (rangeHeader.location != NSNotFound) {
+            first = strtoull([[request substringFromIndex:NSMaxRange(rangeHeader)] UTF8String], NULL, 10);
+            ifRangeHeader = [request rangeOfString:@"\r\nif-range: "];
+            partial = (ifRangeHeader.location == NSNotFound)
+                   || [[request substringFromIndex:NSMaxRange(ifRangeHeader)] hasPrefix:eTag];
+        }
+
+        if (partial && first >= kSGRangeServerBodyLength) {
+            response = [SGTestHTTPResponse responseWithStatusCode:416 headers:nil body:nil];
+        } else if (partial) {
+            response = [SGTestHTTPResponse responseWithStatusCode:206 headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                @"application/octet-stream", @"Content-Type",
+                [NSString stringWithFormat:@"bytes %llu-%lu/%lu", first, (unsigned long) (kSGRangeServerBodyLength - 1), (unsigned long) kSGRangeServerBodyLength], @"Content-Range",
+                eTag, @"ETag",
+                nil
+            ] body:[body subdataWithRange:NSMakeRange((NSUInteger) first, kSGRangeServerBodyLength - (NSUInteger) first)]];
+        } else {
+            response = [SGTestHTTPResponse responseWithStatusCode:200 headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                @"application/octet-stream", @"Content-Type",
+                @"bytes", @"Accept-Ranges",
+                eTag, @"ETag",
+                nil
+            ] body:body];
+        }
+
+        // Drop the connection part way through the body, if we've been told to.
+
+        if (requestIndex < dropCount) {
+            response.bodyLengthToSend = kSGRangeServerDropLength;
+        }
+        return response;
+    }] autorelease];
+    server.recordsRequests = YES;
+    [server start];
+    return server;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void RunUntil(RetryingHTTPOperation * op, RetryingHTTPOperationState state)
+    // Spins the run loop until op reaches state (or finishes), or for twenty seconds.
+{
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:20.0];
+
+    while ( ![op isFinished] && (op.retryState != state) && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    }
+}
+
+
+static RetryingHTTPOperation * StartOperation(NSOperationQueue * queue, SGTestHTTPServer * server, NSString * path)
+{
+    NSURL * url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/file", (unsigned) server.port]];
+    RetryingHTTPOperation * op = [[[RetryingHTTPOperation alloc] initWithRequest:[NSURLRequest requestWithURL:url]] autorelease];
+
+    op.responseFilePath = path;
+    [queue addOperation:op];
+    return op;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@implementation RetryingHTTPOperationTest
+
+
+- (NSString *)cleanFilePath {
+    NSString * path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"RetryingHTTPOperationTest"];
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+    [[NSFileManager defaultManager] removeItemAtPath:[path stringByAppendingString:@".resume"] error:NULL];
+    return path;
+}
+
+
+- (void)testRetryResumesAfterMidStreamDisconnect {
+    NSOperationQueue * queue = [[[NSOperationQueue alloc] init] autorelease];
+    SGTestHTTPServer * server = StartRangeServer(1, NO);
+    NSString * path = [self cleanFilePath];
+    RetryingHTTPOperation * op;
+    NSArray * requests;
+
+    STAssertNotNil(server, @"Could not start the stub server", nil);
+
+    op = StartOperation(queue, server, path);
+    RunUntil(op, kRetryingHTTPOperationStateFinished);
+    [server stop];
+
+    STAssertTrue([op isFinished], @"Operation should finish", nil);
+    STAssertNil(op.error, nil, nil);
+    STAssertEquals(op.retryCount, (NSUInteger) 1, nil, nil);
+    STAssertEqualObjects([NSData dataWithContentsOfFile:path], BodyForVersion(1), @"The pieces should make up the body", nil);
+
+    requests = server.requests;
+    STAssertEquals([requests count], (NSUInteger) 2, nil, nil);
+    STAssertTrue([[[requests objectAtIndex:1] lowercaseString] rangeOfString:[NSString stringWithFormat:@"\r\nrange: bytes=%lu-\r\n", (unsigned long) kSGRangeServerDropLength]].location != NSNotFound, @"The retry should ask for the rest", nil);
+    STAssertTrue([[[requests objectAtIndex:1] lowercaseString] rangeOfString:@"\r\nif-range: \"v1\"\r\n"].location != NSNotFound, @"The retry should be guarded by If-Range", nil);
+    STAssertEquals(server.bodyBytesSent, (unsigned long long) kSGRangeServerBodyLength, @"Nothing should be fetched twice", nil);
+    STAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[path stringByAppendingString:@".resume"]], @"Resume information should go once we're done", nil);
+}
+
+
+- (void)testRetryFetchesEverythingWhenResourceChanges {
+    NSOperationQueue * queue = [[[NSOperationQueue alloc] init] autorelease];
+    SGTestHTTPServer * server = StartRangeServer(1, YES);
+    NSString * path = [self cleanFilePath];
+    RetryingHTTPOperation * op;
+
+    STAssertNotNil(server, @"Could not start the stub server", nil);
+
+    op = StartOperation(queue, server, path);
+    RunUntil(op, kRetryingHTTPOperationStateFinished);
+    [server stop];
+
+    STAssertTrue([op isFinished], @"Operation should finish", nil);
+    STAssertNil(op.error, nil, nil);
+    STAssertEqualObjects([NSData dataWithContentsOfFile:path], BodyForVersion(2), @"The file should hold only the new body", nil);
+    STAssertEquals(server.bodyBytesSent, (unsigned long long) (kSGRangeServerDropLength + kSGRangeServerBodyLength), @"The new body should be fetched in full", nil);
+}
+
+
+- (void)testNewOperationResumesWhereCancelledOneStopped {
+    NSOperationQueue * queue = [[[NSOperationQueue alloc] init] autorelease];
+    SGTestHTTPServer * server = StartRangeServer(1, NO);
+    NSString * path = [self cleanFilePath];
+    RetryingHTTPOperation * op;
+    NSArray * requests;
+
+    STAssertNotNil(server, @"Could not start the stub server", nil);
+
+    // Let the first operation fail part way through, then give up on it.
+
+    op = StartOperation(queue, server, path);
+    RunUntil(op, kRetryingHTTPOperationStateWaitingToRetry);
+    STAssertEquals(op.retryState, (RetryingHTTPOperationState) kRetryingHTTPOperationStateWaitingToRetry, nil, nil);
+    [op cancel];
+    RunUntil(op, kRetryingHTTPOperationStateFinished);
+    STAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:[path stringByAppendingString:@".resume"]], @"Cancelling should keep the resume information", nil);
+
+    // A new operation for the same file should carry on from there.
+
+    op = StartOperation(queue, server, path);
+    RunUntil(op, kRetryingHTTPOperationStateFinished);
+    [server stop];
+
+    STAssertNil(op.error, nil, nil);
+    STAssertEquals(op.retryCount, (NSUInteger) 0, @"The new operation shouldn't need to retry", nil);
+    STAssertEqualObjects([NSData dataWithContentsOfFile:path], BodyForVersion(1), nil, nil);
+    requests = server.requests;
+    STAssertEquals([requests count], (NSUInteger) 2, nil, nil);
+    STAssertTrue([[[requests lastObject] lowercaseString] rangeOfString:@"\r\nrange: bytes="].location != NSNotFound, @"The new operation should resume", nil);
+    STAssertEquals(server.bodyBytesSent, (unsigned long long) kSGRangeServerBodyLength, nil, nil);
+}
+
+@end
@@ -0,0 +1,75 @@
+/*
+    File:       SGBufferPool.h
+
+    Contains:   A pool of reusable memory buffers, in power of two size classes.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+    SGBufferPool recycles the large buffers that QHTTPOperation uses to accumulate 
+    response bodies.  Without it, every response allocates a buffer sized from its 
+    Content-Length (or from defaultResponseSize), grows it as the data arrives, and 
+    frees it when the client is done; under sustained traffic that's a lot of 
+    churn in large allocations, which are expensive on iOS because each one maps 
+    and unmaps fresh pages.  Some important points:
+
+    o Buffers come in power of two size classes, from minimumBufferSize up to 
+      maximumBufferSize.  A request for more than maximumBufferSize is served 
+      straight from malloc and never pooled.
+
+    o The pool hands out buffers wrapped in an NSMutableData subclass.  When that 
+      object grows beyond its buffer, it swaps to a buffer of the next class up 
+      (returning the old one); when it's deallocated, its buffer goes back to the 
+      pool.  So QHTTPOperation's responseBody is a pooled buffer, and handing it 
+      to a client involves no copy; the buffer returns to the pool when the 
+      client releases it.
+
+    o The pool keeps at most retainedBytesLimit bytes of free buffers.  Buffers 
+      returned beyond that are freed.  The pool also drops all its free buffers 
+      when the application gets a memory warning.
+
+    o The statistics let you see how well the pool is working.  allocationCount 
+      is the number of buffers the pool has had to malloc; reuseCount is the 
+      number of times it has handed out a recycled one.
+
+    All methods can be called from any thread.
+*/
+
+@interface SGBufferPool : NSObject
+{
+    void *              _freeLists;
+    NSUInteger          _classCount;
+    NSUInteger          _minimumBufferSize;
+    NSUInteger          _maximumBufferSize;
+    NSUInteger          _retainedBytesLimit;
+    NSUInteger          _retainedBytes;                     // protected by @synchronized (self)
+    uint64_t            _allocationCount;                   // protected by @synchronized (self)
+    uint64_t            _reuseCount;                        // protected by @synchronized (self)
+}
+
++ (SGBufferPool *)sharedPool;
+    // Returns a pool with buffers from 4 KB to 4 MB, retaining up to 4 MB of free 
+    // buffers (1/4 of those figures on embedded, as with QHTTPOperation's 
+    // maximumResponseSize).
+
+- (id)initWithMinimumBufferSize:(NSUInteger)minimumBufferSize maximumBufferSize:(NSUInteger)maximumBufferSize retainedBytesLimit:(NSUInteger)retainedBytesLimit;
+    // The buffer sizes are rounded up to powers of two.
+
+@property (nonatomic, assign, readonly ) NSUInteger     minimumBufferSize;
+@property (nonatomic, assign, readonly ) NSUInteger     maximumBufferSize;
+@property (atomic,    assign, readwrite) NSUInteger     retainedBytesLimit;
+
+- (NSMutableData *)mutableDataWithCapacity:(NSUInteger)capacity;
+    // Returns an empty, autoreleased NSMutableData backed by a pooled buffer of at 
+    // least capacity bytes.
+
+- (void)drain;
+    // Frees all the free buffers in the pool.
+
+@property (atomic, assign, readonly) NSUInteger         retainedBytes;
+@property (atomic, assign, readonly) uint64_t           allocationCount;
+@property (atomic, assign, readonly) uint64_t           reuseCount;
+
+@end
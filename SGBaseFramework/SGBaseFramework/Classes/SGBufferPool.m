@@ -0,0 +1,356 @@
+/*
+    File:       SGBufferPool.m
+
+    Contains:   A pool of reusable memory buffers, in power of two size classes.
+
+*/
+
+#import "SGBufferPool.h"
+
+#import <UIKit/UIKit.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+@interface SGBufferPool ()
+
+- (void *)borrowBufferOfSize:(NSUInteger)size actualSize:(NSUInteger *)actualSizePtr;
+- (void)returnBuffer:(void *)buffer size:(NSUInteger)size;
+
+@end
+
+#pragma mark * SGPooledMutableData
+
+// SGPooledMutableData is the NSMutableData subclass that the pool hands out.  The 
+// primitive methods of NSMutableData are -bytes, -length, -mutableBytes and 
+// -setLength:; we also override the append methods, because the inherited versions 
+// go through -setLength:, which has to zero fill the new bytes only for them to be 
+// overwritten.
+
+@interface SGPooledMutableData : NSMutableData
+{
+    SGBufferPool *  _pool;
+    void *          _bytes;
+    NSUInteger      _length;
+    NSUInteger      _capacity;
+}
+
+- (id)initWithPool:(SGBufferPool *)pool capacity:(NSUInteger)capacity;
+
+@end
+
+@implementation SGPooledMutableData
+
+- (id)initWithPool:(SGBufferPool *)pool capacity:(NSUInteger)capacity
+{
+    assert(pool != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_pool = [pool retain];
+        self->_bytes = [pool borrowBufferOfSize:capacity actualSize:&self->_capacity];
+        assert(self->_bytes != NULL);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_pool returnBuffer:self->_bytes size:self->_capacity];
+    [self->_pool release];
+    [super dealloc];
+}
+
+- (const void *)bytes
+{
+    return self->_bytes;
+}
+
+- (void *)mutableBytes
+{
+    return self->_bytes;
+}
+
+- (NSUInteger)length
+{
+    return self->_length;
+}
+
+- (void)ensureCapacity:(NSUInteger)capacity
+    // Swaps to a bigger buffer, if necessary.  We at least double the size so that 
+    // a series of appends doesn't keep copying.
+{
+    void *      newBytes;
+    NSUInteger  newCapacity;
+
+    if (capacity > self->_capacity) {
+        newBytes = [self->_pool borrowBufferOfSize:MAX(capacity, self->_capacity * 2) actualSize:&newCapacity];
+        assert(newBytes != NULL);
+        memcpy(newBytes, self->_bytes, self->_length);
+        [self->_pool returnBuffer:self->_bytes size:self->_capacity];
+        self->_bytes = newBytes;
+        self->_capacity = newCapacity;
+    }
+}
+
+- (void)setLength:(NSUInteger)length
+{
+    [self ensureCapacity:length];
+    if (length > self->_length) {
+        memset( ((uint8_t *) self->_bytes) + self->_length, 0, length - self->_length);
+    }
+    self->_length = length;
+}
+
+- (void)appendBytes:(const void *)bytes length:(NSUInteger)length
+{
+    [self ensureCapacity:self->_length + length];
+    memcpy( ((uint8_t *) self->_bytes) + self->_length, bytes, length);
+    self->_length += length;
+}
+
+- (void)appendData:(NSData *)data
+{
+    [self appendBytes:[data bytes] length:[data length]];
+}
+
+@end
+
+#pragma mark * SGBufferPool
+
+static NSUInteger RoundUpToPowerOfTwo(NSUInteger value)
+{
+    NSUInteger  result;
+
+    result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+@implementation SGBufferPool
+
++ (SGBufferPool *)sharedPool
+    // See comment in header.
+{
+    static SGBufferPool * sSharedPool;
+
+    // any thread
+    @synchronized (self) {
+        if (sSharedPool == nil) {
+            #if TARGET_OS_EMBEDDED || TARGET_IPHONE_SIMULATOR
+                static const NSUInteger kPlatformReductionFactor = 4;
+            #else
+                static const NSUInteger kPlatformReductionFactor = 1;
+            #endif
+            sSharedPool = [[SGBufferPool alloc] initWithMinimumBufferSize:4 * 1024 
+                                                         maximumBufferSize:4 * 1024 * 1024 / kPlatformReductionFactor 
+                                                        retainedBytesLimit:4 * 1024 * 1024 / kPlatformReductionFactor];
+            assert(sSharedPool != nil);
+        }
+    }
+    return sSharedPool;
+}
+
+- (id)initWithMinimumBufferSize:(NSUInteger)minimumBufferSize maximumBufferSize:(NSUInteger)maximumBufferSize retainedBytesLimit:(NSUInteger)retainedBytesLimit
+    // See comment in header.
+{
+    assert(minimumBufferSize != 0);
+    assert(minimumBufferSize <= maximumBufferSize);
+    self = [super init];
+    if (self != nil) {
+        CFMutableArrayRef * freeLists;
+
+        self->_minimumBufferSize = RoundUpToPowerOfTwo(minimumBufferSize);
+        self->_maximumBufferSize = RoundUpToPowerOfTwo(maximumBufferSize);
+        self->_retainedBytesLimit = retainedBytesLimit;
+        
+        for (NSUInteger size = self->_minimumBufferSize; size <= self->_maximumBufferSize; size <<= 1) {
+            self->_classCount += 1;
+        }
+        
+        // Each free list is a CFArray of raw buffer pointers, hence the NULL callbacks.
+        
+        freeLists = malloc(self->_classCount * sizeof(CFMutableArrayRef));
+        assert(freeLists != NULL);
+        for (NSUInteger i = 0; i < self->_classCount; i++) {
+            freeLists[i] = CFArrayCreateMutable(NULL, 0, NULL);
+            assert(freeLists[i] != NULL);
+        }
+        self->_freeLists = freeLists;
+
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(didReceiveMemoryWarning:) name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    CFMutableArrayRef * freeLists;
+
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+    [self drain];
+    freeLists = (CFMutableArrayRef *) self->_freeLists;
+    for (NSUInteger i = 0; i < self->_classCount; i++) {
+        CFRelease(freeLists[i]);
+    }
+    free(freeLists);
+    [super dealloc];
+}
+
+@synthesize minimumBufferSize = _minimumBufferSize;
+@synthesize maximumBufferSize = _maximumBufferSize;
+
+- (NSUInteger)retainedBytesLimit
+{
+    @synchronized (self) {
+        return self->_retainedBytesLimit;
+    }
+}
+
+- (void)setRetainedBytesLimit:(NSUInteger)newValue
+{
+    @synchronized (self) {
+        self->_retainedBytesLimit = newValue;
+    }
+}
+
+- (NSUInteger)retainedBytes
+{
+    @synchronized (self) {
+        return self->_retainedBytes;
+    }
+}
+
+- (uint64_t)allocationCount
+{
+    @synchronized (self) {
+        return self->_allocationCount;
+    }
+}
+
+- (uint64_t)reuseCount
+{
+    @synchronized (self) {
+        return self->_reuseCount;
+    }
+}
+
+- (NSUInteger)classIndexForSize:(NSUInteger)size
+    // Returns the index of the smallest size class that holds size bytes, or 
+    // NSNotFound if size is too big to pool.
+{
+    NSUInteger  result;
+    NSUInteger  classSize;
+
+    if (size > self->_maximumBufferSize) {
+        return NSNotFound;
+    }
+    result = 0;
+    classSize = self->_minimumBufferSize;
+    while (classSize < size) {
+        classSize <<= 1;
+        result += 1;
+    }
+    return result;
+}
+
+- (void *)borrowBufferOfSize:(NSUInteger)size actualSize:(NSUInteger *)actualSizePtr
+    // Returns a buffer of at least size bytes, and sets *actualSizePtr to its size, 
+    // which is what must be passed back to -returnBuffer:size:.
+{
+    NSUInteger          classIndex;
+    CFMutableArrayRef   freeList;
+    void *              result;
+
+    // any thread
+    assert(actualSizePtr != NULL);
+
+    classIndex = [self classIndexForSize:size];
+    if (classIndex == NSNotFound) {
+        *actualSizePtr = size;
+    } else {
+        *actualSizePtr = self->_minimumBufferSize << classIndex;
+    }
+
+    result = NULL;
+    @synchronized (self) {
+        if (classIndex != NSNotFound) {
+            freeList = ((CFMutableArrayRef *) self->_freeLists)[classIndex];
+            if (CFArrayGetCount(freeList) != 0) {
+                result = (void *) CFArrayGetValueAtIndex(freeList, CFArrayGetCount(freeList) - 1);
+                CFArrayRemoveValueAtIndex(freeList, CFArrayGetCount(freeList) - 1);
+                self->_retainedBytes -= *actualSizePtr;
+                self->_reuseCount += 1;
+            }
+        }
+        if (result == NULL) {
+            self->_allocationCount += 1;
+        }
+    }
+    
+    // We malloc outside the lock; it can take a while for big buffers.
+    
+    if (result == NULL) {
+        result = malloc(MAX(*actualSizePtr, (NSUInteger) 1));
+        assert(result != NULL);
+    }
+    return result;
+}
+
+- (void)returnBuffer:(void *)buffer size:(NSUInteger)size
+    // Takes back a buffer from -borrowBufferOfSize:actualSize:.
+{
+    NSUInteger  classIndex;
+    BOOL        pooled;
+
+    // any thread
+    assert(buffer != NULL);
+
+    pooled = NO;
+    classIndex = [self classIndexForSize:size];
+    if ( (classIndex != NSNotFound) && (size == (self->_minimumBufferSize << classIndex)) ) {
+        @synchronized (self) {
+            if ( (self->_retainedBytes + size) <= self->_retainedBytesLimit ) {
+                CFArrayAppendValue(((CFMutableArrayRef *) self->_freeLists)[classIndex], buffer);
+                self->_retainedBytes += size;
+                pooled = YES;
+            }
+        }
+    }
+    if ( ! pooled ) {
+        free(buffer);
+    }
+}
+
+- (NSMutableData *)mutableDataWithCapacity:(NSUInteger)capacity
+    // See comment in header.
+{
+    return [[[SGPooledMutableData alloc] initWithPool:self capacity:capacity] autorelease];
+}
+
+- (void)drain
+    // See comment in header.
+{
+    CFMutableArrayRef * freeLists;
+
+    // any thread
+    freeLists = (CFMutableArrayRef *) self->_freeLists;
+    @synchronized (self) {
+        for (NSUInteger i = 0; i < self->_classCount; i++) {
+            for (CFIndex j = 0; j < CFArrayGetCount(freeLists[i]); j++) {
+                free( (void *) CFArrayGetValueAtIndex(freeLists[i], j) );
+            }
+            CFArrayRemoveAllValues(freeLists[i]);
+        }
+        self->_retainedBytes = 0;
+    }
+}
+
+- (void)didReceiveMemoryWarning:(NSNotification *)note
+{
+    #pragma unused(note)
+    [self drain];
+}
+
+@end
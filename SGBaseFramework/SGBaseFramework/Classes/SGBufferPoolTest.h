@@ -0,0 +1,24 @@
+//
+//  SGBufferPoolTest.h
+//  SGBaseFramework
+//
+//  Unit tests and an allocation benchmark for SGBufferPool.
+
+#define USE_APPLICATION_UNIT_TEST 0
+
+#import <SenTestingKit/SenTestingKit.h>
+#import <UIKit/UIKit.h>
+
+
+@interface SGBufferPoolTest : SenTestCase {
+    NSUInteger _finishedCount;
+    NSUInteger _failedCount;
+    NSUInteger _peakResidentSize;
+    NSData * _detachedBody;
+}
+
+- (void)testBuffersAreReusedWithinTheirSizeClass;
+- (void)testDetachedResponseBodyIsNotCopied;
+- (void)testPoolReducesAllocationsOverManyRequests;
+
+@end
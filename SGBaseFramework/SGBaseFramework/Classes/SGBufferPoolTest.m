@@ -0,0 +1,227 @@
+//
+//  SGBufferPoolTest.m
+//  SGBaseFramework
+//
+
+#import "SGBufferPoolTest.h"
+#import "SGBufferPool.h"
+#import "SGNetworkManager.h"
+#import "QHTTPOperation.h"
+#import "SGTestHTTPServer.h"
+
+#include <mach/mach.h>
+
+static const NSUInteger kSGKeepAliveServerBodyLength   = 48 * 1024;
+
+static const NSUInteger kSGBufferBenchmarkRequestCount = 10000;
+static const NSUInteger kSGBufferBenchmarkBatchSize    = 200;
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SGTestHTTPServer * StartKeepAliveServer(void)
+    // Starts a loopback server that answers every request with the same body as fast as
+    // it can.  It honours keep-alive, so that ten thousand requests don't use up the
+    // ephemeral ports.
+{
+    SGTestHTTPServer * server;
+
+    server = [[[SGTestHTTPServer alloc] initWithStatusCode:200 headers:[NSDictionary dictionaryWithObjectsAndKeys:
+        @"application/octet-stream", @"Content-Type",
+        @"no-store", @"Cache-Control",
+        nil
+    ] body:[NSMutableData dataWithLength:kSGKeepAliveServerBodyLength]] autorelease];
+    server.keepAlive = YES;
+    [server start];
+    return server;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static NSUInteger SGResidentSize(void) {
+    struct task_basic_info info;
+    mach_msg_type_number_t count = TASK_BASIC_INFO_COUNT;
+
+    if (task_info(mach_task_self(), TASK_BASIC_INFO, (task_info_t) &info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return (NSUInteger) info.resident_size;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@implementation SGBufferPoolTest
+
+
+- (void)testBuffersAreReusedWithinTheirSizeClass {
+    SGBufferPool * pool = [[[SGBufferPool alloc] initWithMinimumBufferSize:4096 maximumBufferSize:65536 retainedBytesLimit:65536] autorelease];
+    NSMutableData * data;
+    const void * firstBytes;
+
+    // The first buffer has to come from malloc.
+
+    data = [[pool mutableDataWithCapacity:3000] retain];
+    firstBytes = [data bytes];
+    [data appendBytes:"hello" length:5];
+    STAssertEquals([data length], (NSUInteger) 5, nil, nil);
+    STAssertEquals(memcmp([data bytes], "hello", 5), 0, nil, nil);
+    [data release];
+    STAssertEquals(pool.allocationCount, (uint64_t) 1, nil, nil);
+    STAssertEquals(pool.retainedBytes, (NSUInteger) 4096, @"The buffer should go back to the pool", nil);
+
+    // A request in the same size class gets the same buffer back.
+
+    data = [[pool mutableDataWithCapacity:4096] retain];
+    STAssertEquals([data bytes], firstBytes, @"The buffer should be recycled", nil);
+    STAssertEquals([data length], (NSUInteger) 0, nil, nil);
+    STAssertEquals(pool.reuseCount, (uint64_t) 1, nil, nil);
+
+    // Growing past the buffer moves to a bigger class and keeps the contents.
+
+    [data setLength:10];
+    memcpy([data mutableBytes], "0123456789", 10);
+    [data increaseLengthBy:5000];
+    STAssertEquals([data length], (NSUInteger) 5010, nil, nil);
+    STAssertEquals(memcmp([data bytes], "0123456789", 10), 0, @"Growing should preserve the contents", nil);
+    [data release];
+    STAssertEquals(pool.retainedBytes, (NSUInteger) (4096 + 8192), nil, nil);
+
+    // Requests over the maximum aren't pooled, and neither are buffers beyond the limit.
+
+    data = [[pool mutableDataWithCapacity:100000] retain];
+    [data release];
+    STAssertEquals(pool.retainedBytes, (NSUInteger) (4096 + 8192), @"Oversized buffers shouldn't be pooled", nil);
+
+    [pool drain];
+    STAssertEquals(pool.retainedBytes, (NSUInteger) 0, nil, nil);
+}
+
+
+- (void)detachingTransferDidFinish:(QHTTPOperation *)op {
+    _finishedCount += 1;
+    _detachedBody = [[op detachResponseBody] retain];
+    STAssertNil(op.responseBody, @"The operation should let go of the body", nil);
+}
+
+
+- (void)testDetachedResponseBodyIsNotCopied {
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    SGTestHTTPServer * server = StartKeepAliveServer();
+    SGBufferPool * savedPool = [[manager.bufferPool retain] autorelease];
+    SGURLCache * savedCache = [[manager.URLCache retain] autorelease];
+    SGBufferPool * pool = [[[SGBufferPool alloc] initWithMinimumBufferSize:4096 maximumBufferSize:1024 * 1024 retainedBytesLimit:1024 * 1024] autorelease];
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:10.0];
+    NSURL * url;
+    QHTTPOperation * op;
+
+    STAssertNotNil(server, @"Could not start the stub server", nil);
+    manager.bufferPool = pool;
+    manager.URLCache = nil;
+
+    _finishedCount = 0;
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/detach", server.port]];
+    op = [[[QHTTPOperation alloc] initWithRequest:[manager requestToGetURL:url]] autorelease];
+    [manager addNetworkTransferOperation:op finishedTarget:self action:@selector(detachingTransferDidFinish:)];
+    while (_finishedCount == 0 && [deadline timeIntervalSinceNow] > 0) {
+        NSAutoreleasePool * arp = [[NSAutoreleasePool alloc] init];
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+        [arp drain];
+    }
+    manager.bufferPool = savedPool;
+    manager.URLCache = savedCache;
+    [server stop];
+
+    STAssertEquals([_detachedBody length], kSGKeepAliveServerBodyLength, nil, nil);
+    STAssertEquals(pool.retainedBytes, (NSUInteger) 0, @"The buffer should still be in use", nil);
+
+    // Only our reference is left, so releasing it puts the buffer straight back.
+
+    [_detachedBody release];
+    _detachedBody = nil;
+    STAssertTrue(pool.retainedBytes >= kSGKeepAliveServerBodyLength, @"The buffer should be back in the pool", nil);
+}
+
+
+- (void)transferDidFinish:(QHTTPOperation *)op {
+    NSUInteger residentSize;
+
+    _finishedCount += 1;
+    if (op.error != nil || [op.responseBody length] != kSGKeepAliveServerBodyLength) {
+        _failedCount += 1;
+    }
+    residentSize = SGResidentSize();
+    if (residentSize > _peakResidentSize) {
+        _peakResidentSize = residentSize;
+    }
+}
+
+
+- (void)runRequestsToPort:(in_port_t)port {
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:300.0];
+    NSUInteger issued = 0;
+
+    _finishedCount = 0;
+    _failedCount = 0;
+    _peakResidentSize = SGResidentSize();
+
+    // We issue the requests in batches so that the operation objects themselves don't
+    // dominate the memory use.
+
+    while (_finishedCount < kSGBufferBenchmarkRequestCount && [deadline timeIntervalSinceNow] > 0) {
+        NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+
+        if (issued == _finishedCount) {
+            for (NSUInteger i = 0; i < kSGBufferBenchmarkBatchSize && issued < kSGBufferBenchmarkRequestCount; i++, issued++) {
+                NSURL * url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/blob?i=%lu", port, (unsigned long) issued]];
+                QHTTPOperation * op = [[[QHTTPOperation alloc] initWithRequest:[manager requestToGetURL:url]] autorelease];
+                [manager addNetworkTransferOperation:op finishedTarget:self action:@selector(transferDidFinish:)];
+            }
+        }
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+        [pool drain];
+    }
+    STAssertEquals(_finishedCount, kSGBufferBenchmarkRequestCount, @"All transfers should finish", nil);
+    STAssertEquals(_failedCount, (NSUInteger) 0, @"All transfers should succeed", nil);
+}
+
+
+- (void)testPoolReducesAllocationsOverManyRequests {
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    SGTestHTTPServer * server = StartKeepAliveServer();
+    SGURLCache * savedCache = [[manager.URLCache retain] autorelease];
+    SGBufferPool * savedPool = [[manager.bufferPool retain] autorelease];
+    SGBufferPool * pool = [[[SGBufferPool alloc] initWithMinimumBufferSize:4096 maximumBufferSize:1024 * 1024 retainedBytesLimit:1024 * 1024] autorelease];
+    NSUInteger unpooledPeak;
+    NSUInteger pooledPeak;
+
+    STAssertNotNil(server, @"Could not start the stub server", nil);
+    manager.URLCache = nil;
+
+    // Without a pool, each response allocates a fresh buffer.
+
+    manager.bufferPool = nil;
+    [self runRequestsToPort:server.port];
+    unpooledPeak = _peakResidentSize;
+
+    manager.bufferPool = pool;
+    [self runRequestsToPort:server.port];
+    pooledPeak = _peakResidentSize;
+
+    manager.bufferPool = savedPool;
+    manager.URLCache = savedCache;
+    [server stop];
+
+    NSLog(@"%lu requests of %lu bytes: without pool %lu buffer allocations, peak RSS %lu KB; "
+          "with pool %llu allocations, %llu reuses, peak RSS %lu KB",
+          (unsigned long) kSGBufferBenchmarkRequestCount, (unsigned long) kSGKeepAliveServerBodyLength,
+          (unsigned long) kSGBufferBenchmarkRequestCount, (unsigned long) (unpooledPeak / 1024),
+          pool.allocationCount, pool.reuseCount, (unsigned long) (pooledPeak / 1024));
+    STAssertTrue(pool.allocationCount < kSGBufferBenchmarkRequestCount / 10, @"Most buffers should be recycled", nil);
+    STAssertTrue(pool.reuseCount + pool.allocationCount >= kSGBufferBenchmarkRequestCount, nil, nil);
+}
+
+@end
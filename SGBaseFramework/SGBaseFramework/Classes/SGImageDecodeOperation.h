@@ -0,0 +1,56 @@
+/*
+    File:       SGImageDecodeOperation.h
+
+    Contains:   An NSOperation that decodes image data into a ready-to-draw UIImage.
+
+*/
+
+#import <UIKit/UIKit.h>
+
+@class SGURLCache;
+
+/*
+    SGImageDecodeOperation turns compressed image data (JPEG, PNG and so on) into 
+    a UIImage whose bitmap is already decoded.  +[UIImage imageWithData:] is lazy; 
+    it defers the decode until the image is first drawn, which means the decode 
+    happens on the main thread, in the middle of a scroll, and is repeated every 
+    time the system throws the bitmap away.  This operation forces the decode by 
+    drawing the image into a bitmap context, so it's meant to be run on a 
+    background queue, typically:
+
+    op = [[[SGImageDecodeOperation alloc] initWithImageData:data URL:url] autorelease];
+    [[SGNetworkManager sharedManager] addCPUOperation:op finishedTarget:self action:@selector(decodeDone:)];
+
+    If the operation has a cache, it stores the decoded image in the cache's image 
+    tier, and it skips the decode entirely if the cache already has an image for 
+    the URL.
+*/
+
+@interface SGImageDecodeOperation : NSOperation
+{
+    NSData *        _imageData;
+    NSString *      _URL;
+    SGURLCache *    _cache;
+    CGFloat         _scale;
+    UIImage *       _image;
+}
+
+- (id)initWithImageData:(NSData *)imageData URL:(NSString *)URL;
+    // Creates an operation to decode imageData.  URL identifies the image in the 
+    // cache; it may be nil, in which case the image isn't cached.
+
+// Things that are configured by the init method and can't be changed.
+
+@property (nonatomic, copy,   readonly ) NSData *       imageData;
+@property (nonatomic, copy,   readonly ) NSString *     URL;
+
+// Things you can configure before queuing the operation.
+
+@property (nonatomic, retain, readwrite) SGURLCache *   cache;          // default is +[SGURLCache instance]; nil means don't cache
+@property (nonatomic, assign, readwrite) CGFloat        scale;          // default is 1.0
+
+// Things that are only meaningful after the operation is finished.
+
+@property (nonatomic, retain, readonly ) UIImage *      image;          // nil if the data isn't a valid image
+
+@end
@@ -0,0 +1,119 @@
+/*
+    File:       SGImageDecodeOperation.m
+
+    Contains:   An NSOperation that decodes image data into a ready-to-draw UIImage.
+
+*/
+
+#import "SGImageDecodeOperation.h"
+
+#import "SGURLCache.h"
+
+@interface SGImageDecodeOperation ()
+
+// Read/write versions of public properties
+
+@property (nonatomic, retain, readwrite) UIImage *      image;
+
+@end
+
+@implementation SGImageDecodeOperation
+
+- (id)initWithImageData:(NSData *)imageData URL:(NSString *)URL
+    // See comment in header.
+{
+    // any thread
+    assert(imageData != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_imageData = [imageData copy];
+        self->_URL       = [URL copy];
+        self->_cache     = [[SGURLCache instance] retain];
+        self->_scale     = 1.0f;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_imageData release];
+    [self->_URL release];
+    [self->_cache release];
+    [self->_image release];
+    [super dealloc];
+}
+
+@synthesize imageData = _imageData;
+@synthesize URL       = _URL;
+@synthesize cache     = _cache;
+@synthesize scale     = _scale;
+@synthesize image     = _image;
+
+static UIImage * CreateDecodedImage(NSData * imageData, CGFloat scale)
+    // Decodes imageData and draws the result into a bitmap context in the format 
+    // that Core Animation uses natively (32-bit BGRA, premultiplied alpha), so that 
+    // drawing the image later on never has to decode or convert anything.
+{
+    UIImage *           result;
+    UIImage *           lazyImage;
+    CGImageRef          lazyCGImage;
+    CGColorSpaceRef     colorSpace;
+    CGContextRef        context;
+    CGImageRef          decodedCGImage;
+    size_t              width;
+    size_t              height;
+
+    assert(imageData != nil);
+    assert(scale > 0.0f);
+
+    result = nil;
+
+    lazyImage = [[UIImage alloc] initWithData:imageData];
+    lazyCGImage = lazyImage.CGImage;
+    if (lazyCGImage != NULL) {
+        width  = CGImageGetWidth(lazyCGImage);
+        height = CGImageGetHeight(lazyCGImage);
+
+        colorSpace = CGColorSpaceCreateDeviceRGB();
+        assert(colorSpace != NULL);
+
+        context = CGBitmapContextCreate(NULL, width, height, 8, 0, colorSpace, kCGImageAlphaPremultipliedFirst | kCGBitmapByteOrder32Little);
+        if (context != NULL) {
+            CGContextDrawImage(context, CGRectMake(0.0f, 0.0f, (CGFloat) width, (CGFloat) height), lazyCGImage);
+            decodedCGImage = CGBitmapContextCreateImage(context);
+            if (decodedCGImage != NULL) {
+                result = [[UIImage alloc] initWithCGImage:decodedCGImage scale:scale orientation:lazyImage.imageOrientation];
+                CGImageRelease(decodedCGImage);
+            }
+            CGContextRelease(context);
+        }
+
+        CGColorSpaceRelease(colorSpace);
+    }
+    [lazyImage release];
+
+    return result;
+}
+
+- (void)main
+{
+    UIImage *   image;
+
+    // If someone else decoded this image while we were queued, use theirs.
+
+    image = nil;
+    if ( (self.cache != nil) && (self.URL != nil) ) {
+        image = [[[self.cache imageForURL:self.URL] retain] autorelease];
+    }
+
+    if ( (image == nil) && ! [self isCancelled] ) {
+        image = [CreateDecodedImage(self.imageData, self.scale) autorelease];
+        if ( (image != nil) && (self.cache != nil) && (self.URL != nil) ) {
+            [self.cache storeImage:image forURL:self.URL];
+        }
+    }
+
+    self.image = image;
+}
+
+@end
@@ -7,16 +7,44 @@
 
 #import <Foundation/Foundation.h>
 
+#import "SGOperationRegistry.h"
+
+@class SGURLCache;
+@class SGBufferPool;
+@class SGTransferWindowController;
+@class SGRunLoopThreadPool;
+
+// The priority lanes of the network transfer queue.  See "Operation dispatch" below.
+
+enum SGNetworkTransferPriority {
+    kSGNetworkTransferPriorityInteractive,      // the user is waiting for it, e.g. the JSON for the current screen
+    kSGNetworkTransferPriorityDefault,
+    kSGNetworkTransferPriorityBackground,       // nobody is waiting for it, e.g. thumbnail prefetches
+    kSGNetworkTransferPriorityCount
+};
+typedef enum SGNetworkTransferPriority SGNetworkTransferPriority;
+
 @interface SGNetworkManager : NSObject
 {
-    NSThread *                      _networkRunLoopThread;
+    SGRunLoopThreadPool *           _networkRunLoopThreadPool;
     NSOperationQueue *              _queueForNetworkManagement;
     NSOperationQueue *              _queueForNetworkTransfers;
     NSOperationQueue *              _queueForCPU;
-    CFMutableDictionaryRef          _runningOperationToTargetMap;
-    CFMutableDictionaryRef          _runningOperationToActionMap;
-    CFMutableDictionaryRef          _runningOperationToThreadMap;
+    SGOperationRegistry *           _operationRegistry;
+    CFMutableDictionaryRef          _completionBatches;
+    NSTimeInterval                  _completionBatchInterval;
     NSUInteger                      _runningNetworkTransferCount;
+    SGURLCache *                    _URLCache;
+    SGBufferPool *                  _bufferPool;
+    NSMutableDictionary *           _inFlightGETs;
+    CFMutableDictionaryRef          _followersByLeader;
+    NSArray *                       _pendingTransferLanes;
+    NSInteger                       _pendingTransferLaneCredits[kSGNetworkTransferPriorityCount];
+    CFMutableSetRef                 _runningTransfers;
+    NSCountedSet *                  _runningTransfersPerHost;
+    NSUInteger                      _maximumTransfers;
+    NSUInteger                      _maximumTransfersPerHost;
+    SGTransferWindowController *    _transferWindowController;
 }
 
 + (SGNetworkManager *)sharedManager;
@@ -27,7 +55,24 @@
 - (NSMutableURLRequest *)requestToGetURL:(NSURL *)url;
     // Returns a mutable request that's configured to do an HTTP GET operation 
     // for the specified URL.  This sets up any request properties that should be 
-    // common to all network requests, most notably the user agent string.
+    // common to all network requests, most notably the user agent string. 
+    // It doesn't make the request conditional; a QHTTPOperation does that when 
+    // it starts, if it's using a cache.
+    //
+    // Can be called from any thread.
+
+@property (atomic, retain, readwrite) SGURLCache *      URLCache;
+    // The cache used to revalidate GET requests.  -addNetworkTransferOperation:... 
+    // gives this cache to any QHTTPOperation that doesn't already have one, so 
+    // that a 304 is served from the cache and fresh responses are stored in it. 
+    // Defaults to +[SGURLCache instance]; set it to nil to turn revalidation off.
+    //
+    // Can be called from any thread.
+
+@property (atomic, retain, readwrite) SGBufferPool *    bufferPool;
+    // The pool from which response buffers are borrowed.  -addNetworkTransferOperation:... 
+    // gives this pool to any QHTTPOperation that doesn't already have one.  Defaults to 
+    // +[SGBufferPool sharedPool]; set it to nil to allocate a fresh buffer per response.
     //
     // Can be called from any thread.
 
@@ -48,8 +93,8 @@
 //   is unbounded, so that network management operations always proceed.  This is fine because 
 //   network management operations are all run loop based and consume very few real resources.
 //
-// o The width of the network transfer queue is set to some fixed value, which controls the total 
-//   number of network operations that we can be running simultaneously.
+// o The number of network transfer operations that run simultaneously is limited by 
+//   maximumTransfers; see the notes on priority lanes below.
 //
 // o The width of the CPU operation queue is left at the default value, which typically means 
 //   we start one CPU operation per available core (which on iOS devices means one).  This 
@@ -64,9 +109,11 @@
 //
 // o If you queue a network operation and that network operation supports the runLoopThread 
 //   property and the value of that property is nil, this sets the run loop thread of the operation 
-//   to the above-mentioned internal networking thread.  This means that, by default, all 
-//   network run loop callbacks run on this internal networking thread.  The goal here is to 
-//   minimise main thread latency.
+//   to one of the internal networking threads in networkRunLoopThreadPool.  This means that, by 
+//   default, all network run loop callbacks run on these internal networking threads.  The goal 
+//   here is to minimise main thread latency and, with one thread per core (up to four), to let 
+//   many concurrent transfers process their data in parallel.  An operation stays on the same 
+//   thread for its whole life.
 // 
 //   It's worth noting that this is only true for network operation run loop callbacks, and is
 //   /not/ true for target/action completions.  These are called on the thread that queued 
@@ -86,15 +133,80 @@
 // o To simplify clean up, -cancelOperation: does nothing if the supplied operation is nil 
 //   or if it's not currently queued.
 //
-// We don't do any prioritisation of operations, although that would be a relatively 
-// simple extension.  For example, you could have one network transfer queue for gallery XML 
-// files and another for thumbnail downloads, and tweak their widths appropriately.  And 
-// don't forget, within a queue, a client can affect the priority of an operation using 
-// -[NSOperation setThreadPriority:] and -[NSOperation setQueuePriority:].
+// o Identical concurrent GETs are coalesced.  If you add a plain QHTTPOperation for a GET 
+//   while another one with the same URL and header fields is in flight, your operation 
+//   doesn't take a network transfer slot.  Instead it becomes a follower of the in-flight 
+//   one: it waits for the leader to finish and then, on the network management queue, 
+//   takes its response.  Your target/action is still called with your own operation, on 
+//   your own thread, as usual.  Cancelling a follower doesn't affect the leader; cancelling 
+//   the leader sends its followers back to their lanes, as if they'd just been added, so 
+//   that they wait for a transfer slot like any other transfer.  Subclasses of QHTTPOperation, 
+//   and operations with a responseOutputStream, a responseConsumer or an authenticationDelegate, 
+//   are never coalesced.
+//
+// o Network transfer operations are not simply dumped on a queue.  Each one goes into one 
+//   of three priority lanes, and the network manager starts operations from the lanes as 
+//   transfer slots come free:
+//
+//   - No more than maximumTransfers operations run at once, as before.
+//
+//   - No more than maximumTransfersPerHost of them go to the same host, so that a burst of 
+//     requests to one slow server can't take every slot.  An operation that's blocked by 
+//     its host's cap doesn't block the operations behind it in its lane.
+//
+//   - Lanes are served by smooth weighted round robin, with weights of 8, 4 and 1 for 
+//     the interactive, default and background lanes.  So, when all lanes are backed up, 
+//     8 out of 13 slots go to interactive operations, but a background operation still 
+//     gets one in 13, and so is never starved.
+//
+//   -addNetworkTransferOperation:finishedTarget:action: uses the default lane.  Within 
+//   a lane, operations are started in the order they were added; NSOperation's 
+//   queuePriority doesn't come into it.
+//
+// o The -addXxxOperation:finishedTarget:batchAction: variants opt in to batched completion. 
+//   The action takes an NSArray of operations rather than a single one.  Batched operations 
+//   that finish close together, and that were queued on the same thread, are delivered 
+//   together: the thread is woken once, and each distinct target/action pair is called once 
+//   with all of its operations, in the order in which they finished.  A batch collects 
+//   operations until the thread's next run loop turn or, if completionBatchInterval is 
+//   non-zero, for that long after its first operation finishes.  Apart from that, batched 
+//   completions follow the rules above: they're called on the queuing thread, and a 
+//   cancelled operation is left out of its batch.  This is useful if you queue a burst of 
+//   hundreds of small operations from the main thread.
+//
+// o If you set transferWindowController, maximumTransfers is no longer fixed.  Each 
+//   QHTTPOperation that finishes on the network transfer queue (without being cancelled) 
+//   is reported to the controller, and maximumTransfers follows the controller's width. 
+//   Setting maximumTransfers yourself still works, but only until the next transfer 
+//   finishes.
 
 - (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action;
 - (void)addNetworkTransferOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action;
+- (void)addNetworkTransferOperation:(NSOperation *)operation priority:(SGNetworkTransferPriority)priority finishedTarget:(id)target action:(SEL)action;
 - (void)addCPUOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action;
+
+- (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target batchAction:(SEL)batchAction;
+- (void)addNetworkTransferOperation:(NSOperation *)operation priority:(SGNetworkTransferPriority)priority finishedTarget:(id)target batchAction:(SEL)batchAction;
+- (void)addCPUOperation:(NSOperation *)operation finishedTarget:(id)target batchAction:(SEL)batchAction;
+
 - (void)cancelOperation:(NSOperation *)operation;
 
+@property (atomic, assign, readwrite) NSTimeInterval completionBatchInterval;  // default is 0, implying one run loop turn
+@property (atomic, assign, readwrite) NSUInteger maximumTransfers;           // default is 4
+@property (atomic, assign, readwrite) NSUInteger maximumTransfersPerHost;    // default is 3, leaving a slot for other hosts
+@property (atomic, retain, readwrite) SGTransferWindowController * transferWindowController; // default is nil, implying a fixed maximumTransfers
+
+@property (nonatomic, retain, readonly) SGRunLoopThreadPool * networkRunLoopThreadPool;
+    // The threads that run network operation run loop callbacks.  You can change its 
+    // policy, or use it to place your own run loop based operations.
+    //
+    // Can be called from any thread.
+
+@property (nonatomic, assign, readonly) SGOperationRegistryStatistics operationStatistics;
+    // Counts of the operations queued by the -addXxxOperation:... methods: those in 
+    // flight, those of them still waiting in a priority lane, and those that have 
+    // completed or been cancelled.
+    //
+    // Can be called from any thread.
+
 @end
@@ -9,6 +9,10 @@
 #import "SGNetworkManager.h"
 
 #import "QHTTPOperation.h"
+#import "SGURLCache.h"
+#import "SGBufferPool.h"
+#import "SGTransferWindowController.h"
+#import "SGRunLoopThreadPool.h"
 
 #import "Logging.h"
 
@@ -16,12 +20,20 @@
 
 // private properties
 
-@property (atomic, retain, readonly ) NSThread *             networkRunLoopThread;
-
 @property (nonatomic, retain, readonly ) NSOperationQueue *     queueForNetworkTransfers;
 @property (nonatomic, retain, readonly ) NSOperationQueue *     queueForNetworkManagement;
 @property (nonatomic, retain, readonly ) NSOperationQueue *     queueForCPU;
 
+// forward declarations
+
+- (void)startPendingTransfers;
+- (void)dispatchFollowers:(NSArray *)followers ofLeader:(QHTTPOperation *)leader;
+- (void)transferDidFinish:(NSOperation *)operation;
+- (void)addNetworkTransferOperation:(NSOperation *)operation priority:(SGNetworkTransferPriority)priority finishedTarget:(id)target action:(SEL)action batched:(BOOL)batched;
+- (void)addOperation:(NSOperation *)operation toCompletionBatchForThread:(NSThread *)thread;
+- (void)enqueueOperation:(NSOperation *)operation onQueue:(NSOperationQueue *)queue priority:(SGNetworkTransferPriority)priority;
+- (void)routeTransferOperation:(NSOperation *)operation priority:(SGNetworkTransferPriority)priority;
+
 @end
 
 @implementation SGNetworkManager
@@ -59,13 +71,30 @@
         [self->_queueForNetworkManagement setMaxConcurrentOperationCount:NSIntegerMax];
         assert(self->_queueForNetworkManagement != nil);
 
-        // Create the network transfer queue.  We will run up to 4 simultaneous network requests.
+        // Create the network transfer queue.  We will run up to 4 simultaneous network requests, 
+        // but we enforce that limit ourselves, in -startPendingTransfers, because the queue 
+        // knows nothing about lanes or hosts.  The queue itself is unbounded so that it never 
+        // holds back an operation that we've decided to start.
         
         self->_queueForNetworkTransfers = [[NSOperationQueue alloc] init];
         assert(self->_queueForNetworkTransfers != nil);
         
-        [self->_queueForNetworkTransfers setMaxConcurrentOperationCount:4];
+        [self->_queueForNetworkTransfers setMaxConcurrentOperationCount:NSIntegerMax];
         assert(self->_queueForNetworkTransfers != nil);
+        
+        self->_maximumTransfers        = 4;
+        self->_maximumTransfersPerHost = 3;
+        
+        // Create the priority lanes, one array per SGNetworkTransferPriority, and the sets 
+        // that track what's running.  _runningTransfers uses pointer equality, which is what 
+        // we want for operations.
+        
+        self->_pendingTransferLanes = [[NSArray alloc] initWithObjects:[NSMutableArray array], [NSMutableArray array], [NSMutableArray array], nil];
+        assert([self->_pendingTransferLanes count] == kSGNetworkTransferPriorityCount);
+        self->_runningTransfers = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+        assert(self->_runningTransfers != NULL);
+        self->_runningTransfersPerHost = [[NSCountedSet alloc] init];
+        assert(self->_runningTransfersPerHost != nil);
 
         // Create the CPU queue.  In contrast to the network queues, we leave 
         // maxConcurrentOperationCount set to the default, which means on current iOS devices 
@@ -75,29 +104,50 @@
         self->_queueForCPU = [[NSOperationQueue alloc] init];
         assert(self->_queueForCPU != nil);
         
-        // Create two dictionaries to store the target and action for each queued operation. 
-        // Note that we retain the operation and the target but there's no need to retain the 
-        // action selector.
-
-        self->_runningOperationToTargetMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-        assert(self->_runningOperationToTargetMap != NULL);
-        self->_runningOperationToActionMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-        assert(self->_runningOperationToActionMap != NULL);
-        self->_runningOperationToThreadMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-        assert(self->_runningOperationToThreadMap != NULL);
+        // Revalidate GET requests against the shared cache.
+        
+        self->_URLCache = [[SGURLCache instance] retain];
+        assert(self->_URLCache != nil);
+        
+        // Recycle response buffers.
         
-        // We run all of our network callbacks on a secondary thread to ensure that they don't 
-        // contribute to main thread latency.  Create and configure that thread.
+        self->_bufferPool = [[SGBufferPool sharedPool] retain];
+        assert(self->_bufferPool != nil);
         
-        self->_networkRunLoopThread = [[NSThread alloc] initWithTarget:self selector:@selector(networkRunLoopThreadEntry) object:nil];
-        assert(self->_networkRunLoopThread != nil);
+        // Create a dictionary to track the leader for each in-flight GET, so that we can 
+        // coalesce identical requests.
+        
+        self->_inFlightGETs = [[NSMutableDictionary alloc] init];
+        assert(self->_inFlightGETs != nil);
+        
+        // Create a dictionary to hold the followers waiting for each leader.  CFDictionary 
+        // because NSOperation can't be copied, and so can't be an NSDictionary key.
+        
+        self->_followersByLeader = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_followersByLeader != NULL);
+        
+        // Create the registry that stores the target, action and thread for each queued 
+        // operation.
 
-        [self->_networkRunLoopThread setName:@"networkRunLoopThread"];
-        if ( [self->_networkRunLoopThread respondsToSelector:@selector(setThreadPriority)] ) {
-            [self->_networkRunLoopThread setThreadPriority:0.3];
-        }
+        self->_operationRegistry = [[SGOperationRegistry alloc] init];
+        assert(self->_operationRegistry != nil);
 
-        [self->_networkRunLoopThread start];
+        // Create a dictionary to hold the pending completion batch, if any, for each 
+        // thread.  CFDictionary because NSThread can't be copied, and so can't be an 
+        // NSDictionary key.
+
+        self->_completionBatches = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_completionBatches != NULL);
+        
+        // We run all of our network callbacks on secondary threads to ensure that they don't 
+        // contribute to main thread latency.  One thread per core lets concurrent transfers 
+        // process their data in parallel; beyond four, the threads would just be fighting 
+        // over the network.
+        
+        self->_networkRunLoopThreadPool = [[SGRunLoopThreadPool alloc] initWithThreadCount:MIN(MAX([[NSProcessInfo processInfo] activeProcessorCount], (NSUInteger) 1), (NSUInteger) 4) 
+                                                                                      name:@"networkRunLoopThread" 
+                                                                            threadPriority:0.3];
+        assert(self->_networkRunLoopThreadPool != nil);
     }
     return self;
 }
@@ -135,29 +185,19 @@
     }
     [result setValue:sUserAgentString forHTTPHeaderField:@"User-Agent"];
     
+    // We don't add conditional headers here.  Only an operation that can serve a 
+    // 304 from its cache should send them, and it's the operation that knows that; 
+    // see -[QHTTPOperation conditionalRequestWithCachedBody:validators:].
+    
     return result;
 }
 
-#pragma mark * Operation dispatch
-
-@synthesize networkRunLoopThread = _networkRunLoopThread;
-
-- (void)networkRunLoopThreadEntry
-    // This thread runs all of our network operation run loop callbacks.
-{
-    assert( ! [NSThread isMainThread] );
-    while (YES) {
-        NSAutoreleasePool * pool;
-
-        pool = [[NSAutoreleasePool alloc] init];
-        assert(pool != nil);
+@synthesize URLCache = _URLCache;
+@synthesize bufferPool = _bufferPool;
 
-        [[NSRunLoop currentRunLoop] run];
+#pragma mark * Operation dispatch
 
-        [pool drain];
-    }
-    assert(NO);
-}
+@synthesize networkRunLoopThreadPool = _networkRunLoopThreadPool;
 
 - (BOOL)networkInUse
     // See comment in header.
@@ -213,8 +253,12 @@
 @synthesize queueForNetworkManagement = _queueForNetworkManagement;
 @synthesize queueForCPU               = _queueForCPU;
 
-- (void)addOperation:(NSOperation *)operation toQueue:(NSOperationQueue *)queue finishedTarget:(id)target action:(SEL)action
-    // Core code to enqueue an operation on a queue.
+- (void)addOperation:(NSOperation *)operation toQueue:(NSOperationQueue *)queue priority:(SGNetworkTransferPriority)priority finishedTarget:(id)target action:(SEL)action batched:(BOOL)batched
+    // Core code to enqueue an operation on a queue.  priority is only used for 
+    // the network transfer queue.  If batched is set, action takes an array of 
+    // operations; see -deliverCompletionBatch.  If queue is nil, the operation is 
+    // registered, as waiting to start, but not queued; the caller must pass it to 
+    // -enqueueOperation:onQueue:priority: later.
 {
     // any thread
     assert(operation != nil);
@@ -251,6 +295,23 @@
         }
     #endif
 
+    // Enter the operation into our registry.  Network transfers wait in their lane 
+    // until -startPendingTransfers hands them to the queue.
+    
+    [self->_operationRegistry addOperation:operation target:target action:action thread:[NSThread currentThread] queued:( (queue == nil) || (queue == self.queueForNetworkTransfers) ) batched:batched];
+    
+    if (queue != nil) {
+        [self enqueueOperation:operation onQueue:queue priority:priority];
+    }
+}
+
+- (void)enqueueOperation:(NSOperation *)operation onQueue:(NSOperationQueue *)queue priority:(SGNetworkTransferPriority)priority
+    // Queues an operation that's already in the registry.
+{
+    // any thread
+    assert(operation != nil);
+    assert(queue != nil);
+
     // Update our networkInUse property; because we can be running on any thread, we 
     // do this update on the main thread.
     
@@ -258,64 +319,447 @@
         [self performSelectorOnMainThread:@selector(incrementRunningNetworkTransferCount) withObject:nil waitUntilDone:NO];
     }
     
-    // Atomically enter the operation into our target and action maps.
-    
-    @synchronized (self) {
-        assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
-        assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
-
-        assert( CFDictionaryGetValue(self->_runningOperationToTargetMap, operation) == NULL );      // shouldn't already be in our map
-        assert( CFDictionaryGetValue(self->_runningOperationToActionMap, operation) == NULL );      // shouldn't already be in our map
-        assert( CFDictionaryGetValue(self->_runningOperationToThreadMap, operation) == NULL );      // shouldn't already be in our map
-        
-        // Add the operations to , triggering a KVO notification 
-        // of networkInUse if required.
-        
-        CFDictionarySetValue(self->_runningOperationToTargetMap, operation, target);
-        CFDictionarySetValue(self->_runningOperationToActionMap, operation, action);
-        CFDictionarySetValue(self->_runningOperationToThreadMap, operation, [NSThread currentThread]);
-
-        assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
-        assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
-    }
-    
     // Observe the isFinished property of the operation.  We pass the queue parameter as the 
     // context so that, in the completion routine, we know what queue the operation was sent 
     // to (necessary to decide what thread to run the target/action on).
     
     [operation addObserver:self forKeyPath:@"isFinished" options:0 context:queue];
     
-    // Queue the operation.  When the operation completes, -operationDone: is called.
+    // Queue the operation.  When the operation completes, -operationDone: is called.  
+    // Network transfers go into their lane, to be queued when there's a slot for them.
     
-    [queue addOperation:operation];
+    if (queue == self.queueForNetworkTransfers) {
+        assert(priority < kSGNetworkTransferPriorityCount);
+        @synchronized (self) {
+            [[self->_pendingTransferLanes objectAtIndex:priority] addObject:operation];
+        }
+        [self startPendingTransfers];
+    } else {
+        [queue addOperation:operation];
+    }
 }
 
-- (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action
+#pragma mark * Transfer scheduling
+
+static NSString * HostOfOperation(NSOperation * operation)
+    // Returns the host that the operation talks to, for the per-host limit.  All 
+    // operations that don't have a request are lumped together under the empty host.
+{
+    NSString *  result;
+
+    result = nil;
+    if ( [operation respondsToSelector:@selector(request)] ) {
+        id  request;
+        
+        request = [(id) operation request];
+        if ( [request isKindOfClass:[NSURLRequest class]] ) {
+            result = [[[request URL] host] lowercaseString];
+        }
+    }
+    if (result == nil) {
+        result = @"";
+    }
+    return result;
+}
+
+- (NSOperation *)dequeueNextTransfer
+    // Picks the next operation to start and removes it from its lane, or returns nil 
+    // if no pending operation can start.  Must be called with @synchronized (self).
+    //
+    // The lanes are served by smooth weighted round robin.  Every lane that has an 
+    // operation that can start earns its weight in credit; the lane with the most 
+    // credit wins, and pays back the total weight of the lanes that took part.  Over 
+    // time, each backed up lane gets slots in proportion to its weight, and the slots 
+    // are spread evenly rather than in bursts.
+{
+    static const NSInteger  kLaneWeights[kSGNetworkTransferPriorityCount] = { 8, 4, 1 };
+    NSUInteger              candidateIndexes[kSGNetworkTransferPriorityCount];
+    NSInteger               totalWeight;
+    NSInteger               bestLane;
+    NSMutableArray *        lane;
+    NSOperation *           result;
+
+    totalWeight = 0;
+    bestLane = -1;
+    for (NSInteger laneIndex = 0; laneIndex < kSGNetworkTransferPriorityCount; laneIndex++) {
+        
+        // Find the first operation in the lane whose host has a free slot.
+        
+        lane = [self->_pendingTransferLanes objectAtIndex:(NSUInteger) laneIndex];
+        candidateIndexes[laneIndex] = NSNotFound;
+        for (NSUInteger operationIndex = 0; operationIndex < [lane count]; operationIndex++) {
+            if ( [self->_runningTransfersPerHost countForObject:HostOfOperation([lane objectAtIndex:operationIndex])] < self->_maximumTransfersPerHost ) {
+                candidateIndexes[laneIndex] = operationIndex;
+                break;
+            }
+        }
+        
+        // Idle lanes don't bank credit, lest they come back and hog the slots.
+        
+        if (candidateIndexes[laneIndex] == NSNotFound) {
+            self->_pendingTransferLaneCredits[laneIndex] = 0;
+        } else {
+            self->_pendingTransferLaneCredits[laneIndex] += kLaneWeights[laneIndex];
+            totalWeight += kLaneWeights[laneIndex];
+            if ( (bestLane < 0) || (self->_pendingTransferLaneCredits[laneIndex] > self->_pendingTransferLaneCredits[bestLane]) ) {
+                bestLane = laneIndex;
+            }
+        }
+    }
+
+    result = nil;
+    if (bestLane >= 0) {
+        self->_pendingTransferLaneCredits[bestLane] -= totalWeight;
+        lane = [self->_pendingTransferLanes objectAtIndex:(NSUInteger) bestLane];
+        result = [[[lane objectAtIndex:candidateIndexes[bestLane]] retain] autorelease];
+        [lane removeObjectAtIndex:candidateIndexes[bestLane]];
+    }
+    return result;
+}
+
+- (void)startPendingTransfers
+    // Moves pending transfers to the network transfer queue while there are free slots.
+{
+    NSMutableArray *    operationsToStart;
+    NSOperation *       operation;
+
+    // any thread
+    operationsToStart = [NSMutableArray array];
+    assert(operationsToStart != nil);
+
+    @synchronized (self) {
+        while ( (NSUInteger) CFSetGetCount(self->_runningTransfers) < self->_maximumTransfers ) {
+            operation = [self dequeueNextTransfer];
+            if (operation == nil) {
+                break;
+            }
+            CFSetAddValue(self->_runningTransfers, operation);
+            [self->_runningTransfersPerHost addObject:HostOfOperation(operation)];
+            [operationsToStart addObject:operation];
+        }
+    }
+
+    // We add the operations outside of the @synchronized block because the queue 
+    // might start them, and thus call us back, synchronously.
+    //
+    // Only running transfers count against their thread's load.  Management operations, 
+    // and transfers waiting in their lane or for a leader, spend their time waiting, and 
+    // a RetryingHTTPOperation's transfers inherit its thread, so counting at assignment 
+    // would make a thread look busy while it's backing off.  -observeValueForKeyPath:... 
+    // takes the transfer off again when it finishes.
+
+    for (operation in operationsToStart) {
+        if ( [operation respondsToSelector:@selector(runLoopThread)] ) {
+            [self.networkRunLoopThreadPool recordOperation:operation usingThread:[(id) operation runLoopThread]];
+        }
+        [self->_operationRegistry operationDidLeaveQueue:operation];
+        [self.queueForNetworkTransfers addOperation:operation];
+    }
+}
+
+static BOOL IsCongestionFailure(QHTTPOperation * operation)
+    // Returns YES if the operation failed in a way that suggests we're asking too much 
+    // of the network or the server: either it got no response at all, or the server 
+    // said it was overloaded.  A 404, say, tells us nothing about the transfer width.
+{
+    NSInteger   statusCode;
+
+    assert(operation != nil);
+    if (operation.error == nil) {
+        return NO;
+    }
+    if (operation.lastResponse == nil) {
+        return YES;
+    }
+    statusCode = operation.lastResponse.statusCode;
+    return (statusCode >= 500) || (statusCode == 429);
+}
+
+- (void)transferDidFinish:(NSOperation *)operation
+    // Called when an operation on the network transfer queue finishes, to free its slot 
+    // and, if we have a window controller, to report how the transfer went.
+{
+    BOOL                            wasRunning;
+    SGTransferWindowController *    controller;
+
+    // any thread
+    assert(operation != nil);
+
+    @synchronized (self) {
+        wasRunning = CFSetContainsValue(self->_runningTransfers, operation);
+        if (wasRunning) {
+            [self->_runningTransfersPerHost removeObject:HostOfOperation(operation)];
+            CFSetRemoveValue(self->_runningTransfers, operation);
+        }
+        controller = [[self->_transferWindowController retain] autorelease];
+    }
+
+    if ( wasRunning && (controller != nil) && [operation isKindOfClass:[QHTTPOperation class]] && ! [operation isCancelled] ) {
+        QHTTPOperation *    httpOperation;
+
+        httpOperation = (QHTTPOperation *) operation;
+        [controller recordTransferWithBytes:httpOperation.bytesReceived timeToFirstByte:httpOperation.timeToFirstByte failed:IsCongestionFailure(httpOperation)];
+        @synchronized (self) {
+            if (self->_transferWindowController == controller) {
+                self->_maximumTransfers = controller.width;
+            }
+        }
+    }
+    [self startPendingTransfers];
+}
+
+- (NSUInteger)maximumTransfers
+    // See comment in header.
+{
+    @synchronized (self) {
+        return self->_maximumTransfers;
+    }
+}
+
+- (void)setMaximumTransfers:(NSUInteger)newValue
     // See comment in header.
+{
+    assert(newValue != 0);
+    @synchronized (self) {
+        self->_maximumTransfers = newValue;
+    }
+    [self startPendingTransfers];
+}
+
+- (NSUInteger)maximumTransfersPerHost
+    // See comment in header.
+{
+    @synchronized (self) {
+        return self->_maximumTransfersPerHost;
+    }
+}
+
+- (void)setMaximumTransfersPerHost:(NSUInteger)newValue
+    // See comment in header.
+{
+    assert(newValue != 0);
+    @synchronized (self) {
+        self->_maximumTransfersPerHost = newValue;
+    }
+    [self startPendingTransfers];
+}
+
+- (SGTransferWindowController *)transferWindowController
+    // See comment in header.
+{
+    @synchronized (self) {
+        return [[self->_transferWindowController retain] autorelease];
+    }
+}
+
+- (void)setTransferWindowController:(SGTransferWindowController *)newValue
+    // See comment in header.
+{
+    @synchronized (self) {
+        if (newValue != self->_transferWindowController) {
+            [self->_transferWindowController release];
+            self->_transferWindowController = [newValue retain];
+            if (newValue != nil) {
+                self->_maximumTransfers = newValue.width;
+            }
+        }
+    }
+    [self startPendingTransfers];
+}
+
+- (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action batched:(BOOL)batched
+    // Common code for the two network management variants.
 {
     if ([operation respondsToSelector:@selector(setRunLoopThread:)]) {
         if ( [(id)operation runLoopThread] == nil ) {
-            [ (id)operation setRunLoopThread:self.networkRunLoopThread];
+            [ (id)operation setRunLoopThread:[self.networkRunLoopThreadPool nextThread]];
+        }
+    }
+    [self addOperation:operation toQueue:self.queueForNetworkManagement priority:kSGNetworkTransferPriorityDefault finishedTarget:target action:action batched:batched];
+}
+
+- (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action
+    // See comment in header.
+{
+    [self addNetworkManagementOperation:operation finishedTarget:target action:action batched:NO];
+}
+
+- (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target batchAction:(SEL)batchAction
+    // See comment in header.
+{
+    [self addNetworkManagementOperation:operation finishedTarget:target action:batchAction batched:YES];
+}
+
+- (NSString *)coalescingKeyForOperation:(NSOperation *)operation
+    // Returns the key under which operation can be coalesced with identical 
+    // operations, or nil if it can't be coalesced.  Two GETs are identical if 
+    // they have the same URL and the same header fields; the header fields cover 
+    // things like Accept, Authorization, Cookie and Range that change the response.
+{
+    NSString *          result;
+    QHTTPOperation *    httpOperation;
+    NSURLRequest *      request;
+    NSDictionary *      headers;
+    NSMutableString *   key;
+
+    // any thread
+    assert(operation != nil);
+
+    result = nil;
+    if ( [operation class] == [QHTTPOperation class] ) {
+        httpOperation = (QHTTPOperation *) operation;
+        request = httpOperation.request;
+        if ( [[request HTTPMethod] isEqual:@"GET"] 
+          && ([request HTTPBody] == nil) 
+          && ([request HTTPBodyStream] == nil) 
+          && (httpOperation.responseOutputStream == nil) 
+          && (httpOperation.responseConsumer == nil) 
+          && (httpOperation.authenticationDelegate == nil) 
+          && (httpOperation.leaderOperation == nil) ) {
+            key = [NSMutableString stringWithString:[[request URL] absoluteString]];
+            assert(key != nil);
+            headers = [request allHTTPHeaderFields];
+            for (NSString * name in [[headers allKeys] sortedArrayUsingSelector:@selector(caseInsensitiveCompare:)]) {
+                [key appendFormat:@"\n%@: %@", [name lowercaseString], [headers objectForKey:name]];
+            }
+            result = key;
         }
     }
-    [self addOperation:operation toQueue:self.queueForNetworkManagement finishedTarget:target action:action];
+    return result;
 }
 
 - (void)addNetworkTransferOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action
     // See comment in header.
 {
+    [self addNetworkTransferOperation:operation priority:kSGNetworkTransferPriorityDefault finishedTarget:target action:action];
+}
+
+- (void)addNetworkTransferOperation:(NSOperation *)operation priority:(SGNetworkTransferPriority)priority finishedTarget:(id)target action:(SEL)action
+    // See comment in header.
+{
+    [self addNetworkTransferOperation:operation priority:priority finishedTarget:target action:action batched:NO];
+}
+
+- (void)addNetworkTransferOperation:(NSOperation *)operation priority:(SGNetworkTransferPriority)priority finishedTarget:(id)target batchAction:(SEL)batchAction
+    // See comment in header.
+{
+    [self addNetworkTransferOperation:operation priority:priority finishedTarget:target action:batchAction batched:YES];
+}
+
+- (void)addNetworkTransferOperation:(NSOperation *)operation priority:(SGNetworkTransferPriority)priority finishedTarget:(id)target action:(SEL)action batched:(BOOL)batched
+    // Common code for the network transfer variants.
+{
+    // The thread's load isn't counted until the transfer starts; see -startPendingTransfers.
+    
     if ([operation respondsToSelector:@selector(setRunLoopThread:)]) {
         if ( [(id)operation runLoopThread] == nil ) {
-            [ (id)operation setRunLoopThread:self.networkRunLoopThread];
+            [ (id)operation setRunLoopThread:[self.networkRunLoopThreadPool nextThread]];
+        }
+    }
+    if ( [operation isKindOfClass:[QHTTPOperation class]] ) {
+        if ( ((QHTTPOperation *) operation).cache == nil ) {
+            ((QHTTPOperation *) operation).cache = self.URLCache;
+        }
+        if ( ((QHTTPOperation *) operation).bufferPool == nil ) {
+            ((QHTTPOperation *) operation).bufferPool = self.bufferPool;
+        }
+    }
+
+    [self addOperation:operation toQueue:nil priority:priority finishedTarget:target action:action batched:batched];
+    [self routeTransferOperation:operation priority:priority];
+}
+
+- (void)routeTransferOperation:(NSOperation *)operation priority:(SGNetworkTransferPriority)priority
+    // Sends a registered transfer on its way.  If an identical GET is in flight, this 
+    // operation becomes a follower of it, and waits in _followersByLeader until 
+    // -dispatchFollowers:ofLeader: sends it on.  Otherwise this operation becomes the 
+    // leader for its key, and goes into its lane.
+{
+    NSString *          key;
+    QHTTPOperation *    leader;
+    NSMutableArray *    followers;
+
+    // any thread
+    assert(operation != nil);
+
+    // The leader is removed from _inFlightGETs when it finishes, in 
+    // -observeValueForKeyPath:ofObject:change:context:, under the same lock, and only then 
+    // delivered to its owner.  So linking the follower inside the lock marks the leader 
+    // as having followers before its owner can call -detachResponseBody, and the leader 
+    // is sure to find the follower when it finishes.
+    
+    leader = nil;
+    key = [self coalescingKeyForOperation:operation];
+    if (key != nil) {
+        @synchronized (self) {
+            leader = [[[self->_inFlightGETs objectForKey:key] retain] autorelease];
+            if (leader == nil) {
+                [self->_inFlightGETs setObject:operation forKey:key];
+            } else {
+                ((QHTTPOperation *) operation).leaderOperation = leader;
+                [operation addDependency:leader];
+                followers = (NSMutableArray *) CFDictionaryGetValue(self->_followersByLeader, leader);
+                if (followers == nil) {
+                    followers = [NSMutableArray array];
+                    assert(followers != nil);
+                    CFDictionarySetValue(self->_followersByLeader, leader, followers);
+                }
+                [followers addObject:[NSArray arrayWithObjects:operation, [NSNumber numberWithInt:priority], nil]];
+            }
+        }
+    }
+    
+    if (leader == nil) {
+        [self enqueueOperation:operation onQueue:self.queueForNetworkTransfers priority:priority];
+    }
+}
+
+- (void)dispatchFollowers:(NSArray *)followers ofLeader:(QHTTPOperation *)leader
+    // Called when leader finishes to send on the followers that were waiting for it. 
+    // Each element of followers is an array holding the follower and its priority.
+    //
+    // If the leader ran, its followers go to the network management queue, where they 
+    // take its results.  If it was cancelled, there are no results to take, so its 
+    // followers go back through -routeTransferOperation:priority:, just as if they'd 
+    // been added afresh: the first becomes the new leader, in its lane, and the rest 
+    // follow it.  That way an orphan never runs a transfer outside the limits.  A 
+    // follower that's been cancelled itself has nothing to wait for, so it goes 
+    // straight to the management queue, to finish.
+{
+    QHTTPOperation *            follower;
+    SGNetworkTransferPriority   priority;
+
+    // any thread
+    assert(followers != nil);
+    assert(leader != nil);
+    assert([leader isFinished]);
+
+    for (NSArray * entry in followers) {
+        follower = [entry objectAtIndex:0];
+        priority = (SGNetworkTransferPriority) [[entry objectAtIndex:1] intValue];
+        assert(follower.leaderOperation == leader);
+        
+        if ( [leader isCancelled] && ! [follower isCancelled] ) {
+            [follower removeDependency:leader];
+            follower.leaderOperation = nil;
+            [self routeTransferOperation:follower priority:priority];
+        } else {
+            [self->_operationRegistry operationDidLeaveQueue:follower];
+            [self enqueueOperation:follower onQueue:self.queueForNetworkManagement priority:priority];
         }
     }
-    [self addOperation:operation toQueue:self.queueForNetworkTransfers finishedTarget:target action:action];
 }
 
 - (void)addCPUOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action
     // See comment in header.
 {
-    [self addOperation:operation toQueue:self.queueForCPU finishedTarget:target action:action];
+    [self addOperation:operation toQueue:self.queueForCPU priority:kSGNetworkTransferPriorityDefault finishedTarget:target action:action batched:NO];
+}
+
+- (void)addCPUOperation:(NSOperation *)operation finishedTarget:(id)target batchAction:(SEL)batchAction
+    // See comment in header.
+{
+    [self addOperation:operation toQueue:self.queueForCPU priority:kSGNetworkTransferPriorityDefault finishedTarget:target action:batchAction batched:YES];
 }
 
 - (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
@@ -325,6 +769,9 @@
         NSOperation *       operation;
         NSOperationQueue *  queue;
         NSThread *          thread;
+        BOOL                batched;
+        NSString *          key;
+        NSArray *           followers;
         
         operation = (NSOperation *) object;
         assert([operation isKindOfClass:[NSOperation class]]);
@@ -334,21 +781,39 @@
         assert([queue isKindOfClass:[NSOperationQueue class]]);
 
         [operation removeObserver:self forKeyPath:@"isFinished"];
+        [self.networkRunLoopThreadPool operationDidFinish:operation];
+        
+        // If the operation was leading a coalesced GET, later requests must start afresh, 
+        // and the followers it has can go on their way.  And if it was a transfer, its 
+        // slot is now free for the next one.
+        
+        key = nil;
+        if (queue == self.queueForNetworkTransfers) {
+            key = [self coalescingKeyForOperation:operation];
+            [self transferDidFinish:operation];
+        }
         
+        followers = nil;
         @synchronized (self) {
-            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
-            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
-
-            thread = (NSThread *) CFDictionaryGetValue(self->_runningOperationToThreadMap, operation);
-            if (thread != nil) {
-                [thread retain];
+            if ( (key != nil) && ([self->_inFlightGETs objectForKey:key] == operation) ) {
+                [self->_inFlightGETs removeObjectForKey:key];
+                followers = [[(NSArray *) CFDictionaryGetValue(self->_followersByLeader, operation) retain] autorelease];
+                if (followers != nil) {
+                    CFDictionaryRemoveValue(self->_followersByLeader, operation);
+                }
             }
         }
+        if (followers != nil) {
+            [self dispatchFollowers:followers ofLeader:(QHTTPOperation *) operation];
+        }
 
+        thread = [self->_operationRegistry threadForOperation:operation batched:&batched];
         if (thread != nil) {
-            [self performSelector:@selector(operationDone:) onThread:thread withObject:operation waitUntilDone:NO];
-            
-            [thread release];
+            if (batched) {
+                [self addOperation:operation toCompletionBatchForThread:thread];
+            } else {
+                [self performSelector:@selector(operationDone:) onThread:thread withObject:operation waitUntilDone:NO];
+            }
 
             if (queue == self.queueForNetworkTransfers) {
                 [self performSelectorOnMainThread:@selector(decrementRunningNetworkTransferCount) withObject:nil waitUntilDone:NO];
@@ -365,49 +830,32 @@
 {
     id          target;
     SEL         action;
-    NSThread *  thread;
 
     // any thread
     assert(operation != nil);
 
-    // Find the target/action, if any, in the map and then remove it.
+    // Find the target/action, if any, in the registry and then remove it.  The registry 
+    // hands us its reference to target, so target persists until we release it below. 
+    // We might not find the operation because -cancelOperation: might have pulled it 
+    // out from underneath us.  An operation that was cancelled, but that we pull out 
+    // first, is counted as cancelled all the same.
     
-    @synchronized (self) {
-        assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
-        assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
-
-        target =         (id) CFDictionaryGetValue(self->_runningOperationToTargetMap, operation);
-        action =        (SEL) CFDictionaryGetValue(self->_runningOperationToActionMap, operation);
-        thread = (NSThread *) CFDictionaryGetValue(self->_runningOperationToThreadMap, operation);
-        assert( (target != nil) == (action != nil) );
-        assert( (target != nil) == (thread != nil) );
-
-        // We need target to persist across the remove /and/ after we leave the @synchronized 
-        // block, so we retain it here.  We need to test target for nil because -cancelOperation: 
-        // might have pulled it out from underneath us.
-
-        if (target != nil) {
-            [target retain];
-
-            assert( thread == [NSThread currentThread] );
-
-            CFDictionaryRemoveValue(self->_runningOperationToTargetMap, operation);
-            CFDictionaryRemoveValue(self->_runningOperationToActionMap, operation);
-            CFDictionaryRemoveValue(self->_runningOperationToThreadMap, operation);
-        }
-        assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
-        assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
+    target = nil;
+    action = nil;
+    if ( [self->_operationRegistry removeOperation:operation completed:! [operation isCancelled] target:&target action:&action] ) {
+        assert(target != nil);
+        assert(action != nil);
     }
     
     // If we removed the operation, call the target/action.  However, we still have to 
     // test isCancelled here because -cancelOperation: might have cancelled it but 
-    // not yet pulled it out of the map.
+    // not yet pulled it out of the registry.
     // 
     // Note that there's no race condition testing isCancelled here.  We know that the 
-    // operation is out of the map at this point (specifically, at the point we leave 
-    // the @synchronized block), so no one can call -cancelOperation: on the operation. 
+    // operation is out of the registry at this point (specifically, at the point 
+    // -removeOperation:... returns), so no one can call -cancelOperation: on the operation. 
     // So, the final fate of the operation, cancelled or not, is determined before 
-    // we enter the @synchronized block.
+    // we remove it.
     
     if (target != nil) {
         if ( ! [operation isCancelled] ) {
@@ -418,12 +866,131 @@
     }
 }
 
+- (void)addOperation:(NSOperation *)operation toCompletionBatchForThread:(NSThread *)thread
+    // Adds a finished operation to the completion batch for thread.  If this starts 
+    // a new batch, we arrange for -deliverCompletionBatch to run on that thread, 
+    // either on its next run loop turn or after completionBatchInterval.  Operations 
+    // that finish in the meantime join the batch without waking the thread again.
+{
+    NSMutableArray *    batch;
+    BOOL                isNewBatch;
+    NSTimeInterval      interval;
+
+    // any thread
+    assert(operation != nil);
+    assert(thread != nil);
+
+    @synchronized (self) {
+        batch = (NSMutableArray *) CFDictionaryGetValue(self->_completionBatches, thread);
+        isNewBatch = (batch == nil);
+        if (isNewBatch) {
+            batch = [NSMutableArray array];
+            assert(batch != nil);
+            CFDictionarySetValue(self->_completionBatches, thread, batch);
+        }
+        [batch addObject:operation];
+        interval = self->_completionBatchInterval;
+    }
+
+    if (isNewBatch) {
+        if (interval > 0.0) {
+            [self performSelector:@selector(scheduleCompletionBatchDelivery:) onThread:thread withObject:[NSNumber numberWithDouble:interval] waitUntilDone:NO];
+        } else {
+            [self performSelector:@selector(deliverCompletionBatch) onThread:thread withObject:nil waitUntilDone:NO];
+        }
+    }
+}
+
+- (void)scheduleCompletionBatchDelivery:(NSNumber *)interval
+    // Runs on the thread that owns a new completion batch, to start its window.  We can't 
+    // do this from the thread that creates the batch because -performSelector:withObject:afterDelay: 
+    // only works on the current thread's run loop.
+{
+    assert(interval != nil);
+    [self performSelector:@selector(deliverCompletionBatch) withObject:nil afterDelay:[interval doubleValue] inModes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+}
+
+- (void)deliverCompletionBatch
+    // Runs on the thread that queued the operations in its completion batch.  We pull 
+    // each operation out of the registry, exactly as -operationDone: does, and then call 
+    // each distinct target/action once with the array of its operations, in the order 
+    // they finished.
+{
+    NSArray *           batch;
+    NSMutableArray *    groupTargets;
+    NSMutableArray *    groupActions;
+    NSMutableArray *    groupOperations;
+    id                  target;
+    SEL                 action;
+    NSUInteger          groupIndex;
+
+    // any thread
+    @synchronized (self) {
+        batch = [[(NSArray *) CFDictionaryGetValue(self->_completionBatches, [NSThread currentThread]) retain] autorelease];
+        CFDictionaryRemoveValue(self->_completionBatches, [NSThread currentThread]);
+    }
+    assert(batch != nil);
+
+    groupTargets    = [NSMutableArray array];
+    assert(groupTargets != nil);
+    groupActions    = [NSMutableArray array];
+    assert(groupActions != nil);
+    groupOperations = [NSMutableArray array];
+    assert(groupOperations != nil);
+    
+    for (NSOperation * operation in batch) {
+    
+        // See -operationDone: for why we test isCancelled after removing the operation.
+        
+        target = nil;
+        action = nil;
+        if ( ! [self->_operationRegistry removeOperation:operation completed:! [operation isCancelled] target:&target action:&action] ) {
+            continue;
+        }
+        assert(target != nil);
+        assert(action != nil);
+        
+        if ( ! [operation isCancelled] ) {
+            groupIndex = 0;
+            while ( (groupIndex < [groupTargets count]) && ( ([groupTargets objectAtIndex:groupIndex] != target) || ! [[groupActions objectAtIndex:groupIndex] isEqual:NSStringFromSelector(action)] ) ) {
+                groupIndex += 1;
+            }
+            if (groupIndex == [groupTargets count]) {
+                [groupTargets    addObject:target];
+                [groupActions    addObject:NSStringFromSelector(action)];
+                [groupOperations addObject:[NSMutableArray array]];
+            }
+            [[groupOperations objectAtIndex:groupIndex] addObject:operation];
+        }
+        [target release];
+    }
+    
+    for (groupIndex = 0; groupIndex < [groupTargets count]; groupIndex++) {
+        [[groupTargets objectAtIndex:groupIndex] performSelector:NSSelectorFromString([groupActions objectAtIndex:groupIndex]) withObject:[groupOperations objectAtIndex:groupIndex]];
+    }
+}
+
+- (NSTimeInterval)completionBatchInterval
+    // See comment in header.
+{
+    @synchronized (self) {
+        return self->_completionBatchInterval;
+    }
+}
+
+- (void)setCompletionBatchInterval:(NSTimeInterval)newValue
+    // See comment in header.
+{
+    assert(newValue >= 0.0);
+    @synchronized (self) {
+        self->_completionBatchInterval = newValue;
+    }
+}
+
 - (void)cancelOperation:(NSOperation *)operation
     // See comment in header.
 {
-    id          target;
-    SEL         action;
-    NSThread *  thread;
+    BOOL        wasPending;
 
     // any thread
  
@@ -437,31 +1004,39 @@
 
         [operation cancel];
 
-        // Now we pull the target/action out of the map.
+        // If it's a transfer that's still waiting in its lane, queue it now; there's no 
+        // point making it wait for a slot just to finish.  It doesn't count against 
+        // the limits, and -transferDidFinish: knows to ignore it.
         
         @synchronized (self) {
-            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
-            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
-
-            target =         (id) CFDictionaryGetValue(self->_runningOperationToTargetMap, operation);
-            action =        (SEL) CFDictionaryGetValue(self->_runningOperationToActionMap, operation);
-            thread = (NSThread *) CFDictionaryGetValue(self->_runningOperationToThreadMap, operation);
-            assert( (target != nil) == (action != nil) );
-            assert( (target != nil) == (thread != nil) );
-
-            // We don't need to retain target here because we never actually call it, we just 
-            // test it for nil.  We need to test for target for nil because -operationDone: 
-            // might have won the race to pull it out.
-
-            if (target != nil) {
-                CFDictionaryRemoveValue(self->_runningOperationToTargetMap, operation);
-                CFDictionaryRemoveValue(self->_runningOperationToActionMap, operation);
-                CFDictionaryRemoveValue(self->_runningOperationToThreadMap, operation);
+            wasPending = NO;
+            for (NSMutableArray * lane in self->_pendingTransferLanes) {
+                if ([lane indexOfObjectIdenticalTo:operation] != NSNotFound) {
+                    [[operation retain] autorelease];
+                    [lane removeObjectIdenticalTo:operation];
+                    wasPending = YES;
+                    break;
+                }
             }
-            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
-            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
         }
+        if (wasPending) {
+            [self->_operationRegistry operationDidLeaveQueue:operation];
+            [self.queueForNetworkTransfers addOperation:operation];
+        }
+
+        // Now we pull the target/action out of the registry.  We don't need the target, 
+        // we just need to make sure -operationDone: never calls it.  If -operationDone: won 
+        // the race to pull it out, this does nothing.
+        
+        (void) [self->_operationRegistry removeOperation:operation completed:NO target:NULL action:NULL];
     }
 }
 
+- (SGOperationRegistryStatistics)operationStatistics
+    // See comment in header.
+{
+    // any thread
+    return self->_operationRegistry.statistics;
+}
+
 @end
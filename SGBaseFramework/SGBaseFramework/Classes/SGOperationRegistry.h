@@ -0,0 +1,75 @@
+/*
+    File:       SGOperationRegistry.h
+
+    Contains:   A lock-striped table of queued operations and their completion target/action.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+    SGOperationRegistry is where SGNetworkManager remembers, for each operation it 
+    has queued, the target/action to call when the operation finishes and the thread 
+    to call it on.  Some important points:
+
+    o The three values are kept together in one record, so registering, completing 
+      and cancelling an operation each take one lookup.
+
+    o The table is split into stripes, each with its own lock and dictionary, and an 
+      operation's stripe is picked from its address.  Threads working on different 
+      operations rarely contend for the same lock, which matters when lots of threads 
+      are adding and cancelling operations at once.
+
+    o The statistics are maintained with atomic counters, so reading them never takes 
+      a lock.  As with any counter that other threads are changing, they can be out of 
+      date by the time you look at them.
+
+    All methods can be called from any thread.
+*/
+
+// A snapshot of the registry's counters.
+
+struct SGOperationRegistryStatistics {
+    NSUInteger  inFlight;           // registered and not yet completed or cancelled
+    NSUInteger  queued;             // the subset of inFlight that's still waiting to start
+    uint64_t    completed;          // removed by -removeOperation:completed:... with completed set
+    uint64_t    cancelled;          // removed by -removeOperation:completed:... with completed clear
+};
+typedef struct SGOperationRegistryStatistics SGOperationRegistryStatistics;
+
+@interface SGOperationRegistry : NSObject
+{
+    void *              _stripes;
+    volatile int32_t    _inFlightCount;                                         // any thread, atomic
+    volatile int32_t    _queuedCount;                                           // any thread, atomic
+    volatile int64_t    _completedCount;                                        // any thread, atomic
+    volatile int64_t    _cancelledCount;                                        // any thread, atomic
+}
+
+- (void)addOperation:(NSOperation *)operation target:(id)target action:(SEL)action thread:(NSThread *)thread queued:(BOOL)queued batched:(BOOL)batched;
+    // Registers the operation, which must not already be registered.  The registry 
+    // retains the operation, target and thread until the operation is removed.  Pass 
+    // YES for queued if the operation won't start straight away; call 
+    // -operationDidLeaveQueue: when it does.  batched is just remembered for 
+    // -threadForOperation:batched:; the registry doesn't care what it means.
+
+- (void)operationDidLeaveQueue:(NSOperation *)operation;
+    // Records that a queued operation has been handed to its NSOperationQueue.  Does 
+    // nothing if the operation isn't registered, or isn't queued.
+
+- (NSThread *)threadForOperation:(NSOperation *)operation batched:(BOOL *)batchedPtr;
+    // Returns the thread on which the operation's target/action should be called, or 
+    // nil if the operation isn't registered.  If it is, and batchedPtr is not NULL, 
+    // *batchedPtr is set to the value passed to -addOperation:....
+
+- (BOOL)removeOperation:(NSOperation *)operation completed:(BOOL)completed target:(id *)targetPtr action:(SEL *)actionPtr;
+    // Removes the operation from the registry.  Returns NO, and leaves *targetPtr and 
+    // *actionPtr alone, if it isn't registered; this lets completion and cancellation 
+    // race to remove an operation, with exactly one of them winning.  Otherwise, if 
+    // targetPtr is not NULL, it's set to the target, which the caller must release; 
+    // if actionPtr is not NULL, it's set to the action.  completed says which counter 
+    // to bump.
+
+@property (nonatomic, assign, readonly) SGOperationRegistryStatistics   statistics;
+
+@end
@@ -0,0 +1,250 @@
+/*
+    File:       SGOperationRegistry.m
+
+    Contains:   A lock-striped table of queued operations and their completion target/action.
+
+*/
+
+#import "SGOperationRegistry.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <libkern/OSAtomic.h>
+
+/*
+    Each stripe is a pthread mutex and a CFDictionary from operation to record.  The 
+    dictionary retains the operation (its key) but not the record; records are plain C 
+    structures that we malloc and free ourselves, which saves an object allocation per 
+    operation.  The record holds its own references to the target and thread.
+
+    Stripes are padded out to a cache line so that two CPUs working on adjacent stripes 
+    don't end up fighting over the same line anyway.
+*/
+
+enum {
+    kSGOperationRegistryStripeCount = 16,           // must be a power of two
+    kSGOperationRegistryCacheLineSize = 64
+};
+
+struct SGOperationRecord {
+    id          target;
+    SEL         action;
+    NSThread *  thread;
+    BOOL        queued;
+    BOOL        batched;
+};
+typedef struct SGOperationRecord SGOperationRecord;
+
+struct SGOperationRegistryStripe {
+    pthread_mutex_t             lock;
+    CFMutableDictionaryRef      records;
+    char                        padding[kSGOperationRegistryCacheLineSize];
+};
+typedef struct SGOperationRegistryStripe SGOperationRegistryStripe;
+
+static inline SGOperationRegistryStripe * StripeForOperation(SGOperationRegistryStripe * stripes, NSOperation * operation)
+    // Objects are at least 16 byte aligned, so the low bits of the address are 
+    // useless; we fold some higher ones in instead.
+{
+    uintptr_t   address;
+
+    address = (uintptr_t) operation;
+    return &stripes[ ((address >> 4) ^ (address >> 10)) & (kSGOperationRegistryStripeCount - 1) ];
+}
+
+@implementation SGOperationRegistry
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        SGOperationRegistryStripe * stripes;
+        int                         err;
+
+        stripes = calloc(kSGOperationRegistryStripeCount, sizeof(SGOperationRegistryStripe));
+        assert(stripes != NULL);
+        for (NSUInteger i = 0; i < kSGOperationRegistryStripeCount; i++) {
+            err = pthread_mutex_init(&stripes[i].lock, NULL);
+            assert(err == 0);
+            stripes[i].records = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+            assert(stripes[i].records != NULL);
+        }
+        self->_stripes = stripes;
+    }
+    return self;
+}
+
+static void ReleaseRecord(const void * key, const void * value, void * context)
+    // A CFDictionaryApplierFunction that frees each record left in a stripe.
+{
+    SGOperationRecord * record;
+
+    #pragma unused(key)
+    #pragma unused(context)
+    record = (SGOperationRecord *) value;
+    [record->target release];
+    [record->thread release];
+    free(record);
+}
+
+- (void)dealloc
+{
+    SGOperationRegistryStripe * stripes;
+
+    stripes = (SGOperationRegistryStripe *) self->_stripes;
+    for (NSUInteger i = 0; i < kSGOperationRegistryStripeCount; i++) {
+        CFDictionaryApplyFunction(stripes[i].records, ReleaseRecord, NULL);
+        CFRelease(stripes[i].records);
+        (void) pthread_mutex_destroy(&stripes[i].lock);
+    }
+    free(stripes);
+    [super dealloc];
+}
+
+- (void)addOperation:(NSOperation *)operation target:(id)target action:(SEL)action thread:(NSThread *)thread queued:(BOOL)queued batched:(BOOL)batched
+    // See comment in header.
+{
+    SGOperationRegistryStripe * stripe;
+    SGOperationRecord *         record;
+
+    // any thread
+    assert(operation != nil);
+    assert(target != nil);
+    assert(action != nil);
+    assert(thread != nil);
+
+    record = malloc(sizeof(*record));
+    assert(record != NULL);
+    record->target = [target retain];
+    record->action = action;
+    record->thread = [thread retain];
+    record->queued = queued;
+    record->batched = batched;
+
+    // Bump the counters first, so that the statistics never show more operations 
+    // completed than were ever in flight.
+
+    (void) OSAtomicIncrement32Barrier(&self->_inFlightCount);
+    if (queued) {
+        (void) OSAtomicIncrement32Barrier(&self->_queuedCount);
+    }
+
+    stripe = StripeForOperation(self->_stripes, operation);
+    pthread_mutex_lock(&stripe->lock);
+    assert( CFDictionaryGetValue(stripe->records, operation) == NULL );         // shouldn't already be in our table
+    CFDictionarySetValue(stripe->records, operation, record);
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+- (void)operationDidLeaveQueue:(NSOperation *)operation
+    // See comment in header.
+{
+    SGOperationRegistryStripe * stripe;
+    SGOperationRecord *         record;
+    BOOL                        wasQueued;
+
+    // any thread
+    assert(operation != nil);
+
+    wasQueued = NO;
+    stripe = StripeForOperation(self->_stripes, operation);
+    pthread_mutex_lock(&stripe->lock);
+    record = (SGOperationRecord *) CFDictionaryGetValue(stripe->records, operation);
+    if ( (record != NULL) && record->queued ) {
+        record->queued = NO;
+        wasQueued = YES;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (wasQueued) {
+        (void) OSAtomicDecrement32Barrier(&self->_queuedCount);
+    }
+}
+
+- (NSThread *)threadForOperation:(NSOperation *)operation batched:(BOOL *)batchedPtr
+    // See comment in header.
+{
+    SGOperationRegistryStripe * stripe;
+    SGOperationRecord *         record;
+    NSThread *                  result;
+
+    // any thread
+    assert(operation != nil);
+
+    result = nil;
+    stripe = StripeForOperation(self->_stripes, operation);
+    pthread_mutex_lock(&stripe->lock);
+    record = (SGOperationRecord *) CFDictionaryGetValue(stripe->records, operation);
+    if (record != NULL) {
+        result = [record->thread retain];
+        if (batchedPtr != NULL) {
+            *batchedPtr = record->batched;
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    return [result autorelease];
+}
+
+- (BOOL)removeOperation:(NSOperation *)operation completed:(BOOL)completed target:(id *)targetPtr action:(SEL *)actionPtr
+    // See comment in header.
+{
+    SGOperationRegistryStripe * stripe;
+    SGOperationRecord *         record;
+
+    // any thread
+    assert(operation != nil);
+
+    stripe = StripeForOperation(self->_stripes, operation);
+    pthread_mutex_lock(&stripe->lock);
+    record = (SGOperationRecord *) CFDictionaryGetValue(stripe->records, operation);
+    if (record != NULL) {
+
+        // Removing the operation from the dictionary might release the last reference 
+        // to it, which in turn might do all sorts of things, so we keep it alive until 
+        // we've left the lock.
+
+        [[operation retain] autorelease];
+        CFDictionaryRemoveValue(stripe->records, operation);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (record != NULL) {
+        if (record->queued) {
+            (void) OSAtomicDecrement32Barrier(&self->_queuedCount);
+        }
+        (void) OSAtomicDecrement32Barrier(&self->_inFlightCount);
+        if (completed) {
+            (void) OSAtomicIncrement64Barrier(&self->_completedCount);
+        } else {
+            (void) OSAtomicIncrement64Barrier(&self->_cancelledCount);
+        }
+
+        if (targetPtr != NULL) {
+            *targetPtr = record->target;
+        } else {
+            [record->target release];
+        }
+        if (actionPtr != NULL) {
+            *actionPtr = record->action;
+        }
+        [record->thread release];
+        free(record);
+    }
+    return (record != NULL);
+}
+
+- (SGOperationRegistryStatistics)statistics
+    // See comment in header.
+{
+    SGOperationRegistryStatistics   result;
+
+    // any thread
+    result.inFlight  = (NSUInteger) OSAtomicAdd32Barrier(0, &self->_inFlightCount);
+    result.queued    = (NSUInteger) OSAtomicAdd32Barrier(0, &self->_queuedCount);
+    result.completed = (uint64_t)   OSAtomicAdd64Barrier(0, &self->_completedCount);
+    result.cancelled = (uint64_t)   OSAtomicAdd64Barrier(0, &self->_cancelledCount);
+    return result;
+}
+
+@end
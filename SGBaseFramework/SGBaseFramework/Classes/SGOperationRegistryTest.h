@@ -0,0 +1,22 @@
+//
+//  SGOperationRegistryTest.h
+//  SGBaseFramework
+//
+//  Unit tests and an add/cancel benchmark for SGOperationRegistry.
+
+#define USE_APPLICATION_UNIT_TEST 0
+
+#import <SenTestingKit/SenTestingKit.h>
+#import <UIKit/UIKit.h>
+
+
+@interface SGOperationRegistryTest : SenTestCase {
+    NSUInteger _batchCount;
+    NSMutableArray * _batchedOperations;
+}
+
+- (void)testRecordsSurviveUntilRemovedOnce;
+- (void)testBenchmarkAddAndCancelFromManyThreads;
+- (void)testBatchedCompletionsArriveTogether;
+
+@end
@@ -0,0 +1,260 @@
+//
+//  SGOperationRegistryTest.m
+//  SGBaseFramework
+//
+
+#import "SGOperationRegistryTest.h"
+#import "SGOperationRegistry.h"
+#import "SGNetworkManager.h"
+
+#include <pthread.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+
+enum {
+    kBenchmarkOperationsPerThread = 20000,
+    kBenchmarkBatchSize           = 64,
+    kBenchmarkMaxThreads          = 16
+};
+
+struct BenchmarkContext {
+    SGOperationRegistry *       registry;       // used by the registry path
+    CFMutableDictionaryRef      targetMap;      // used by the @synchronized path
+    CFMutableDictionaryRef      actionMap;      // used by the @synchronized path
+    CFMutableDictionaryRef      threadMap;      // used by the @synchronized path
+    id                          lock;           // used by the @synchronized path
+    id                          target;
+    volatile int32_t            go;
+};
+typedef struct BenchmarkContext BenchmarkContext;
+
+static void * RegistryWorker(void * arg)
+    // Adds and cancels operations, a batch at a time, the way SGNetworkManager does.
+{
+    BenchmarkContext *  context;
+    NSAutoreleasePool * pool;
+    NSMutableArray *    batch;
+    NSThread *          thread;
+
+    context = (BenchmarkContext *) arg;
+    pool = [[NSAutoreleasePool alloc] init];
+    thread = [NSThread currentThread];
+    batch = [NSMutableArray arrayWithCapacity:kBenchmarkBatchSize];
+    for (NSUInteger i = 0; i < kBenchmarkBatchSize; i++) {
+        [batch addObject:[[[NSOperation alloc] init] autorelease]];
+    }
+    while (context->go == 0) {
+        // spin
+    }
+    for (NSUInteger i = 0; i < kBenchmarkOperationsPerThread; i += kBenchmarkBatchSize) {
+        for (NSOperation * operation in batch) {
+            [context->registry addOperation:operation target:context->target action:@selector(description) thread:thread queued:YES batched:NO];
+        }
+        for (NSOperation * operation in batch) {
+            (void) [context->registry removeOperation:operation completed:NO target:NULL action:NULL];
+        }
+    }
+    [pool drain];
+    return NULL;
+}
+
+static void * SynchronizedWorker(void * arg)
+    // As RegistryWorker, but using the three maps and global lock that SGNetworkManager 
+    // used to use.
+{
+    BenchmarkContext *  context;
+    NSAutoreleasePool * pool;
+    NSMutableArray *    batch;
+    NSThread *          thread;
+
+    context = (BenchmarkContext *) arg;
+    pool = [[NSAutoreleasePool alloc] init];
+    thread = [NSThread currentThread];
+    batch = [NSMutableArray arrayWithCapacity:kBenchmarkBatchSize];
+    for (NSUInteger i = 0; i < kBenchmarkBatchSize; i++) {
+        [batch addObject:[[[NSOperation alloc] init] autorelease]];
+    }
+    while (context->go == 0) {
+        // spin
+    }
+    for (NSUInteger i = 0; i < kBenchmarkOperationsPerThread; i += kBenchmarkBatchSize) {
+        for (NSOperation * operation in batch) {
+            @synchronized (context->lock) {
+                CFDictionarySetValue(context->targetMap, operation, context->target);
+                CFDictionarySetValue(context->actionMap, operation, @selector(description));
+                CFDictionarySetValue(context->threadMap, operation, thread);
+            }
+        }
+        for (NSOperation * operation in batch) {
+            @synchronized (context->lock) {
+                if (CFDictionaryGetValue(context->targetMap, operation) != NULL) {
+                    CFDictionaryRemoveValue(context->targetMap, operation);
+                    CFDictionaryRemoveValue(context->actionMap, operation);
+                    CFDictionaryRemoveValue(context->threadMap, operation);
+                }
+            }
+        }
+    }
+    [pool drain];
+    return NULL;
+}
+
+static double RunBenchmark(BenchmarkContext * context, NSUInteger threadCount, void * (*worker)(void *))
+    // Runs threadCount workers and returns the throughput in add/cancel pairs per second.
+{
+    pthread_t                   workers[kBenchmarkMaxThreads];
+    uint64_t                    start;
+    uint64_t                    end;
+    mach_timebase_info_data_t   timebase;
+    int                         err;
+
+    assert(threadCount <= kBenchmarkMaxThreads);
+
+    context->go = 0;
+    OSMemoryBarrier();
+
+    for (NSUInteger i = 0; i < threadCount; i++) {
+        err = pthread_create(&workers[i], NULL, worker, context);
+        assert(err == 0);
+    }
+
+    start = mach_absolute_time();
+    (void) OSAtomicIncrement32Barrier(&context->go);
+    for (NSUInteger i = 0; i < threadCount; i++) {
+        err = pthread_join(workers[i], NULL);
+        assert(err == 0);
+    }
+    end = mach_absolute_time();
+
+    (void) mach_timebase_info(&timebase);
+    return ((double) (threadCount * kBenchmarkOperationsPerThread)) / (((double) (end - start) * timebase.numer / timebase.denom) / 1.0e9);
+}
+
+@implementation SGOperationRegistryTest
+
+- (void)testRecordsSurviveUntilRemovedOnce {
+    SGOperationRegistry * registry = [[[SGOperationRegistry alloc] init] autorelease];
+    NSOperation * operation = [[[NSOperation alloc] init] autorelease];
+    NSOperation * other = [[[NSOperation alloc] init] autorelease];
+    NSString * target = [NSString stringWithFormat:@"target %d", 1];
+    id removedTarget = nil;
+    SEL removedAction = NULL;
+    BOOL batched = NO;
+    SGOperationRegistryStatistics stats;
+
+    [registry addOperation:operation target:target action:@selector(length) thread:[NSThread currentThread] queued:YES batched:NO];
+    [registry addOperation:other target:target action:@selector(length) thread:[NSThread currentThread] queued:NO batched:YES];
+    stats = registry.statistics;
+    STAssertEquals(stats.inFlight, (NSUInteger) 2, nil, nil);
+    STAssertEquals(stats.queued, (NSUInteger) 1, nil, nil);
+    STAssertEquals([registry threadForOperation:operation batched:NULL], [NSThread currentThread], nil, nil);
+    STAssertEquals([registry threadForOperation:other batched:&batched], [NSThread currentThread], nil, nil);
+    STAssertTrue(batched, nil, nil);
+
+    [registry operationDidLeaveQueue:operation];
+    [registry operationDidLeaveQueue:operation];
+    STAssertEquals(registry.statistics.queued, (NSUInteger) 0, @"Leaving the queue twice should only count once", nil);
+
+    STAssertTrue([registry removeOperation:operation completed:YES target:&removedTarget action:&removedAction], nil, nil);
+    STAssertEquals(removedTarget, (id) target, nil, nil);
+    STAssertEquals(removedAction, @selector(length), nil, nil);
+    [removedTarget release];
+
+    // Whoever comes second, completion or cancellation, finds nothing.
+
+    STAssertFalse([registry removeOperation:operation completed:NO target:NULL action:NULL], nil, nil);
+    STAssertNil([registry threadForOperation:operation batched:NULL], nil, nil);
+
+    STAssertTrue([registry removeOperation:other completed:NO target:NULL action:NULL], nil, nil);
+    stats = registry.statistics;
+    STAssertEquals(stats.inFlight, (NSUInteger) 0, nil, nil);
+    STAssertEquals(stats.queued, (NSUInteger) 0, nil, nil);
+    STAssertEquals(stats.completed, (uint64_t) 1, nil, nil);
+    STAssertEquals(stats.cancelled, (uint64_t) 1, nil, nil);
+}
+
+- (void)testBenchmarkAddAndCancelFromManyThreads {
+    static const NSUInteger kThreadCounts[] = { 1, 4, 16 };
+    BenchmarkContext context;
+
+    memset(&context, 0, sizeof(context));
+    context.target = @"target";
+
+    for (NSUInteger i = 0; i < sizeof(kThreadCounts) / sizeof(kThreadCounts[0]); i++) {
+        NSUInteger threadCount;
+        double registryRate;
+        double synchronizedRate;
+        SGOperationRegistryStatistics stats;
+
+        threadCount = kThreadCounts[i];
+
+        context.registry = [[SGOperationRegistry alloc] init];
+        registryRate = RunBenchmark(&context, threadCount, RegistryWorker);
+        stats = context.registry.statistics;
+        STAssertEquals(stats.inFlight, (NSUInteger) 0, @"Every operation should be removed", nil);
+        STAssertEquals(stats.queued, (NSUInteger) 0, @"Every operation should be removed", nil);
+        STAssertEquals(stats.cancelled, (uint64_t) (threadCount * kBenchmarkOperationsPerThread), @"Every operation should be counted", nil);
+        NSLog(@"SGOperationRegistry:  %2zu threads, %10.0f add/cancel pairs/s", (size_t) threadCount, registryRate);
+        [context.registry release];
+        context.registry = nil;
+
+        context.targetMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        context.actionMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+        context.threadMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        context.lock = [[NSObject alloc] init];
+        synchronizedRate = RunBenchmark(&context, threadCount, SynchronizedWorker);
+        STAssertEquals(CFDictionaryGetCount(context.targetMap), (CFIndex) 0, @"Every operation should be removed", nil);
+        NSLog(@"SGOperationRegistry @synchronized maps: %2zu threads, %10.0f add/cancel pairs/s", (size_t) threadCount, synchronizedRate);
+        CFRelease(context.targetMap);
+        CFRelease(context.actionMap);
+        CFRelease(context.threadMap);
+        [context.lock release];
+        context.lock = nil;
+    }
+}
+
+- (void)operationsDidFinish:(NSArray *)operations {
+    STAssertTrue([NSThread isMainThread], @"Batches should arrive on the queuing thread", nil);
+    _batchCount += 1;
+    [_batchedOperations addObjectsFromArray:operations];
+}
+
+- (void)testBatchedCompletionsArriveTogether {
+    static const NSUInteger kOperationCount = 100;
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    NSTimeInterval savedInterval = manager.completionBatchInterval;
+    NSMutableArray * operations = [NSMutableArray array];
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:10.0];
+    NSOperation * cancelled;
+
+    _batchCount = 0;
+    _batchedOperations = [NSMutableArray array];
+    manager.completionBatchInterval = 0.1;
+
+    // Hold the operations back until they're all queued, so that the cancelled one
+    // can't finish first.
+
+    NSOperation * gate = [[[NSOperation alloc] init] autorelease];
+    for (NSUInteger i = 0; i < kOperationCount; i++) {
+        NSOperation * op = [[[NSOperation alloc] init] autorelease];
+        [op addDependency:gate];
+        [operations addObject:op];
+        [manager addCPUOperation:op finishedTarget:self batchAction:@selector(operationsDidFinish:)];
+    }
+    cancelled = [operations objectAtIndex:kOperationCount / 2];
+    [manager cancelOperation:cancelled];
+    [[[[NSOperationQueue alloc] init] autorelease] addOperation:gate];
+
+    while ([_batchedOperations count] < kOperationCount - 1 && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    }
+    manager.completionBatchInterval = savedInterval;
+
+    STAssertEquals([_batchedOperations count], kOperationCount - 1, @"Every uncancelled operation should be delivered", nil);
+    STAssertFalse([_batchedOperations containsObject:cancelled], @"The cancelled operation should be left out", nil);
+    STAssertTrue(_batchCount < kOperationCount / 4, @"Completions should be batched, got %lu batches", (unsigned long) _batchCount);
+    NSLog(@"SGNetworkManager: %lu completions in %lu batches", (unsigned long) [_batchedOperations count], (unsigned long) _batchCount);
+    _batchedOperations = nil;
+}
+
+@end
@@ -7,16 +7,48 @@
 
 #import <Foundation/Foundation.h>
 
+// Severity levels for the leveled logging API.  See "Leveled logging", below.
+
+enum {
+    kSGQLogLevelDebug   = 0,
+    kSGQLogLevelInfo    = 1,
+    kSGQLogLevelNotice  = 2,
+    kSGQLogLevelWarning = 3,
+    kSGQLogLevelError   = 4,
+    kSGQLogLevelFault   = 5,
+    kSGQLogLevelNone    = 6                 // only meaningful as a threshold; disables all levels
+};
+typedef NSUInteger SGQLogLevel;
+
+@class SGQLogRingBuffer;
+@class SGQLogEntryStore;
+@class SGQLogCrashRing;
+
 @interface SGQLog : NSObject
 {
     BOOL                _enabled;                                               // main thread write, any thread read
-    int                 _logFile;                                               // main thread write, any thread read
-    off_t               _logFileLength;                                         // main thread only, only valid if _logFile != -1
+    int                 _logFile;                                               // main thread write, any thread read, protected by @synchronized (self)
+    off_t               _logFileLength;                                         // protected by @synchronized (self), only valid if _logFile != -1
     BOOL                _loggingToStdErr;                                       // main thread write, any thread read
     NSUInteger          _optionsMask;                                           // main thread write, any thread read
     BOOL                _showViewer;                                            // main thread only
-    NSMutableArray *    _logEntries;                                            // main thread only
-    NSMutableArray *    _pendingEntries;                                        // any thread, protected by @synchronize (self)
+    BOOL                _deferredFormatting;                                    // main thread write, any thread read
+    BOOL                _preciseTimestamps;                                     // main thread write, any thread read
+    SGQLogLevel         _minimumLevel;                                          // main thread write, any thread read
+    SGQLogEntryStore *  _logEntries;                                            // main thread only
+    SGQLogRingBuffer *  _pendingEntries;                                        // any thread, lock-free
+    volatile int32_t    _flushScheduled;                                        // any thread, atomic
+    uint64_t            _droppedEntriesReported;                                // protected by @synchronized (_pendingEntries)
+    BOOL                _flushingInBackground;                                  // main thread write, any thread read
+    volatile int32_t    _batchFlushScheduled;                                   // any thread, atomic
+    NSThread *          _flusherThread;                                         // main thread write, any thread read
+    NSTimer *           _flusherTimer;                                          // flusher thread only
+    NSMutableArray *    _backgroundEntries;                                     // protected by @synchronized (_backgroundEntries)
+    time_t              _logFileCreationTime;                                   // protected by @synchronized (self)
+    NSUInteger          _closedSegmentCount;                                    // protected by @synchronized (self)
+    NSMutableArray *    _closedSegmentPaths;                                    // protected by @synchronized (self)
+    NSOperationQueue *  _archiveQueue;                                          // any thread
+    SGQLogCrashRing *   _crashRing;                                             // main thread write, any thread read
 }
 
 + (SGQLog *)log;                                                                  // any thread
@@ -36,40 +68,132 @@
 @property (nonatomic, assign, readonly, getter=isLoggingToFile) BOOL   loggingToFile;      // any thread, observable, always changed by main thread
 @property (nonatomic, assign, readonly, getter=isLoggingToStdErr) BOOL loggingToStdErr;    // any thread, observable, always changed by main thread
 @property (nonatomic, assign, readonly) NSUInteger                     optionsMask;        // any thread, observable, always changed by main thread
+@property (nonatomic, assign, readonly) SGQLogLevel                    minimumLevel;       // any thread, observable, always changed by main thread
+@property (nonatomic, assign, readonly, getter=isDeferredFormatting) BOOL deferredFormatting; // any thread, observable, always changed by main thread
+@property (nonatomic, assign, readonly, getter=isFlushingInBackground) BOOL flushingInBackground; // any thread, observable, always changed by main thread
+@property (nonatomic, assign, readonly) BOOL                           preciseTimestamps;  // any thread, observable, always changed by main thread
 
 @property (nonatomic, assign, readonly) BOOL                           showViewer;         // main thread, observable, always changed by main thread
 
-// User Default         Property
-// ------------         --------
-// qlogEnabled          enabled
-// qlogLoggingToFile    loggingToFile
-// qlogLoggingToStdErr  loggingToStdErr
-// qlogOption0..31      optionsMask
+// User Default             Property
+// ------------             --------
+// qlogEnabled              enabled
+// qlogLoggingToFile        loggingToFile
+// qlogBackgroundFlush      flushingInBackground
+// qlogLoggingToStdErr      loggingToStdErr
+// qlogOption0..31          optionsMask
+// qlogMinimumLevel         minimumLevel
+// qlogMemoryEntryCapacity  memoryEntryCapacity
+// qlogDeferredFormatting   deferredFormatting
+// qlogPreciseTimestamps    preciseTimestamps
+// qlogShowViewer           showViewer
 
 // Log entry generation
 
 // Some things to note:
 // 
 // o The -logOptions:xxx methods only log if the specified bit is set in 
-//   optionsMask (that is, (optionsMask & (1 << option)) is not zero).
+//   optionsMask (that is, (optionsMask & (1 << option)) is not zero).  The 
+//   entry's message is prefixed with "[opt<option>] " so that it can be found 
+//   later.  The tag is added when the entry is rendered, so the format string 
+//   is passed through untouched, even in deferred formatting mode.
 //
 // o The format string is as implemented by +[NSString stringWithFormat:].
+//
+// o If deferredFormatting is set, the logging thread only captures the format 
+//   and its arguments; the entry is formatted when it's flushed.  This makes 
+//   logging much cheaper for the calling thread.  %@ arguments are still 
+//   described immediately, so prefer scalar arguments on hot paths.  Deferred 
+//   formatting is not used when logging to stderr.  See SGQLogBinaryRecord.h 
+//   for the details.
+//
+// o Each entry's header looks like:
+//
+//   YYYY-MM-DD HH:MM:SS.mmm <prog>[<pid>:<tid>#<seq>] 
+//
+//   where <tid> is the Mach thread number, in hex, and <seq> counts the entries 
+//   logged by that thread.  A gap in <seq> means that some of the thread's entries 
+//   were dropped (see droppedEntryCount).
+//
+// o If preciseTimestamps is set, the time comes from a monotonic clock and is 
+//   printed to the nanosecond (SS.nnnnnnnnn).  That clock is anchored to the 
+//   wall clock when logging starts, so entries logged close together, even on 
+//   different threads, are ordered correctly and the difference between their 
+//   times is the elapsed time.  The monotonic clock stops while the device 
+//   sleeps, so it's re-anchored to the wall clock when the app wakes up, when 
+//   the system time changes, and whenever a periodic check finds the two clocks 
+//   more than a few milliseconds apart.  The difference between two entries' 
+//   times is therefore not exact if a re-anchor happened between them.
 
 - (void)logWithFormat:(NSString *)format, ... NS_FORMAT_FUNCTION(1, 2);                             // any thread
 - (void)logWithFormat:(NSString *)format arguments:(va_list)argList;                                // any thread
 - (void)logOption:(NSUInteger)option withFormat:(NSString *)format, ... NS_FORMAT_FUNCTION(2, 3);   // any thread
 - (void)logOption:(NSUInteger)option withFormat:(NSString *)format arguments:(va_list)argList;      // any thread
 
+// Leveled logging
+
+// Some things to note:
+//
+// o Each entry has a level, a subsystem tag (a short string like @"net") and, 
+//   optionally, a dictionary of key/value fields.  The entry is rendered as:
+//
+//   <level letter> [<subsystem>] <message> <key>=<value> ...
+//
+//   with the fields sorted by key, so that entries are easy to grep for.
+//
+// o Entries below minimumLevel are discarded.  You should generally use the 
+//   SGQLogDebug, SGQLogInfo, etc macros, defined below, rather than calling 
+//   these methods directly.  The macros check the level before evaluating any 
+//   of their arguments, and they compile out entirely for levels below 
+//   SGQLOG_COMPILED_MINIMUM_LEVEL.
+
+- (void)logLevel:(SGQLogLevel)level subsystem:(NSString *)subsystem fields:(NSDictionary *)fields withFormat:(NSString *)format, ... NS_FORMAT_FUNCTION(4, 5);                 // any thread
+- (void)logLevel:(SGQLogLevel)level subsystem:(NSString *)subsystem fields:(NSDictionary *)fields withFormat:(NSString *)format arguments:(va_list)argList;                  // any thread
+
 // In memory log entries
 
 // New entries are added to the end of this array and, as there's an upper limit 
 // number of entries that will be held in memory, ald entries are removed from 
-// the beginning.
+// the beginning.  The limit is memoryEntryCapacity; internally logEntries is a 
+// circular buffer, so evicting old entries is cheap even when the limit is large.
+//
+// Every change to logEntries is described by SGQLogEntriesDidChangeNotification, 
+// which is posted on the main thread.  Its user info dictionary says how many entries 
+// were removed from the start of the array and how many were then added to the 
+// end.  That's a single notification per change, which is easier to apply to a 
+// table view than the equivalent sequence of KVO notifications.  If logging to a 
+// file, the added entries have been written to it by the time the notification 
+// is posted, in both immediate and background flushing modes.
+
+@property (nonatomic, retain, readonly) NSArray *                      logEntries;         // observable, always changed by main thread
+@property (nonatomic, assign, readonly) NSUInteger                     memoryEntryCapacity; // main thread, observable, always changed by main thread
+
+// Pending log entries
+
+// Log entries are queued in a fixed-size, lock-free buffer until the main thread
+// flushes them.  If a burst of logging fills that buffer, further entries are
+// dropped rather than blocking the logging thread.  The next flush adds an entry
+// noting how many were lost.
+
+@property (nonatomic, assign, readonly) uint64_t                       droppedEntryCount;  // any thread, not observable
 
-@property (nonatomic, retain, readonly) NSMutableArray *               logEntries;         // observable, always changed by main thread
+// If flushingInBackground is set, pending entries are flushed by a low priority 
+// background thread rather than the main thread.  That thread batches up entries 
+// for a short while (or until enough have accumulated), writes them to the log 
+// file with a single writev, and then passes them to the main thread to add to 
+// logEntries.  This keeps the file I/O off the main thread and coalesces the 
+// logEntries KVO notifications.  -flush still works as expected; it waits for 
+// the background thread to write out everything that's pending.
 
 // In file log entries
 
+// The log file is rotated when it gets too big or too old.  The old log file is 
+// gzip compressed in the background and kept, along with a small number of older 
+// segments, in the same directory.  The limits are set at compile time; see the 
+// QLOG_LOG_FILE_xxx macros in SGQLog.m.  If the app dies before a rotated 
+// segment has been compressed, the segment is picked up and compressed on the 
+// next launch.
+
 - (NSInputStream *)streamForLogValidToLength:(off_t *)lengthPtr;                // main thread only
     // Returns an un-opened stream.  If lengthPtr is not NULL then, on return 
     // *lengthPtr contains the number of bytes in that stream that are 
@@ -77,5 +201,84 @@
     //
     // This can only be called on the main thread but the resulting stream 
     // can be passed to any thread for processing.
-    
+
+- (NSString *)pathToLogFileValidToLength:(off_t *)lengthPtr;             // main thread only
+    // If logging to a file, returns the path to the current log file.  If 
+    // lengthPtr is not NULL then, on return, *lengthPtr contains the number 
+    // of bytes in that file that are guaranteed to be valid.  Returns nil if 
+    // not logging to a file.  Unlike -streamForLogValidToLength:, this does not 
+    // flush, so it's safe to call from a logEntries observer.
+
+- (NSInputStream *)streamForLogIncludingArchives:(BOOL)includeArchives validToLength:(off_t *)lengthPtr;   // main thread only
+    // Like -streamForLogValidToLength: but, if includeArchives is set, the 
+    // stream starts with the (decompressed) contents of the rotated segments, 
+    // oldest first, followed by the current log file.
+
+// Crash recovery
+
+// While logging is enabled, every entry is also copied into a small memory mapped 
+// file (the crash ring) on the logging thread.  If the app dies before the entry 
+// is flushed, the kernel still writes it to disk.  On the next launch, the entries 
+// in the crash ring that never reached the log file are added back, after 
+// a "QLog recovered" entry, so that they end up in the log file.  Nothing is 
+// recovered if the app went into the background, or terminated, after its last 
+// entry was flushed.  In deferred formatting mode, the crash ring holds the 
+// unformatted binary record, which is only formatted if it's recovered.  See 
+// SGQLogCrashRing.h for the details.
+
 @end
+
+extern NSString * const SGQLogEntriesDidChangeNotification;
+extern NSString * const SGQLogEntriesRemovedCountKey;          // NSNumber, entries removed from the start
+extern NSString * const SGQLogEntriesAddedCountKey;            // NSNumber, entries then added to the end
+
+// Leveled logging macros
+
+// SGQLOG_COMPILED_MINIMUM_LEVEL is the lowest level that's compiled in at all. 
+// By default, debug builds get everything and release builds drop debug and info 
+// entries.  You can override it on a per-file basis by defining it before including 
+// this header.
+
+#if ! defined(SGQLOG_COMPILED_MINIMUM_LEVEL)
+    #if defined(DEBUG) && DEBUG
+        #define SGQLOG_COMPILED_MINIMUM_LEVEL kSGQLogLevelDebug
+    #else
+        #define SGQLOG_COMPILED_MINIMUM_LEVEL kSGQLogLevelNotice
+    #endif
+#endif
+
+extern volatile SGQLogLevel gSGQLogLevelThreshold;
+    // The lowest level that's currently logged, or kSGQLogLevelNone if logging is 
+    // disabled.  This mirrors minimumLevel and enabled, and exists so that the 
+    // macros below can check the level without a message send.  It starts out at 
+    // kSGQLogLevelDebug so that the first leveled log call creates the SGQLog 
+    // singleton, which then sets it properly.
+
+static inline BOOL SGQLogLevelIsEnabled(SGQLogLevel level)
+{
+    return (level >= gSGQLogLevelThreshold);
+}
+
+#define SGQLogAtLevel(level, subsystem, fieldsDict, ...) \
+    do { \
+        if ( ((level) >= SGQLOG_COMPILED_MINIMUM_LEVEL) && SGQLogLevelIsEnabled(level) ) { \
+            [[SGQLog log] logLevel:(level) subsystem:(subsystem) fields:(fieldsDict) withFormat:__VA_ARGS__]; \
+        } \
+    } while (0)
+
+#define SGQLogDebug(subsystem, ...)     SGQLogAtLevel(kSGQLogLevelDebug,   subsystem, nil, __VA_ARGS__)
+#define SGQLogInfo(subsystem, ...)      SGQLogAtLevel(kSGQLogLevelInfo,    subsystem, nil, __VA_ARGS__)
+#define SGQLogNotice(subsystem, ...)    SGQLogAtLevel(kSGQLogLevelNotice,  subsystem, nil, __VA_ARGS__)
+#define SGQLogWarning(subsystem, ...)   SGQLogAtLevel(kSGQLogLevelWarning, subsystem, nil, __VA_ARGS__)
+#define SGQLogError(subsystem, ...)     SGQLogAtLevel(kSGQLogLevelError,   subsystem, nil, __VA_ARGS__)
+#define SGQLogFault(subsystem, ...)     SGQLogAtLevel(kSGQLogLevelFault,   subsystem, nil, __VA_ARGS__)
+
+// SGQLogFields builds a fields dictionary from alternating values and keys, as per 
+// +[NSDictionary dictionaryWithObjectsAndKeys:].  For example:
+//
+// SGQLogAtLevel(kSGQLogLevelWarning, @"net", SGQLogFields(url, @"url", [NSNumber numberWithInt:status], @"status"), @"request failed");
+//
+// Because it's expanded inside SGQLogAtLevel's level check, the dictionary is 
+// only built if the entry is actually logged.
+
+#define SGQLogFields(...)               [NSDictionary dictionaryWithObjectsAndKeys:__VA_ARGS__, nil]
@@ -6,7 +6,16 @@
 
 #import "SGQLog.h"
 
+#import <UIKit/UIKit.h>
+
+#import "SGQLogRingBuffer.h"
+#import "SGQLogBinaryRecord.h"
+#import "SGQLogSegmentedInputStream.h"
+#import "SGQLogEntryStore.h"
+#import "SGQLogCrashRing.h"
+
 #include <stdarg.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -14,8 +23,13 @@
 #include <time.h>
 #include <sys/time.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <libkern/OSAtomic.h>
 
+#include "zlib.h"
+
 // Enable QLOG_ADD_SEQUENCE_NUMBERS to add sequences numbers to the front of each 
 // log entry.  This is a useful tool for debugging various problems.  For example, 
 // sequence numbers make it easy to see if the log viewer is messing up its table 
@@ -25,6 +39,73 @@
     #define QLOG_ADD_SEQUENCE_NUMBERS 0
 #endif
 
+// QLOG_PENDING_ENTRY_CAPACITY is the number of log entries that can be queued 
+// waiting for the main thread to flush them.  Entries logged while the queue is 
+// full are dropped (and counted in droppedEntryCount).
+
+#if ! defined(QLOG_PENDING_ENTRY_CAPACITY)
+    #define QLOG_PENDING_ENTRY_CAPACITY 4096
+#endif
+
+// QLOG_DEFAULT_MEMORY_ENTRY_CAPACITY is the number of entries held in logEntries 
+// unless overridden by the qlogMemoryEntryCapacity user default.
+
+#if ! defined(QLOG_DEFAULT_MEMORY_ENTRY_CAPACITY)
+    #define QLOG_DEFAULT_MEMORY_ENTRY_CAPACITY 10000
+#endif
+
+// When flushingInBackground is set, the flusher thread waits 
+// QLOG_BACKGROUND_FLUSH_INTERVAL seconds after the first pending entry arrives 
+// before flushing, unless QLOG_BACKGROUND_FLUSH_BATCH_SIZE entries accumulate 
+// first, in which case it flushes immediately.
+
+#if ! defined(QLOG_BACKGROUND_FLUSH_INTERVAL)
+    #define QLOG_BACKGROUND_FLUSH_INTERVAL 0.25
+#endif
+
+#if ! defined(QLOG_BACKGROUND_FLUSH_BATCH_SIZE)
+    #define QLOG_BACKGROUND_FLUSH_BATCH_SIZE 256
+#endif
+
+// When the log file reaches QLOG_LOG_FILE_MAX_SIZE bytes, or is more than 
+// QLOG_LOG_FILE_MAX_AGE seconds old, it's closed and a new log file is started. 
+// The closed segment is compressed in the background and kept as an archive; 
+// only the newest QLOG_ARCHIVED_SEGMENT_COUNT archives are kept.  Note that 
+// the age is only checked when entries are written.
+
+#if ! defined(QLOG_LOG_FILE_MAX_SIZE)
+    #define QLOG_LOG_FILE_MAX_SIZE (512 * 1024)
+#endif
+
+#if ! defined(QLOG_LOG_FILE_MAX_AGE)
+    #define QLOG_LOG_FILE_MAX_AGE (24 * 60 * 60)
+#endif
+
+#if ! defined(QLOG_ARCHIVED_SEGMENT_COUNT)
+    #define QLOG_ARCHIVED_SEGMENT_COUNT 4
+#endif
+
+// QLOG_CRASH_RING_SLOT_COUNT is the number of recent entries kept in the crash 
+// ring.  Each one takes 512 bytes of the crash ring file.
+
+#if ! defined(QLOG_CRASH_RING_SLOT_COUNT)
+    #define QLOG_CRASH_RING_SLOT_COUNT 512
+#endif
+
+// When preciseTimestamps is set, the monotonic clock is compared against the 
+// wall clock every QLOG_CLOCK_CHECK_INTERVAL seconds (of monotonic time) and 
+// re-anchored if they differ by more than QLOG_CLOCK_REANCHOR_THRESHOLD 
+// seconds.  The monotonic clock stops while the device sleeps, so this is what 
+// brings it back into line after a sleep.
+
+#if ! defined(QLOG_CLOCK_CHECK_INTERVAL)
+    #define QLOG_CLOCK_CHECK_INTERVAL 1.0
+#endif
+
+#if ! defined(QLOG_CLOCK_REANCHOR_THRESHOLD)
+    #define QLOG_CLOCK_REANCHOR_THRESHOLD 0.01
+#endif
+
 @interface SGQLog ()
 
 // private properties
@@ -34,9 +115,51 @@
 // forward declarations
 
 - (void)setupFromPreferences;
+- (void)changeLogEntriesRemovingOldest:(NSUInteger)removeCount adding:(NSArray *)entries;
+- (void)startFlusherThread;
+- (void)scheduleBackgroundFlush;
+- (void)flushOnFlusherThread;
+- (void)rotateLogFile;
+- (void)archiveClosedSegmentAtPath:(NSString *)closedPath;
+- (void)recoverClosedSegments;
+- (void)recoverCrashRingEntries:(NSArray *)records;
 
 @end
 
+// A text record for an entry that's also in the crash ring starts with this 
+// marker and the entry's crash ring index, so that -writeEntriesToLogFile:crashRingIndexes: 
+// can tell the ring once the entry is in the log file.  Like the 0xFF that starts 
+// a binary record, 0xFE can never start a UTF-8 string.
+
+enum {
+    kIndexedTextRecordMarker     = 0xFE,
+    kIndexedTextRecordHeaderSize = 1 + sizeof(int64_t)
+};
+
+NSString * const SGQLogEntriesDidChangeNotification = @"SGQLogEntriesDidChangeNotification";
+NSString * const SGQLogEntriesRemovedCountKey       = @"SGQLogEntriesRemovedCountKey";
+NSString * const SGQLogEntriesAddedCountKey         = @"SGQLogEntriesAddedCountKey";
+
+volatile SGQLogLevel gSGQLogLevelThreshold = kSGQLogLevelDebug;
+
+// The monotonic clock used when preciseTimestamps is set.  It's anchored to the 
+// wall clock when the SGQLog object is created and thereafter counts Mach 
+// absolute time ticks.  Mach absolute time doesn't advance while the device is 
+// asleep, so the anchor is checked periodically, and when the app wakes up, and 
+// moved if the two clocks have drifted apart; see CheckClockAnchor.
+
+static mach_timebase_info_data_t    sClockTimebase;             // set up by -init and never changes
+static uint64_t                     sClockCheckIntervalTicks;   // set up by -init and never changes
+static OSSpinLock                   sClockLock = OS_SPINLOCK_INIT;
+static uint64_t                     sClockBaseTicks;            // protected by sClockLock
+static struct timespec              sClockBaseTime;             // protected by sClockLock
+static uint64_t                     sClockCheckTicks;           // protected by sClockLock
+
+// Each thread's sequence id counter lives directly in the value of this 
+// thread-specific data key, so there's nothing to allocate or free.
+
+static pthread_key_t                sThreadSequenceKey;
+
 @implementation SGQLog
 
 + (SGQLog *)log
@@ -59,22 +182,91 @@
     return sLog;
 }
 
+static uint64_t NanosecondsForTicks(uint64_t ticks)
+    // Converts Mach absolute time ticks to nanoseconds.  The multiply won't 
+    // overflow for any plausible uptime with the timebases used by iOS hardware.
+{
+    return (ticks * sClockTimebase.numer) / sClockTimebase.denom;
+}
+
+static void CheckClockAnchor(uint64_t nowTicks)
+    // Compares the monotonic clock against the wall clock and, if they've drifted 
+    // apart by more than QLOG_CLOCK_REANCHOR_THRESHOLD, re-anchors the former to 
+    // the latter.  Small differences are left alone, so that precise timestamps 
+    // don't jitter backwards and forwards with the wall clock.
+    //
+    // Can be called on any thread, but the caller must hold sClockLock.
+{
+    struct timeval  now;
+    int64_t         monotonicNanos;
+    int64_t         wallNanos;
+    int64_t         drift;
+
+    if (gettimeofday(&now, NULL) == 0) {
+        monotonicNanos = ((int64_t) sClockBaseTime.tv_sec * 1000000000) + sClockBaseTime.tv_nsec + (int64_t) NanosecondsForTicks(nowTicks - sClockBaseTicks);
+        wallNanos      = ((int64_t) now.tv_sec * 1000000000) + ((int64_t) now.tv_usec * 1000);
+        drift = wallNanos - monotonicNanos;
+        if ( (sClockBaseTicks == 0) || (llabs(drift) > (int64_t) (QLOG_CLOCK_REANCHOR_THRESHOLD * 1000000000.0)) ) {
+            sClockBaseTicks = nowTicks;
+            sClockBaseTime.tv_sec  = now.tv_sec;
+            sClockBaseTime.tv_nsec = now.tv_usec * 1000;
+        }
+    }
+    sClockCheckTicks = nowTicks;
+}
+
 - (id)init
 {
+    int             junk;
+
     self = [super init];
     if (self != nil) {
-        self->_logEntries = [[NSMutableArray alloc] init];
+        self->_logEntries = [[SGQLogEntryStore alloc] initWithCapacity:QLOG_DEFAULT_MEMORY_ENTRY_CAPACITY];
         assert(self->_logEntries != nil);
 
-        self->_pendingEntries = [[NSMutableArray alloc] init];
+        self->_pendingEntries = [[SGQLogRingBuffer alloc] initWithCapacity:QLOG_PENDING_ENTRY_CAPACITY];
         assert(self->_pendingEntries != nil);
+
+        self->_backgroundEntries = [[NSMutableArray alloc] init];
+        assert(self->_backgroundEntries != nil);
+
+        self->_closedSegmentPaths = [[NSMutableArray alloc] init];
+        assert(self->_closedSegmentPaths != nil);
+
+        self->_archiveQueue = [[NSOperationQueue alloc] init];
+        assert(self->_archiveQueue != nil);
+        [self->_archiveQueue setMaxConcurrentOperationCount:1];
         
         self->_enabled = NO;
         self->_logFile = -1;
         self->_logFileLength = -1;
 
-        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(preferencesChanged:) name:NSUserDefaultsDidChangeNotification object:nil];
+        [self recoverClosedSegments];
+
+        junk = pthread_key_create(&sThreadSequenceKey, NULL);
+        assert(junk == 0);
+
+        junk = mach_timebase_info(&sClockTimebase);
+        assert(junk == KERN_SUCCESS);
+        sClockCheckIntervalTicks = (uint64_t) ((QLOG_CLOCK_CHECK_INTERVAL * 1000000000.0 * sClockTimebase.denom) / sClockTimebase.numer);
+        OSSpinLockLock(&sClockLock);
+        CheckClockAnchor(mach_absolute_time());
+        OSSpinLockUnlock(&sClockLock);
+
+        // We can be initialised on any thread, whichever one logs first.  Set up 
+        // from the preferences before we start listening for changes to them, so 
+        // that the main thread can't run -setupFromPreferences while we're still 
+        // running it here.
+
         [self setupFromPreferences];
+
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(preferencesChanged:) name:NSUserDefaultsDidChangeNotification object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(clockMayHaveChanged:) name:UIApplicationWillEnterForegroundNotification object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(clockMayHaveChanged:) name:UIApplicationDidBecomeActiveNotification object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(clockMayHaveChanged:) name:UIApplicationSignificantTimeChangeNotification object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(clockMayHaveChanged:) name:NSSystemClockDidChangeNotification object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(applicationMayExit:) name:UIApplicationDidEnterBackgroundNotification object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(applicationMayExit:) name:UIApplicationWillTerminateNotification object:nil];
     }
     return self;
 }
@@ -101,6 +293,20 @@
     return [logDirPath stringByAppendingPathComponent:@"QLog.log"];
 }
 
+- (NSString *)pathToArchivedSegment:(NSUInteger)segmentNumber
+    // Returns the path to the specified compressed log segment.  Segment 1 is 
+    // the newest.
+{
+    assert(segmentNumber >= 1);
+    return [[self.pathToLogFile stringByDeletingPathExtension] stringByAppendingFormat:@".%u.log.gz", (unsigned int) segmentNumber];
+}
+
+- (NSString *)pathToCrashRing
+    // Returns the path to the crash ring file, which lives next to the log file.
+{
+    return [[self.pathToLogFile stringByDeletingPathExtension] stringByAppendingPathExtension:@"crashring"];
+}
+
 - (void)setupFromPreferences
     // Sets up the object based on the current user defaults.
 {
@@ -110,9 +316,13 @@
     int                 junk;
     struct stat         sb;
     NSUInteger          newOptionsMask;
+    NSUInteger          newCapacity;
+    SGQLogLevel         newLevel;
 
-    // This is always called either on the main thread or before initialisation is 
-    // complete and, as such, does not need to be synchronised.
+    // This is always called either on the main thread or, from -init, before 
+    // initialisation is complete (on whatever thread first called +log) and, as 
+    // such, does not need to be synchronised.  Anything it calls must cope with 
+    // the latter.
 
     userDefaults = [NSUserDefaults standardUserDefaults];
     assert(userDefaults != nil);
@@ -143,29 +353,34 @@
         if (shouldLogToFile) {
         
             // We should be logging to a file but are not.  Open the log file and 
-            // get its length from newLength.  Note that the only other code that looks 
-            // at _logFile is also running on the main thread, so we don't have to worry 
-            // about synchronisation here.
+            // get its length from newLength.  The flusher thread may be writing to 
+            // the log file, so we synchronise with it.
         
-            assert(self->_logFile == -1);
-            self->_logFile = open([self.pathToLogFile fileSystemRepresentation], O_RDWR | O_CREAT | O_APPEND, DEFFILEMODE);
-            assert(self->_logFile != -1);
-            
-            if (self->_logFile != -1) {
-                junk = fstat(self->_logFile, &sb);
-                assert(junk == 0);
+            @synchronized (self) {
+                assert(self->_logFile == -1);
+                self->_logFile = open([self.pathToLogFile fileSystemRepresentation], O_RDWR | O_CREAT | O_APPEND, DEFFILEMODE);
+                assert(self->_logFile != -1);
                 
-                newLength = sb.st_size;
-                assert(newLength >= 0);
+                if (self->_logFile != -1) {
+                    junk = fstat(self->_logFile, &sb);
+                    assert(junk == 0);
+                    
+                    newLength = sb.st_size;
+                    assert(newLength >= 0);
+
+                    self->_logFileCreationTime = sb.st_birthtimespec.tv_sec;
+                }
             }
         } else {
         
             // We are logging to a file and shouldn't be.  Close down the log file.
             
-            assert(self->_logFile != -1);
-            junk = close(self->_logFile);
-            assert(junk == -1);
-            self->_logFile = -1;
+            @synchronized (self) {
+                assert(self->_logFile != -1);
+                junk = close(self->_logFile);
+                assert(junk == 0);
+                self->_logFile = -1;
+            }
             
             newLength = -1;
         }
@@ -210,6 +425,73 @@
         [self didChangeValueForKey:@"optionsMask"];
     }
 
+    // deferredFormatting property
+
+    shouldBeEnabled = [userDefaults boolForKey:@"qlogDeferredFormatting"];
+    if (shouldBeEnabled != self->_deferredFormatting) {
+        [self willChangeValueForKey:@"deferredFormatting"];
+        self->_deferredFormatting = shouldBeEnabled;
+        [self didChangeValueForKey:@"deferredFormatting"];
+    }
+
+    // preciseTimestamps property
+
+    shouldBeEnabled = [userDefaults boolForKey:@"qlogPreciseTimestamps"];
+    if (shouldBeEnabled != self->_preciseTimestamps) {
+        [self willChangeValueForKey:@"preciseTimestamps"];
+        self->_preciseTimestamps = shouldBeEnabled;
+        [self didChangeValueForKey:@"preciseTimestamps"];
+    }
+
+    // flushingInBackground property
+    
+    shouldBeEnabled = [userDefaults boolForKey:@"qlogBackgroundFlush"];
+    if (shouldBeEnabled != self->_flushingInBackground) {
+        if ( shouldBeEnabled && (self->_flusherThread == nil) ) {
+            [self startFlusherThread];
+        }
+        [self willChangeValueForKey:@"flushingInBackground"];
+        self->_flushingInBackground = shouldBeEnabled;
+        [self didChangeValueForKey:@"flushingInBackground"];
+    }
+
+    // minimumLevel property
+
+    newLevel = (SGQLogLevel) [userDefaults integerForKey:@"qlogMinimumLevel"];
+    if (newLevel > kSGQLogLevelNone) {
+        newLevel = kSGQLogLevelNone;
+    }
+    if (newLevel != self->_minimumLevel) {
+        [self willChangeValueForKey:@"minimumLevel"];
+        self->_minimumLevel = newLevel;
+        [self didChangeValueForKey:@"minimumLevel"];
+    }
+    gSGQLogLevelThreshold = self->_enabled ? self->_minimumLevel : kSGQLogLevelNone;
+    OSMemoryBarrier();
+
+    // memoryEntryCapacity property
+
+    newCapacity = (NSUInteger) [userDefaults integerForKey:@"qlogMemoryEntryCapacity"];
+    if (newCapacity == 0) {
+        newCapacity = QLOG_DEFAULT_MEMORY_ENTRY_CAPACITY;
+    }
+    if (newCapacity != self->_logEntries.capacity) {
+        NSUInteger  removeCount;
+
+        // Shrinking below the current count goes through the main thread only 
+        // path, so that observers hear about the removed entries.  During -init 
+        // there are no entries, and possibly no main thread, so we don't call it.
+
+        removeCount = ([self->_logEntries count] > newCapacity) ? ([self->_logEntries count] - newCapacity) : 0;
+        if (removeCount != 0) {
+            [self changeLogEntriesRemovingOldest:removeCount adding:nil];
+        }
+
+        [self willChangeValueForKey:@"memoryEntryCapacity"];
+        self->_logEntries.capacity = newCapacity;
+        [self didChangeValueForKey:@"memoryEntryCapacity"];
+    }
+
     // showViewer property
 
     shouldBeEnabled = [userDefaults boolForKey:@"qlogShowViewer"];
@@ -218,6 +500,24 @@
         self->_showViewer = shouldBeEnabled;
         [self didChangeValueForKey:@"showViewer"];
     }
+
+    // Crash ring.  We open this the first time that logging is enabled, and then 
+    // keep it open.  We do this last, so that the recovered entries go to the 
+    // log file, and through the flusher thread, if those are configured.
+
+    if ( self->_enabled && (self->_crashRing == nil) ) {
+        SGQLogCrashRing *   crashRing;
+
+        crashRing = [[SGQLogCrashRing alloc] initWithPath:[self pathToCrashRing] slotCount:QLOG_CRASH_RING_SLOT_COUNT];
+        if (crashRing != nil) {
+            [self recoverCrashRingEntries:crashRing.recoveredEntries];
+
+            // Make sure the ring is fully set up before any other thread sees it.
+
+            OSMemoryBarrier();
+            self->_crashRing = crashRing;
+        }
+    }
 }
 
 - (void)preferencesChanged:(NSNotification *)note
@@ -229,6 +529,32 @@
     [self setupFromPreferences];
 }
 
+- (void)clockMayHaveChanged:(NSNotification *)note
+    // Called when the app wakes up or the system time changes.  The device may 
+    // have been asleep, during which time the monotonic clock stood still, so 
+    // check the precise timestamp anchor straight away rather than waiting for 
+    // the next periodic check.
+{
+    #pragma unused(note)
+    OSSpinLockLock(&sClockLock);
+    CheckClockAnchor(mach_absolute_time());
+    OSSpinLockUnlock(&sClockLock);
+}
+
+- (void)applicationMayExit:(NSNotification *)note
+    // Called when the app goes into the background or is about to terminate.  
+    // Either way the process may go away without further notice, so flush 
+    // everything and tell the crash ring that there's nothing to recover.  We set 
+    // the flag before flushing; see the comment in -addPendingRecordNoCopy:length:.
+{
+    #pragma unused(note)
+    assert([NSThread isMainThread]);
+    if (self->_crashRing != nil) {
+        self->_crashRing.cleanShutdown = YES;
+    }
+    [self flush];
+}
+
 @synthesize enabled = _enabled;
 
 - (BOOL)isLoggingToFile
@@ -246,64 +572,329 @@
 
 @synthesize showViewer      = _showViewer;
 
-- (void)logWithFormat:(NSString *)format arguments:(va_list)argList
-    // See comment in header.
-{
-    NSString *  formattedArgs;
-    NSString *  newEntry;
-    
+@synthesize deferredFormatting = _deferredFormatting;
+
+@synthesize preciseTimestamps = _preciseTimestamps;
+
+static void GetStamp(BOOL precise, SGQLogStamp * stamp)
+    // Fills in the stamp for an entry being logged by the current thread.  If 
+    // precise is set, the time comes from the monotonic clock, with nanosecond 
+    // resolution; otherwise it's the wall clock, with microsecond resolution.
+    //
     // Can be called on any thread.
-    
-    if (self->_enabled) {
-        BOOL            success;
+{
+    uintptr_t   threadSequence;
+
+    if (precise) {
+        uint64_t        nowTicks;
+        uint64_t        baseTicks;
+        struct timespec baseTime;
+        uint64_t        elapsed;
+
+        // Read the clock inside the lock, so that it's never earlier than an 
+        // anchor set by another thread.
+
+        OSSpinLockLock(&sClockLock);
+        nowTicks = mach_absolute_time();
+        if ( (nowTicks - sClockCheckTicks) >= sClockCheckIntervalTicks ) {
+            CheckClockAnchor(nowTicks);
+        }
+        baseTicks = sClockBaseTicks;
+        baseTime  = sClockBaseTime;
+        OSSpinLockUnlock(&sClockLock);
+
+        elapsed = NanosecondsForTicks(nowTicks - baseTicks);
+        elapsed += (uint64_t) baseTime.tv_nsec;
+        stamp->time.tv_sec  = baseTime.tv_sec + (time_t) (elapsed / 1000000000);
+        stamp->time.tv_nsec = (long) (elapsed % 1000000000);
+    } else {
         struct timeval  now;
-        struct tm       localNow;
-        char            sequenceNumberStr[32];
-        char            dateTimeStr[32];
-        
-        // Create the log entry.  Note that the log entry header is formatted to look like the 
-        // result of NSLog.
 
-        formattedArgs = [[[NSString alloc] initWithFormat:format arguments:argList] autorelease];
-        assert(formattedArgs != nil);
+        if (gettimeofday(&now, NULL) == 0) {
+            stamp->time.tv_sec  = now.tv_sec;
+            stamp->time.tv_nsec = now.tv_usec * 1000;
+        } else {
+            stamp->time.tv_sec  = -1;
+            stamp->time.tv_nsec = 0;
+        }
+    }
+    stamp->precise = precise;
+    stamp->option = -1;
+    stamp->crashRingIndex = -1;
+    stamp->thread = (uint32_t) pthread_mach_thread_np(pthread_self());
+
+    // Only the current thread touches its counter, so no atomics are required.
+
+    threadSequence = (uintptr_t) pthread_getspecific(sThreadSequenceKey) + 1;
+    (void) pthread_setspecific(sThreadSequenceKey, (const void *) threadSequence);
+    stamp->threadSequence = (uint32_t) threadSequence;
+
+    #if QLOG_ADD_SEQUENCE_NUMBERS
+        static uint64_t sLastSequenceNumber;
+        stamp->sequenceNumber = (uint64_t) OSAtomicAdd64(1, (int64_t *) &sLastSequenceNumber);
+    #else
+        stamp->sequenceNumber = 0;
+    #endif
+}
+
+static OSSpinLock   sDateTimeCacheLock = OS_SPINLOCK_INIT;
+static time_t       sDateTimeCacheSeconds = -1;                 // protected by sDateTimeCacheLock
+static char         sDateTimeCacheStr[32];                      // protected by sDateTimeCacheLock
+
+static void FormatDateTime(time_t seconds, char * dateTimeStr, size_t dateTimeStrSize)
+    // Formats seconds as "YYYY-MM-DD HH:MM:SS" local time.  Log entries come in 
+    // bursts, so we cache the result for the most recent second; that saves a 
+    // localtime_r and strftime_l for all but the first entry in each second.
+    //
+    // Can be called on any thread.
+{
+    BOOL        success;
+    struct tm   localNow;
 
-        success = gettimeofday(&now, NULL) == 0;
+    OSSpinLockLock(&sDateTimeCacheLock);
+    success = (seconds == sDateTimeCacheSeconds);
+    if (success) {
+        strlcpy(dateTimeStr, sDateTimeCacheStr, dateTimeStrSize);
+    }
+    OSSpinLockUnlock(&sDateTimeCacheLock);
+
+    if ( ! success ) {
+        success = (seconds != -1);
+        if (success) {
+            success = localtime_r(&seconds, &localNow) != NULL;
+        }
         if (success) {
-            success = localtime_r(&now.tv_sec, &localNow) != NULL;
+            success = strftime_l(dateTimeStr, dateTimeStrSize, "%Y-%m-%d %H:%M:%S", &localNow, NULL) != 0;
         }
         if (success) {
-            success = strftime_l(dateTimeStr, sizeof(dateTimeStr), "%Y-%m-%d %H:%M:%S", &localNow, NULL) != 0;
+            OSSpinLockLock(&sDateTimeCacheLock);
+            sDateTimeCacheSeconds = seconds;
+            strlcpy(sDateTimeCacheStr, dateTimeStr, sizeof(sDateTimeCacheStr));
+            OSSpinLockUnlock(&sDateTimeCacheLock);
+        } else {
+            strlcpy(dateTimeStr, "?", dateTimeStrSize);
+        }
+    }
+}
+
+static void FormatHeader(const SGQLogStamp * stamp, char * header, size_t headerSize)
+    // Formats the header for an entry with the specified stamp.  The header is 
+    // formatted to look like the result of NSLog, with the thread's sequence id 
+    // appended to the thread number.  Precise stamps get nanoseconds rather than 
+    // milliseconds.  Entries logged with -logOption:xxx get their "[opt<option>] " 
+    // tag here, after the header.  The sequence number is ignored unless 
+    // QLOG_ADD_SEQUENCE_NUMBERS is set.
+    //
+    // Can be called on any thread.
+{
+    char            sequenceNumberStr[32];
+    char            dateTimeStr[32];
+    char            optionStr[16];
+
+    assert(stamp != NULL);
+    assert(header != NULL);
+
+    FormatDateTime(stamp->time.tv_sec, dateTimeStr, sizeof(dateTimeStr));
+    
+    #if QLOG_ADD_SEQUENCE_NUMBERS
+        snprintf(sequenceNumberStr, sizeof(sequenceNumberStr), "%llu ", (unsigned long long) stamp->sequenceNumber);
+    #else
+        sequenceNumberStr[0] = 0;
+    #endif
+
+    if (stamp->option >= 0) {
+        snprintf(optionStr, sizeof(optionStr), "[opt%u] ", (unsigned int) stamp->option);
+    } else {
+        optionStr[0] = 0;
+    }
+
+    (void) snprintf(header, headerSize, "%s%s.%0*ld %s[%d:%x#%u] %s", 
+        sequenceNumberStr, 
+        dateTimeStr, 
+        stamp->precise ? 9 : 3, 
+        stamp->precise ? stamp->time.tv_nsec : (stamp->time.tv_nsec / 1000000), 
+        getprogname(), 
+        (int) getpid(), 
+        (unsigned int) stamp->thread, 
+        (unsigned int) stamp->threadSequence, 
+        optionStr
+    );
+}
+
+- (NSString *)entryWithMessage:(NSString *)message stamp:(const SGQLogStamp *)stamp
+    // Returns a complete log entry for the message, adding the header described 
+    // by the stamp.
+    //
+    // Can be called on any thread.
+{
+    NSString *      result;
+    char            header[128];
+
+    assert(message != nil);
+    assert(stamp != NULL);
+
+    FormatHeader(stamp, header, sizeof(header));
+    
+    result = [NSString stringWithFormat:@"%s%@", header, message];
+    assert(result != nil);
+
+    return result;
+}
+
+- (void)addPendingRecordNoCopy:(void *)bytes length:(size_t)length
+    // Adds a record, which the ring buffer takes ownership of, to the pending entries 
+    // and, if no flush is scheduled, tells the main thread (or the flusher thread) 
+    // about it.  It's important that we schedule the flush after adding the entry; 
+    // -drainPendingEntriesWithCrashRingIndexes: clears _flushScheduled before it drains, so either it 
+    // sees our entry or we see the cleared flag.
+    //
+    // Likewise, we clear the crash ring's cleanShutdown flag after adding the entry; 
+    // -applicationMayExit: sets it before it flushes, so either that flush sees our 
+    // entry or the flag stays clear.
+    //
+    // Can be called on any thread.
+{
+    SGQLogCrashRing *   crashRing;
+
+    (void) [self->_pendingEntries addRecordWithBytesNoCopy:bytes length:length];
+    crashRing = self->_crashRing;
+    if ( (crashRing != nil) && crashRing.cleanShutdown ) {
+        crashRing.cleanShutdown = NO;
+    }
+    if ( ! self->_flushingInBackground ) {
+        if ( OSAtomicCompareAndSwap32Barrier(0, 1, &self->_flushScheduled) ) {
+            [self performSelectorOnMainThread:@selector(flush) withObject:nil waitUntilDone:NO];
+        }
+    } else {
+        if ( OSAtomicCompareAndSwap32Barrier(0, 1, &self->_flushScheduled) ) {
+            [self performSelector:@selector(scheduleBackgroundFlush) onThread:self->_flusherThread withObject:nil waitUntilDone:NO];
         }
-        if ( ! success ) {
-            strlcpy(dateTimeStr, "?", sizeof(dateTimeStr));
+        
+        // If a large batch has built up, don't wait for the timer.
+        
+        if ( ([self->_pendingEntries approximateCount] >= QLOG_BACKGROUND_FLUSH_BATCH_SIZE) && OSAtomicCompareAndSwap32Barrier(0, 1, &self->_batchFlushScheduled) ) {
+            [self performSelector:@selector(flushOnFlusherThread) onThread:self->_flusherThread withObject:nil waitUntilDone:NO];
+        }
+    }
+}
+
+- (void)addBinaryRecordToCrashRing:(const void *)record length:(size_t)length atIndex:(int64_t)index
+    // Adds an entry to the crash ring in deferred formatting mode.  We don't have 
+    // the formatted message, and don't want to pay to format it, or even its 
+    // header, so we record a persistent copy of the binary record.  That's 
+    // rendered if the entry is recovered.
+    //
+    // Can be called on any thread.
+{
+    uint8_t         buffer[512];
+    struct iovec    part;
+
+    assert(self->_crashRing != nil);
+    assert(index >= 0);
+
+    part.iov_base = buffer;
+    part.iov_len  = SGQLogBinaryRecordCopyPersistent(record, length, buffer, MIN(sizeof(buffer), self->_crashRing.maximumEntryLength));
+    [self->_crashRing addEntryWithParts:&part count:1 atIndex:index];
+}
+
+- (void)logWithOption:(int32_t)option format:(NSString *)format arguments:(va_list)argList
+    // The common code behind -logWithFormat:arguments: and 
+    // -logOption:withFormat:arguments:.  option is -1 for the former.  The option 
+    // goes into the entry's stamp, so FormatHeader adds the "[opt<option>] " tag 
+    // when the entry is rendered and the format string is passed through untouched.
+    //
+    // Can be called on any thread.
+{
+    NSString *      formattedArgs;
+    NSString *      newEntry;
+    const char *    newEntryUTF8;
+    size_t          newEntryLength;
+    void *          record;
+    size_t          recordHeaderSize;
+    SGQLogStamp     stamp;
+    SGQLogCrashRing * crashRing;
+    
+    // Can be called on any thread.
+    
+    if (self->_enabled) {
+        GetStamp(self->_preciseTimestamps, &stamp);
+        stamp.option = option;
+
+        // Claim the entry's crash ring slot up front, so that the pending record 
+        // can carry the slot's index.
+
+        crashRing = self->_crashRing;
+        if (crashRing != nil) {
+            stamp.crashRingIndex = [crashRing reserveEntryIndex];
         }
+
+        // In deferred formatting mode, just capture the arguments and leave the 
+        // formatting to -flush.  We can't do that if we're logging to stderr, 
+        // because that needs the formatted entry right now, or if the format 
+        // isn't one that SGQLogBinaryRecordCreate supports.
         
-        #if QLOG_ADD_SEQUENCE_NUMBERS
-            static uint64_t sLastSequenceNumber;
-            snprintf(sequenceNumberStr, sizeof(sequenceNumberStr), "%llu ", (unsigned long long) OSAtomicAdd64(1, (int64_t *) &sLastSequenceNumber));
-        #else
-            sequenceNumberStr[0] = 0;
-        #endif
+        if ( self->_deferredFormatting && ! self->_loggingToStdErr ) {
+            record = SGQLogBinaryRecordCreate(format, argList, &stamp, &newEntryLength);
+            if (record != NULL) {
+                if (stamp.crashRingIndex >= 0) {
+                    [self addBinaryRecordToCrashRing:record length:newEntryLength atIndex:stamp.crashRingIndex];
+                }
+                [self addPendingRecordNoCopy:record length:newEntryLength];
+                return;
+            }
+        }
         
-        newEntry = [NSString stringWithFormat:@"%s%s.%03d %s[%d:%x] %@", sequenceNumberStr, dateTimeStr, (int) (now.tv_usec / 1000), getprogname(), (int) getpid(), (unsigned int) mach_thread_self(), formattedArgs];
+        // Create the log entry.
+
+        formattedArgs = [[[NSString alloc] initWithFormat:format arguments:argList] autorelease];
+        assert(formattedArgs != nil);
+
+        newEntry = [self entryWithMessage:formattedArgs stamp:&stamp];
         assert(newEntry != nil);
         
-        // Add the log entry to the list of new entries and, if this is the first 
-        // element in the list, tell the main thread about it.
+        newEntryUTF8 = [newEntry UTF8String];
+        assert(newEntryUTF8 != NULL);
+        newEntryLength = strlen(newEntryUTF8);
+
+        // Add the log entry to the crash ring and then to the pending entries.  
+        // If it's in the ring, the pending record is tagged with its index.
+
+        recordHeaderSize = 0;
+        if (stamp.crashRingIndex >= 0) {
+            struct iovec    part;
+
+            part.iov_base = (void *) newEntryUTF8;
+            part.iov_len  = newEntryLength;
+            [crashRing addEntryWithParts:&part count:1 atIndex:stamp.crashRingIndex];
+
+            recordHeaderSize = kIndexedTextRecordHeaderSize;
+        }
         
-        @synchronized (self) {
-            [self->_pendingEntries addObject:newEntry];
-            if ([self->_pendingEntries count] == 1) {
-                [self performSelectorOnMainThread:@selector(flush) withObject:nil waitUntilDone:NO];
+        record = malloc(recordHeaderSize + newEntryLength + 1);
+        assert(record != NULL);
+        if (record != NULL) {
+            if (recordHeaderSize != 0) {
+                ((uint8_t *) record)[0] = kIndexedTextRecordMarker;
+                memcpy( ((uint8_t *) record) + 1, &stamp.crashRingIndex, sizeof(stamp.crashRingIndex));
             }
+            memcpy( ((uint8_t *) record) + recordHeaderSize, newEntryUTF8, newEntryLength);
+            [self addPendingRecordNoCopy:record length:recordHeaderSize + newEntryLength];
         }
         
         if (self.isLoggingToStdErr) {
-            fprintf(stderr, "%s\n", [newEntry UTF8String]);
+            fprintf(stderr, "%s\n", newEntryUTF8);
         }
     }
 }
 
+- (void)logWithFormat:(NSString *)format arguments:(va_list)argList
+    // See comment in header.
+{
+    // Can be called on any thread.
+
+    [self logWithOption:-1 format:format arguments:argList];
+}
+
 - (void)logWithFormat:(NSString *)format, ...
     // See comment in header.
 {
@@ -322,7 +913,7 @@
     // See comment in header.
 {
     if ( self->_enabled && (self->_optionsMask & (1 << option)) ) {
-        [self logWithFormat:format arguments:argList];
+        [self logWithOption:(int32_t) option format:format arguments:argList];
     }
 }
 
@@ -333,128 +924,288 @@
 
     if ( self->_enabled && (self->_optionsMask & (1 << option)) ) {
         va_start(argList, format);
-        [self logWithFormat:format arguments:argList];
+        [self logOption:option withFormat:format arguments:argList];
         va_end(argList);
     }
 }
 
-@synthesize logEntries = _logEntries;
+static const char * kLevelNames[] = { "D", "I", "N", "W", "E", "F" };
 
-- (NSData *)dataForLogEntries:(NSArray *)entries
-    // Flattens the supplied array of log entries to a data object containing 
-    // LF terminated UTF-8 strings.
+- (void)logLevel:(SGQLogLevel)level subsystem:(NSString *)subsystem fields:(NSDictionary *)fields withFormat:(NSString *)format arguments:(va_list)argList
+    // See comment in header.
 {
-    NSMutableData *     result;
-    
-    result = [NSMutableData dataWithCapacity:[entries count] * 80];
-    assert(result != nil);
+    NSString *          message;
+    NSMutableString *   fieldsString;
 
-    for (NSString * entry in entries) {
-        NSData *        entryData;
-        
-        assert([entry isKindOfClass:[NSString class]]);
+    assert(level < kSGQLogLevelNone);
+    assert(subsystem != nil);
+    assert(format != nil);
 
-        entryData = [entry dataUsingEncoding:NSUTF8StringEncoding];
-        assert(entryData != nil);
-        
-        [result appendData:entryData];
-        [result appendBytes:"\n" length:1];
+    if ( self->_enabled && (level >= self->_minimumLevel) && (level < kSGQLogLevelNone) ) {
+        message = [[NSString alloc] initWithFormat:format arguments:argList];
+        assert(message != nil);
+
+        // Render the fields sorted by key, so that the output is stable.
+
+        fieldsString = nil;
+        if ([fields count] != 0) {
+            fieldsString = [NSMutableString string];
+            assert(fieldsString != nil);
+
+            for (id key in [[fields allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+                [fieldsString appendFormat:@" %@=%@", key, [fields objectForKey:key]];
+            }
+        }
+
+        [self logWithFormat:@"%s [%@] %@%@", kLevelNames[level], subsystem, message, (fieldsString != nil) ? fieldsString : @""];
+
+        [message release];
     }
-    return result;
 }
 
-- (void)flush
+- (void)logLevel:(SGQLogLevel)level subsystem:(NSString *)subsystem fields:(NSDictionary *)fields withFormat:(NSString *)format, ...
     // See comment in header.
 {
-    NSArray *       entriesToAdd;
-    NSIndexSet *    indexSet;
-    int             junk;
-    struct stat     sb;
-    
-    assert([NSThread isMainThread]);
-    
-    // Steal the entries from the _pendingEntries array.
-    
-    @synchronized (self) {
-        entriesToAdd = [[self->_pendingEntries copy] autorelease];
-        [self->_pendingEntries removeAllObjects];
+    va_list     argList;
+
+    if ( self->_enabled && (level >= self->_minimumLevel) ) {
+        va_start(argList, format);
+        [self logLevel:level subsystem:subsystem fields:fields withFormat:format arguments:argList];
+        va_end(argList);
     }
+}
+
+@synthesize minimumLevel = _minimumLevel;
+
+@synthesize logEntries = _logEntries;
 
-    // We might have no pending log entries (because of someone calling us directly, 
-    // rather than the logging code calling us via -performSelectorOnMainThread:xxx), 
-    // so we only do the rest of this code if we actually got some log entries.
+- (NSUInteger)memoryEntryCapacity
+    // See comment in header.
+{
+    return self->_logEntries.capacity;
+}
+
+- (uint64_t)droppedEntryCount
+    // See comment in header.
+{
+    return self->_pendingEntries.droppedCount;
+}
+
+- (NSData *)dataForLogEntries:(NSArray *)entries
+    // Flattens the supplied array of log entries to a data object containing 
+    // LF terminated UTF-8 strings.
+{
+    NSMutableData *     result;
     
-    if ([entriesToAdd count] != 0) {
+    result = [NSMutableData dataWithCapacity:[entries count] * 80];
+    assert(result != nil);
 
-        // Add the entries to the in-memory log.
+    for (NSString * entry in entries) {
+        NSData *        entryData;
         
-        indexSet = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange([self->_logEntries count], [entriesToAdd count])];
-        assert(indexSet != nil);
-
-        [self willChange:NSKeyValueChangeInsertion valuesAtIndexes:indexSet forKey:@"logEntries"];
-        [self->_logEntries addObjectsFromArray:entriesToAdd];
-        [self  didChange:NSKeyValueChangeInsertion valuesAtIndexes:indexSet forKey:@"logEntries"];
+        assert([entry isKindOfClass:[NSString class]]);
 
-        // If we've hit the limit of the in-memory log, prune it now.  We do this after adding 
-        // the new entries so that if there are more than 100 new entries we still clip correctly.
+        entryData = [entry dataUsingEncoding:NSUTF8StringEncoding];
+        assert(entryData != nil);
         
-        if ([self->_logEntries count] > 100) {
-            indexSet = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, [self->_logEntries count] - 100)];
-            assert(indexSet != nil);
+        [result appendData:entryData];
+        [result appendBytes:"\n" length:1];
+    }
+    return result;
+}
 
-            [self willChange:NSKeyValueChangeRemoval valuesAtIndexes:indexSet forKey:@"logEntries"];
-            [self->_logEntries removeObjectsAtIndexes:indexSet];
-            [self  didChange:NSKeyValueChangeRemoval valuesAtIndexes:indexSet forKey:@"logEntries"];
+- (NSArray *)drainPendingEntriesWithCrashRingIndexes:(NSData **)crashRingIndexesPtr
+    // Drains the pending entries ring buffer, returning the entries as an array of 
+    // strings.  If any entries were dropped since the last drain, a synthetic entry 
+    // recording that fact is added to the end of the array.  *crashRingIndexesPtr 
+    // is set to the crash ring indexes (as an array of int64_t) of those entries 
+    // that are in the crash ring.
+    //
+    // This runs on the main thread or, when flushing in the background, on the 
+    // flusher thread.  The ring buffer only supports one consumer at a time, so 
+    // we serialise on it; in practice there's only ever contention while 
+    // flushingInBackground is changing.
+{
+    NSMutableArray *    result;
+    NSMutableData *     crashRingIndexes;
+    NSArray *           records;
+    uint64_t            droppedCount;
+
+    assert(crashRingIndexesPtr != NULL);
+
+    // Clear the flush scheduled flags before draining; see the comment in 
+    // -addPendingRecordNoCopy:length:.
+
+    (void) OSAtomicCompareAndSwap32Barrier(1, 0, &self->_flushScheduled);
+    (void) OSAtomicCompareAndSwap32Barrier(1, 0, &self->_batchFlushScheduled);
+
+    @synchronized (self->_pendingEntries) {
+        records = [self->_pendingEntries drainRecords];
+        assert(records != nil);
+
+        result = [NSMutableArray arrayWithCapacity:[records count] + 1];
+        assert(result != nil);
+        crashRingIndexes = [NSMutableData dataWithCapacity:[records count] * sizeof(int64_t)];
+        assert(crashRingIndexes != nil);
+
+        droppedCount = self->_pendingEntries.droppedCount;
+        droppedCount -= self->_droppedEntriesReported;
+        self->_droppedEntriesReported += droppedCount;
+    }
+
+    for (NSData * record in records) {
+        NSString *      entry;
+        const uint8_t * recordBytes;
+        int64_t         crashRingIndex;
+
+        recordBytes = [record bytes];
+        crashRingIndex = -1;
+        if ( SGQLogIsBinaryRecord(recordBytes, [record length]) ) {
+            NSString *      message;
+            SGQLogStamp     stamp;
+
+            // A deferred formatting record; this is where it finally gets formatted.
+
+            message = SGQLogBinaryRecordCopyMessage(recordBytes, [record length], &stamp);
+            assert(message != nil);
+
+            entry = [[self entryWithMessage:message stamp:&stamp] retain];
+            [message release];
+            crashRingIndex = stamp.crashRingIndex;
+        } else if ( ([record length] >= kIndexedTextRecordHeaderSize) && (recordBytes[0] == kIndexedTextRecordMarker) ) {
+            memcpy(&crashRingIndex, &recordBytes[1], sizeof(crashRingIndex));
+            entry = [[NSString alloc] initWithBytes:&recordBytes[kIndexedTextRecordHeaderSize] length:[record length] - kIndexedTextRecordHeaderSize encoding:NSUTF8StringEncoding];
+        } else {
+            entry = [[NSString alloc] initWithData:record encoding:NSUTF8StringEncoding];
         }
-        
-        // If we're logging to a file, add the entries to the on-disk log.
-        
-        if (self->_logFile != -1) {
-            int                 err;
-            NSData *            dataToWrite;
-            NSUInteger          bytesToWrite;
-            NSUInteger          bytesWrittenSoFar;
-            const char *        buf;
-            
-            err = 0;
-            
-            // Flatten the array of strings into a single blob of UTF-8 data.
-            
-            dataToWrite = [self dataForLogEntries:entriesToAdd];
-            assert(dataToWrite != nil);
-        
-            // Write that data to the file.
-            
-            bytesToWrite = [dataToWrite length];
-            bytesWrittenSoFar = 0;
-            buf = [dataToWrite bytes];
-            do {
-                ssize_t     bytesWritten;
-                
-                if (bytesWrittenSoFar == bytesToWrite) {
-                    break;
-                }
-                bytesWritten = write(self->_logFile, &buf[bytesWrittenSoFar], bytesToWrite - bytesWrittenSoFar);
-                if (bytesWritten > 0) {
-                    bytesWrittenSoFar += (NSUInteger)bytesWritten;
-                } else {
-                    assert(bytesWritten != 0);
-                    err = errno;
-                    
-                    if (err == EINTR) {
-                        err = 0;
-                    } else {
+        assert(entry != nil);
+        if (entry != nil) {
+            [result addObject:entry];
+            [entry release];
+            if (crashRingIndex >= 0) {
+                [crashRingIndexes appendBytes:&crashRingIndex length:sizeof(crashRingIndex)];
+            }
+        }
+    }
+
+    if (droppedCount != 0) {
+        SGQLogStamp     stamp;
+        NSString *      message;
+
+        GetStamp(self->_preciseTimestamps, &stamp);
+        message = [NSString stringWithFormat:@"QLog dropped %llu entries", (unsigned long long) droppedCount];
+        [result addObject:[self entryWithMessage:message stamp:&stamp]];
+    }
+
+    *crashRingIndexesPtr = crashRingIndexes;
+    return result;
+}
+
+static BOOL WriteAllV(int fd, struct iovec * iov, int iovCount)
+    // A wrapper around writev that handles short writes and EINTR.  Note that 
+    // this modifies the iovec array.
+{
+    int     err;
+
+    err = 0;
+    while (iovCount != 0) {
+        ssize_t     bytesWritten;
+
+        bytesWritten = writev(fd, iov, iovCount);
+        if (bytesWritten > 0) {
+
+            // Skip the iovecs that were completely written and adjust the one 
+            // that was partially written, if any.
+
+            while ( (iovCount != 0) && ((size_t) bytesWritten >= iov->iov_len) ) {
+                bytesWritten -= (ssize_t) iov->iov_len;
+                iov += 1;
+                iovCount -= 1;
+            }
+            if (iovCount != 0) {
+                iov->iov_base = ((char *) iov->iov_base) + bytesWritten;
+                iov->iov_len -= (size_t) bytesWritten;
+            }
+        } else {
+            assert(bytesWritten != 0);
+            err = errno;
+            if (err == EINTR) {
+                err = 0;
+            } else {
+                break;
+            }
+        }
+    }
+    return (err == 0);
+}
+
+- (void)writeEntriesToLogFile:(NSArray *)entries crashRingIndexes:(NSData *)crashRingIndexes
+    // Appends the entries, as LF terminated UTF-8, to the log file, if there is one.  
+    // We gather the entries with writev rather than flattening them into one big 
+    // buffer.  Once they're written, we mark the entries' crash ring slots (as 
+    // returned by -drainPendingEntriesWithCrashRingIndexes:) as flushed, so that 
+    // they aren't recovered after a crash.
+    //
+    // Can be called on any thread.  We hold the @synchronized (self) lock while we 
+    // write so that the main thread can't close or truncate the file underneath us.
+{
+    enum { kMaxIOVecs = 512 };         // must be even and no more than IOV_MAX
+    struct iovec    iov[kMaxIOVecs];
+    int             iovCount;
+    BOOL            success;
+    int             junk;
+    struct stat     sb;
+
+    assert(entries != nil);
+    assert(crashRingIndexes != nil);
+
+    @synchronized (self) {
+        if ( (self->_logFile != -1) && ([entries count] != 0) ) {
+            success  = YES;
+            iovCount = 0;
+            for (NSString * entry in entries) {
+                const char *    entryUTF8;
+
+                assert([entry isKindOfClass:[NSString class]]);
+
+                entryUTF8 = [entry UTF8String];
+                assert(entryUTF8 != NULL);
+
+                iov[iovCount].iov_base = (void *) entryUTF8;
+                iov[iovCount].iov_len  = strlen(entryUTF8);
+                iov[iovCount + 1].iov_base = "\n";
+                iov[iovCount + 1].iov_len  = 1;
+                iovCount += 2;
+
+                if (iovCount == kMaxIOVecs) {
+                    success = WriteAllV(self->_logFile, iov, iovCount);
+                    iovCount = 0;
+                    if ( ! success ) {
                         break;
                     }
                 }
-            } while (YES);
+            }
+            if ( success && (iovCount != 0) ) {
+                success = WriteAllV(self->_logFile, iov, iovCount);
+            }
             
             // I have no idea what to do with an error at this point.  Right now, I'm just 
             // going to ignore it in production code.
             
-            assert(err == 0);
+            assert(success);
+
+            if ( success && (self->_crashRing != nil) ) {
+                const int64_t * indexes;
+                NSUInteger      indexCount;
+
+                indexes = [crashRingIndexes bytes];
+                indexCount = [crashRingIndexes length] / sizeof(int64_t);
+                for (NSUInteger i = 0; i < indexCount; i++) {
+                    [self->_crashRing markEntryFlushedAtIndex:indexes[i]];
+                }
+            }
 
-            // Once we've written out the entire buffer, update the log file length.  
+            // Once we've written out all the entries, update the log file length.  
             // We do this at the end to ensure that the client sees only complete 
             // log records.  Also, we get the length from the file rather than keeping 
             // track of it ourself so that things can't possibly get too far out of 
@@ -465,45 +1216,551 @@
             
             self->_logFileLength = sb.st_size;
             assert(self->_logFileLength >= 0);
+
+            if ( (self->_logFileLength >= QLOG_LOG_FILE_MAX_SIZE) || ((time(NULL) - self->_logFileCreationTime) >= QLOG_LOG_FILE_MAX_AGE) ) {
+                [self rotateLogFile];
+            }
         }
     }
 }
 
-- (void)clear
-    // See comment in header.
+#pragma mark * Rotation
+
+- (void)rotateLogFile
+    // Closes the current log file, renames it out of the way, and starts a new one. 
+    // The closed segment is then compressed by the archive queue.  Renaming and 
+    // reopening is quick, which is important because we're called with the 
+    // @synchronized (self) lock held.
 {
+    NSString *      logPath;
+    NSString *      closedPath;
+    int             junk;
+
+    assert(self->_logFile != -1);
+
+    logPath = self.pathToLogFile;
+    assert(logPath != nil);
+
+    self->_closedSegmentCount += 1;
+    closedPath = [[logPath stringByDeletingPathExtension] stringByAppendingFormat:@".closed-%u.log", (unsigned int) self->_closedSegmentCount];
+    assert(closedPath != nil);
+
+    junk = close(self->_logFile);
+    assert(junk == 0);
+    self->_logFile = -1;
+
+    junk = rename([logPath fileSystemRepresentation], [closedPath fileSystemRepresentation]);
+    assert(junk == 0);
+    if (junk == 0) {
+        [self->_closedSegmentPaths addObject:closedPath];
+        [self->_archiveQueue addOperation:[[[NSInvocationOperation alloc] initWithTarget:self selector:@selector(archiveClosedSegmentAtPath:) object:closedPath] autorelease]];
+    }
+
+    // If the rename failed, we reopen (and truncate) the existing file; losing 
+    // the old log is better than letting it grow without bound.
+
+    self->_logFile = open([logPath fileSystemRepresentation], O_RDWR | O_CREAT | O_APPEND | O_TRUNC, DEFFILEMODE);
+    assert(self->_logFile != -1);
+
+    self->_logFileLength = 0;
+    self->_logFileCreationTime = time(NULL);
+}
+
+static BOOL CompressFile(NSString * sourcePath, NSString * destinationPath)
+    // gzip compresses the file at sourcePath into a new file at destinationPath.
+{
+    BOOL        success;
+    int         sourceFile;
+    gzFile      destinationFile;
+    int         err;
+
+    destinationFile = NULL;
+    sourceFile = open([sourcePath fileSystemRepresentation], O_RDONLY);
+    success = (sourceFile >= 0);
+    if (success) {
+        destinationFile = gzopen([destinationPath fileSystemRepresentation], "wb");
+        success = (destinationFile != NULL);
+    }
+    while (success) {
+        uint8_t     buffer[32768];
+        ssize_t     bytesRead;
+
+        bytesRead = read(sourceFile, buffer, sizeof(buffer));
+        if (bytesRead > 0) {
+            success = (gzwrite(destinationFile, buffer, (unsigned int) bytesRead) == bytesRead);
+        } else if (bytesRead == 0) {
+            break;
+        } else if (errno != EINTR) {
+            success = NO;
+        }
+    }
+    if (destinationFile != NULL) {
+        err = gzclose(destinationFile);
+        success = success && (err == Z_OK);
+    }
+    if (sourceFile >= 0) {
+        err = close(sourceFile);
+        assert(err == 0);
+    }
+    return success;
+}
+
+- (void)archiveClosedSegmentAtPath:(NSString *)closedPath
+    // Runs on the archive queue to compress a closed segment and shuffle it into 
+    // the list of archived segments.  The compression is done without the lock 
+    // held; the shuffle, which is just a few renames, is done with it held, so 
+    // that -streamForLogIncludingArchives:validToLength: always sees a consistent 
+    // set of segments.
+{
+    NSString *  tmpPath;
+    BOOL        success;
+    int         junk;
+
+    assert(closedPath != nil);
+
+    tmpPath = [closedPath stringByAppendingPathExtension:@"gz"];
+    assert(tmpPath != nil);
+
+    success = CompressFile(closedPath, tmpPath);
+    
+    @synchronized (self) {
+
+        // If -clear ran while we were compressing, the closed segment is no longer 
+        // in _closedSegmentPaths and we just throw away our work.
+
+        if ( success && [self->_closedSegmentPaths containsObject:closedPath] ) {
+            (void) unlink([[self pathToArchivedSegment:QLOG_ARCHIVED_SEGMENT_COUNT] fileSystemRepresentation]);
+            for (NSUInteger segmentNumber = QLOG_ARCHIVED_SEGMENT_COUNT - 1; segmentNumber >= 1; segmentNumber--) {
+                (void) rename([[self pathToArchivedSegment:segmentNumber] fileSystemRepresentation], [[self pathToArchivedSegment:segmentNumber + 1] fileSystemRepresentation]);
+            }
+            junk = rename([tmpPath fileSystemRepresentation], [[self pathToArchivedSegment:1] fileSystemRepresentation]);
+            assert(junk == 0);
+        } else {
+            (void) unlink([tmpPath fileSystemRepresentation]);
+        }
+
+        // If compression failed we lose the segment.  There's not much else we 
+        // can do; we don't want uncompressed segments piling up.
+
+        (void) unlink([closedPath fileSystemRepresentation]);
+        [self->_closedSegmentPaths removeObject:closedPath];
+    }
+}
+
+- (void)recoverClosedSegments
+    // Called by -init to pick up any closed segments left behind by a previous run 
+    // that ended before the archive queue got to them.  _closedSegmentPaths only 
+    // lives in memory, so, without this, those segments would never be compressed, 
+    // and -rotateLogFile, which starts counting from 1 again, would rename the 
+    // new closed segments on top of them.  We queue them for compression, oldest 
+    // first, and carry on numbering from the newest.  We also delete any 
+    // half-written compressed files from compressions that were interrupted.
+{
+    NSString *          logPath;
+    NSString *          logDirPath;
+    NSString *          closedPrefix;
+    NSArray *           fileNames;
+    NSMutableArray *    closedNumbers;
+
+    logPath = self.pathToLogFile;
+    assert(logPath != nil);
+    logDirPath = [logPath stringByDeletingLastPathComponent];
+    closedPrefix = [[[logPath lastPathComponent] stringByDeletingPathExtension] stringByAppendingString:@".closed-"];
+
+    fileNames = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:logDirPath error:NULL];
+
+    closedNumbers = [NSMutableArray array];
+    assert(closedNumbers != nil);
+    for (NSString * fileName in fileNames) {
+        if ( [fileName hasPrefix:closedPrefix] ) {
+            if ( [fileName hasSuffix:@".log.gz"] ) {
+                (void) unlink([[logDirPath stringByAppendingPathComponent:fileName] fileSystemRepresentation]);
+            } else if ( [fileName hasSuffix:@".log"] ) {
+                NSInteger   closedNumber;
+
+                closedNumber = [[fileName substringFromIndex:[closedPrefix length]] integerValue];
+                if (closedNumber > 0) {
+                    [closedNumbers addObject:[NSNumber numberWithInteger:closedNumber]];
+                }
+            }
+        }
+    }
+    [closedNumbers sortUsingSelector:@selector(compare:)];
+
+    @synchronized (self) {
+        for (NSNumber * closedNumber in closedNumbers) {
+            NSString *  closedPath;
+
+            closedPath = [[logPath stringByDeletingPathExtension] stringByAppendingFormat:@".closed-%u.log", (unsigned int) [closedNumber unsignedIntegerValue]];
+            assert(closedPath != nil);
+
+            [self->_closedSegmentPaths addObject:closedPath];
+            [self->_archiveQueue addOperation:[[[NSInvocationOperation alloc] initWithTarget:self selector:@selector(archiveClosedSegmentAtPath:) object:closedPath] autorelease]];
+            self->_closedSegmentCount = [closedNumber unsignedIntegerValue];
+        }
+    }
+}
+
+- (void)changeLogEntriesRemovingOldest:(NSUInteger)removeCount adding:(NSArray *)entries
+    // Makes all changes to logEntries.  Entries are only ever removed from the start 
+    // and added at the end, so the change can be described by two counts, which is 
+    // what we post in SGQLogEntriesDidChangeNotification.  We also trigger the 
+    // equivalent KVO notifications for the benefit of any KVO observers.
+{
+    NSUInteger      addCount;
+    NSIndexSet *    indexSet;
+
     assert([NSThread isMainThread]);
+    assert(removeCount <= [self->_logEntries count]);
+
+    // If there are more new entries than will fit, just keep the newest.
+
+    addCount = [entries count];
+    if (addCount > self->_logEntries.capacity) {
+        entries = [entries subarrayWithRange:NSMakeRange(addCount - self->_logEntries.capacity, self->_logEntries.capacity)];
+        addCount = self->_logEntries.capacity;
+    }
+
+    // Make room for the new entries.
+
+    if ( ([self->_logEntries count] - removeCount + addCount) > self->_logEntries.capacity ) {
+        removeCount = [self->_logEntries count] + addCount - self->_logEntries.capacity;
+    }
+
+    if ( (removeCount != 0) || (addCount != 0) ) {
+        if (removeCount != 0) {
+            indexSet = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, removeCount)];
+            assert(indexSet != nil);
+
+            [self willChange:NSKeyValueChangeRemoval valuesAtIndexes:indexSet forKey:@"logEntries"];
+            [self->_logEntries removeOldestEntries:removeCount];
+            [self  didChange:NSKeyValueChangeRemoval valuesAtIndexes:indexSet forKey:@"logEntries"];
+        }
+        if (addCount != 0) {
+            indexSet = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange([self->_logEntries count], addCount)];
+            assert(indexSet != nil);
+
+            [self willChange:NSKeyValueChangeInsertion valuesAtIndexes:indexSet forKey:@"logEntries"];
+            (void) [self->_logEntries addEntries:entries];
+            [self  didChange:NSKeyValueChangeInsertion valuesAtIndexes:indexSet forKey:@"logEntries"];
+        }
+
+        [[NSNotificationCenter defaultCenter] postNotificationName:SGQLogEntriesDidChangeNotification object:self userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedInteger:removeCount],   SGQLogEntriesRemovedCountKey, 
+            [NSNumber numberWithUnsignedInteger:addCount],      SGQLogEntriesAddedCountKey, 
+            nil
+        ]];
+    }
+}
+
+- (void)addEntriesToLogEntries:(NSArray *)entriesToAdd
+    // Adds the entries to the in-memory log, evicting the oldest entries if there's 
+    // no room.
+{
+    assert([NSThread isMainThread]);
+    assert(entriesToAdd != nil);
+
+    [self changeLogEntriesRemovingOldest:0 adding:entriesToAdd];
+}
+
+#pragma mark * Background flushing
+
+@synthesize flushingInBackground = _flushingInBackground;
+
+- (void)flusherThreadEntry
+    // This thread runs the background flushes.  We add a port to its run loop 
+    // so that -run has a source to wait on, rather than returning immediately.
+{
+    assert( ! [NSThread isMainThread] );
+    [[NSRunLoop currentRunLoop] addPort:[NSMachPort port] forMode:NSDefaultRunLoopMode];
+    while (YES) {
+        NSAutoreleasePool * pool;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+
+        [[NSRunLoop currentRunLoop] run];
+
+        [pool drain];
+    }
+    assert(NO);
+}
+
+- (void)startFlusherThread
+    // Creates and starts the flusher thread.  Once started, it lives for the life 
+    // of the application.
+    //
+    // Called by -setupFromPreferences, so it can be called on any thread during 
+    // -init, and on the main thread thereafter.
+{
+    assert(self->_flusherThread == nil);
+
+    self->_flusherThread = [[NSThread alloc] initWithTarget:self selector:@selector(flusherThreadEntry) object:nil];
+    assert(self->_flusherThread != nil);
+
+    [self->_flusherThread setName:@"QLogFlusherThread"];
+    [self->_flusherThread setThreadPriority:0.1];
+
+    [self->_flusherThread start];
+}
+
+- (void)scheduleBackgroundFlush
+    // Called on the flusher thread when the first entry arrives in the pending 
+    // entries buffer.  We start a timer so that we can batch up entries for a 
+    // while before writing them.
+{
+    assert([NSThread currentThread] == self->_flusherThread);
+
+    if (self->_flusherTimer == nil) {
+        self->_flusherTimer = [[NSTimer scheduledTimerWithTimeInterval:QLOG_BACKGROUND_FLUSH_INTERVAL target:self selector:@selector(flusherTimerDone:) userInfo:nil repeats:NO] retain];
+        assert(self->_flusherTimer != nil);
+    }
+}
+
+- (void)flusherTimerDone:(NSTimer *)timer
+{
+    assert([NSThread currentThread] == self->_flusherThread);
+    assert(timer == self->_flusherTimer);
+    #pragma unused(timer)
+    [self flushOnFlusherThread];
+}
+
+- (void)flushOnFlusherThread
+    // Drains the pending entries, writes them to the log file and queues them up 
+    // for the main thread to add to logEntries.  This is called when the batch 
+    // timer fires, when the pending entries buffer reaches the batch size, and 
+    // synchronously by -flush.
+{
+    NSArray *   entries;
+    NSData *    crashRingIndexes;
+    BOOL        mainThreadNeedsPoke;
+
+    assert([NSThread currentThread] == self->_flusherThread);
+
+    [self->_flusherTimer invalidate];
+    [self->_flusherTimer release];
+    self->_flusherTimer = nil;
+
+    entries = [self drainPendingEntriesWithCrashRingIndexes:&crashRingIndexes];
+    if ([entries count] != 0) {
+        [self writeEntriesToLogFile:entries crashRingIndexes:crashRingIndexes];
+
+        // Rather than poke the main thread for every batch, we accumulate the entries 
+        // and only poke it if it's not already been poked.  This coalesces the KVO 
+        // notifications for logEntries, which can be expensive if the viewer is up.
+
+        @synchronized (self->_backgroundEntries) {
+            mainThreadNeedsPoke = ([self->_backgroundEntries count] == 0);
+            [self->_backgroundEntries addObjectsFromArray:entries];
+        }
+        if (mainThreadNeedsPoke) {
+            [self performSelectorOnMainThread:@selector(publishBackgroundEntries) withObject:nil waitUntilDone:NO];
+        }
+    }
+}
+
+- (void)publishBackgroundEntries
+    // Adds any entries flushed by the flusher thread to logEntries.
+{
+    NSArray *   entries;
+
+    assert([NSThread isMainThread]);
+
+    @synchronized (self->_backgroundEntries) {
+        entries = [[self->_backgroundEntries copy] autorelease];
+        [self->_backgroundEntries removeAllObjects];
+    }
+    [self addEntriesToLogEntries:entries];
+}
+
+#pragma mark * Crash recovery
+
+- (void)recoverCrashRingEntries:(NSArray *)records
+    // Adds the entries recovered from the crash ring to the pending entries.  The 
+    // ring has already left out the entries that made it to the log file, and 
+    // everything if the previous run shut down cleanly, so these are all lost 
+    // entries.
+{
+    NSMutableArray *    lostEntries;
+
+    // any thread; -init calls us via -setupFromPreferences
+    assert(records != nil);
+
+    // Turn the records back into entries.  Entries logged in deferred formatting 
+    // mode are persistent binary records, which we render now.  The rest are 
+    // text.  The ring truncates text on a character boundary, so it should always 
+    // be valid UTF-8.  However, a slot that was overwritten by two producers might 
+    // not be, so fall back to Latin-1, which always works.
+
+    lostEntries = [NSMutableArray arrayWithCapacity:[records count]];
+    assert(lostEntries != nil);
+    for (NSData * record in records) {
+        NSString *  entry;
+
+        if ( SGQLogIsPersistentRecord([record bytes], [record length]) ) {
+            NSString *      message;
+            SGQLogStamp     stamp;
+
+            message = SGQLogPersistentRecordCopyMessage([record bytes], [record length], &stamp);
+            assert(message != nil);
+            entry = [[self entryWithMessage:message stamp:&stamp] retain];
+            [message release];
+        } else {
+            entry = [[NSString alloc] initWithData:record encoding:NSUTF8StringEncoding];
+            if (entry == nil) {
+                entry = [[NSString alloc] initWithData:record encoding:NSISOLatin1StringEncoding];
+            }
+        }
+        assert(entry != nil);
+        if (entry != nil) {
+            [lostEntries addObject:entry];
+            [entry release];
+        }
+    }
+
+    // Queue a marker entry and then the lost entries themselves.  They now 
+    // have headers, so they go in as is.
+
+    if ([lostEntries count] != 0) {
+        SGQLogStamp     stamp;
+        NSString *      marker;
+
+        GetStamp(self->_preciseTimestamps, &stamp);
+        marker = [self entryWithMessage:[NSString stringWithFormat:@"QLog recovered %u entries logged before the previous run ended", (unsigned int) [lostEntries count]] stamp:&stamp];
+        assert(marker != nil);
+
+        for (NSString * entry in [[NSArray arrayWithObject:marker] arrayByAddingObjectsFromArray:lostEntries]) {
+            const char *    entryUTF8;
+            size_t          entryLength;
+            void *          record;
+
+            entryUTF8 = [entry UTF8String];
+            assert(entryUTF8 != NULL);
+            entryLength = strlen(entryUTF8);
+
+            record = malloc( (entryLength != 0) ? entryLength : 1 );
+            assert(record != NULL);
+            if (record != NULL) {
+                memcpy(record, entryUTF8, entryLength);
+                [self addPendingRecordNoCopy:record length:entryLength];
+            }
+        }
+    }
+}
+
+#pragma mark * Flushing
+
+- (void)flush
+    // See comment in header.
+{
+    NSArray *       entriesToAdd;
+    NSData *        crashRingIndexes;
     
-    // First truncate the log file (if any).
+    assert([NSThread isMainThread]);
+
+    // When flushing in the background, we bounce the flush over to the flusher 
+    // thread and wait for it to finish.  This means that, when we return, the 
+    // log file is up to date, which is what -streamForLogValidToLength: expects.
+    // The flusher thread also picks up any entries that were queued for it while 
+    // we were in the immediate mode, and vice versa below.
+
+    if (self->_flusherThread != nil) {
+        [self performSelector:@selector(flushOnFlusherThread) onThread:self->_flusherThread withObject:nil waitUntilDone:YES];
+        [self publishBackgroundEntries];
+    }
+
+    if ( ! self->_flushingInBackground ) {
     
-    if (self->_logFile != -1) {
-        int     junk;
+        // Steal the entries from the pending entries ring buffer.
         
-        junk = ftruncate(self->_logFile, 0);
-        assert(junk == 0);
+        entriesToAdd = [self drainPendingEntriesWithCrashRingIndexes:&crashRingIndexes];
+
+        // We might have no pending log entries (because of someone calling us directly, 
+        // rather than the logging code calling us via -performSelectorOnMainThread:xxx), 
+        // so we only do the rest of this code if we actually got some log entries.
+        
+        // Write the entries out before adding them to logEntries, so that the 
+        // log file is up to date by the time SGQLogEntriesDidChangeNotification 
+        // goes out.  The background path does the same.
         
-        self->_logFileLength = 0;
+        if ([entriesToAdd count] != 0) {
+            [self writeEntriesToLogFile:entriesToAdd crashRingIndexes:crashRingIndexes];
+            [self addEntriesToLogEntries:entriesToAdd];
+        }
+    }
+}
+
+- (void)clear
+    // See comment in header.
+{
+    assert([NSThread isMainThread]);
+    
+    // First truncate the log file (if any).  We synchronise with any background 
+    // flush that's writing to the file.
+    
+    @synchronized (self) {
+        if (self->_logFile != -1) {
+            int     junk;
+            
+            junk = ftruncate(self->_logFile, 0);
+            assert(junk == 0);
+            
+            self->_logFileLength = 0;
+            self->_logFileCreationTime = time(NULL);
+        }
+
+        // Then delete any rotated segments.  Any segments that are still being 
+        // compressed are deleted by -archiveClosedSegmentAtPath: once it notices 
+        // that they're no longer in _closedSegmentPaths.
+
+        for (NSString * closedPath in self->_closedSegmentPaths) {
+            (void) unlink([closedPath fileSystemRepresentation]);
+        }
+        [self->_closedSegmentPaths removeAllObjects];
+        for (NSUInteger segmentNumber = 1; segmentNumber <= QLOG_ARCHIVED_SEGMENT_COUNT; segmentNumber++) {
+            (void) unlink([[self pathToArchivedSegment:segmentNumber] fileSystemRepresentation]);
+        }
     }
+
+    // Empty the crash ring, so that cleared entries don't come back after a crash.
+
+    [self->_crashRing removeAllEntries];
     
     // Next nix any in-memory log entries.
     
-    if ([self->_logEntries count] != 0) {
-        NSIndexSet *    indexSet;
-        
-        indexSet = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, [self->_logEntries count])];
-        assert(indexSet != 0);
-        
-        [self willChange:NSKeyValueChangeRemoval valuesAtIndexes:indexSet forKey:@"logEntries"];
-        [self->_logEntries removeAllObjects];
-        [self  didChange:NSKeyValueChangeRemoval valuesAtIndexes:indexSet forKey:@"logEntries"];
+    [self changeLogEntriesRemovingOldest:[self->_logEntries count] adding:nil];
+}
+
+- (NSString *)pathToLogFileValidToLength:(off_t *)lengthPtr
+    // See comment in header.
+{
+    NSString *  result;
+
+    assert([NSThread isMainThread]);
+
+    result = nil;
+    @synchronized (self) {
+        if (self->_logFile != -1) {
+            result = self.pathToLogFile;
+            if (lengthPtr != NULL) {
+                assert(self->_logFileLength >= 0);
+                *lengthPtr = self->_logFileLength;
+            }
+        }
     }
+    return result;
 }
 
 - (NSInputStream *)streamForLogValidToLength:(off_t *)lengthPtr
     // See comment in header.
+{
+    return [self streamForLogIncludingArchives:NO validToLength:lengthPtr];
+}
+
+- (NSInputStream *)streamForLogIncludingArchives:(BOOL)includeArchives validToLength:(off_t *)lengthPtr
+    // See comment in header.
 {
     NSInputStream * result;
-    NSString *      path;
 
     // It's important that this be called on the main thread so that it's coordinated 
     // with the the preferences re-read code that might be closing or opening the log 
@@ -532,17 +1789,54 @@
             }
         }
     } else {
-        // There is a log file, so return a file stream for that.
+        NSMutableArray *    segmentPaths;
+        off_t               length;
 
-        path = self.pathToLogFile;
-        assert(path != nil);
-        
-        result = [NSInputStream inputStreamWithFileAtPath:path];
+        // There is a log file, so return a stream for that, preceded by the 
+        // rotated segments if requested.  We hold the lock while we gather up 
+        // the segments so that we don't race with the flusher thread rotating 
+        // the log or the archive queue shuffling the archives.  The stream opens 
+        // the segments immediately, so it's unaffected by anything that happens 
+        // after we drop the lock.
+
+        segmentPaths = [NSMutableArray array];
+        assert(segmentPaths != nil);
+
+        @synchronized (self) {
+            length = 0;
+            if (includeArchives) {
+                for (NSUInteger segmentNumber = QLOG_ARCHIVED_SEGMENT_COUNT; segmentNumber >= 1; segmentNumber--) {
+                    NSString *  archivePath;
+                    off_t       archiveLength;
+
+                    archivePath = [self pathToArchivedSegment:segmentNumber];
+                    archiveLength = [SGQLogSegmentedInputStream uncompressedLengthOfSegmentAtPath:archivePath];
+                    if (archiveLength > 0) {
+                        [segmentPaths addObject:archivePath];
+                        length += archiveLength;
+                    }
+                }
+                for (NSString * closedPath in self->_closedSegmentPaths) {
+                    off_t       closedLength;
+
+                    closedLength = [SGQLogSegmentedInputStream uncompressedLengthOfSegmentAtPath:closedPath];
+                    if (closedLength > 0) {
+                        [segmentPaths addObject:closedPath];
+                        length += closedLength;
+                    }
+                }
+            }
+            [segmentPaths addObject:self.pathToLogFile];
+
+            assert(self->_logFileLength >= 0);
+            length += self->_logFileLength;
+
+            result = [[[SGQLogSegmentedInputStream alloc] initWithSegmentPaths:segmentPaths] autorelease];
+        }
         
         if (result != nil) {
             if (lengthPtr != NULL) {
-                assert(self->_logFileLength >= 0);
-                *lengthPtr = self->_logFileLength;
+                *lengthPtr = length;
             }
         }
     }
@@ -0,0 +1,95 @@
+/*
+    File:       SGQLogBinaryRecord.h
+
+    Contains:   Compact, unformatted log records for SGQLog's deferred formatting mode.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+#include <stdarg.h>
+#include <time.h>
+
+/*
+    In deferred formatting mode SGQLog doesn't format log entries on the logging
+    thread.  Instead it captures the format string pointer, the entry's stamp (its
+    time, thread and sequence ids) and the arguments into a binary record, and
+    renders that record to text when the main thread flushes the pending entries.
+    Some things to note:
+
+    o The format string is retained by the record and released when the record
+      is rendered, or by SGQLogRecordFree if the record is discarded without being
+      rendered.  In practice format strings are almost always constants, for
+      which retain and release are free.
+
+    o Scalar arguments are copied as is.  %s strings are copied because the caller's
+      buffer may not outlive the call.  %@ objects are described at capture time
+      because we can't assume that an arbitrary object is safe to message from
+      the main thread later on (or that it won't have changed by then).  So, for
+      hot paths, prefer scalar arguments.
+
+    o Not every format can be captured.  Positional arguments (%1$@), %n and
+      the wide character conversions (%S, %ls) are not supported.  In that case
+      SGQLogBinaryRecordCreate returns NULL and the caller must fall back to
+      formatting the entry immediately.
+
+    o A binary record always starts with a byte (0xFF) that can never start a
+      UTF-8 string, so binary and text records can share the same queue.
+
+    o The format string pointer means nothing to a later run of the process, so
+      SGQLog puts a persistent copy of the record, with the format string's text
+      in place of the pointer, into its crash ring.  That copy is rendered when
+      it's recovered, which may be after it's been truncated to fit the ring.
+      It starts with 0xFD, another byte that can never start a UTF-8 string.
+*/
+
+struct SGQLogStamp {
+    struct timespec time;                   // wall clock time; tv_sec is -1 if unknown
+    BOOL            precise;                // time came from the monotonic nanosecond clock
+    uint32_t        thread;                 // Mach thread number
+    uint32_t        threadSequence;         // counts entries logged by that thread
+    uint64_t        sequenceNumber;         // only used if QLOG_ADD_SEQUENCE_NUMBERS is set
+    int32_t         option;                 // the -logOption:xxx option, or -1 if none
+    int64_t         crashRingIndex;         // the entry's index in the crash ring, or -1 if none
+};
+typedef struct SGQLogStamp SGQLogStamp;
+    // The information that SGQLog puts in each entry's header.  This is taken 
+    // on the logging thread when the entry is logged.
+
+extern void * SGQLogBinaryRecordCreate(NSString * format, va_list argList, const SGQLogStamp * stamp, size_t * lengthPtr);
+    // Captures a log entry into a newly malloc'd binary record, returning
+    // the record and its length in *lengthPtr.  Returns NULL if the format
+    // isn't supported.  Can be called on any thread.
+
+extern BOOL SGQLogIsBinaryRecord(const void * bytes, size_t length);
+    // Returns YES if the bytes are a binary record (as opposed to a UTF-8 text
+    // record).
+
+extern NSString * SGQLogBinaryRecordCopyMessage(const void * bytes, size_t length, SGQLogStamp * stampPtr);
+    // Renders the message part of a binary record (that is, the result of applying
+    // the format to the arguments) and, if stampPtr is not NULL, returns the stamp
+    // captured with it.  This releases the record's reference to the format string,
+    // so it must be called exactly once per record.  The caller is responsible for
+    // releasing the result, and for freeing the record itself.
+
+extern size_t SGQLogBinaryRecordCopyPersistent(const void * bytes, size_t length, void * buffer, size_t bufferSize);
+    // Copies a persistent form of a binary record into buffer, truncating it if
+    // it's longer than bufferSize, and returns the number of bytes copied.  This
+    // doesn't consume the record.  Can be called on any thread; it doesn't
+    // allocate memory or take any locks.
+
+extern BOOL SGQLogIsPersistentRecord(const void * bytes, size_t length);
+    // Returns YES if the bytes are a persistent record, as created by
+    // SGQLogBinaryRecordCopyPersistent, that's long enough to render.
+
+extern NSString * SGQLogPersistentRecordCopyMessage(const void * bytes, size_t length, SGQLogStamp * stampPtr);
+    // Like SGQLogBinaryRecordCopyMessage but for a persistent record, possibly
+    // from an earlier run of the process.  If the record was truncated, this
+    // renders as much of the message as it can.  The returned stamp's
+    // crashRingIndex is always -1.  The caller is responsible for releasing
+    // the result.
+
+extern void SGQLogRecordFree(void * bytes, size_t length);
+    // Frees a malloc'd record, binary or text, that's being discarded without 
+    // being rendered.  For a binary record, this also releases the record's 
+    // reference to the format string.  Can be called on any thread.
@@ -0,0 +1,825 @@
+/*
+    File:       SGQLogBinaryRecord.m
+
+    Contains:   Compact, unformatted log records for SGQLog's deferred formatting mode.
+*/
+
+#import "SGQLogBinaryRecord.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    Record layout
+    -------------
+    A record is a SGQLogBinaryRecordHeader followed by the captured arguments, in
+    the order in which the format string consumes them.  Each argument is a one
+    byte kind followed by its payload:
+
+    o kArgKindInt       -- an int (used for '*' widths and precisions, and %c / %C)
+    o kArgKindLongLong  -- any other integer conversion, already truncated to the
+                           size implied by its length modifier and then widened to
+                           64 bits
+    o kArgKindDouble    -- any floating point conversion
+    o kArgKindPointer   -- %p, widened to 64 bits
+    o kArgKindString    -- %s or %@; a uint32_t length followed by that many bytes
+                           of NUL terminated UTF-8
+
+    Payloads are unaligned, so they're always accessed via memcpy.
+
+    A persistent record is a copy of a record that doesn't depend on this run
+    of the process.  It's the record's header, with kPersistentRecordMagic as
+    its magic and a NULL format, followed by a uint32_t length and that many
+    bytes of the format string's UTF-8 (without a NUL), followed by the record's
+    arguments.  A persistent record may have been truncated, so everything in
+    it is bounds checked before it's used.
+*/
+
+enum {
+    kBinaryRecordMagic     = 0xFF,
+    kPersistentRecordMagic = 0xFD
+};
+
+struct SGQLogBinaryRecordHeader {
+    uint8_t         magic;
+    uint8_t         precise;
+    int16_t         option;
+    uint32_t        thread;
+    uint64_t        sequenceNumber;
+    int64_t         seconds;
+    int32_t         nanoseconds;
+    uint32_t        threadSequence;
+    int64_t         crashRingIndex;
+    CFStringRef     format;                 // retained
+};
+typedef struct SGQLogBinaryRecordHeader SGQLogBinaryRecordHeader;
+
+enum {
+    kArgKindInt      = 1,
+    kArgKindLongLong = 2,
+    kArgKindDouble   = 3,
+    kArgKindPointer  = 4,
+    kArgKindString   = 5
+};
+
+enum {
+    kLengthNone,
+    kLengthHH,
+    kLengthH,
+    kLengthL,
+    kLengthLL,
+    kLengthZ,
+    kLengthT,
+    kLengthJ,
+    kLengthBigL
+};
+
+struct FormatSpec {
+    size_t      length;                     // total length of the spec, including the '%'
+    size_t      lengthModifierOffset;       // offset of the length modifier (or conversion if there's none)
+    int         starCount;                  // number of '*' widths and precisions
+    int         precision;                  // -1 if none, -2 if '*'
+    int         lengthModifier;
+    char        conversion;
+};
+typedef struct FormatSpec FormatSpec;
+
+static BOOL ParseFormatSpec(const char * cursor, FormatSpec * spec)
+    // Parses the conversion specification starting at cursor, which must point
+    // to a '%' that isn't part of "%%".  Returns NO if we don't support the
+    // specification.
+{
+    const char *    p;
+
+    assert(cursor[0] == '%');
+    memset(spec, 0, sizeof(*spec));
+    spec->precision = -1;
+
+    p = cursor + 1;
+
+    // Flags.
+
+    while ( (*p != 0) && (strchr("-+ #0'", *p) != NULL) ) {
+        p += 1;
+    }
+
+    // Width.  A digit string followed by '$' is a positional argument, which we don't
+    // support.
+
+    if (*p == '*') {
+        spec->starCount += 1;
+        p += 1;
+    } else {
+        while ( (*p >= '0') && (*p <= '9') ) {
+            p += 1;
+        }
+    }
+    if (*p == '$') {
+        return NO;
+    }
+
+    // Precision.
+
+    if (*p == '.') {
+        p += 1;
+        if (*p == '*') {
+            spec->starCount += 1;
+            spec->precision = -2;
+            p += 1;
+        } else {
+            spec->precision = 0;
+            while ( (*p >= '0') && (*p <= '9') ) {
+                spec->precision = (spec->precision * 10) + (*p - '0');
+                p += 1;
+            }
+        }
+    }
+
+    // Length modifier.
+
+    spec->lengthModifierOffset = (size_t) (p - cursor);
+    switch (*p) {
+        case 'h': {
+            if (p[1] == 'h') {
+                spec->lengthModifier = kLengthHH;
+                p += 2;
+            } else {
+                spec->lengthModifier = kLengthH;
+                p += 1;
+            }
+        } break;
+        case 'l': {
+            if (p[1] == 'l') {
+                spec->lengthModifier = kLengthLL;
+                p += 2;
+            } else {
+                spec->lengthModifier = kLengthL;
+                p += 1;
+            }
+        } break;
+        case 'q': {
+            spec->lengthModifier = kLengthLL;
+            p += 1;
+        } break;
+        case 'z': {
+            spec->lengthModifier = kLengthZ;
+            p += 1;
+        } break;
+        case 't': {
+            spec->lengthModifier = kLengthT;
+            p += 1;
+        } break;
+        case 'j': {
+            spec->lengthModifier = kLengthJ;
+            p += 1;
+        } break;
+        case 'L': {
+            spec->lengthModifier = kLengthBigL;
+            p += 1;
+        } break;
+        default: {
+            spec->lengthModifier = kLengthNone;
+        } break;
+    }
+
+    // Conversion.
+
+    spec->conversion = *p;
+    if ( (spec->conversion == 0) || (strchr("diouxXcCeEfFgGaAsp@", spec->conversion) == NULL) ) {
+        return NO;
+    }
+    if ( ((spec->conversion == 'c') || (spec->conversion == 's')) && (spec->lengthModifier != kLengthNone) ) {
+        return NO;          // wide characters and strings
+    }
+    spec->length = (size_t) (p - cursor) + 1;
+    return YES;
+}
+
+static const char * CopyFormatCString(CFStringRef format, char * buffer, size_t bufferSize)
+    // Returns a C string for the format, using the string's internal storage if
+    // possible (which it usually is for constant strings) and buffer otherwise.
+    // Returns NULL if the format doesn't fit.
+{
+    const char *    result;
+
+    result = CFStringGetCStringPtr(format, kCFStringEncodingUTF8);
+    if (result == NULL) {
+        if ( CFStringGetCString(format, buffer, (CFIndex) bufferSize, kCFStringEncodingUTF8) ) {
+            result = buffer;
+        }
+    }
+    return result;
+}
+
+#pragma mark * Capture
+
+struct RecordBuilder {
+    uint8_t *   bytes;
+    size_t      length;
+    size_t      capacity;
+};
+typedef struct RecordBuilder RecordBuilder;
+
+static uint8_t * RecordBuilderReserve(RecordBuilder * builder, size_t count)
+    // Extends the record by count bytes and returns a pointer to them, or NULL 
+    // if we run out of memory.
+{
+    size_t      needed;
+    uint8_t *   result;
+
+    needed = builder->length + count;
+    if (needed > builder->capacity) {
+        uint8_t *   newBytes;
+        size_t      newCapacity;
+
+        newCapacity = builder->capacity * 2;
+        if (newCapacity < needed) {
+            newCapacity = needed;
+        }
+        newBytes = realloc(builder->bytes, newCapacity);
+        if (newBytes == NULL) {
+            return NULL;
+        }
+        builder->bytes    = newBytes;
+        builder->capacity = newCapacity;
+    }
+    result = &builder->bytes[builder->length];
+    builder->length = needed;
+    return result;
+}
+
+static BOOL RecordBuilderAppend(RecordBuilder * builder, uint8_t kind, const void * payload, size_t payloadLength)
+{
+    uint8_t *   dest;
+
+    dest = RecordBuilderReserve(builder, 1 + payloadLength);
+    if (dest != NULL) {
+        dest[0] = kind;
+        memcpy(&dest[1], payload, payloadLength);
+    }
+    return (dest != NULL);
+}
+
+static BOOL RecordBuilderAppendString(RecordBuilder * builder, const char * str, size_t strLength)
+{
+    uint8_t *   dest;
+    uint32_t    length32;
+
+    length32 = (uint32_t) strLength + 1;
+    dest = RecordBuilderReserve(builder, 1 + sizeof(length32) + length32);
+    if (dest != NULL) {
+        dest[0] = kArgKindString;
+        memcpy(&dest[1], &length32, sizeof(length32));
+        memcpy(&dest[1 + sizeof(length32)], str, strLength);
+        dest[1 + sizeof(length32) + strLength] = 0;
+    }
+    return (dest != NULL);
+}
+
+void * SGQLogBinaryRecordCreate(NSString * format, va_list argList, const SGQLogStamp * stamp, size_t * lengthPtr)
+    // See comment in header.
+{
+    BOOL                        success;
+    RecordBuilder               builder;
+    SGQLogBinaryRecordHeader    header;
+    char                        formatBuffer[512];
+    const char *                cFormat;
+    const char *                cursor;
+    va_list                     args;
+
+    // any thread
+    assert(format != nil);
+    assert(stamp != NULL);
+    assert(lengthPtr != NULL);
+
+    cFormat = CopyFormatCString((CFStringRef) format, formatBuffer, sizeof(formatBuffer));
+    if (cFormat == NULL) {
+        return NULL;
+    }
+
+    builder.capacity = 256;
+    builder.length   = sizeof(header);
+    builder.bytes    = malloc(builder.capacity);
+    if (builder.bytes == NULL) {
+        return NULL;
+    }
+
+    // Capture the arguments.  We work on a copy of the va_list so that, if we fail,
+    // the caller can still use the original.
+
+    success = YES;
+    va_copy(args, argList);
+    cursor = cFormat;
+    while ( success && ((cursor = strchr(cursor, '%')) != NULL) ) {
+        FormatSpec  spec;
+        int         stars[2];
+
+        if (cursor[1] == '%') {
+            cursor += 2;
+            continue;
+        }
+        success = ParseFormatSpec(cursor, &spec);
+        if ( ! success ) {
+            break;
+        }
+        for (int i = 0; success && (i < spec.starCount); i++) {
+            stars[i] = va_arg(args, int);
+            success = RecordBuilderAppend(&builder, kArgKindInt, &stars[i], sizeof(stars[i]));
+        }
+        if ( ! success ) {
+            break;
+        }
+
+        switch (spec.conversion) {
+            case 'd':
+            case 'i': {
+                long long   value;
+
+                switch (spec.lengthModifier) {
+                    default:
+                    case kLengthNone: value = va_arg(args, int);                             break;
+                    case kLengthHH:   value = (signed char) va_arg(args, int);               break;
+                    case kLengthH:    value = (short) va_arg(args, int);                     break;
+                    case kLengthL:    value = va_arg(args, long);                            break;
+                    case kLengthLL:   value = va_arg(args, long long);                       break;
+                    case kLengthZ:    value = (long long) (ssize_t) va_arg(args, size_t);    break;
+                    case kLengthT:    value = va_arg(args, ptrdiff_t);                       break;
+                    case kLengthJ:    value = (long long) va_arg(args, intmax_t);            break;
+                }
+                success = RecordBuilderAppend(&builder, kArgKindLongLong, &value, sizeof(value));
+            } break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X': {
+                unsigned long long  value;
+
+                switch (spec.lengthModifier) {
+                    default:
+                    case kLengthNone: value = va_arg(args, unsigned int);                           break;
+                    case kLengthHH:   value = (unsigned char) va_arg(args, unsigned int);           break;
+                    case kLengthH:    value = (unsigned short) va_arg(args, unsigned int);          break;
+                    case kLengthL:    value = va_arg(args, unsigned long);                          break;
+                    case kLengthLL:   value = va_arg(args, unsigned long long);                     break;
+                    case kLengthZ:    value = va_arg(args, size_t);                                 break;
+                    case kLengthT:    value = (unsigned long long) va_arg(args, ptrdiff_t);         break;
+                    case kLengthJ:    value = (unsigned long long) va_arg(args, uintmax_t);         break;
+                }
+                success = RecordBuilderAppend(&builder, kArgKindLongLong, &value, sizeof(value));
+            } break;
+            case 'c':
+            case 'C': {
+                int     value;
+
+                value = va_arg(args, int);
+                success = RecordBuilderAppend(&builder, kArgKindInt, &value, sizeof(value));
+            } break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double  value;
+
+                if (spec.lengthModifier == kLengthBigL) {
+                    value = (double) va_arg(args, long double);
+                } else {
+                    value = va_arg(args, double);
+                }
+                success = RecordBuilderAppend(&builder, kArgKindDouble, &value, sizeof(value));
+            } break;
+            case 'p': {
+                uint64_t    value;
+
+                value = (uint64_t) (uintptr_t) va_arg(args, void *);
+                success = RecordBuilderAppend(&builder, kArgKindPointer, &value, sizeof(value));
+            } break;
+            case 's': {
+                const char *    str;
+                size_t          strLength;
+                int             precision;
+
+                str = va_arg(args, const char *);
+                if (str == NULL) {
+                    str = "(null)";
+                }
+                precision = spec.precision;
+                if (precision == -2) {
+                    precision = stars[spec.starCount - 1];
+                }
+                if (precision >= 0) {
+                    strLength = strnlen(str, (size_t) precision);
+                } else {
+                    strLength = strlen(str);
+                }
+                success = RecordBuilderAppendString(&builder, str, strLength);
+            } break;
+            case '@': {
+                id              obj;
+                const char *    str;
+
+                obj = va_arg(args, id);
+                str = (obj == nil) ? "(null)" : [[obj description] UTF8String];
+                if (str == NULL) {
+                    str = "";
+                }
+                success = RecordBuilderAppendString(&builder, str, strlen(str));
+            } break;
+            default: {
+                assert(NO);
+                success = NO;
+            } break;
+        }
+
+        cursor += spec.length;
+    }
+    va_end(args);
+
+    // Fill in the header.
+
+    if (success) {
+        memset(&header, 0, sizeof(header));
+        header.magic          = kBinaryRecordMagic;
+        header.precise        = (stamp->precise != NO);
+        header.option         = (int16_t) stamp->option;
+        header.thread         = stamp->thread;
+        header.threadSequence = stamp->threadSequence;
+        header.sequenceNumber = stamp->sequenceNumber;
+        header.seconds        = (int64_t) stamp->time.tv_sec;
+        header.nanoseconds    = (int32_t) stamp->time.tv_nsec;
+        header.crashRingIndex = stamp->crashRingIndex;
+        header.format = CFRetain((CFStringRef) format);
+        memcpy(builder.bytes, &header, sizeof(header));
+
+        *lengthPtr = builder.length;
+    } else {
+        free(builder.bytes);
+        builder.bytes = NULL;
+    }
+    return builder.bytes;
+}
+
+BOOL SGQLogIsBinaryRecord(const void * bytes, size_t length)
+    // See comment in header.
+{
+    return (length >= sizeof(SGQLogBinaryRecordHeader)) && (((const uint8_t *) bytes)[0] == kBinaryRecordMagic);
+}
+
+void SGQLogRecordFree(void * bytes, size_t length)
+    // See comment in header.
+{
+    SGQLogBinaryRecordHeader    header;
+
+    if (bytes != NULL) {
+        if ( SGQLogIsBinaryRecord(bytes, length) ) {
+            memcpy(&header, bytes, sizeof(header));
+            CFRelease(header.format);
+        }
+        free(bytes);
+    }
+}
+
+#pragma mark * Render
+
+// Appends a value to result using spec as the format, passing the '*' arguments
+// first.  spec is a single conversion specification, so this is as safe as the
+// original format string was.
+
+#define AppendFormattedValue(result, spec, starCount, stars, value)                     \
+    do {                                                                                \
+        switch (starCount) {                                                            \
+            case 0:  [result appendFormat:spec, value];                       break;    \
+            case 1:  [result appendFormat:spec, stars[0], value];             break;    \
+            default: [result appendFormat:spec, stars[0], stars[1], value];   break;    \
+        }                                                                               \
+    } while (0)
+
+static void AppendUTF8Bytes(NSMutableString * result, const char * bytes, size_t length)
+{
+    NSString *  str;
+
+    if (length != 0) {
+        str = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+        if (str != nil) {
+            [result appendString:str];
+            [str release];
+        }
+    }
+}
+
+static uint8_t ArgKindForConversion(char conversion)
+    // Returns the kind of argument that SGQLogBinaryRecordCreate captures for 
+    // the conversion.
+{
+    uint8_t     result;
+
+    if (strchr("diouxX", conversion) != NULL) {
+        result = kArgKindLongLong;
+    } else if (strchr("cC", conversion) != NULL) {
+        result = kArgKindInt;
+    } else if (conversion == 'p') {
+        result = kArgKindPointer;
+    } else if (strchr("s@", conversion) != NULL) {
+        result = kArgKindString;
+    } else {
+        assert(strchr("eEfFgGaA", conversion) != NULL);
+        result = kArgKindDouble;
+    }
+    return result;
+}
+
+static const uint8_t * TakeArg(const uint8_t * args, const uint8_t * argsEnd, uint8_t kind, void * value, size_t valueSize)
+    // If the next argument is complete and of the specified kind, copies its 
+    // payload to value and returns a pointer to the argument after it.  Otherwise 
+    // returns NULL.
+{
+    if ( ((size_t) (argsEnd - args) < (1 + valueSize)) || (args[0] != kind) ) {
+        return NULL;
+    }
+    memcpy(value, &args[1], valueSize);
+    return args + 1 + valueSize;
+}
+
+static const uint8_t * TakeStringArg(const uint8_t * args, const uint8_t * argsEnd, const char ** strPtr)
+    // Like TakeArg but for a kArgKindString argument, returning a pointer to 
+    // the NUL terminated string in *strPtr.
+{
+    uint32_t    strLength;
+
+    args = TakeArg(args, argsEnd, kArgKindString, &strLength, sizeof(strLength));
+    if ( (args == NULL) || (strLength == 0) || ((size_t) (argsEnd - args) < strLength) || (args[strLength - 1] != 0) ) {
+        return NULL;
+    }
+    *strPtr = (const char *) args;
+    return args + strLength;
+}
+
+static const uint8_t * AppendMessage(NSMutableString * result, const char * cFormat, const uint8_t * args, const uint8_t * argsEnd)
+    // Appends the result of applying cFormat to the arguments that run from args 
+    // to argsEnd, and returns a pointer to the first argument that wasn't used.  
+    // If the format can't be parsed, or the arguments run out or don't match the 
+    // format, we stop there and return NULL.  That can't happen with a record from 
+    // this run, but it can with a persistent record that was truncated.
+{
+    const char *    cursor;
+    const char *    literal;
+
+    literal = cFormat;
+    cursor  = cFormat;
+    while ( (args != NULL) && ((cursor = strchr(cursor, '%')) != NULL) ) {
+        FormatSpec  spec;
+        int         stars[2];
+        char        specBuffer[64];
+        size_t      specLength;
+        NSString *  specString;
+
+        AppendUTF8Bytes(result, literal, (size_t) (cursor - literal));
+        literal = NULL;
+        if (cursor[1] == '%') {
+            [result appendString:@"%"];
+            cursor += 2;
+            literal = cursor;
+            continue;
+        }
+
+        if ( ! ParseFormatSpec(cursor, &spec) ) {
+            args = NULL;
+            break;
+        }
+
+        for (int i = 0; (args != NULL) && (i < spec.starCount); i++) {
+            args = TakeArg(args, argsEnd, kArgKindInt, &stars[i], sizeof(stars[i]));
+        }
+        if (args == NULL) {
+            break;
+        }
+
+        // Rebuild the specification without its length modifier, adding "ll" for
+        // integer conversions because we widened those values at capture time.
+
+        specLength = spec.lengthModifierOffset;
+        if (specLength > (sizeof(specBuffer) - 4)) {
+            specLength = sizeof(specBuffer) - 4;
+        }
+        memcpy(specBuffer, cursor, specLength);
+        if (strchr("diouxX", spec.conversion) != NULL) {
+            specBuffer[specLength++] = 'l';
+            specBuffer[specLength++] = 'l';
+        }
+        specBuffer[specLength++] = spec.conversion;
+        specBuffer[specLength]   = 0;
+        specString = [[NSString alloc] initWithUTF8String:specBuffer];
+        assert(specString != nil);
+
+        switch ( ArgKindForConversion(spec.conversion) ) {
+            case kArgKindInt: {
+                int     value;
+
+                args = TakeArg(args, argsEnd, kArgKindInt, &value, sizeof(value));
+                if (args != NULL) {
+                    AppendFormattedValue(result, specString, spec.starCount, stars, value);
+                }
+            } break;
+            case kArgKindLongLong: {
+                long long   value;
+
+                args = TakeArg(args, argsEnd, kArgKindLongLong, &value, sizeof(value));
+                if (args != NULL) {
+                    AppendFormattedValue(result, specString, spec.starCount, stars, value);
+                }
+            } break;
+            case kArgKindDouble: {
+                double  value;
+
+                args = TakeArg(args, argsEnd, kArgKindDouble, &value, sizeof(value));
+                if (args != NULL) {
+                    AppendFormattedValue(result, specString, spec.starCount, stars, value);
+                }
+            } break;
+            case kArgKindPointer: {
+                uint64_t    value;
+
+                args = TakeArg(args, argsEnd, kArgKindPointer, &value, sizeof(value));
+                if (args != NULL) {
+                    AppendFormattedValue(result, specString, spec.starCount, stars, (void *) (uintptr_t) value);
+                }
+            } break;
+            case kArgKindString: {
+                const char *    str;
+
+                args = TakeStringArg(args, argsEnd, &str);
+                if (args == NULL) {
+                    // do nothing
+                } else if (spec.conversion == '@') {
+                    NSString *  obj;
+
+                    obj = [[NSString alloc] initWithUTF8String:str];
+                    AppendFormattedValue(result, specString, spec.starCount, stars, obj);
+                    [obj release];
+                } else {
+                    AppendFormattedValue(result, specString, spec.starCount, stars, str);
+                }
+            } break;
+            default: {
+                assert(NO);
+            } break;
+        }
+        [specString release];
+
+        cursor += spec.length;
+        if (args != NULL) {
+            literal = cursor;
+        }
+    }
+    if (literal != NULL) {
+        AppendUTF8Bytes(result, literal, strlen(literal));
+    }
+    return args;
+}
+
+static void GetStampFromHeader(const SGQLogBinaryRecordHeader * header, SGQLogStamp * stampPtr)
+    // Fills in *stampPtr, if it's not NULL, from the record header.
+{
+    if (stampPtr != NULL) {
+        stampPtr->time.tv_sec     = (time_t) header->seconds;
+        stampPtr->time.tv_nsec    = (long) header->nanoseconds;
+        stampPtr->precise         = (header->precise != 0);
+        stampPtr->thread          = header->thread;
+        stampPtr->threadSequence  = header->threadSequence;
+        stampPtr->sequenceNumber  = header->sequenceNumber;
+        stampPtr->option          = header->option;
+        stampPtr->crashRingIndex  = header->crashRingIndex;
+    }
+}
+
+NSString * SGQLogBinaryRecordCopyMessage(const void * bytes, size_t length, SGQLogStamp * stampPtr)
+    // See comment in header.
+{
+    NSMutableString *           result;
+    SGQLogBinaryRecordHeader    header;
+    const uint8_t *             argsEnd;
+    const uint8_t *             argsUsedEnd;
+    char                        formatBuffer[512];
+    const char *                cFormat;
+
+    assert(SGQLogIsBinaryRecord(bytes, length));
+
+    memcpy(&header, bytes, sizeof(header));
+    argsEnd = ((const uint8_t *) bytes) + length;
+
+    GetStampFromHeader(&header, stampPtr);
+
+    result = [[NSMutableString alloc] initWithCapacity:128];
+    assert(result != nil);
+
+    cFormat = CopyFormatCString(header.format, formatBuffer, sizeof(formatBuffer));
+    assert(cFormat != NULL);            // it worked at capture time
+    if (cFormat != NULL) {
+        argsUsedEnd = AppendMessage(result, cFormat, ((const uint8_t *) bytes) + sizeof(header), argsEnd);
+        assert(argsUsedEnd == argsEnd); // it worked at capture time
+        #pragma unused(argsUsedEnd)
+    }
+
+    CFRelease(header.format);
+
+    return result;
+}
+
+#pragma mark * Persistent records
+
+static size_t AppendTruncated(uint8_t * buffer, size_t bufferSize, size_t offset, const void * bytes, size_t length)
+    // Copies as much of bytes as fits into buffer at offset, returning the new 
+    // offset.
+{
+    if (length > (bufferSize - offset)) {
+        length = bufferSize - offset;
+    }
+    memcpy(&buffer[offset], bytes, length);
+    return offset + length;
+}
+
+size_t SGQLogBinaryRecordCopyPersistent(const void * bytes, size_t length, void * buffer, size_t bufferSize)
+    // See comment in header.
+{
+    SGQLogBinaryRecordHeader    header;
+    char                        formatBuffer[512];
+    const char *                cFormat;
+    uint32_t                    formatLength;
+    size_t                      result;
+
+    // any thread
+    assert(SGQLogIsBinaryRecord(bytes, length));
+    assert(buffer != NULL);
+
+    memcpy(&header, bytes, sizeof(header));
+    cFormat = CopyFormatCString(header.format, formatBuffer, sizeof(formatBuffer));
+    assert(cFormat != NULL);            // it worked at capture time
+    if (cFormat == NULL) {
+        cFormat = "";
+    }
+    formatLength = (uint32_t) strlen(cFormat);
+
+    header.magic  = kPersistentRecordMagic;
+    header.format = NULL;
+
+    result = AppendTruncated(buffer, bufferSize, 0,      &header,       sizeof(header));
+    result = AppendTruncated(buffer, bufferSize, result, &formatLength, sizeof(formatLength));
+    result = AppendTruncated(buffer, bufferSize, result, cFormat,       formatLength);
+    result = AppendTruncated(buffer, bufferSize, result, ((const uint8_t *) bytes) + sizeof(header), length - sizeof(header));
+    return result;
+}
+
+BOOL SGQLogIsPersistentRecord(const void * bytes, size_t length)
+    // See comment in header.
+{
+    return (length >= (sizeof(SGQLogBinaryRecordHeader) + sizeof(uint32_t))) && (((const uint8_t *) bytes)[0] == kPersistentRecordMagic);
+}
+
+NSString * SGQLogPersistentRecordCopyMessage(const void * bytes, size_t length, SGQLogStamp * stampPtr)
+    // See comment in header.
+{
+    NSMutableString *           result;
+    SGQLogBinaryRecordHeader    header;
+    uint32_t                    formatLength;
+    char                        cFormat[512];
+    const uint8_t *             cursor;
+    const uint8_t *             end;
+
+    assert(SGQLogIsPersistentRecord(bytes, length));
+
+    cursor = bytes;
+    end    = cursor + length;
+
+    memcpy(&header, cursor, sizeof(header));
+    cursor += sizeof(header);
+    GetStampFromHeader(&header, stampPtr);
+    if (stampPtr != NULL) {
+        stampPtr->crashRingIndex = -1;
+    }
+
+    memcpy(&formatLength, cursor, sizeof(formatLength));
+    cursor += sizeof(formatLength);
+
+    // If the record was truncated in the middle of the format string, we render 
+    // what we have of it.
+
+    if (formatLength > (size_t) (end - cursor)) {
+        formatLength = (uint32_t) (end - cursor);
+    }
+    if (formatLength > (sizeof(cFormat) - 1)) {
+        formatLength = sizeof(cFormat) - 1;
+    }
+    memcpy(cFormat, cursor, formatLength);
+    cFormat[formatLength] = 0;
+    cursor += formatLength;
+
+    result = [[NSMutableString alloc] initWithCapacity:128];
+    assert(result != nil);
+
+    (void) AppendMessage(result, cFormat, cursor, end);
+
+    return result;
+}
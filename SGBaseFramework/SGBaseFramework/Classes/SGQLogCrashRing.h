@@ -0,0 +1,94 @@
+/*
+    File:       SGQLogCrashRing.h
+
+    Contains:   A memory mapped, fixed-size log of recent entries that survives a crash.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+#include <sys/uio.h>
+
+/*
+    SGQLogCrashRing keeps a copy of the most recent log entries in a file that's
+    mapped into memory.  SGQLog writes each entry into the ring on the logging
+    thread, before the entry is queued for the flush, so the ring holds entries
+    that never made it to the log file.  Some important points:
+
+    o The file is mapped shared, so anything written to the ring is in the kernel's
+      page cache immediately.  If the process dies, for whatever reason (SIGSEGV,
+      SIGABRT, being killed by the watchdog), the kernel still writes those pages
+      to disk.  We never call msync or fsync, so the ring doesn't protect against
+      the device itself going down, but it costs nothing more than a memcpy.
+
+    o The ring is a fixed number of fixed-size slots.  Entries that don't fit in
+      a slot are truncated.  When the ring is full, new entries overwrite the
+      oldest ones.
+
+    o Adding an entry is lock-free.  A producer claims a slot by atomically incrementing
+      the ring's next index, invalidates the slot, copies in the entry, and then
+      publishes it by setting the slot's sequence number.  A slot that was being
+      written when the process died is never published, and so is ignored by
+      recovery.  If the ring laps a producer while it's copying (that is, other
+      threads log a full ring's worth of entries in the meantime), the slot may
+      end up with a mixture of two entries; that's a price worth paying for not
+      having a lock.
+
+    o SGQLog marks each entry as flushed once it's in the log file, and sets
+      cleanShutdown once everything logged so far has been flushed (when the
+      app goes into the background or terminates).  Adding an entry doesn't
+      clear cleanShutdown; SGQLog does that once the entry is queued for the
+      flush.
+
+    o When the ring is opened, any entries left over from the previous run are
+      read out into recoveredEntries and the ring is emptied.  Flushed entries
+      aren't recovered, and nothing is recovered if cleanShutdown was set.
+*/
+
+@interface SGQLogCrashRing : NSObject
+{
+    void *          _base;
+    size_t          _size;
+    NSUInteger      _slotCount;
+    NSArray *       _recoveredEntries;
+}
+
+- (id)initWithPath:(NSString *)path slotCount:(NSUInteger)slotCount;           // any thread
+    // Opens the ring file at path, creating it if necessary, and maps it.  slotCount
+    // is rounded up to a power of two.  If the file exists but has a different
+    // geometry, its contents are discarded.  Returns nil if the file can't be
+    // created or mapped.
+
+@property (nonatomic, assign, readonly) NSUInteger  slotCount;                  // any thread
+@property (nonatomic, assign, readonly) NSUInteger  maximumEntryLength;         // any thread
+    // The number of bytes of each entry that's kept; the rest is truncated.
+
+@property (nonatomic, copy,   readonly) NSArray *   recoveredEntries;           // any thread
+    // The entries that were in the ring when it was opened, oldest first, as
+    // an array of data objects.
+
+@property (nonatomic, assign, readwrite) BOOL       cleanShutdown;              // any thread
+    // Whether everything logged so far has been flushed.  This is stored in the
+    // ring, so it's what the next run sees if the process goes away now.
+
+- (int64_t)reserveEntryIndex;                                                   // any thread
+    // Claims the index for an entry that's about to be added.  Reserving the
+    // index before adding the entry lets the caller tag its own copy of the
+    // entry with the index, for -markEntryFlushedAtIndex:.
+
+- (void)addEntryWithParts:(const struct iovec *)parts count:(int)count atIndex:(int64_t)index; // any thread
+    // Adds an entry to the ring at an index returned by -reserveEntryIndex.  The
+    // entry is the concatenation of the parts.  If it's truncated, any partial
+    // UTF-8 sequence at the end is dropped, so that text entries stay valid.
+    // This doesn't allocate memory or take any locks.
+
+- (void)markEntryFlushedAtIndex:(int64_t)index;                                 // any thread
+    // Records that the entry added at index has been written to the log file,
+    // so that recovery skips it.  Does nothing if a newer entry has since
+    // overwritten it.
+
+- (void)removeAllEntries;                                                       // any thread
+    // Empties the ring.  Entries that are being added concurrently may or may
+    // not survive.
+
+@end
@@ -0,0 +1,330 @@
+/*
+    File:       SGQLogCrashRing.m
+
+    Contains:   A memory mapped, fixed-size log of recent entries that survives a crash.
+*/
+
+#import "SGQLogCrashRing.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libkern/OSAtomic.h>
+
+/*
+    File layout
+    -----------
+    The file is a header followed by slotCount slots, each of which is kSlotSize
+    bytes.  The header is padded to kSlotSize bytes so that the slots are aligned.
+    All values are in host byte order; the file never leaves the device.
+
+    A slot's sequence is zero if the slot is empty (or being written), and is
+    otherwise one more than the index at which the entry was added.  Recovery
+    uses the index to put the entries back in order and to ignore slots from
+    earlier laps of the ring.  Once the entry has been written to the log file,
+    the sequence is negated, which tells recovery to skip it.
+
+    cleanShutdown is non-zero if everything logged before the process went away
+    was flushed, in which case there's nothing to recover.
+*/
+
+enum {
+    kCrashRingMagic   = 'QLCR',
+    kCrashRingVersion = 2,
+    kSlotSize         = 512
+};
+
+struct SGQLogCrashRingHeader {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            slotCount;
+    uint32_t            slotSize;
+    volatile int64_t    nextIndex;
+    volatile uint32_t   cleanShutdown;
+    uint32_t            reserved;
+};
+typedef struct SGQLogCrashRingHeader SGQLogCrashRingHeader;
+
+struct SGQLogCrashRingSlot {
+    volatile int64_t    sequence;
+    uint32_t            length;
+    uint32_t            reserved;
+    char                bytes[kSlotSize - 16];
+};
+typedef struct SGQLogCrashRingSlot SGQLogCrashRingSlot;
+
+@implementation SGQLogCrashRing
+
+- (SGQLogCrashRingHeader *)header
+{
+    return (SGQLogCrashRingHeader *) self->_base;
+}
+
+- (SGQLogCrashRingSlot *)slotAtIndex:(int64_t)index
+{
+    return (SGQLogCrashRingSlot *) (((char *) self->_base) + kSlotSize + ((size_t) (index & (int64_t) (self->_slotCount - 1)) * kSlotSize));
+}
+
+- (NSArray *)copyEntriesFromPreviousRun
+    // Returns the published entries in the ring, oldest first, as data objects.
+{
+    NSMutableArray *        result;
+    NSMutableArray *        indexes;
+    int64_t                 nextIndex;
+
+    result = [[NSMutableArray alloc] init];
+    assert(result != nil);
+    indexes = [NSMutableArray array];
+    assert(indexes != nil);
+
+    nextIndex = [self header]->nextIndex;
+    for (NSUInteger slotIndex = 0; slotIndex < self->_slotCount; slotIndex++) {
+        SGQLogCrashRingSlot *   slot;
+        int64_t                 index;
+
+        slot = [self slotAtIndex:(int64_t) slotIndex];
+        if (slot->sequence > 0) {
+            index = slot->sequence - 1;
+            if ( (index < nextIndex) && ((index + (int64_t) self->_slotCount) >= nextIndex) && (slot->length <= sizeof(slot->bytes)) ) {
+                [indexes addObject:[NSNumber numberWithLongLong:index]];
+            }
+        }
+    }
+    [indexes sortUsingSelector:@selector(compare:)];
+
+    for (NSNumber * index in indexes) {
+        SGQLogCrashRingSlot *   slot;
+        NSData *                entry;
+
+        slot = [self slotAtIndex:[index longLongValue]];
+
+        entry = [[NSData alloc] initWithBytes:slot->bytes length:slot->length];
+        assert(entry != nil);
+        [result addObject:entry];
+        [entry release];
+    }
+
+    return result;
+}
+
+- (id)initWithPath:(NSString *)path slotCount:(NSUInteger)slotCount
+    // See comment in header.
+{
+    int                     err;
+    int                     junk;
+    int                     fd;
+    struct stat             sb;
+    SGQLogCrashRingHeader * header;
+
+    // any thread
+    assert(path != nil);
+    assert(slotCount != 0);
+
+    self = [super init];
+    if (self != nil) {
+        self->_slotCount = 1;
+        while (self->_slotCount < slotCount) {
+            self->_slotCount <<= 1;
+        }
+        self->_size = kSlotSize + (self->_slotCount * kSlotSize);
+
+        // Open the file, making sure that it's the right size.  We don't need
+        // the file descriptor once the file is mapped.
+
+        err = 0;
+        fd = open([path fileSystemRepresentation], O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            err = errno;
+        }
+        if (err == 0) {
+            err = fstat(fd, &sb);
+            if (err < 0) {
+                err = errno;
+            }
+        }
+        if ( (err == 0) && (sb.st_size != (off_t) self->_size) ) {
+            err = ftruncate(fd, (off_t) self->_size);
+            if (err < 0) {
+                err = errno;
+            }
+        }
+        if (err == 0) {
+            self->_base = mmap(NULL, self->_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (self->_base == MAP_FAILED) {
+                self->_base = NULL;
+                err = errno;
+            }
+        }
+        if (fd >= 0) {
+            junk = close(fd);
+            assert(junk == 0);
+        }
+
+        if (err != 0) {
+            [self release];
+            self = nil;
+        } else {
+            // If the file was written by this version with the same geometry, and
+            // the previous run didn't shut down cleanly, recover its entries.
+            // Either way, start afresh.
+
+            header = [self header];
+            if ( (header->magic == kCrashRingMagic) && (header->version == kCrashRingVersion) && (header->slotCount == self->_slotCount) && (header->slotSize == kSlotSize) && (header->cleanShutdown == 0) ) {
+                self->_recoveredEntries = [self copyEntriesFromPreviousRun];
+            } else {
+                self->_recoveredEntries = [[NSArray alloc] init];
+            }
+            assert(self->_recoveredEntries != nil);
+
+            memset(self->_base, 0, self->_size);
+            header->magic     = kCrashRingMagic;
+            header->version   = kCrashRingVersion;
+            header->slotCount = (uint32_t) self->_slotCount;
+            header->slotSize  = kSlotSize;
+            OSMemoryBarrier();
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    int     junk;
+
+    if (self->_base != NULL) {
+        junk = munmap(self->_base, self->_size);
+        assert(junk == 0);
+    }
+    [self->_recoveredEntries release];
+    [super dealloc];
+}
+
+@synthesize slotCount        = _slotCount;
+@synthesize recoveredEntries = _recoveredEntries;
+
+- (NSUInteger)maximumEntryLength
+    // See comment in header.
+{
+    return sizeof(((SGQLogCrashRingSlot *) NULL)->bytes);
+}
+
+- (BOOL)cleanShutdown
+    // See comment in header.
+{
+    // any thread
+    return [self header]->cleanShutdown != 0;
+}
+
+- (void)setCleanShutdown:(BOOL)newValue
+    // See comment in header.
+{
+    // any thread
+    [self header]->cleanShutdown = newValue ? 1 : 0;
+    OSMemoryBarrier();
+}
+
+- (int64_t)reserveEntryIndex
+    // See comment in header.
+{
+    // any thread
+    return OSAtomicIncrement64Barrier(&[self header]->nextIndex) - 1;
+}
+
+- (void)addEntryWithParts:(const struct iovec *)parts count:(int)count atIndex:(int64_t)index
+    // See comment in header.
+{
+    SGQLogCrashRingSlot *   slot;
+    size_t                  length;
+
+    // any thread
+    assert( (parts != NULL) || (count == 0) );
+    assert(index >= 0);
+
+    slot = [self slotAtIndex:index];
+
+    // Invalidate the slot, so that a crash part way through the copy doesn't
+    // leave a half written entry that looks valid.
+
+    slot->sequence = 0;
+    OSMemoryBarrier();
+
+    length = 0;
+    for (int i = 0; i < count; i++) {
+        size_t  partLength;
+
+        partLength = parts[i].iov_len;
+        if ( partLength > (sizeof(slot->bytes) - length) ) {
+            partLength = sizeof(slot->bytes) - length;
+        }
+        memcpy(&slot->bytes[length], parts[i].iov_base, partLength);
+        length += partLength;
+        if (length == sizeof(slot->bytes)) {
+            break;
+        }
+    }
+
+    // If we filled the slot, we may have truncated the entry in the middle of a 
+    // UTF-8 sequence.  If so, drop that partial sequence.  For a binary entry this 
+    // just truncates it a little further.
+
+    if (length == sizeof(slot->bytes)) {
+        size_t      end;
+        size_t      continuationCount;
+
+        end = length;
+        continuationCount = 0;
+        while ( (end != 0) && (continuationCount < 3) && ((slot->bytes[end - 1] & 0xC0) == 0x80) ) {
+            end -= 1;
+            continuationCount += 1;
+        }
+        if ( (end != 0) && ((slot->bytes[end - 1] & 0xC0) == 0xC0) ) {
+            uint8_t     lead;
+            size_t      needed;
+
+            lead = (uint8_t) slot->bytes[end - 1];
+            needed = (lead >= 0xF0) ? 3 : ((lead >= 0xE0) ? 2 : 1);
+            if (continuationCount < needed) {
+                length = end - 1;
+            }
+        }
+    }
+    slot->length = (uint32_t) length;
+
+    OSMemoryBarrier();
+    slot->sequence = index + 1;
+}
+
+- (void)markEntryFlushedAtIndex:(int64_t)index
+    // See comment in header.
+{
+    SGQLogCrashRingSlot *   slot;
+
+    // any thread
+    assert(index >= 0);
+
+    // If the slot has been reused since, the compare-and-swap fails, which is 
+    // what we want; the new entry hasn't been flushed.
+
+    slot = [self slotAtIndex:index];
+    (void) OSAtomicCompareAndSwap64Barrier(index + 1, - (index + 1), &slot->sequence);
+}
+
+- (void)removeAllEntries
+    // See comment in header.
+{
+    // any thread
+
+    // We can't reset nextIndex without racing with producers, so instead we
+    // invalidate every slot.  Recovery ignores empty slots regardless of nextIndex.
+
+    for (NSUInteger slotIndex = 0; slotIndex < self->_slotCount; slotIndex++) {
+        [self slotAtIndex:(int64_t) slotIndex]->sequence = 0;
+    }
+    OSMemoryBarrier();
+}
+
+@end
@@ -0,0 +1,51 @@
+/*
+    File:       SGQLogEntryStore.h
+
+    Contains:   A fixed-capacity circular array of log entries.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+    SGQLogEntryStore holds SGQLog's in-memory log entries.  It's an NSArray, so 
+    clients can treat it exactly like the NSMutableArray that it replaces, but 
+    internally it's a circular buffer: adding an entry when the store is full 
+    evicts the oldest entry in constant time, rather than shifting every other 
+    entry down.  Some things to note:
+
+    o Index 0 is always the oldest entry.
+
+    o Unlike a normal NSArray, the store changes over time.  It's only changed 
+      on the main thread, and SGQLog posts SGQLogEntriesDidChangeNotification 
+      (and KVO notifications for logEntries) when it does.  If you need a 
+      snapshot, copy it.
+*/
+
+@interface SGQLogEntryStore : NSArray
+{
+    id *            _entries;
+    NSUInteger      _capacity;
+    NSUInteger      _head;                      // index of the oldest entry in _entries
+    NSUInteger      _count;
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity;
+    // Creates an empty store that can hold up to capacity entries.
+
+@property (nonatomic, assign, readwrite) NSUInteger capacity;
+    // Setting this keeps the newest entries that fit.
+
+- (NSUInteger)addEntries:(NSArray *)entries;
+    // Adds the entries to the end of the store, evicting the oldest entries if 
+    // there's no room.  If there are more new entries than the capacity, only the 
+    // newest of them are kept.  Returns the number of existing entries that were 
+    // evicted.
+
+- (void)removeOldestEntries:(NSUInteger)count;
+    // Removes the specified number of entries from the start of the store.
+
+- (void)removeAllEntries;
+    // Empties the store.
+
+@end
@@ -0,0 +1,156 @@
+/*
+    File:       SGQLogEntryStore.m
+
+    Contains:   A fixed-capacity circular array of log entries.
+
+*/
+
+#import "SGQLogEntryStore.h"
+
+@implementation SGQLogEntryStore
+
+- (id)initWithCapacity:(NSUInteger)capacity
+    // See comment in header.
+{
+    assert(capacity != 0);
+    self = [super init];
+    if (self != nil) {
+        self->_entries = calloc(capacity, sizeof(id));
+        assert(self->_entries != NULL);
+        self->_capacity = capacity;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self removeAllEntries];
+    free(self->_entries);
+    [super dealloc];
+}
+
+- (NSUInteger)capacity
+    // See comment in header.
+{
+    return self->_capacity;
+}
+
+- (void)setCapacity:(NSUInteger)newCapacity
+    // See comment in header.
+{
+    id *        newEntries;
+    NSUInteger  keep;
+
+    assert(newCapacity != 0);
+
+    if (newCapacity != self->_capacity) {
+        newEntries = calloc(newCapacity, sizeof(id));
+        assert(newEntries != NULL);
+        if (newEntries == NULL) {
+            return;
+        }
+
+        // Release the entries that don't fit, then copy the rest across, oldest 
+        // first, starting at index 0.
+
+        keep = MIN(self->_count, newCapacity);
+        for (NSUInteger i = 0; i < self->_count; i++) {
+            id  entry;
+
+            entry = self->_entries[(self->_head + i) % self->_capacity];
+            if (i < (self->_count - keep)) {
+                [entry release];
+            } else {
+                newEntries[i - (self->_count - keep)] = entry;
+            }
+        }
+        free(self->_entries);
+
+        self->_entries  = newEntries;
+        self->_capacity = newCapacity;
+        self->_head     = 0;
+        self->_count    = keep;
+    }
+}
+
+- (NSUInteger)addEntries:(NSArray *)entries
+    // See comment in header.
+{
+    NSUInteger  evicted;
+    NSUInteger  entryCount;
+    NSUInteger  skip;
+
+    assert(entries != nil);
+
+    evicted = 0;
+    entryCount = [entries count];
+
+    // If there are more new entries than will fit, skip the oldest of them.
+
+    skip = (entryCount > self->_capacity) ? (entryCount - self->_capacity) : 0;
+    for (NSUInteger i = skip; i < entryCount; i++) {
+        id          entry;
+        NSUInteger  tail;
+
+        entry = [[entries objectAtIndex:i] retain];
+        assert(entry != nil);
+
+        tail = (self->_head + self->_count) % self->_capacity;
+        if (self->_count == self->_capacity) {
+
+            // The store is full, so the tail is the oldest entry.  Evict it.
+
+            assert(tail == self->_head);
+            [self->_entries[tail] release];
+            self->_head = (self->_head + 1) % self->_capacity;
+            evicted += 1;
+        } else {
+            self->_count += 1;
+        }
+        self->_entries[tail] = entry;
+    }
+
+    // Because we skipped the new entries that wouldn't fit, everything we evicted 
+    // was an existing entry.
+
+    return evicted;
+}
+
+- (void)removeOldestEntries:(NSUInteger)count
+    // See comment in header.
+{
+    assert(count <= self->_count);
+
+    for (NSUInteger i = 0; i < count; i++) {
+        [self->_entries[self->_head] release];
+        self->_entries[self->_head] = nil;
+        self->_head = (self->_head + 1) % self->_capacity;
+    }
+    self->_count -= count;
+    if (self->_count == 0) {
+        self->_head = 0;
+    }
+}
+
+- (void)removeAllEntries
+    // See comment in header.
+{
+    [self removeOldestEntries:self->_count];
+}
+
+#pragma mark * NSArray primitives
+
+- (NSUInteger)count
+{
+    return self->_count;
+}
+
+- (id)objectAtIndex:(NSUInteger)index
+{
+    if (index >= self->_count) {
+        [NSException raise:NSRangeException format:@"index %lu beyond bounds (%lu)", (unsigned long) index, (unsigned long) self->_count];
+    }
+    return self->_entries[(self->_head + index) % self->_capacity];
+}
+
+@end
@@ -0,0 +1,69 @@
+/*
+    File:       SGQLogFileReader.h
+
+    Contains:   Pages through a log file without reading it all into memory.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+@class SGQLogSearchIndex;
+
+/*
+    SGQLogFileReader gives SGQLogViewer random access to the lines of the log file. 
+    Some important points:
+
+    o The file is memory mapped, so only the pages that are actually looked at 
+      are read from disk.
+
+    o The reader builds an index of line offsets (four bytes per line) on a 
+      background thread.  It indexes the file in chunks and publishes each chunk 
+      to the main thread as it goes, so lineCount grows incrementally and the 
+      first screenful of lines is available almost immediately.
+
+    o Lines are only decoded into strings when you ask for them with -lineAtIndex:.
+
+    o The log file grows and gets rotated or truncated underneath us.  Call 
+      -updateToLength: with the file's new valid length to pick up new lines.  If 
+      the file has been replaced or truncated, the index is thrown away and rebuilt, 
+      which causes lineCount to go back to zero (and then grow again).
+
+    o Only complete (LF terminated) lines are indexed.
+*/
+
+@interface SGQLogFileReader : NSObject
+{
+    NSString *      _path;
+    NSData *        _mappedData;                // main thread only
+    ino_t           _inode;                     // main thread only
+    uint32_t *      _lineEnds;                  // main thread only
+    NSUInteger      _lineEndsCapacity;          // main thread only
+    NSUInteger      _lineCount;                 // main thread only
+    off_t           _indexedLength;             // main thread only, end of the last complete line
+    off_t           _scannedLength;             // main thread only, end of the last range given to the indexer
+    off_t           _requestedLength;           // main thread only
+    BOOL            _indexing;                  // main thread only
+    NSUInteger      _generation;                // main thread only
+    SGQLogSearchIndex * _searchIndex;           // main thread write, any thread read
+}
+
+- (id)initWithPath:(NSString *)path;
+    // Creates a reader for the log file at path.  The file isn't looked at 
+    // until you call -updateToLength:.
+
+- (void)updateToLength:(off_t)length;                                   // main thread only
+    // Tells the reader that the first length bytes of the file are valid and 
+    // starts indexing any that haven't already been indexed.
+
+@property (nonatomic, copy,   readonly) NSString *      path;           // any thread
+@property (nonatomic, assign, readonly) NSUInteger      lineCount;      // main thread only, observable
+
+- (NSString *)lineAtIndex:(NSUInteger)lineIndex;                        // main thread only
+    // Returns the specified line, without its trailing LF.
+
+@property (nonatomic, retain, readwrite) SGQLogSearchIndex * searchIndex;   // main thread only
+    // If set, the background indexer also feeds each chunk of lines into this 
+    // search index, so that the search index's line numbers match ours.  Set 
+    // this before the first -updateToLength:.
+
+@end
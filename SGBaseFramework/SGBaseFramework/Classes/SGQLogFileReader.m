@@ -0,0 +1,329 @@
+/*
+    File:       SGQLogFileReader.m
+
+    Contains:   Pages through a log file without reading it all into memory.
+
+*/
+
+#import "SGQLogFileReader.h"
+
+#import "SGQLogSearchIndex.h"
+
+#include <sys/stat.h>
+
+// QLOG_READER_CHUNK_SIZE is the number of bytes the background indexer scans 
+// before publishing what it's found to the main thread.
+
+#if ! defined(QLOG_READER_CHUNK_SIZE)
+    #define QLOG_READER_CHUNK_SIZE (256 * 1024)
+#endif
+
+@interface SGQLogFileReader ()
+
+- (void)startIndexing;
+
+@end
+
+@implementation SGQLogFileReader
+
+- (id)initWithPath:(NSString *)path
+    // See comment in header.
+{
+    assert(path != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_path = [path copy];
+        assert(self->_path != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // The background indexer retains us, so we can't be deallocated while it's 
+    // running.
+    assert( ! self->_indexing );
+    [self->_path release];
+    [self->_mappedData release];
+    [self->_searchIndex release];
+    free(self->_lineEnds);
+    [super dealloc];
+}
+
+@synthesize path      = _path;
+@synthesize lineCount = _lineCount;
+
+- (SGQLogSearchIndex *)searchIndex
+    // See comment in header.
+{
+    return [[self->_searchIndex retain] autorelease];
+}
+
+- (void)setSearchIndex:(SGQLogSearchIndex *)newValue
+    // See comment in header.
+{
+    assert([NSThread isMainThread]);
+    assert( ! self->_indexing );
+    if (newValue != self->_searchIndex) {
+        [self->_searchIndex release];
+        self->_searchIndex = [newValue retain];
+        [self->_searchIndex resetWithGeneration:self->_generation];
+    }
+}
+
+- (void)reset
+    // Throws away the mapping and the index.
+{
+    assert([NSThread isMainThread]);
+
+    [self->_mappedData release];
+    self->_mappedData = nil;
+    self->_inode = 0;
+    self->_indexedLength = 0;
+    self->_scannedLength = 0;
+    self->_requestedLength = 0;
+
+    // Bumping the generation causes any in-flight indexing results to be ignored.
+
+    self->_generation += 1;
+    [self->_searchIndex resetWithGeneration:self->_generation];
+
+    if (self->_lineCount != 0) {
+        [self willChangeValueForKey:@"lineCount"];
+        self->_lineCount = 0;
+        [self didChangeValueForKey:@"lineCount"];
+    }
+}
+
+- (void)updateToLength:(off_t)length
+    // See comment in header.
+{
+    struct stat     sb;
+    BOOL            replaced;
+
+    assert([NSThread isMainThread]);
+    assert(length >= 0);
+
+    // We use a 32-bit index to keep it small.  SGQLog rotates the log file long 
+    // before it gets this big.
+
+    if (length > UINT32_MAX) {
+        length = UINT32_MAX;
+    }
+
+    // If the file has been rotated or truncated, start again.
+
+    replaced = (stat([self->_path fileSystemRepresentation], &sb) != 0);
+    if ( ! replaced ) {
+        replaced = ( (self->_mappedData != nil) && (sb.st_ino != self->_inode) ) || (length < self->_indexedLength);
+    }
+    if (replaced) {
+        [self reset];
+    }
+
+    if (length > self->_requestedLength) {
+        self->_requestedLength = length;
+        if ( ! self->_indexing ) {
+            [self startIndexing];
+        }
+    }
+}
+
+- (void)startIndexing
+    // Maps the file (or remaps it, if it's grown) and kicks off the background 
+    // indexer to index from _indexedLength to _requestedLength.
+{
+    NSData *        mappedData;
+    struct stat     sb;
+
+    assert([NSThread isMainThread]);
+    assert( ! self->_indexing );
+    assert(self->_requestedLength > self->_scannedLength);
+
+    // NSData maps the entire file as it stands at this instant, which might be longer 
+    // than _requestedLength, but never shorter unless the file's been truncated 
+    // (in which case the next -updateToLength: will reset us).
+
+    if ( (self->_mappedData == nil) || ((off_t) [self->_mappedData length] < self->_requestedLength) ) {
+        mappedData = [[NSData alloc] initWithContentsOfFile:self->_path options:NSDataReadingMapped error:NULL];
+        if ( (mappedData == nil) || (stat([self->_path fileSystemRepresentation], &sb) != 0) ) {
+
+            // Forget the request so that the next -updateToLength: tries again.
+
+            [mappedData release];
+            self->_requestedLength = self->_scannedLength;
+            return;
+        }
+        [self->_mappedData release];
+        self->_mappedData = mappedData;
+        self->_inode = sb.st_ino;
+    }
+    if ((off_t) [self->_mappedData length] < self->_requestedLength) {
+        self->_requestedLength = (off_t) [self->_mappedData length];
+        if (self->_requestedLength <= self->_scannedLength) {
+            return;
+        }
+    }
+
+    // We start scanning from the end of the last complete line, so any partial 
+    // line at the end of the previous scan gets rescanned.
+
+    self->_scannedLength = self->_requestedLength;
+    self->_indexing = YES;
+    [self performSelectorInBackground:@selector(indexInBackground:) withObject:[NSDictionary dictionaryWithObjectsAndKeys:
+        self->_mappedData,                                              @"data", 
+        [NSNumber numberWithLongLong:self->_indexedLength],             @"start", 
+        [NSNumber numberWithLongLong:self->_requestedLength],           @"end", 
+        [NSNumber numberWithUnsignedInteger:self->_generation],         @"generation", 
+        self->_searchIndex,                                             @"searchIndex",         // may be nil, so must be last
+        nil
+    ]];
+}
+
+- (void)indexInBackground:(NSDictionary *)request
+    // Runs on a background thread to scan the data for line endings.  Each chunk 
+    // of line ends is sent to the main thread as an NSData of uint32_t offsets. 
+    // The final chunk is flagged so that the main thread knows that we're done. 
+    // If there's a search index, we feed it each chunk here, on the background 
+    // thread, so that search indexing never touches the main thread.
+{
+    NSAutoreleasePool * pool;
+    NSData *            data;
+    const uint8_t *     bytes;
+    off_t               start;
+    off_t               end;
+    NSNumber *          generation;
+
+    pool = [[NSAutoreleasePool alloc] init];
+    assert(pool != nil);
+
+    data       = [request objectForKey:@"data"];
+    start      = [[request objectForKey:@"start"] longLongValue];
+    end        = [[request objectForKey:@"end"] longLongValue];
+    generation = [request objectForKey:@"generation"];
+    assert( (data != nil) && (start < end) && (end <= (off_t) [data length]) );
+
+    bytes = [data bytes];
+    do {
+        NSMutableData *     lineEnds;
+        off_t               chunkEnd;
+        const uint8_t *     cursor;
+        const uint8_t *     limit;
+
+        lineEnds = [NSMutableData data];
+        assert(lineEnds != nil);
+
+        chunkEnd = MIN(end, start + QLOG_READER_CHUNK_SIZE);
+        cursor = bytes + start;
+        limit  = bytes + chunkEnd;
+        while (cursor < limit) {
+            const uint8_t *     lf;
+            uint32_t            lineEnd;
+
+            lf = memchr(cursor, '\n', (size_t) (limit - cursor));
+            if (lf == NULL) {
+                break;
+            }
+            lineEnd = (uint32_t) (lf + 1 - bytes);
+            [lineEnds appendBytes:&lineEnd length:sizeof(lineEnd)];
+            cursor = lf + 1;
+        }
+
+        [[request objectForKey:@"searchIndex"] addLinesFromData:data lineEnds:[lineEnds bytes] count:[lineEnds length] / sizeof(uint32_t) generation:[generation unsignedIntegerValue]];
+
+        [self performSelectorOnMainThread:@selector(didIndexChunk:) withObject:[NSDictionary dictionaryWithObjectsAndKeys:
+            lineEnds,                                       @"lineEnds", 
+            generation,                                     @"generation", 
+            [NSNumber numberWithBool:(chunkEnd == end)],    @"done", 
+            nil
+        ] waitUntilDone:NO];
+
+        start = chunkEnd;
+    } while (start < end);
+
+    [pool drain];
+}
+
+- (void)didIndexChunk:(NSDictionary *)result
+    // Called on the main thread with each chunk of results from the background 
+    // indexer.
+{
+    NSData *        lineEnds;
+    NSUInteger      newLineCount;
+
+    assert([NSThread isMainThread]);
+
+    lineEnds = [result objectForKey:@"lineEnds"];
+    assert(lineEnds != nil);
+
+    if ( ([[result objectForKey:@"generation"] unsignedIntegerValue] == self->_generation) && ([lineEnds length] != 0) ) {
+        newLineCount = [lineEnds length] / sizeof(uint32_t);
+
+        // Grow the index geometrically, to keep the number of reallocs down.
+
+        if ((self->_lineCount + newLineCount) > self->_lineEndsCapacity) {
+            uint32_t *  newLineEnds;
+            NSUInteger  newCapacity;
+
+            newCapacity = MAX(self->_lineEndsCapacity * 2, self->_lineCount + newLineCount);
+            newLineEnds = realloc(self->_lineEnds, newCapacity * sizeof(uint32_t));
+            assert(newLineEnds != NULL);
+            if (newLineEnds == NULL) {
+                return;
+            }
+            self->_lineEnds = newLineEnds;
+            self->_lineEndsCapacity = newCapacity;
+        }
+        memcpy(&self->_lineEnds[self->_lineCount], [lineEnds bytes], [lineEnds length]);
+
+        [self willChangeValueForKey:@"lineCount"];
+        self->_lineCount += newLineCount;
+        [self didChangeValueForKey:@"lineCount"];
+
+        self->_indexedLength = self->_lineEnds[self->_lineCount - 1];
+    }
+
+    // When the indexer is done, start it again if more of the file has become 
+    // valid in the meantime.  Note that we look at this for the last chunk 
+    // regardless of generation; even a stale indexer has to finish before we can 
+    // start a new one.
+
+    if ([[result objectForKey:@"done"] boolValue]) {
+        assert(self->_indexing);
+        self->_indexing = NO;
+
+        if (self->_requestedLength > self->_scannedLength) {
+            [self startIndexing];
+        }
+    }
+}
+
+- (NSString *)lineAtIndex:(NSUInteger)lineIndex
+    // See comment in header.
+{
+    NSString *      result;
+    const uint8_t * bytes;
+    uint32_t        lineStart;
+    uint32_t        lineEnd;
+
+    assert([NSThread isMainThread]);
+    assert(lineIndex < self->_lineCount);
+
+    lineStart = (lineIndex == 0) ? 0 : self->_lineEnds[lineIndex - 1];
+    lineEnd   = self->_lineEnds[lineIndex] - 1;                             // drop the LF
+    assert(lineStart <= lineEnd);
+
+    bytes = [self->_mappedData bytes];
+    result = [[[NSString alloc] initWithBytes:&bytes[lineStart] length:lineEnd - lineStart encoding:NSUTF8StringEncoding] autorelease];
+    if (result == nil) {
+
+        // The log should always be valid UTF-8 but, if it's not, show something 
+        // rather than nothing.
+
+        result = [[[NSString alloc] initWithBytes:&bytes[lineStart] length:lineEnd - lineStart encoding:NSISOLatin1StringEncoding] autorelease];
+    }
+    assert(result != nil);
+    return result;
+}
+
+@end
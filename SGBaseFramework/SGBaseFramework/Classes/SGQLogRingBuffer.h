@@ -0,0 +1,67 @@
+/*
+    File:       SGQLogRingBuffer.h
+
+    Contains:   A bounded, lock-free, multi-producer single-consumer queue of log records.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+    SGQLogRingBuffer is the pending entry queue used by SGQLog.  Any number of threads
+    can add records concurrently without taking a lock; a single consumer (SGQLog's
+    -flush, which always runs on one thread at a time) drains them.  Some important
+    points:
+
+    o Each record is an opaque, immutable blob of bytes.  SGQLog uses LF-free UTF-8
+      text, optionally tagged with a crash ring index, or binary records (see 
+      SGQLogBinaryRecord.h).  The ring buffer only cares 
+      when it discards a record without handing it to the consumer, in which case 
+      it frees it with SGQLogRecordFree, so that a binary record's format string 
+      is released.
+
+    o The capacity is fixed at init time and rounded up to a power of two.  If a
+      producer finds the buffer full, the record is dropped rather than blocking
+      the producer.  The number of dropped records is available via droppedCount.
+
+    o The implementation is the classic bounded queue with a per-slot sequence
+      number; producers claim a slot with a compare-and-swap on the enqueue
+      position and then publish it by bumping that slot's sequence number.
+*/
+
+@interface SGQLogRingBuffer : NSObject
+{
+    void *              _slots;
+    NSUInteger          _capacity;
+    NSUInteger          _mask;
+    volatile int64_t    _enqueuePosition;                                       // any thread, atomic
+    volatile int64_t    _dequeuePosition;                                       // consumer thread write, any thread read
+    volatile int64_t    _droppedCount;                                          // any thread, atomic
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity;
+    // Initialises the ring buffer to hold up to capacity records (rounded up
+    // to a power of two).
+
+@property (nonatomic, assign, readonly) NSUInteger  capacity;                   // any thread
+@property (nonatomic, assign, readonly) uint64_t    droppedCount;               // any thread
+@property (nonatomic, assign, readonly) NSUInteger  approximateCount;           // any thread
+    // The number of records claimed but not yet drained.  This is only a hint; 
+    // it can be out of date by the time you look at it.
+
+- (BOOL)addRecordWithBytes:(const void *)bytes length:(size_t)length;          // any thread
+    // Copies the bytes into a new record and adds it to the ring buffer.  Returns
+    // NO, and increments droppedCount, if the ring buffer is full.
+
+- (BOOL)addRecordWithBytesNoCopy:(void *)bytes length:(size_t)length;          // any thread
+    // Like -addRecordWithBytes:length: except that the ring buffer takes ownership
+    // of bytes, which must have been allocated with malloc.  If the record is
+    // dropped, bytes is freed (with SGQLogRecordFree) before returning.
+
+- (NSArray *)drainRecords;                                                      // consumer thread only
+    // Removes all the published records from the ring buffer and returns them,
+    // oldest first, as an array of NSData objects.  The data objects take over
+    // the record buffers, so no bytes are copied.  Returns an empty array if
+    // there's nothing pending.
+
+@end
@@ -0,0 +1,224 @@
+/*
+    File:       SGQLogRingBuffer.m
+
+    Contains:   A bounded, lock-free, multi-producer single-consumer queue of log records.
+*/
+
+#import "SGQLogRingBuffer.h"
+
+#import "SGQLogBinaryRecord.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <libkern/OSAtomic.h>
+
+/*
+    Theory of Operation
+    -------------------
+    Every slot has a sequence number.  Initially slot i has sequence number i.
+
+    o A producer reads the enqueue position, pos, and looks at slot (pos & mask).
+      If the slot's sequence number is equal to pos, the slot is free and the producer
+      tries to claim it by compare-and-swapping the enqueue position from pos to
+      pos + 1.  If it wins, it fills in the slot and then publishes it by setting the
+      slot's sequence number to pos + 1.
+
+    o If the slot's sequence number is less than pos, the consumer hasn't yet emptied
+      the slot from the previous lap, so the buffer is full and the record is dropped.
+
+    o If the slot's sequence number is greater than pos, some other producer claimed
+      the slot first; the producer re-reads the enqueue position and tries again.
+
+    o The consumer looks at slot (dequeuePos & mask).  If its sequence number is
+      dequeuePos + 1, the slot has been published, so the consumer takes the record
+      and sets the slot's sequence number to dequeuePos + capacity, marking the slot
+      free for the next lap.  Otherwise there's nothing more to drain.
+
+    Note that a record that's been claimed but not yet published stops the drain at
+    that point, even if later slots have been published.  That's fine; the producer
+    that's mid-publish will trigger another flush (see SGQLog) and the remaining records
+    will be picked up then.
+*/
+
+struct SGQLogRingBufferSlot {
+    volatile int64_t    sequence;
+    void *              bytes;
+    size_t              length;
+};
+typedef struct SGQLogRingBufferSlot SGQLogRingBufferSlot;
+
+static inline int64_t SGQLogAtomicLoad64(volatile int64_t * value)
+    // 64-bit loads are not atomic on 32-bit ARM, so we go through OSAtomic.
+{
+    return OSAtomicAdd64Barrier(0, value);
+}
+
+@implementation SGQLogRingBuffer
+
+- (id)initWithCapacity:(NSUInteger)capacity
+    // See comment in header.
+{
+    assert(capacity != 0);
+    self = [super init];
+    if (self != nil) {
+        SGQLogRingBufferSlot *  slots;
+
+        self->_capacity = 1;
+        while (self->_capacity < capacity) {
+            self->_capacity <<= 1;
+        }
+        self->_mask = self->_capacity - 1;
+
+        slots = calloc(self->_capacity, sizeof(SGQLogRingBufferSlot));
+        assert(slots != NULL);
+        for (NSUInteger i = 0; i < self->_capacity; i++) {
+            slots[i].sequence = (int64_t) i;
+        }
+        self->_slots = slots;
+
+        OSMemoryBarrier();
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    SGQLogRingBufferSlot *  slots;
+
+    slots = (SGQLogRingBufferSlot *) self->_slots;
+    if (slots != NULL) {
+        for (NSUInteger i = 0; i < self->_capacity; i++) {
+            SGQLogRecordFree(slots[i].bytes, slots[i].length);
+        }
+        free(slots);
+    }
+    [super dealloc];
+}
+
+@synthesize capacity = _capacity;
+
+- (uint64_t)droppedCount
+    // See comment in header.
+{
+    return (uint64_t) SGQLogAtomicLoad64(&self->_droppedCount);
+}
+
+- (NSUInteger)approximateCount
+    // See comment in header.
+{
+    int64_t     count;
+
+    // any thread
+    count = SGQLogAtomicLoad64(&self->_enqueuePosition) - SGQLogAtomicLoad64(&self->_dequeuePosition);
+    return (count > 0) ? (NSUInteger) count : 0;
+}
+
+- (BOOL)addRecordWithBytesNoCopy:(void *)bytes length:(size_t)length
+    // See comment in header.
+{
+    SGQLogRingBufferSlot *  slots;
+    SGQLogRingBufferSlot *  slot;
+    int64_t                 pos;
+    int64_t                 diff;
+
+    // any thread
+    assert(bytes != NULL);
+
+    slots = (SGQLogRingBufferSlot *) self->_slots;
+
+    // Claim a slot.
+
+    pos = SGQLogAtomicLoad64(&self->_enqueuePosition);
+    do {
+        slot = &slots[pos & (int64_t) self->_mask];
+        diff = SGQLogAtomicLoad64(&slot->sequence) - pos;
+        if (diff == 0) {
+            if ( OSAtomicCompareAndSwap64Barrier(pos, pos + 1, &self->_enqueuePosition) ) {
+                break;
+            }
+            pos = SGQLogAtomicLoad64(&self->_enqueuePosition);
+        } else if (diff < 0) {
+
+            // The buffer is full.  We drop the record rather than block the producer.
+
+            (void) OSAtomicIncrement64Barrier(&self->_droppedCount);
+            SGQLogRecordFree(bytes, length);
+            return NO;
+        } else {
+            pos = SGQLogAtomicLoad64(&self->_enqueuePosition);
+        }
+    } while (YES);
+
+    // Fill in and publish the slot.  The barrier ensures that the consumer can't see the
+    // new sequence number before it sees the record.
+
+    slot->bytes  = bytes;
+    slot->length = length;
+    OSMemoryBarrier();
+    slot->sequence = pos + 1;
+
+    return YES;
+}
+
+- (BOOL)addRecordWithBytes:(const void *)bytes length:(size_t)length
+    // See comment in header.
+{
+    void *  copy;
+
+    // any thread
+    assert( (bytes != NULL) || (length == 0) );
+
+    // We always allocate at least one byte so that an empty record still has a buffer.
+
+    copy = malloc( (length != 0) ? length : 1 );
+    assert(copy != NULL);
+    if (copy == NULL) {
+        (void) OSAtomicIncrement64Barrier(&self->_droppedCount);
+        return NO;
+    }
+    if (length != 0) {
+        memcpy(copy, bytes, length);
+    }
+    return [self addRecordWithBytesNoCopy:copy length:length];
+}
+
+- (NSArray *)drainRecords
+    // See comment in header.
+{
+    NSMutableArray *        result;
+    SGQLogRingBufferSlot *  slots;
+
+    result = [NSMutableArray array];
+    assert(result != nil);
+
+    slots = (SGQLogRingBufferSlot *) self->_slots;
+    do {
+        SGQLogRingBufferSlot *  slot;
+        int64_t                 pos;
+        NSData *                record;
+
+        pos = SGQLogAtomicLoad64(&self->_dequeuePosition);
+        slot = &slots[pos & (int64_t) self->_mask];
+        if (SGQLogAtomicLoad64(&slot->sequence) != (pos + 1)) {
+            break;
+        }
+
+        // The data object takes over the malloc'd buffer.
+
+        record = [[NSData alloc] initWithBytesNoCopy:slot->bytes length:slot->length freeWhenDone:YES];
+        assert(record != nil);
+        [result addObject:record];
+        [record release];
+
+        slot->bytes  = NULL;
+        slot->length = 0;
+        OSMemoryBarrier();
+        slot->sequence = pos + (int64_t) self->_capacity;
+
+        (void) OSAtomicIncrement64Barrier(&self->_dequeuePosition);
+    } while (YES);
+
+    return result;
+}
+
+@end
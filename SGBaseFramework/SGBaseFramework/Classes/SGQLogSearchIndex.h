@@ -0,0 +1,108 @@
+/*
+    File:       SGQLogSearchIndex.h
+
+    Contains:   An incremental search index over the lines of the log file.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+#include <time.h>
+
+/*
+    SGQLogSearchIndex lets SGQLogViewer search and filter the log file without
+    scanning all of it.  SGQLogFileReader feeds it each chunk of lines as it indexes
+    them on its background thread.  Some important points:
+
+    o Only the live log file is indexed, that is, the current segment, which SGQLog
+      rotates when it reaches QLOG_LOG_FILE_MAX_SIZE (512 KB by default).  Entries
+      in closed and archived segments are never found.  When the log rotates, the
+      reader resets the index and starts again on the new file.
+
+    o For substring searches, the index keeps a trigram index.  Each (case folded)
+      three byte sequence is hashed to one of 65536 buckets, and each bucket
+      holds a list of the blocks of 64 lines that contain a trigram in that bucket.
+      A query intersects the lists for each of its trigrams and then only has
+      to check the lines in the surviving blocks.  The block lists are delta
+      encoded as varints, so the index is a fraction of the size of the log.
+
+    o For each line the index also records the time, thread, level and option
+      parsed from the entry's header.  These filters are checked against compact
+      arrays, which is cheap enough to do for every line.
+
+    o Lines that don't parse (for example, entries written with a different format)
+      are still indexed for substring search but never match the other filters.
+
+    o Queries can run on any thread, but they're serialised with indexing: both
+      hold the index's lock, so a query waits for the chunk being indexed, and
+      indexing waits for the query.  A query sees the lines indexed so far.
+*/
+
+@interface SGQLogSearchQuery : NSObject
+{
+    NSString *      _substring;
+    NSNumber *      _thread;
+    NSDate *        _startDate;
+    NSDate *        _endDate;
+    NSNumber *      _minimumLevel;
+    NSNumber *      _option;
+}
+
++ (SGQLogSearchQuery *)queryWithString:(NSString *)string;
+    // Parses a query as typed into the viewer's search bar.  Terms of the form
+    // key:value set the corresponding filter:
+    //
+    // tid:<hex>            thread
+    // level:<D|I|N|W|E|F>  minimumLevel
+    // opt:<n>              option
+    // after:<time>         startDate
+    // before:<time>        endDate
+    //
+    // where <time> is either HH:MM[:SS], meaning today, or YYYY-MM-DDTHH:MM[:SS].
+    // Everything else is joined with single spaces to form the substring.
+
+// All criteria are optional; nil matches everything.
+
+@property (nonatomic, copy,   readwrite) NSString *     substring;      // case insensitive
+@property (nonatomic, retain, readwrite) NSNumber *     thread;         // the Mach thread number from the entry header
+@property (nonatomic, retain, readwrite) NSDate *       startDate;      // inclusive, one second resolution
+@property (nonatomic, retain, readwrite) NSDate *       endDate;        // inclusive, one second resolution
+@property (nonatomic, retain, readwrite) NSNumber *     minimumLevel;   // an SGQLogLevel
+@property (nonatomic, retain, readwrite) NSNumber *     option;         // the option passed to -logOption:xxx
+
+@property (nonatomic, assign, readonly, getter=isEmpty) BOOL empty;
+
+@end
+
+@interface SGQLogSearchIndex : NSObject
+{
+    NSUInteger      _generation;
+    NSData *        _data;
+    NSUInteger      _lineCount;
+    NSUInteger      _lineCapacity;
+    uint32_t *      _lineEnds;
+    uint32_t *      _lineTimes;
+    uint32_t *      _lineThreads;
+    uint8_t *       _lineLevels;
+    uint8_t *       _lineOptions;
+    void *          _buckets;
+    char            _cachedDay[10];
+    time_t          _cachedDayStart;
+}
+
+- (void)resetWithGeneration:(NSUInteger)generation;                     // any thread
+    // Throws away the index.  Subsequent calls to -addLines:xxx are ignored unless
+    // they have this generation.
+
+- (void)addLinesFromData:(NSData *)data lineEnds:(const uint32_t *)lineEnds count:(NSUInteger)count generation:(NSUInteger)generation;    // any thread
+    // Indexes the next count lines.  data is the log file and lineEnds holds the
+    // offset just past the LF of each new line; the first new line starts where
+    // the previous one ended.
+
+@property (nonatomic, assign, readonly) NSUInteger lineCount;           // any thread
+
+- (NSData *)linesMatchingQuery:(SGQLogSearchQuery *)query;              // any thread
+    // Returns the numbers of the matching lines, in ascending order, as an array
+    // of uint32_t.
+
+@end
@@ -0,0 +1,651 @@
+/*
+    File:       SGQLogSearchIndex.m
+
+    Contains:   An incremental search index over the lines of the log file.
+
+*/
+
+#import "SGQLogSearchIndex.h"
+
+#import "SGQLog.h"
+
+#include <ctype.h>
+#include <string.h>
+
+enum {
+    kLinesPerBlock  = 64,
+    kBucketCount    = 65536,
+    kUnknownLevel   = 0xFF,
+    kUnknownOption  = 0xFF
+};
+
+static const uint32_t kNoBlock = UINT32_MAX;
+
+// The level letters, in SGQLogLevel order.  These must match the letters that
+// SGQLog uses to render leveled entries.
+
+static const char kLevelLetters[] = "DINWEF";
+
+#pragma mark * SGQLogSearchQuery
+
+@implementation SGQLogSearchQuery
+
+- (void)dealloc
+{
+    [self->_substring release];
+    [self->_thread release];
+    [self->_startDate release];
+    [self->_endDate release];
+    [self->_minimumLevel release];
+    [self->_option release];
+    [super dealloc];
+}
+
+@synthesize substring    = _substring;
+@synthesize thread       = _thread;
+@synthesize startDate    = _startDate;
+@synthesize endDate      = _endDate;
+@synthesize minimumLevel = _minimumLevel;
+@synthesize option       = _option;
+
+- (BOOL)isEmpty
+    // See comment in header.
+{
+    return ([self.substring length] == 0) && (self.thread == nil) && (self.startDate == nil) && (self.endDate == nil) && (self.minimumLevel == nil) && (self.option == nil);
+}
+
+static NSDate * DateFromQueryString(NSString * string)
+    // Parses a time for the after: and before: terms.  Returns nil if the string
+    // isn't valid.
+{
+    struct tm   tm;
+    time_t      now;
+    int         fieldCount;
+    char        trailing;
+
+    now = time(NULL);
+    (void) localtime_r(&now, &tm);
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+
+    fieldCount = sscanf([string UTF8String], "%d-%d-%dT%d:%d:%d%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &trailing);
+    if ( (fieldCount == 5) || (fieldCount == 6) ) {
+        tm.tm_year -= 1900;
+        tm.tm_mon  -= 1;
+    } else {
+        (void) localtime_r(&now, &tm);
+        tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+        fieldCount = sscanf([string UTF8String], "%d:%d:%d%c", &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &trailing);
+        if ( (fieldCount != 2) && (fieldCount != 3) ) {
+            return nil;
+        }
+    }
+    return [NSDate dateWithTimeIntervalSince1970:(NSTimeInterval) mktime(&tm)];
+}
+
++ (SGQLogSearchQuery *)queryWithString:(NSString *)string
+    // See comment in header.
+{
+    SGQLogSearchQuery * result;
+    NSMutableArray *    words;
+
+    assert(string != nil);
+
+    result = [[[SGQLogSearchQuery alloc] init] autorelease];
+    assert(result != nil);
+
+    words = [NSMutableArray array];
+    assert(words != nil);
+
+    for (NSString * term in [string componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]]) {
+        NSRange     colonRange;
+        NSString *  key;
+        NSString *  value;
+        BOOL        isFilter;
+
+        if ([term length] == 0) {
+            continue;
+        }
+
+        isFilter = NO;
+        colonRange = [term rangeOfString:@":"];
+        if (colonRange.location != NSNotFound) {
+            key   = [[term substringToIndex:colonRange.location] lowercaseString];
+            value = [term substringFromIndex:colonRange.location + 1];
+
+            isFilter = YES;
+            if ([key isEqual:@"tid"]) {
+                unsigned int    thread;
+
+                isFilter = [[NSScanner scannerWithString:value] scanHexInt:&thread];
+                if (isFilter) {
+                    result.thread = [NSNumber numberWithUnsignedInt:thread];
+                }
+            } else if ([key isEqual:@"level"]) {
+                const char *    letter;
+
+                letter = ([value length] == 1) ? strchr(kLevelLetters, toupper([value characterAtIndex:0] & 0x7F)) : NULL;
+                isFilter = (letter != NULL) && (*letter != 0);
+                if (isFilter) {
+                    result.minimumLevel = [NSNumber numberWithUnsignedInteger:(NSUInteger) (letter - kLevelLetters)];
+                }
+            } else if ([key isEqual:@"opt"]) {
+                NSInteger   option;
+
+                isFilter = [[NSScanner scannerWithString:value] scanInteger:&option] && (option >= 0) && (option < 32);
+                if (isFilter) {
+                    result.option = [NSNumber numberWithInteger:option];
+                }
+            } else if ([key isEqual:@"after"]) {
+                result.startDate = DateFromQueryString(value);
+                isFilter = (result.startDate != nil);
+            } else if ([key isEqual:@"before"]) {
+                result.endDate = DateFromQueryString(value);
+                isFilter = (result.endDate != nil);
+            } else {
+                isFilter = NO;
+            }
+        }
+        if ( ! isFilter ) {
+            [words addObject:term];
+        }
+    }
+    if ([words count] != 0) {
+        result.substring = [words componentsJoinedByString:@" "];
+    }
+    return result;
+}
+
+@end
+
+#pragma mark * SGQLogSearchIndex
+
+struct Bucket {
+    uint8_t *   blocks;             // varint encoded deltas between block numbers
+    uint32_t    length;
+    uint32_t    capacity;
+    uint32_t    lastBlock;
+};
+typedef struct Bucket Bucket;
+
+static inline uint8_t Fold(uint8_t c)
+    // Case folds ASCII; leaves everything else alone.
+{
+    return ( (c >= 'A') && (c <= 'Z') ) ? (uint8_t) (c + ('a' - 'A')) : c;
+}
+
+static inline uint32_t TrigramBucket(const uint8_t * p)
+    // Returns the bucket for the trigram at p.
+{
+    uint32_t    trigram;
+
+    trigram = (((uint32_t) Fold(p[0])) << 16) | (((uint32_t) Fold(p[1])) << 8) | (uint32_t) Fold(p[2]);
+    return (trigram * 2654435761U) >> 16;
+}
+
+static void BucketAppendBlock(Bucket * bucket, uint32_t block)
+    // Records that block contains a trigram in this bucket.
+{
+    uint32_t    delta;
+
+    assert( (bucket->lastBlock == kNoBlock) || (block > bucket->lastBlock) );
+
+    delta = block - ((bucket->lastBlock == kNoBlock) ? 0 : (bucket->lastBlock + 1));
+    bucket->lastBlock = block;
+
+    if ( (bucket->length + 5) > bucket->capacity ) {
+        uint8_t *   newBlocks;
+        uint32_t    newCapacity;
+
+        newCapacity = (bucket->capacity == 0) ? 16 : (bucket->capacity * 2);
+        newBlocks = realloc(bucket->blocks, newCapacity);
+        assert(newBlocks != NULL);
+        if (newBlocks == NULL) {
+            return;
+        }
+        bucket->blocks   = newBlocks;
+        bucket->capacity = newCapacity;
+    }
+    while (delta >= 0x80) {
+        bucket->blocks[bucket->length++] = (uint8_t) (delta | 0x80);
+        delta >>= 7;
+    }
+    bucket->blocks[bucket->length++] = (uint8_t) delta;
+}
+
+static void BucketIntersectBlocks(const Bucket * bucket, uint8_t * blockBits, size_t blockBitsLength)
+    // Clears any bit in blockBits whose block isn't in the bucket.
+{
+    uint8_t *   bucketBits;
+    uint32_t    offset;
+    uint32_t    block;
+
+    bucketBits = calloc(blockBitsLength, 1);
+    assert(bucketBits != NULL);
+    if (bucketBits == NULL) {
+        return;
+    }
+
+    offset = 0;
+    block  = 0;
+    while (offset < bucket->length) {
+        uint32_t    delta;
+        unsigned    shift;
+
+        delta = 0;
+        shift = 0;
+        do {
+            delta |= ((uint32_t) (bucket->blocks[offset] & 0x7F)) << shift;
+            shift += 7;
+        } while (bucket->blocks[offset++] & 0x80);
+
+        block += delta;
+        if ((block / 8) < blockBitsLength) {
+            bucketBits[block / 8] |= (uint8_t) (1 << (block % 8));
+        }
+        block += 1;
+    }
+    for (size_t i = 0; i < blockBitsLength; i++) {
+        blockBits[i] &= bucketBits[i];
+    }
+    free(bucketBits);
+}
+
+static BOOL ContainsFolded(const uint8_t * haystack, size_t haystackLength, const uint8_t * needle, size_t needleLength)
+    // A case insensitive memmem; needle must already be folded.
+{
+    assert(needleLength != 0);
+
+    if (haystackLength >= needleLength) {
+        for (size_t i = 0; i <= (haystackLength - needleLength); i++) {
+            if (Fold(haystack[i]) == needle[0]) {
+                size_t  j;
+
+                for (j = 1; j < needleLength; j++) {
+                    if (Fold(haystack[i + j]) != needle[j]) {
+                        break;
+                    }
+                }
+                if (j == needleLength) {
+                    return YES;
+                }
+            }
+        }
+    }
+    return NO;
+}
+
+static BOOL ParseDecimal(const uint8_t * p, size_t digits, int * valuePtr)
+{
+    int     value;
+
+    value = 0;
+    for (size_t i = 0; i < digits; i++) {
+        if ( ! isdigit(p[i]) ) {
+            return NO;
+        }
+        value = (value * 10) + (p[i] - '0');
+    }
+    *valuePtr = value;
+    return YES;
+}
+
+@implementation SGQLogSearchIndex
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        self->_buckets = calloc(kBucketCount, sizeof(Bucket));
+        assert(self->_buckets != NULL);
+        [self resetWithGeneration:0];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    Bucket *    buckets;
+
+    buckets = (Bucket *) self->_buckets;
+    for (NSUInteger i = 0; i < kBucketCount; i++) {
+        free(buckets[i].blocks);
+    }
+    free(buckets);
+    free(self->_lineEnds);
+    free(self->_lineTimes);
+    free(self->_lineThreads);
+    free(self->_lineLevels);
+    free(self->_lineOptions);
+    [self->_data release];
+    [super dealloc];
+}
+
+- (void)resetWithGeneration:(NSUInteger)generation
+    // See comment in header.
+{
+    @synchronized (self) {
+        Bucket *    buckets;
+
+        buckets = (Bucket *) self->_buckets;
+        for (NSUInteger i = 0; i < kBucketCount; i++) {
+            buckets[i].length    = 0;
+            buckets[i].lastBlock = kNoBlock;
+        }
+        self->_lineCount  = 0;
+        self->_generation = generation;
+
+        [self->_data release];
+        self->_data = nil;
+    }
+}
+
+- (NSUInteger)lineCount
+    // See comment in header.
+{
+    @synchronized (self) {
+        return self->_lineCount;
+    }
+}
+
+- (time_t)timeForHeader:(const uint8_t *)p
+    // Converts "YYYY-MM-DD HH:MM:SS" to a time.  Converting the date part is relatively
+    // expensive, so we cache the start of the current day; log entries tend to come
+    // in date order.
+{
+    int         hour;
+    int         minute;
+    int         second;
+
+    if ( ! ParseDecimal(&p[11], 2, &hour) || ! ParseDecimal(&p[14], 2, &minute) || ! ParseDecimal(&p[17], 2, &second) ) {
+        return 0;
+    }
+    if (memcmp(p, self->_cachedDay, sizeof(self->_cachedDay)) != 0) {
+        struct tm   tm;
+
+        memset(&tm, 0, sizeof(tm));
+        if ( ! ParseDecimal(&p[0], 4, &tm.tm_year) || ! ParseDecimal(&p[5], 2, &tm.tm_mon) || ! ParseDecimal(&p[8], 2, &tm.tm_mday) ) {
+            return 0;
+        }
+        tm.tm_year -= 1900;
+        tm.tm_mon  -= 1;
+        tm.tm_isdst = -1;
+        self->_cachedDayStart = mktime(&tm);
+        memcpy(self->_cachedDay, p, sizeof(self->_cachedDay));
+    }
+    return self->_cachedDayStart + (hour * 60 * 60) + (minute * 60) + second;
+}
+
+- (void)parseHeaderOfLine:(const uint8_t *)line length:(size_t)length intoLine:(NSUInteger)lineNumber
+    // Parses the header that SGQLog puts on each entry:
+    //
+    // [<seq> ]YYYY-MM-DD HH:MM:SS.<fraction> <prog>[<pid>:<tid>[#<thread seq>]] [<level> [<subsystem>] |[opt<n>] ]<message>
+    //
+    // and records the time, thread, level and option in the per-line arrays.
+{
+    const uint8_t * cursor;
+    const uint8_t * limit;
+    const uint8_t * message;
+
+    self->_lineTimes[lineNumber]   = 0;
+    self->_lineThreads[lineNumber] = 0;
+    self->_lineLevels[lineNumber]  = kUnknownLevel;
+    self->_lineOptions[lineNumber] = kUnknownOption;
+
+    cursor = line;
+    limit  = line + length;
+
+    // Skip the sequence number, if any.
+
+    if ( (length > 5) && isdigit(cursor[0]) && (cursor[4] != '-') ) {
+        while ( (cursor < limit) && isdigit(*cursor) ) {
+            cursor += 1;
+        }
+        if ( (cursor < limit) && (*cursor == ' ') ) {
+            cursor += 1;
+        }
+    }
+
+    // Date and time.
+
+    if ( ((limit - cursor) < 19) || (cursor[4] != '-') || (cursor[7] != '-') || (cursor[10] != ' ') || (cursor[13] != ':') || (cursor[16] != ':') ) {
+        return;
+    }
+    self->_lineTimes[lineNumber] = (uint32_t) [self timeForHeader:cursor];
+    cursor += 19;
+
+    // Thread.
+
+    cursor = memchr(cursor, '[', (size_t) (limit - cursor));
+    if (cursor == NULL) {
+        return;
+    }
+    cursor = memchr(cursor, ':', (size_t) (limit - cursor));
+    if (cursor == NULL) {
+        return;
+    }
+    cursor += 1;
+    {
+        uint32_t    thread;
+
+        thread = 0;
+        while ( (cursor < limit) && isxdigit(*cursor) ) {
+            thread = (thread << 4) | (uint32_t) (isdigit(*cursor) ? (*cursor - '0') : (tolower(*cursor) - 'a' + 10));
+            cursor += 1;
+        }
+        if ( (cursor < limit) && (*cursor == '#') ) {
+            do {
+                cursor += 1;
+            } while ( (cursor < limit) && isdigit(*cursor) );
+        }
+        if ( ((limit - cursor) < 2) || (cursor[0] != ']') || (cursor[1] != ' ') ) {
+            return;
+        }
+        self->_lineThreads[lineNumber] = thread;
+    }
+    message = cursor + 2;
+
+    // Level or option.
+
+    if ( ((limit - message) >= 3) && (message[1] == ' ') && (message[2] == '[') && (memchr(kLevelLetters, message[0], sizeof(kLevelLetters) - 1) != NULL) ) {
+        self->_lineLevels[lineNumber] = (uint8_t) (strchr(kLevelLetters, message[0]) - kLevelLetters);
+    } else if ( ((limit - message) >= 6) && (memcmp(message, "[opt", 4) == 0) ) {
+        int     option;
+
+        cursor = message + 4;
+        option = 0;
+        while ( (cursor < limit) && isdigit(*cursor) && (option < 32) ) {
+            option = (option * 10) + (*cursor - '0');
+            cursor += 1;
+        }
+        if ( (cursor < limit) && (*cursor == ']') && (option < 32) ) {
+            self->_lineOptions[lineNumber] = (uint8_t) option;
+        }
+    }
+}
+
+- (BOOL)growLineArraysToCapacity:(NSUInteger)newCapacity
+{
+    void *  newArrays[5];
+    BOOL    success;
+
+    newArrays[0] = realloc(self->_lineEnds,    newCapacity * sizeof(uint32_t));
+    if (newArrays[0] != NULL) { self->_lineEnds    = newArrays[0]; }
+    newArrays[1] = realloc(self->_lineTimes,   newCapacity * sizeof(uint32_t));
+    if (newArrays[1] != NULL) { self->_lineTimes   = newArrays[1]; }
+    newArrays[2] = realloc(self->_lineThreads, newCapacity * sizeof(uint32_t));
+    if (newArrays[2] != NULL) { self->_lineThreads = newArrays[2]; }
+    newArrays[3] = realloc(self->_lineLevels,  newCapacity * sizeof(uint8_t));
+    if (newArrays[3] != NULL) { self->_lineLevels  = newArrays[3]; }
+    newArrays[4] = realloc(self->_lineOptions, newCapacity * sizeof(uint8_t));
+    if (newArrays[4] != NULL) { self->_lineOptions = newArrays[4]; }
+
+    success = (newArrays[0] != NULL) && (newArrays[1] != NULL) && (newArrays[2] != NULL) && (newArrays[3] != NULL) && (newArrays[4] != NULL);
+    assert(success);
+    if (success) {
+        self->_lineCapacity = newCapacity;
+    }
+    return success;
+}
+
+- (void)addLinesFromData:(NSData *)data lineEnds:(const uint32_t *)lineEnds count:(NSUInteger)count generation:(NSUInteger)generation
+    // See comment in header.
+{
+    Bucket *        buckets;
+    const uint8_t * bytes;
+
+    assert(data != nil);
+    assert( (lineEnds != NULL) || (count == 0) );
+
+    @synchronized (self) {
+        if ( (generation == self->_generation) && (count != 0) ) {
+            if ( ((self->_lineCount + count) <= self->_lineCapacity) || [self growLineArraysToCapacity:MAX(self->_lineCapacity * 2, self->_lineCount + count)] ) {
+
+                // The data may be a newer mapping of the file than the last chunk's,
+                // but it always covers all of the lines indexed so far.
+
+                if (data != self->_data) {
+                    [self->_data release];
+                    self->_data = [data retain];
+                }
+
+                buckets = (Bucket *) self->_buckets;
+                bytes   = [data bytes];
+                for (NSUInteger i = 0; i < count; i++) {
+                    NSUInteger      lineNumber;
+                    uint32_t        lineStart;
+                    uint32_t        lineEnd;
+                    uint32_t        block;
+
+                    lineNumber = self->_lineCount;
+                    lineStart  = (lineNumber == 0) ? 0 : self->_lineEnds[lineNumber - 1];
+                    lineEnd    = lineEnds[i];
+                    assert( (lineEnd > lineStart) && (lineEnd <= [data length]) );
+
+                    self->_lineEnds[lineNumber] = lineEnd;
+                    [self parseHeaderOfLine:&bytes[lineStart] length:lineEnd - lineStart - 1 intoLine:lineNumber];
+
+                    block = (uint32_t) (lineNumber / kLinesPerBlock);
+                    for (uint32_t offset = lineStart; (offset + 3) <= (lineEnd - 1); offset++) {
+                        Bucket *    bucket;
+
+                        bucket = &buckets[TrigramBucket(&bytes[offset])];
+                        if (bucket->lastBlock != block) {
+                            BucketAppendBlock(bucket, block);
+                        }
+                    }
+
+                    self->_lineCount += 1;
+                }
+            }
+        }
+    }
+}
+
+- (NSData *)linesMatchingQuery:(SGQLogSearchQuery *)query
+    // See comment in header.
+{
+    NSMutableData *     result;
+    NSData *            folded;
+    const uint8_t *     needle;
+    size_t              needleLength;
+    uint32_t            startTime;
+    uint32_t            endTime;
+    uint32_t            thread;
+    NSUInteger          minimumLevel;
+    NSUInteger          option;
+
+    assert(query != nil);
+
+    result = [NSMutableData data];
+    assert(result != nil);
+
+    // Pull the query apart into the simple values that we check each line against.
+
+    folded = [query.substring dataUsingEncoding:NSUTF8StringEncoding];
+    needleLength = [folded length];
+    if (needleLength != 0) {
+        NSMutableData *     foldedMutable;
+        uint8_t *           foldedBytes;
+
+        // Fold the same way as the index does, that is, only ASCII.
+
+        foldedMutable = [[folded mutableCopy] autorelease];
+        foldedBytes = [foldedMutable mutableBytes];
+        for (size_t i = 0; i < needleLength; i++) {
+            foldedBytes[i] = Fold(foldedBytes[i]);
+        }
+        folded = foldedMutable;
+    }
+    needle = [folded bytes];
+    startTime    = (query.startDate    == nil) ? 0          : (uint32_t) [query.startDate timeIntervalSince1970];
+    endTime      = (query.endDate      == nil) ? UINT32_MAX : (uint32_t) [query.endDate   timeIntervalSince1970];
+    thread       = (query.thread       == nil) ? 0          : [query.thread unsignedIntValue];
+    minimumLevel = (query.minimumLevel == nil) ? 0          : [query.minimumLevel unsignedIntegerValue];
+    option       = (query.option       == nil) ? NSNotFound : [query.option unsignedIntegerValue];
+
+    @synchronized (self) {
+        const uint8_t * bytes;
+        uint8_t *       blockBits;
+        size_t          blockBitsLength;
+        NSUInteger      blockCount;
+
+        bytes = [self->_data bytes];
+        blockCount = (self->_lineCount + kLinesPerBlock - 1) / kLinesPerBlock;
+
+        // Use the trigram index to find the blocks that might contain the substring.
+        // If the substring is too short to have any trigrams, every block is a candidate.
+
+        blockBitsLength = (blockCount + 7) / 8;
+        blockBits = malloc(MAX(blockBitsLength, 1));
+        assert(blockBits != NULL);
+        if (blockBits == NULL) {
+            return result;
+        }
+        memset(blockBits, 0xFF, blockBitsLength);
+        if (needleLength >= 3) {
+            for (size_t offset = 0; (offset + 3) <= needleLength; offset++) {
+                BucketIntersectBlocks(&((Bucket *) self->_buckets)[TrigramBucket(&needle[offset])], blockBits, blockBitsLength);
+            }
+        }
+
+        for (NSUInteger block = 0; block < blockCount; block++) {
+            if ( (blockBits[block / 8] & (1 << (block % 8))) == 0 ) {
+                continue;
+            }
+            for (NSUInteger lineNumber = block * kLinesPerBlock; lineNumber < MIN(self->_lineCount, (block + 1) * kLinesPerBlock); lineNumber++) {
+                uint32_t    lineStart;
+                uint32_t    lineNumber32;
+
+                if ( (query.startDate != nil) || (query.endDate != nil) ) {
+                    if ( (self->_lineTimes[lineNumber] == 0) || (self->_lineTimes[lineNumber] < startTime) || (self->_lineTimes[lineNumber] > endTime) ) {
+                        continue;
+                    }
+                }
+                if ( (thread != 0) && (self->_lineThreads[lineNumber] != thread) ) {
+                    continue;
+                }
+                if ( (query.minimumLevel != nil) && ( (self->_lineLevels[lineNumber] == kUnknownLevel) || (self->_lineLevels[lineNumber] < minimumLevel) ) ) {
+                    continue;
+                }
+                if ( (option != NSNotFound) && (self->_lineOptions[lineNumber] != option) ) {
+                    continue;
+                }
+                if (needleLength != 0) {
+                    lineStart = (lineNumber == 0) ? 0 : self->_lineEnds[lineNumber - 1];
+                    if ( ! ContainsFolded(&bytes[lineStart], self->_lineEnds[lineNumber] - lineStart - 1, needle, needleLength) ) {
+                        continue;
+                    }
+                }
+
+                lineNumber32 = (uint32_t) lineNumber;
+                [result appendBytes:&lineNumber32 length:sizeof(lineNumber32)];
+            }
+        }
+        free(blockBits);
+    }
+    return result;
+}
+
+@end
@@ -0,0 +1,43 @@
+/*
+    File:       SGQLogSegmentedInputStream.h
+
+    Contains:   An input stream that reads a sequence of log segments as one.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+    SGQLog rotates its log file into a number of segments, some of which are gzip 
+    compressed.  SGQLogSegmentedInputStream presents those segments, oldest first, 
+    as a single stream of uncompressed log text.  Some things to note:
+
+    o The segment files are opened when the stream is created, so the stream 
+      is unaffected by any subsequent rotation or deletion of those files.
+
+    o Each segment can be either gzip compressed or plain text; zlib works out 
+      which.
+
+    o This is a synchronous stream.  You can open it, read from it and close it, 
+      but scheduling it on a run loop does nothing.  That's all that SGQLog's 
+      clients need.
+*/
+
+@interface SGQLogSegmentedInputStream : NSInputStream
+{
+    NSMutableArray *    _segmentFiles;
+    NSUInteger          _currentSegment;
+    NSStreamStatus      _status;
+    NSError *           _error;
+    id                  _delegate;
+}
+
+- (id)initWithSegmentPaths:(NSArray *)segmentPaths;
+    // Opens each of the segment files.  Segments that can't be opened are skipped.
+
++ (off_t)uncompressedLengthOfSegmentAtPath:(NSString *)path;
+    // Returns the uncompressed length of the segment, or -1 if that can't be 
+    // determined.  For a gzip file this comes from the gzip trailer, which 
+    // records the length modulo 4 GB; that's not a problem for log segments.
+
+@end
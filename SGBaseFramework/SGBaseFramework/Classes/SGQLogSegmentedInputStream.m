@@ -0,0 +1,202 @@
+/*
+    File:       SGQLogSegmentedInputStream.m
+
+    Contains:   An input stream that reads a sequence of log segments as one.
+
+*/
+
+#import "SGQLogSegmentedInputStream.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "zlib.h"
+
+@implementation SGQLogSegmentedInputStream
+
+- (id)initWithSegmentPaths:(NSArray *)segmentPaths
+    // See comment in header.
+{
+    assert(segmentPaths != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_segmentFiles = [[NSMutableArray alloc] init];
+        assert(self->_segmentFiles != nil);
+
+        // Open every segment now, rather than as we get to it, so that we're 
+        // immune to SGQLog renaming or deleting segments while we're reading.  
+        // There are only a handful of segments, so the cost of the zlib state 
+        // for each isn't a concern.
+
+        for (NSString * path in segmentPaths) {
+            int     fd;
+            gzFile  file;
+
+            assert([path isKindOfClass:[NSString class]]);
+
+            fd = open([path fileSystemRepresentation], O_RDONLY);
+            if (fd >= 0) {
+                file = gzdopen(fd, "rb");
+                if (file != NULL) {
+                    [self->_segmentFiles addObject:[NSValue valueWithPointer:file]];
+                } else {
+                    (void) close(fd);
+                }
+            }
+        }
+        self->_status = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self close];
+    [self->_segmentFiles release];
+    [self->_error release];
+    [super dealloc];
+}
+
++ (off_t)uncompressedLengthOfSegmentAtPath:(NSString *)path
+    // See comment in header.
+{
+    off_t           result;
+    int             fd;
+    struct stat     sb;
+    uint8_t         header[2];
+    uint8_t         trailer[4];
+
+    assert(path != nil);
+
+    result = -1;
+    fd = open([path fileSystemRepresentation], O_RDONLY);
+    if (fd >= 0) {
+        if (fstat(fd, &sb) == 0) {
+            if ( (sb.st_size >= 18) && (pread(fd, header, sizeof(header), 0) == sizeof(header)) && (header[0] == 0x1f) && (header[1] == 0x8b) ) {
+
+                // It's a gzip file; ISIZE is the last four bytes, little endian.
+
+                if (pread(fd, trailer, sizeof(trailer), sb.st_size - (off_t) sizeof(trailer)) == sizeof(trailer)) {
+                    result = (off_t) ( ((uint32_t) trailer[0]) | (((uint32_t) trailer[1]) << 8) | (((uint32_t) trailer[2]) << 16) | (((uint32_t) trailer[3]) << 24) );
+                }
+            } else {
+                result = sb.st_size;
+            }
+        }
+        (void) close(fd);
+    }
+    return result;
+}
+
+#pragma mark * NSStream overrides
+
+- (void)open
+{
+    if (self->_status == NSStreamStatusNotOpen) {
+        self->_status = NSStreamStatusOpen;
+    }
+}
+
+- (void)close
+{
+    for (NSValue * fileValue in self->_segmentFiles) {
+        (void) gzclose((gzFile) [fileValue pointerValue]);
+    }
+    [self->_segmentFiles removeAllObjects];
+    self->_status = NSStreamStatusClosed;
+}
+
+- (id)delegate
+{
+    return self->_delegate;
+}
+
+- (void)setDelegate:(id)delegate
+{
+    self->_delegate = delegate;
+}
+
+- (id)propertyForKey:(NSString *)key
+{
+    #pragma unused(key)
+    return nil;
+}
+
+- (BOOL)setProperty:(id)property forKey:(NSString *)key
+{
+    #pragma unused(property)
+    #pragma unused(key)
+    return NO;
+}
+
+- (void)scheduleInRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode
+{
+    #pragma unused(aRunLoop)
+    #pragma unused(mode)
+}
+
+- (void)removeFromRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode
+{
+    #pragma unused(aRunLoop)
+    #pragma unused(mode)
+}
+
+- (NSStreamStatus)streamStatus
+{
+    return self->_status;
+}
+
+- (NSError *)streamError
+{
+    return self->_error;
+}
+
+#pragma mark * NSInputStream overrides
+
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)len
+{
+    NSInteger   result;
+
+    assert(buffer != NULL);
+
+    result = 0;
+    if (self->_status == NSStreamStatusOpen) {
+        while ( (result == 0) && (self->_currentSegment < [self->_segmentFiles count]) ) {
+            gzFile  file;
+            int     bytesRead;
+
+            file = (gzFile) [[self->_segmentFiles objectAtIndex:self->_currentSegment] pointerValue];
+            bytesRead = gzread(file, buffer, (unsigned int) MIN(len, (NSUInteger) INT_MAX));
+            if (bytesRead > 0) {
+                result = bytesRead;
+            } else if (bytesRead == 0) {
+                self->_currentSegment += 1;
+            } else {
+                assert(self->_error == nil);
+                self->_error = [[NSError alloc] initWithDomain:NSPOSIXErrorDomain code:EIO userInfo:nil];
+                self->_status = NSStreamStatusError;
+                result = -1;
+            }
+        }
+        if ( (result == 0) && (self->_currentSegment == [self->_segmentFiles count]) ) {
+            self->_status = NSStreamStatusAtEnd;
+        }
+    }
+    return result;
+}
+
+- (BOOL)getBuffer:(uint8_t **)buffer length:(NSUInteger *)len
+{
+    #pragma unused(buffer)
+    #pragma unused(len)
+    return NO;
+}
+
+- (BOOL)hasBytesAvailable
+{
+    return (self->_status == NSStreamStatusOpen);
+}
+
+@end
@@ -0,0 +1,36 @@
+//
+//  SGQLogTest.h
+//  SGBaseFramework
+//
+//  Unit tests and benchmarks for the SGQLog pending entry path.  The benchmarks 
+//  log their results with NSLog; run them on a device to get meaningful numbers.
+
+#define USE_APPLICATION_UNIT_TEST 0
+
+#import <SenTestingKit/SenTestingKit.h>
+#import <UIKit/UIKit.h>
+
+
+@interface SGQLogTest : SenTestCase {
+    
+}
+
+- (void)testRingBufferAccountsForEveryRecord;
+- (void)testDiscardedBinaryRecordsReleaseFormat;
+- (void)testEntryStoreEvictsOldestEntries;
+- (void)testProducerThroughput;
+- (void)testBinaryRecordRendersLikeStringWithFormat;
+- (void)testPersistentRecordRendersWhenTruncated;
+- (void)testLogCallLatency;
+- (void)testOptionTagIsAddedWhenRendered;
+- (void)testSegmentedStreamConcatenatesSegments;
+- (void)testLeveledEntriesAndDisabledLevelCost;
+- (void)testSearchIndexFilters;
+- (void)testCrashRingRecoversEntries;
+- (void)testCrashRingSkipsFlushedEntries;
+- (void)testBackgroundFlushWritesEveryEntryOnce;
+- (void)testLogFileRotatesAndArchivesAreStreamed;
+- (void)testFileReaderFollowsLogFile;
+- (void)testEntryHeaderFormat;
+
+@end
@@ -0,0 +1,1108 @@
+//
+//  SGQLogTest.m
+//  SGBaseFramework
+//
+
+#import "SGQLogTest.h"
+#import "SGQLog.h"
+#import "SGQLogRingBuffer.h"
+#import "SGQLogBinaryRecord.h"
+#import "SGQLogSegmentedInputStream.h"
+#import "SGQLogEntryStore.h"
+#import "SGQLogSearchIndex.h"
+#import "SGQLogCrashRing.h"
+#import "SGQLogFileReader.h"
+
+#include "zlib.h"
+
+#include <pthread.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+
+enum {
+    kBenchmarkEntriesPerThread = 20000,
+    kBenchmarkMaxThreads       = 16
+};
+
+static const char kBenchmarkEntry[] = "2011-12-01 12:00:00.000 SGBaseFrameworkTests[123:4567] benchmark entry";
+
+struct BenchmarkContext {
+    SGQLogRingBuffer *  ring;           // used by the ring buffer path
+    NSMutableArray *    array;          // used by the @synchronized path
+    NSString *          entry;          // used by the @synchronized path
+    NSUInteger          entriesPerThread;
+    volatile int32_t    go;
+    volatile int32_t    producersRunning;
+    volatile int64_t    drained;
+};
+typedef struct BenchmarkContext BenchmarkContext;
+
+static void * RingBufferProducer(void * arg)
+{
+    BenchmarkContext *  context;
+
+    context = (BenchmarkContext *) arg;
+    while (context->go == 0) {
+        // spin
+    }
+    for (NSUInteger i = 0; i < context->entriesPerThread; i++) {
+        (void) [context->ring addRecordWithBytes:kBenchmarkEntry length:sizeof(kBenchmarkEntry) - 1];
+    }
+    (void) OSAtomicDecrement32Barrier(&context->producersRunning);
+    return NULL;
+}
+
+static void * SynchronizedProducer(void * arg)
+{
+    BenchmarkContext *  context;
+
+    context = (BenchmarkContext *) arg;
+    while (context->go == 0) {
+        // spin
+    }
+    for (NSUInteger i = 0; i < context->entriesPerThread; i++) {
+        // This mirrors the pre-ring buffer SGQLog code.
+        @synchronized (context->array) {
+            [context->array addObject:context->entry];
+        }
+    }
+    (void) OSAtomicDecrement32Barrier(&context->producersRunning);
+    return NULL;
+}
+
+static void * RingBufferConsumer(void * arg)
+{
+    BenchmarkContext *  context;
+
+    context = (BenchmarkContext *) arg;
+    do {
+        NSAutoreleasePool * pool;
+        BOOL                done;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        done = (context->producersRunning == 0);
+        (void) OSAtomicAdd64Barrier((int64_t) [[context->ring drainRecords] count], &context->drained);
+        [pool drain];
+        if (done) {
+            break;
+        }
+    } while (YES);
+    return NULL;
+}
+
+static void * SynchronizedConsumer(void * arg)
+{
+    BenchmarkContext *  context;
+
+    context = (BenchmarkContext *) arg;
+    do {
+        NSAutoreleasePool * pool;
+        BOOL                done;
+        NSArray *           entries;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        done = (context->producersRunning == 0);
+        @synchronized (context->array) {
+            entries = [[context->array copy] autorelease];
+            [context->array removeAllObjects];
+        }
+        (void) OSAtomicAdd64Barrier((int64_t) [entries count], &context->drained);
+        [pool drain];
+        if (done) {
+            break;
+        }
+    } while (YES);
+    return NULL;
+}
+
+static double RunBenchmark(BenchmarkContext * context, NSUInteger threadCount, void * (*producer)(void *), void * (*consumer)(void *))
+    // Runs threadCount producers against one consumer and returns the producer 
+    // throughput in entries per second.
+{
+    pthread_t                   producers[kBenchmarkMaxThreads];
+    pthread_t                   consumerThread;
+    uint64_t                    start;
+    uint64_t                    end;
+    mach_timebase_info_data_t   timebase;
+    int                         err;
+
+    assert(threadCount <= kBenchmarkMaxThreads);
+
+    context->go = 0;
+    context->producersRunning = (int32_t) threadCount;
+    context->drained = 0;
+    OSMemoryBarrier();
+
+    for (NSUInteger i = 0; i < threadCount; i++) {
+        err = pthread_create(&producers[i], NULL, producer, context);
+        assert(err == 0);
+    }
+    err = pthread_create(&consumerThread, NULL, consumer, context);
+    assert(err == 0);
+
+    start = mach_absolute_time();
+    (void) OSAtomicIncrement32Barrier(&context->go);
+    for (NSUInteger i = 0; i < threadCount; i++) {
+        err = pthread_join(producers[i], NULL);
+        assert(err == 0);
+    }
+    end = mach_absolute_time();
+
+    err = pthread_join(consumerThread, NULL);
+    assert(err == 0);
+
+    (void) mach_timebase_info(&timebase);
+    return ((double) (threadCount * context->entriesPerThread)) / (((double) (end - start) * timebase.numer / timebase.denom) / 1.0e9);
+}
+
+static NSString * RenderViaBinaryRecord(NSString * format, ...)
+    // Captures the arguments into a binary record and renders them back again.
+{
+    NSString *      result;
+    va_list         argList;
+    void *          record;
+    size_t          length;
+    SGQLogStamp     stamp;
+
+    memset(&stamp, 0, sizeof(stamp));
+    result = nil;
+    va_start(argList, format);
+    record = SGQLogBinaryRecordCreate(format, argList, &stamp, &length);
+    va_end(argList);
+    if (record != NULL) {
+        result = [SGQLogBinaryRecordCopyMessage(record, length, NULL) autorelease];
+        free(record);
+    }
+    return result;
+}
+
+static void * CreateBinaryRecord(size_t * lengthPtr, NSString * format, ...)
+    // Captures the arguments into a binary record.
+{
+    void *          record;
+    va_list         argList;
+    SGQLogStamp     stamp;
+
+    memset(&stamp, 0, sizeof(stamp));
+    va_start(argList, format);
+    record = SGQLogBinaryRecordCreate(format, argList, &stamp, lengthPtr);
+    va_end(argList);
+    return record;
+}
+
+static NSArray * RecoveredStrings(SGQLogCrashRing * ring)
+    // Returns the entries recovered by the crash ring as UTF-8 strings.
+{
+    NSMutableArray *    result;
+
+    result = [NSMutableArray array];
+    for (NSData * entry in ring.recoveredEntries) {
+        [result addObject:[[[NSString alloc] initWithData:entry encoding:NSUTF8StringEncoding] autorelease]];
+    }
+    return result;
+}
+
+static NSUInteger gArgumentEvaluations;
+
+static NSString * CountedArgument(void)
+    // An argument whose evaluation we can detect.
+{
+    gArgumentEvaluations += 1;
+    return @"argument";
+}
+
+static void ElidedDebugCall(void);
+    // Defined at the end of the file, where debug entries are compiled out.
+
+static double NanosecondsPerDisabledCall(BOOL elided, NSUInteger iterations)
+    // Returns the average time for a call to SGQLogDebug when debug level is 
+    // disabled, either at runtime or (if elided is set) at compile time.
+{
+    uint64_t                    start;
+    uint64_t                    elapsed;
+    mach_timebase_info_data_t   timebase;
+
+    start = mach_absolute_time();
+    for (NSUInteger i = 0; i < iterations; i++) {
+        if (elided) {
+            ElidedDebugCall();
+        } else {
+            SGQLogDebug(@"bench", @"value %@ %d", CountedArgument(), (int) i);
+        }
+    }
+    elapsed = mach_absolute_time() - start;
+
+    (void) mach_timebase_info(&timebase);
+    return ((double) elapsed * timebase.numer / timebase.denom) / (double) iterations;
+}
+
+static double NanosecondsPerLogCall(NSUInteger iterations)
+    // Logs iterations entries, flushing every so often so that the pending 
+    // entries never overflow, and returns the average time per call, not 
+    // counting the flushes.
+{
+    enum { kBatchSize = 1000 };
+    uint64_t                    elapsed;
+    mach_timebase_info_data_t   timebase;
+    
+    elapsed = 0;
+    for (NSUInteger batch = 0; batch < (iterations / kBatchSize); batch++) {
+        NSAutoreleasePool * pool;
+        uint64_t            start;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        start = mach_absolute_time();
+        for (NSUInteger i = 0; i < kBatchSize; i++) {
+            [[SGQLog log] logWithFormat:@"fetch %d of %s took %.3f s (%llu bytes)", (int) i, "feed.json", 0.125, (unsigned long long) batch];
+        }
+        elapsed += mach_absolute_time() - start;
+        [[SGQLog log] flush];
+        [pool drain];
+    }
+
+    (void) mach_timebase_info(&timebase);
+    return ((double) elapsed * timebase.numer / timebase.denom) / (double) iterations;
+}
+
+enum {
+    kBackgroundFlushThreads          = 4,
+    kBackgroundFlushEntriesPerThread = 500
+};
+
+static void * BackgroundFlushLogger(void * arg)
+    // Logs kBackgroundFlushEntriesPerThread entries, each tagged with the 
+    // thread index passed in arg and the entry index.
+{
+    NSAutoreleasePool * pool;
+    unsigned long       threadIndex;
+
+    threadIndex = (unsigned long) (uintptr_t) arg;
+    pool = [[NSAutoreleasePool alloc] init];
+    for (NSUInteger i = 0; i < kBackgroundFlushEntriesPerThread; i++) {
+        [[SGQLog log] logWithFormat:@"bgflush %lu.%lu", threadIndex, (unsigned long) i];
+    }
+    [pool drain];
+    return NULL;
+}
+
+static NSString * LogFileContents(void)
+    // Returns the valid part of the current log file as a string, or nil if 
+    // SGQLog isn't logging to a file.
+{
+    NSString *  path;
+    off_t       length;
+    NSData *    data;
+
+    path = [[SGQLog log] pathToLogFileValidToLength:&length];
+    if (path == nil) {
+        return nil;
+    }
+    data = [NSData dataWithContentsOfFile:path];
+    data = [data subdataWithRange:NSMakeRange(0, MIN([data length], (NSUInteger) length))];
+    return [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease];
+}
+
+static NSCountedSet * MessagesWithPrefix(NSArray * lines, NSString * prefix)
+    // Returns the messages, stripped of their headers, of those entries in lines 
+    // whose message starts with prefix.
+{
+    NSCountedSet *  result;
+    NSString *      marker;
+
+    result = [NSCountedSet set];
+    marker = [@"] " stringByAppendingString:prefix];
+    for (NSString * line in lines) {
+        NSRange     range;
+
+        range = [line rangeOfString:marker];
+        if (range.location != NSNotFound) {
+            [result addObject:[line substringFromIndex:range.location + 2]];
+        }
+    }
+    return result;
+}
+
+static NSString * StreamContents(NSInputStream * stream, off_t length)
+    // Reads the first length bytes of stream and returns them as a string.
+{
+    NSMutableData * contents;
+    uint8_t         buffer[4096];
+    NSInteger       bytesRead;
+
+    contents = [NSMutableData data];
+    [stream open];
+    while ( ([contents length] < (NSUInteger) length) && ((bytesRead = [stream read:buffer maxLength:sizeof(buffer)]) > 0) ) {
+        [contents appendBytes:buffer length:(NSUInteger) bytesRead];
+    }
+    [stream close];
+    [contents setLength:MIN([contents length], (NSUInteger) length)];
+    return [[[NSString alloc] initWithData:contents encoding:NSUTF8StringEncoding] autorelease];
+}
+
+static BOOL WaitForLineCount(SGQLogFileReader * reader, NSUInteger lineCount)
+    // Runs the run loop until the reader has indexed lineCount lines, giving up 
+    // after a few seconds.  Returns whether the reader got there.
+{
+    NSDate *    deadline;
+
+    deadline = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while ( (reader.lineCount < lineCount) && ([deadline timeIntervalSinceNow] > 0.0) ) {
+        (void) [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    }
+    return (reader.lineCount == lineCount);
+}
+
+static NSArray * HeaderFields(NSString * entry)
+    // Splits the header of entry into its date and time, fractional seconds, 
+    // pid, thread, thread sequence number, and message, or returns nil if the 
+    // header isn't formatted the way we expect.
+{
+    NSRegularExpression *   expression;
+    NSTextCheckingResult *  match;
+    NSMutableArray *        result;
+
+    expression = [NSRegularExpression regularExpressionWithPattern:@"^(\\d{4}-\\d\\d-\\d\\d \\d\\d:\\d\\d:\\d\\d)\\.(\\d+) \\S+\\[(\\d+):([0-9a-f]+)#(\\d+)\\] (.*)$" options:0 error:NULL];
+    assert(expression != nil);
+    match = [expression firstMatchInString:entry options:0 range:NSMakeRange(0, [entry length])];
+    if (match == nil) {
+        return nil;
+    }
+    result = [NSMutableArray array];
+    for (NSUInteger rangeIndex = 1; rangeIndex < [match numberOfRanges]; rangeIndex++) {
+        [result addObject:[entry substringWithRange:[match rangeAtIndex:rangeIndex]]];
+    }
+    return result;
+}
+
+@implementation SGQLogTest
+
+- (void)testRingBufferAccountsForEveryRecord {
+    SGQLogRingBuffer *  ring;
+    NSArray *           records;
+    
+    ring = [[[SGQLogRingBuffer alloc] initWithCapacity:6] autorelease];
+    STAssertEquals(ring.capacity, (NSUInteger) 8, @"Capacity should round up to a power of two", nil);
+
+    for (int i = 0; i < 10; i++) {
+        char    buffer[8];
+
+        snprintf(buffer, sizeof(buffer), "%d", i);
+        (void) [ring addRecordWithBytes:buffer length:strlen(buffer)];
+    }
+    STAssertEquals(ring.droppedCount, (uint64_t) 2, @"Records beyond capacity should be dropped", nil);
+
+    records = [ring drainRecords];
+    STAssertEquals([records count], (NSUInteger) 8, @"All published records should drain", nil);
+    STAssertEqualObjects([records objectAtIndex:0], [NSData dataWithBytes:"0" length:1], @"Records should drain oldest first", nil);
+    STAssertEqualObjects([records lastObject],      [NSData dataWithBytes:"7" length:1], @"Records should drain oldest first", nil);
+    STAssertEquals([[ring drainRecords] count], (NSUInteger) 0, @"A second drain should find nothing", nil);
+
+    // After draining, the slots are reusable.
+
+    STAssertTrue([ring addRecordWithBytes:"8" length:1], @"Drained slots should be reusable", nil);
+    STAssertEquals([[ring drainRecords] count], (NSUInteger) 1, @"Reused slot should drain", nil);
+}
+
+- (void)testDiscardedBinaryRecordsReleaseFormat {
+    SGQLogRingBuffer *  ring;
+    NSString *          format;
+    CFIndex             retainCountBefore;
+
+    // A non-constant format string, so that its retain count means something.
+
+    format = [[NSString alloc] initWithFormat:@"%@ %%d", @"dropped"];
+    retainCountBefore = CFGetRetainCount((CFStringRef) format);
+
+    ring = [[SGQLogRingBuffer alloc] initWithCapacity:2];
+    for (int i = 0; i < 4; i++) {
+        void *  record;
+        size_t  length;
+
+        record = CreateBinaryRecord(&length, format, i);
+        STAssertTrue(record != NULL, @"Format should be supported", nil);
+        (void) [ring addRecordWithBytesNoCopy:record length:length];
+    }
+    STAssertEquals(ring.droppedCount, (uint64_t) 2, @"Records beyond capacity should be dropped", nil);
+    STAssertEquals(CFGetRetainCount((CFStringRef) format), retainCountBefore + 2, @"Dropped records should release their format", nil);
+
+    // Records left in the ring when it's deallocated are discarded too.
+
+    [ring release];
+    STAssertEquals(CFGetRetainCount((CFStringRef) format), retainCountBefore, @"Undrained records should release their format", nil);
+
+    [format release];
+}
+
+- (void)testEntryStoreEvictsOldestEntries {
+    SGQLogEntryStore *  store;
+    
+    store = [[[SGQLogEntryStore alloc] initWithCapacity:4] autorelease];
+    STAssertEquals([store addEntries:[NSArray arrayWithObjects:@"a", @"b", @"c", nil]], (NSUInteger) 0, @"Nothing to evict yet", nil);
+    STAssertEquals([store addEntries:[NSArray arrayWithObjects:@"d", @"e", @"f", nil]], (NSUInteger) 2, @"Oldest entries should be evicted", nil);
+    STAssertEqualObjects(store, ([NSArray arrayWithObjects:@"c", @"d", @"e", @"f", nil]), @"Store should hold the newest entries, oldest first", nil);
+
+    // A batch bigger than the store evicts everything and keeps only its own newest entries.
+
+    STAssertEquals([store addEntries:[NSArray arrayWithObjects:@"1", @"2", @"3", @"4", @"5", nil]], (NSUInteger) 4, @"All existing entries should be evicted", nil);
+    STAssertEqualObjects(store, ([NSArray arrayWithObjects:@"2", @"3", @"4", @"5", nil]), @"Store should hold the newest of the batch", nil);
+
+    [store removeOldestEntries:1];
+    store.capacity = 2;
+    STAssertEqualObjects(store, ([NSArray arrayWithObjects:@"4", @"5", nil]), @"Shrinking should keep the newest entries", nil);
+    store.capacity = 8;
+    STAssertTrue([store addEntries:[NSArray arrayWithObject:@"6"]] == 0, @"Growing should make room", nil);
+    STAssertEqualObjects([store lastObject], @"6", @"New entries go at the end", nil);
+
+    [store removeAllEntries];
+    STAssertEquals([store count], (NSUInteger) 0, @"Store should be empty", nil);
+}
+
+- (void)testProducerThroughput {
+    static const NSUInteger kThreadCounts[] = { 1, 2, 4, 8, 16 };
+    BenchmarkContext        context;
+    
+    memset(&context, 0, sizeof(context));
+    context.entriesPerThread = kBenchmarkEntriesPerThread;
+    context.entry = [NSString stringWithUTF8String:kBenchmarkEntry];
+    
+    for (size_t i = 0; i < (sizeof(kThreadCounts) / sizeof(kThreadCounts[0])); i++) {
+        NSUInteger  threadCount;
+        double      ringRate;
+        double      synchronizedRate;
+        uint64_t    droppedBefore;
+
+        threadCount = kThreadCounts[i];
+
+        context.ring = [[SGQLogRingBuffer alloc] initWithCapacity:4096];
+        droppedBefore = context.ring.droppedCount;
+        ringRate = RunBenchmark(&context, threadCount, RingBufferProducer, RingBufferConsumer);
+        STAssertEquals((uint64_t) context.drained + context.ring.droppedCount - droppedBefore, (uint64_t) (threadCount * context.entriesPerThread), @"Every entry should be drained or counted as dropped", nil);
+        NSLog(@"SGQLog ring buffer:   %2zu threads, %10.0f entries/s, %llu dropped", (size_t) threadCount, ringRate, (unsigned long long) context.ring.droppedCount);
+        [context.ring release];
+        context.ring = nil;
+
+        context.array = [[NSMutableArray alloc] init];
+        synchronizedRate = RunBenchmark(&context, threadCount, SynchronizedProducer, SynchronizedConsumer);
+        STAssertEquals((uint64_t) context.drained, (uint64_t) (threadCount * context.entriesPerThread), @"Every entry should be drained", nil);
+        NSLog(@"SGQLog @synchronized: %2zu threads, %10.0f entries/s", (size_t) threadCount, synchronizedRate);
+        [context.array release];
+        context.array = nil;
+    }
+}
+
+- (void)testBinaryRecordRendersLikeStringWithFormat {
+    STAssertEqualStrings(RenderViaBinaryRecord(@"plain"), @"plain", @"Literal only", nil);
+    STAssertEqualStrings(
+        RenderViaBinaryRecord(@"%d %5u %-4x| %hhd %lld %zu %c %%", -42, 7U, 0xabU, 0x1ff, -1LL, (size_t) 12, 'z'), 
+        ([NSString stringWithFormat:@"%d %5u %-4x| %hhd %lld %zu %c %%", -42, 7U, 0xabU, 0x1ff, -1LL, (size_t) 12, 'z']), 
+        @"Integer conversions", nil
+    );
+    STAssertEqualStrings(
+        RenderViaBinaryRecord(@"%.2f %*.*g %e", 3.14159, 8, 3, 2.0 / 3.0, 1e10), 
+        ([NSString stringWithFormat:@"%.2f %*.*g %e", 3.14159, 8, 3, 2.0 / 3.0, 1e10]), 
+        @"Floating point conversions", nil
+    );
+    STAssertEqualStrings(
+        RenderViaBinaryRecord(@"%s|%.3s|%@|%@|%p", "hello", "truncated", @"object", nil, (void *) 0x1234), 
+        ([NSString stringWithFormat:@"%s|%.3s|%@|%@|%p", "hello", "truncated", @"object", nil, (void *) 0x1234]), 
+        @"String, object and pointer conversions", nil
+    );
+    STAssertNil(RenderViaBinaryRecord(@"%1$d", 1), @"Positional arguments are not supported", nil);
+}
+
+- (void)testPersistentRecordRendersWhenTruncated {
+    NSString *      format;
+    void *          record;
+    size_t          length;
+    uint8_t         buffer[512];
+    size_t          persistentLength;
+    NSString *      message;
+    NSString *      expected;
+    SGQLogStamp     stamp;
+
+    // A non-constant format string, which the persistent record has to copy.
+
+    format = [[NSString alloc] initWithFormat:@"%@ %%d of %%s took %%.3f s", @"fetch"];
+    record = CreateBinaryRecord(&length, format, 999, "feed.json", 0.125);
+    STAssertTrue(record != NULL, @"Format should be supported", nil);
+    expected = @"fetch 999 of feed.json took 0.125 s";
+
+    persistentLength = SGQLogBinaryRecordCopyPersistent(record, length, buffer, sizeof(buffer));
+    STAssertTrue(SGQLogIsPersistentRecord(buffer, persistentLength), @"Copy should be a persistent record", nil);
+    STAssertFalse(SGQLogIsBinaryRecord(buffer, persistentLength), @"Copy should not be mistaken for a live record", nil);
+    message = [SGQLogPersistentRecordCopyMessage(buffer, persistentLength, &stamp) autorelease];
+    STAssertEqualStrings(message, expected, @"Persistent record should render like the original", nil);
+    STAssertEquals(stamp.crashRingIndex, (int64_t) -1, @"Persistent record should have no crash ring index", nil);
+
+    // Cutting the record short anywhere renders a prefix of the message.
+
+    for (size_t truncatedLength = 0; truncatedLength < persistentLength; truncatedLength++) {
+        if ( SGQLogIsPersistentRecord(buffer, truncatedLength) ) {
+            message = [SGQLogPersistentRecordCopyMessage(buffer, truncatedLength, NULL) autorelease];
+            STAssertTrue([expected hasPrefix:message], @"Truncated record should render a prefix (%zu bytes: %@)", truncatedLength, message);
+        }
+    }
+
+    [SGQLogBinaryRecordCopyMessage(record, length, NULL) release];
+    free(record);
+    [format release];
+}
+
+- (void)testLogCallLatency {
+    NSUserDefaults *    userDefaults;
+    double              immediate;
+    double              deferred;
+    uint64_t            droppedBefore;
+    NSString *          lastEntry;
+    
+    // Set up the preferences.  This relies on SGQLog picking up the change via 
+    // NSUserDefaultsDidChangeNotification, which is posted synchronously.
+
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults setBool:YES forKey:@"qlogEnabled"];
+    [userDefaults setBool:NO  forKey:@"qlogLoggingToStdErr"];
+
+    [userDefaults setBool:NO  forKey:@"qlogDeferredFormatting"];
+    STAssertFalse([SGQLog log].deferredFormatting, @"Preference should have been applied", nil);
+    droppedBefore = [SGQLog log].droppedEntryCount;
+    immediate = NanosecondsPerLogCall(100000);
+    lastEntry = [[[[SGQLog log].logEntries lastObject] retain] autorelease];
+
+    [userDefaults setBool:YES forKey:@"qlogDeferredFormatting"];
+    STAssertTrue([SGQLog log].deferredFormatting, @"Preference should have been applied", nil);
+    deferred = NanosecondsPerLogCall(100000);
+
+    // The timings depend on the machine, so we only log them.  What we can check is 
+    // that neither mode lost an entry, and that both render the same text.
+
+    NSLog(@"SGQLog immediate formatting: %8.0f ns/call", immediate);
+    NSLog(@"SGQLog deferred formatting:  %8.0f ns/call", deferred);
+    STAssertEquals([SGQLog log].droppedEntryCount, droppedBefore, @"Flushing every batch should keep every entry", nil);
+    STAssertTrue([lastEntry hasSuffix:@"fetch 999 of feed.json took 0.125 s (99 bytes)"], @"Immediate entry rendering", nil);
+    STAssertTrue([[[SGQLog log].logEntries lastObject] hasSuffix:@"fetch 999 of feed.json took 0.125 s (99 bytes)"], @"Deferred entry rendering", nil);
+
+    [userDefaults removeObjectForKey:@"qlogDeferredFormatting"];
+    [userDefaults removeObjectForKey:@"qlogEnabled"];
+    [[SGQLog log] clear];
+}
+
+- (void)testOptionTagIsAddedWhenRendered {
+    NSUserDefaults *    userDefaults;
+    
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults setBool:YES forKey:@"qlogEnabled"];
+    [userDefaults setBool:NO  forKey:@"qlogLoggingToStdErr"];
+    [userDefaults setBool:YES forKey:@"qlogOption3"];
+    STAssertTrue(([SGQLog log].optionsMask & (1 << 3)) != 0, @"Preference should have been applied", nil);
+
+    // The tag goes between the header and the message, in both formatting modes, 
+    // and the message itself is formatted from the caller's format string.
+
+    [userDefaults setBool:NO  forKey:@"qlogDeferredFormatting"];
+    [[SGQLog log] logOption:3 withFormat:@"immediate %d%%", 50];
+    [[SGQLog log] flush];
+    STAssertTrue([[[SGQLog log].logEntries lastObject] hasSuffix:@"] [opt3] immediate 50%"], @"Immediate option entry rendering", nil);
+
+    [userDefaults setBool:YES forKey:@"qlogDeferredFormatting"];
+    [[SGQLog log] logOption:3 withFormat:@"deferred %d%%", 50];
+    [[SGQLog log] flush];
+    STAssertTrue([[[SGQLog log].logEntries lastObject] hasSuffix:@"] [opt3] deferred 50%"], @"Deferred option entry rendering", nil);
+
+    // Entries logged without an option have no tag.
+
+    [[SGQLog log] logWithFormat:@"untagged"];
+    [[SGQLog log] flush];
+    STAssertTrue([[[SGQLog log].logEntries lastObject] rangeOfString:@"[opt"].location == NSNotFound, @"Plain entries should not be tagged", nil);
+
+    [userDefaults removeObjectForKey:@"qlogDeferredFormatting"];
+    [userDefaults removeObjectForKey:@"qlogOption3"];
+    [userDefaults removeObjectForKey:@"qlogEnabled"];
+    [[SGQLog log] clear];
+}
+
+- (void)testSegmentedStreamConcatenatesSegments {
+    NSString *                      compressedPath;
+    NSString *                      plainPath;
+    gzFile                          compressedFile;
+    SGQLogSegmentedInputStream *    stream;
+    NSMutableData *                 contents;
+    uint8_t                         buffer[3];      // small, to force reads to span segments
+    NSInteger                       bytesRead;
+
+    compressedPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"SGQLogTest.1.log.gz"];
+    plainPath      = [NSTemporaryDirectory() stringByAppendingPathComponent:@"SGQLogTest.log"];
+
+    compressedFile = gzopen([compressedPath fileSystemRepresentation], "wb");
+    STAssertTrue(compressedFile != NULL, @"Could not create compressed segment", nil);
+    (void) gzwrite(compressedFile, "old entry\n", 10);
+    (void) gzclose(compressedFile);
+    STAssertTrue([@"new entry\n" writeToFile:plainPath atomically:NO encoding:NSUTF8StringEncoding error:NULL], @"Could not create plain segment", nil);
+
+    STAssertEquals([SGQLogSegmentedInputStream uncompressedLengthOfSegmentAtPath:compressedPath], (off_t) 10, @"Length should come from the gzip trailer", nil);
+    STAssertEquals([SGQLogSegmentedInputStream uncompressedLengthOfSegmentAtPath:plainPath],      (off_t) 10, @"Length should come from the file size", nil);
+
+    stream = [[[SGQLogSegmentedInputStream alloc] initWithSegmentPaths:[NSArray arrayWithObjects:compressedPath, @"/nonexistent", plainPath, nil]] autorelease];
+
+    // The stream opens its segments up front, so deleting them now mustn't matter.
+
+    (void) unlink([compressedPath fileSystemRepresentation]);
+    (void) unlink([plainPath fileSystemRepresentation]);
+
+    contents = [NSMutableData data];
+    [stream open];
+    while ( (bytesRead = [stream read:buffer maxLength:sizeof(buffer)]) > 0 ) {
+        [contents appendBytes:buffer length:(NSUInteger) bytesRead];
+    }
+    STAssertEquals(bytesRead, (NSInteger) 0, @"Stream should end cleanly", nil);
+    STAssertEquals([stream streamStatus], NSStreamStatusAtEnd, @"Stream should be at end", nil);
+    [stream close];
+
+    STAssertEqualObjects([[[NSString alloc] initWithData:contents encoding:NSUTF8StringEncoding] autorelease], @"old entry\nnew entry\n", @"Segments should be concatenated oldest first", nil);
+}
+
+- (void)testLeveledEntriesAndDisabledLevelCost {
+    NSUserDefaults *    userDefaults;
+    double              runtimeDisabled;
+    double              compiledOut;
+
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults setBool:YES forKey:@"qlogEnabled"];
+    [userDefaults setInteger:kSGQLogLevelWarning forKey:@"qlogMinimumLevel"];
+    STAssertEquals([SGQLog log].minimumLevel, (SGQLogLevel) kSGQLogLevelWarning, @"Preference should have been applied", nil);
+
+    // An enabled entry is rendered with its level, subsystem and sorted fields.
+
+    SGQLogAtLevel(kSGQLogLevelError, @"net", SGQLogFields(@"x", @"url", [NSNumber numberWithInt:404], @"status"), @"request %d failed", 7);
+    [[SGQLog log] flush];
+    STAssertTrue([[[SGQLog log].logEntries lastObject] hasSuffix:@"E [net] request 7 failed status=404 url=x"], @"Leveled entry rendering", nil);
+
+    // A disabled entry must not even evaluate its arguments.
+
+    gArgumentEvaluations = 0;
+    runtimeDisabled = NanosecondsPerDisabledCall(NO,  1000000);
+    compiledOut     = NanosecondsPerDisabledCall(YES, 1000000);
+    STAssertEquals(gArgumentEvaluations, (NSUInteger) 0, @"Disabled levels should not evaluate their arguments", nil);
+
+    NSLog(@"SGQLog disabled at runtime:       %6.2f ns/call", runtimeDisabled);
+    NSLog(@"SGQLog disabled at compile time:  %6.2f ns/call", compiledOut);
+
+    [userDefaults removeObjectForKey:@"qlogMinimumLevel"];
+    [userDefaults removeObjectForKey:@"qlogEnabled"];
+    [[SGQLog log] clear];
+}
+
+- (void)testSearchIndexFilters {
+    static const char kLog[] = 
+        "2011-12-01 12:00:00.000 App[12:1a03] starting up\n"
+        "2011-12-01 12:00:05.000000125 App[12:1a03#2] W [net] Request FAILED status=500\n"
+        "2011-12-01 12:01:00.000 App[12:2b07#1] [opt3] sync details\n"
+        "not a log entry, but request failed anyway\n";
+    SGQLogSearchIndex * index;
+    NSData *            data;
+    NSMutableData *     lineEnds;
+    const char *        cursor;
+
+    data = [NSData dataWithBytes:kLog length:sizeof(kLog) - 1];
+    lineEnds = [NSMutableData data];
+    for (cursor = kLog; (cursor = strchr(cursor, '\n')) != NULL; cursor++) {
+        uint32_t    lineEnd;
+
+        lineEnd = (uint32_t) (cursor + 1 - kLog);
+        [lineEnds appendBytes:&lineEnd length:sizeof(lineEnd)];
+    }
+
+    // Add the lines in two chunks, the way SGQLogFileReader would.
+
+    index = [[[SGQLogSearchIndex alloc] init] autorelease];
+    [index addLinesFromData:data lineEnds:[lineEnds bytes] count:1 generation:0];
+    [index addLinesFromData:data lineEnds:((const uint32_t *) [lineEnds bytes]) + 1 count:3 generation:0];
+    [index addLinesFromData:data lineEnds:[lineEnds bytes] count:1 generation:1];
+    STAssertEquals(index.lineCount, (NSUInteger) 4, @"Lines from the wrong generation should be ignored", nil);
+
+    #define AssertMatches(queryString, expected, description) \
+        STAssertEqualObjects([index linesMatchingQuery:[SGQLogSearchQuery queryWithString:queryString]], [NSData dataWithBytes:expected length:sizeof(expected) - sizeof(uint32_t)], description, nil)
+
+    { static const uint32_t kExpected[] = { 1, 3, 0 }; AssertMatches(@"request failed",               kExpected, @"Substring search should be case insensitive"); }
+    { static const uint32_t kExpected[] = { 1,    0 }; AssertMatches(@"failed tid:1a03",              kExpected, @"Thread filter"); }
+    { static const uint32_t kExpected[] = { 2,    0 }; AssertMatches(@"opt:3",                        kExpected, @"Option filter"); }
+    { static const uint32_t kExpected[] = { 1,    0 }; AssertMatches(@"level:w",                      kExpected, @"Level filter"); }
+    { static const uint32_t kExpected[] = { 1, 2, 0 }; AssertMatches(@"after:2011-12-01T12:00:01",    kExpected, @"Time filter"); }
+    { static const uint32_t kExpected[] = {       0 }; AssertMatches(@"no such text",                 kExpected, @"No matches"); }
+
+    #undef AssertMatches
+
+    [index resetWithGeneration:2];
+    STAssertEquals(index.lineCount, (NSUInteger) 0, @"Reset should empty the index", nil);
+}
+
+- (void)testCrashRingRecoversEntries {
+    NSString *          path;
+    SGQLogCrashRing *   ring;
+    NSMutableArray *    expected;
+    NSMutableString *   longEntry;
+    struct iovec        parts[2];
+
+    path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"SGQLogTest.crashring"];
+    (void) unlink([path fileSystemRepresentation]);
+
+    // Lap the ring, so that recovery has to discard the oldest entries and put 
+    // the rest back in order.
+
+    ring = [[SGQLogCrashRing alloc] initWithPath:path slotCount:4];
+    STAssertNotNil(ring, @"Crash ring should open", nil);
+    STAssertEquals([ring.recoveredEntries count], (NSUInteger) 0, @"New crash ring should be empty", nil);
+
+    expected = [NSMutableArray array];
+    for (int i = 0; i < 6; i++) {
+        char    entry[32];
+
+        parts[0].iov_base = "header ";
+        parts[0].iov_len  = 7;
+        parts[1].iov_base = entry;
+        parts[1].iov_len  = (size_t) snprintf(entry, sizeof(entry), "entry %d", i);
+        [ring addEntryWithParts:parts count:2 atIndex:[ring reserveEntryIndex]];
+        if (i >= 3) {
+            [expected addObject:[NSString stringWithFormat:@"header entry %d", i]];
+        }
+    }
+
+    // A long entry gets truncated, without splitting the multi-byte character 
+    // that straddles the limit.
+
+    longEntry = [NSMutableString string];
+    while ([longEntry length] < ring.maximumEntryLength) {
+        [longEntry appendString:@"\u00e9"];
+    }
+    parts[0].iov_base = "x";
+    parts[0].iov_len  = 1;
+    parts[1].iov_base = (void *) [longEntry UTF8String];
+    parts[1].iov_len  = strlen([longEntry UTF8String]);
+    [ring addEntryWithParts:parts count:2 atIndex:[ring reserveEntryIndex]];
+    [expected removeObjectAtIndex:0];
+    [expected addObject:[@"x" stringByAppendingString:[longEntry substringToIndex:(ring.maximumEntryLength - 1) / 2]]];
+
+    // Reopening the ring is equivalent to relaunching after a crash.
+
+    [ring release];
+    ring = [[SGQLogCrashRing alloc] initWithPath:path slotCount:4];
+    STAssertEqualObjects(RecoveredStrings(ring), expected, @"Crash ring should recover the newest entries, oldest first", nil);
+    [ring release];
+
+    ring = [[SGQLogCrashRing alloc] initWithPath:path slotCount:4];
+    STAssertEquals([ring.recoveredEntries count], (NSUInteger) 0, @"Recovered entries should only be recovered once", nil);
+    [ring release];
+
+    (void) unlink([path fileSystemRepresentation]);
+}
+
+- (void)testCrashRingSkipsFlushedEntries {
+    NSString *          path;
+    SGQLogCrashRing *   ring;
+    struct iovec        part;
+    int64_t             indexes[3];
+
+    path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"SGQLogTest.crashring"];
+    (void) unlink([path fileSystemRepresentation]);
+
+    // An entry that's marked as flushed isn't recovered.
+
+    ring = [[SGQLogCrashRing alloc] initWithPath:path slotCount:4];
+    STAssertNotNil(ring, @"Crash ring should open", nil);
+    for (int i = 0; i < 3; i++) {
+        char    entry[32];
+
+        part.iov_base = entry;
+        part.iov_len  = (size_t) snprintf(entry, sizeof(entry), "entry %d", i);
+        indexes[i] = [ring reserveEntryIndex];
+        [ring addEntryWithParts:&part count:1 atIndex:indexes[i]];
+    }
+    [ring markEntryFlushedAtIndex:indexes[1]];
+    [ring release];
+
+    ring = [[SGQLogCrashRing alloc] initWithPath:path slotCount:4];
+    STAssertEqualObjects(RecoveredStrings(ring), ([NSArray arrayWithObjects:@"entry 0", @"entry 2", nil]), @"Crash ring should skip flushed entries", nil);
+
+    // Nothing is recovered after a clean shutdown.
+
+    part.iov_base = "entry 3";
+    part.iov_len  = 7;
+    [ring addEntryWithParts:&part count:1 atIndex:[ring reserveEntryIndex]];
+    STAssertFalse(ring.cleanShutdown, @"Crash ring should start out unclean", nil);
+    ring.cleanShutdown = YES;
+    [ring release];
+
+    ring = [[SGQLogCrashRing alloc] initWithPath:path slotCount:4];
+    STAssertEquals([ring.recoveredEntries count], (NSUInteger) 0, @"Crash ring should recover nothing after a clean shutdown", nil);
+    STAssertFalse(ring.cleanShutdown, @"Reopened crash ring should start out unclean", nil);
+    [ring release];
+
+    (void) unlink([path fileSystemRepresentation]);
+}
+
+- (void)testBackgroundFlushWritesEveryEntryOnce {
+    NSUserDefaults *    userDefaults;
+    uint64_t            droppedBefore;
+    pthread_t           threads[kBackgroundFlushThreads];
+    NSCountedSet *      fileMessages;
+    NSCountedSet *      memoryMessages;
+
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults setBool:YES forKey:@"qlogEnabled"];
+    [userDefaults setBool:NO  forKey:@"qlogLoggingToStdErr"];
+    [userDefaults setBool:YES forKey:@"qlogLoggingToFile"];
+    [userDefaults setBool:YES forKey:@"qlogBackgroundFlush"];
+    STAssertTrue([SGQLog log].flushingInBackground, @"Preference should have been applied", nil);
+    [[SGQLog log] clear];
+    droppedBefore = [SGQLog log].droppedEntryCount;
+
+    // Log from several threads at once, then let -flush wait for the flusher 
+    // thread to write out everything they logged.
+
+    for (NSUInteger t = 0; t < kBackgroundFlushThreads; t++) {
+        int     err;
+
+        err = pthread_create(&threads[t], NULL, BackgroundFlushLogger, (void *) (uintptr_t) t);
+        STAssertEquals(err, 0, @"Could not start logging thread", nil);
+    }
+    for (NSUInteger t = 0; t < kBackgroundFlushThreads; t++) {
+        (void) pthread_join(threads[t], NULL);
+    }
+    [[SGQLog log] flush];
+
+    // Every entry should be in both the log file and logEntries, exactly once.
+
+    STAssertEquals([SGQLog log].droppedEntryCount, droppedBefore, @"Background flushing should keep every entry", nil);
+    fileMessages   = MessagesWithPrefix([LogFileContents() componentsSeparatedByString:@"\n"], @"bgflush ");
+    memoryMessages = MessagesWithPrefix([SGQLog log].logEntries, @"bgflush ");
+    STAssertEquals([fileMessages count],   (NSUInteger) (kBackgroundFlushThreads * kBackgroundFlushEntriesPerThread), @"Log file should have every entry", nil);
+    STAssertEquals([memoryMessages count], (NSUInteger) (kBackgroundFlushThreads * kBackgroundFlushEntriesPerThread), @"logEntries should have every entry", nil);
+    for (NSUInteger t = 0; t < kBackgroundFlushThreads; t++) {
+        for (NSUInteger i = 0; i < kBackgroundFlushEntriesPerThread; i++) {
+            NSString *  message;
+
+            message = [NSString stringWithFormat:@"bgflush %lu.%lu", (unsigned long) t, (unsigned long) i];
+            STAssertEquals([fileMessages countForObject:message],   (NSUInteger) 1, @"Log file should have %@ once", message);
+            STAssertEquals([memoryMessages countForObject:message], (NSUInteger) 1, @"logEntries should have %@ once", message);
+        }
+    }
+
+    [userDefaults removeObjectForKey:@"qlogBackgroundFlush"];
+    [userDefaults removeObjectForKey:@"qlogLoggingToFile"];
+    [userDefaults removeObjectForKey:@"qlogLoggingToStdErr"];
+    [userDefaults removeObjectForKey:@"qlogEnabled"];
+    [[SGQLog log] clear];
+}
+
+- (void)testLogFileRotatesAndArchivesAreStreamed {
+    NSUserDefaults *    userDefaults;
+    NSString *          filler;
+    NSString *          current;
+    NSString *          everything;
+    NSInputStream *     stream;
+    off_t               length;
+    NSRange             firstRange;
+    NSRange             lastRange;
+
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults setBool:YES forKey:@"qlogEnabled"];
+    [userDefaults setBool:NO  forKey:@"qlogLoggingToStdErr"];
+    [userDefaults setBool:YES forKey:@"qlogLoggingToFile"];
+    [userDefaults setBool:NO  forKey:@"qlogBackgroundFlush"];
+    [[SGQLog log] clear];
+
+    // Log a bit more than QLOG_LOG_FILE_MAX_SIZE (512 KB by default), flushing 
+    // every so often so that the pending entries never overflow.  That rotates 
+    // the log file exactly once, with "rotation first" in the closed segment.
+
+    filler = [@"" stringByPaddingToLength:1000 withString:@"x" startingAtIndex:0];
+    [[SGQLog log] logWithFormat:@"rotation first"];
+    for (NSUInteger i = 0; i < 600; i++) {
+        [[SGQLog log] logWithFormat:@"rotation filler %lu %@", (unsigned long) i, filler];
+        if ((i % 50) == 49) {
+            [[SGQLog log] flush];
+        }
+    }
+    [[SGQLog log] logWithFormat:@"rotation last"];
+    [[SGQLog log] flush];
+
+    current = LogFileContents();
+    STAssertTrue([current rangeOfString:@"] rotation first\n"].location == NSNotFound, @"First entry should have been rotated out", nil);
+    STAssertTrue([current rangeOfString:@"] rotation last\n"].location  != NSNotFound, @"Last entry should be in the current log file", nil);
+
+    // Without archives, the stream is just the current log file.
+
+    stream = [[SGQLog log] streamForLogIncludingArchives:NO validToLength:&length];
+    STAssertEqualObjects(StreamContents(stream, length), current, @"Stream without archives should match the current log file", nil);
+
+    // With archives, the rotated segment comes first, whether or not the archive 
+    // queue has got around to compressing it yet.
+
+    stream = [[SGQLog log] streamForLogIncludingArchives:YES validToLength:&length];
+    everything = StreamContents(stream, length);
+    STAssertEquals((off_t) [everything lengthOfBytesUsingEncoding:NSUTF8StringEncoding], length, @"Stream should be valid to its reported length", nil);
+    firstRange = [everything rangeOfString:@"] rotation first\n"];
+    lastRange  = [everything rangeOfString:@"] rotation last\n"];
+    STAssertTrue(firstRange.location != NSNotFound, @"Stream with archives should include the rotated segment", nil);
+    STAssertTrue(lastRange.location  != NSNotFound, @"Stream with archives should include the current log file", nil);
+    STAssertTrue(firstRange.location < lastRange.location, @"Rotated segments should come first", nil);
+    STAssertTrue([everything hasSuffix:current], @"Stream with archives should end with the current log file", nil);
+
+    // Clearing the log deletes the rotated segments too.
+
+    [[SGQLog log] clear];
+    stream = [[SGQLog log] streamForLogIncludingArchives:YES validToLength:&length];
+    STAssertTrue([StreamContents(stream, length) rangeOfString:@"] rotation first\n"].location == NSNotFound, @"Clearing should delete rotated segments", nil);
+
+    [userDefaults removeObjectForKey:@"qlogBackgroundFlush"];
+    [userDefaults removeObjectForKey:@"qlogLoggingToFile"];
+    [userDefaults removeObjectForKey:@"qlogLoggingToStdErr"];
+    [userDefaults removeObjectForKey:@"qlogEnabled"];
+    [[SGQLog log] clear];
+}
+
+- (void)testFileReaderFollowsLogFile {
+    NSUserDefaults *    userDefaults;
+    NSString *          path;
+    off_t               length;
+    SGQLogFileReader *  reader;
+    id                  observer;
+    __block BOOL        notifiedAfterWrite;
+
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults setBool:YES forKey:@"qlogEnabled"];
+    [userDefaults setBool:NO  forKey:@"qlogLoggingToStdErr"];
+    [userDefaults setBool:YES forKey:@"qlogLoggingToFile"];
+    [userDefaults setBool:NO  forKey:@"qlogBackgroundFlush"];
+    [[SGQLog log] clear];
+
+    // By the time SGQLogEntriesDidChangeNotification is posted, the new entries 
+    // must already be in the log file, because that's when the viewer tells its 
+    // reader about them.
+
+    notifiedAfterWrite = NO;
+    observer = [[NSNotificationCenter defaultCenter] addObserverForName:SGQLogEntriesDidChangeNotification object:[SGQLog log] queue:nil usingBlock:^(NSNotification * note) {
+        #pragma unused(note)
+        if ([LogFileContents() rangeOfString:@"] reader 0\n"].location != NSNotFound) {
+            notifiedAfterWrite = YES;
+        }
+    }];
+    for (NSUInteger i = 0; i < 100; i++) {
+        [[SGQLog log] logWithFormat:@"reader %lu", (unsigned long) i];
+    }
+    [[SGQLog log] flush];
+    [[NSNotificationCenter defaultCenter] removeObserver:observer];
+    STAssertTrue(notifiedAfterWrite, @"Entries should be in the log file when the notification is posted", nil);
+
+    // The reader indexes the file in the background and then hands out lines.
+
+    path = [[SGQLog log] pathToLogFileValidToLength:&length];
+    STAssertNotNil(path, @"Should be logging to a file", nil);
+    reader = [[[SGQLogFileReader alloc] initWithPath:path] autorelease];
+    STAssertEquals(reader.lineCount, (NSUInteger) 0, @"Reader shouldn't look at the file until told to", nil);
+    [reader updateToLength:length];
+    STAssertTrue(WaitForLineCount(reader, 100), @"Reader should index every line", nil);
+    STAssertTrue([[reader lineAtIndex:0]  hasSuffix:@"] reader 0"],  @"First line", nil);
+    STAssertTrue([[reader lineAtIndex:99] hasSuffix:@"] reader 99"], @"Last line", nil);
+
+    // As the file grows, the reader picks up the new lines and keeps the old ones.
+
+    [[SGQLog log] logWithFormat:@"reader more"];
+    [[SGQLog log] flush];
+    (void) [[SGQLog log] pathToLogFileValidToLength:&length];
+    [reader updateToLength:length];
+    STAssertTrue(WaitForLineCount(reader, 101), @"Reader should pick up new lines", nil);
+    STAssertTrue([[reader lineAtIndex:0]   hasSuffix:@"] reader 0"],    @"Old lines should be unchanged", nil);
+    STAssertTrue([[reader lineAtIndex:100] hasSuffix:@"] reader more"], @"New line", nil);
+
+    // If the file is truncated, the reader starts again.
+
+    [[SGQLog log] clear];
+    [[SGQLog log] logWithFormat:@"reader after clear"];
+    [[SGQLog log] flush];
+    (void) [[SGQLog log] pathToLogFileValidToLength:&length];
+    [reader updateToLength:length];
+    STAssertTrue(WaitForLineCount(reader, 1), @"Reader should reindex a truncated file", nil);
+    STAssertTrue([[reader lineAtIndex:0] hasSuffix:@"] reader after clear"], @"Line after truncation", nil);
+
+    [userDefaults removeObjectForKey:@"qlogBackgroundFlush"];
+    [userDefaults removeObjectForKey:@"qlogLoggingToFile"];
+    [userDefaults removeObjectForKey:@"qlogLoggingToStdErr"];
+    [userDefaults removeObjectForKey:@"qlogEnabled"];
+    [[SGQLog log] clear];
+}
+
+- (void)testEntryHeaderFormat {
+    NSUserDefaults *    userDefaults;
+    NSDateFormatter *   formatter;
+    NSArray *           first;
+    NSArray *           second;
+    NSArray *           coarse;
+    NSDate *            date;
+
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults setBool:YES forKey:@"qlogEnabled"];
+    [userDefaults setBool:NO  forKey:@"qlogLoggingToStdErr"];
+    [userDefaults setBool:NO  forKey:@"qlogDeferredFormatting"];
+    [userDefaults setBool:YES forKey:@"qlogPreciseTimestamps"];
+    STAssertTrue([SGQLog log].preciseTimestamps, @"Preference should have been applied", nil);
+
+    // Precise entries look like "YYYY-MM-DD HH:MM:SS.nnnnnnnnn prog[pid:thread#seq] ".
+
+    [[SGQLog log] logWithFormat:@"header first"];
+    [[SGQLog log] logWithFormat:@"header second"];
+    [[SGQLog log] flush];
+    first  = HeaderFields([[SGQLog log].logEntries objectAtIndex:[[SGQLog log].logEntries count] - 2]);
+    second = HeaderFields([[SGQLog log].logEntries lastObject]);
+    STAssertNotNil(first,  @"First entry header should be well formed", nil);
+    STAssertNotNil(second, @"Second entry header should be well formed", nil);
+    if ( (first != nil) && (second != nil) ) {
+        STAssertEquals([[first objectAtIndex:1] length], (NSUInteger) 9, @"Precise entries should have nanoseconds", nil);
+        STAssertEquals([[first objectAtIndex:2] intValue], (int) getpid(), @"Header should contain the pid", nil);
+        STAssertEqualObjects([first objectAtIndex:3], [second objectAtIndex:3], @"Both entries come from the same thread", nil);
+        STAssertEquals([[second objectAtIndex:4] longLongValue], [[first objectAtIndex:4] longLongValue] + 1, @"Thread sequence numbers should count up", nil);
+        STAssertEqualObjects([first objectAtIndex:5],  @"header first",  @"First entry message", nil);
+        STAssertEqualObjects([second objectAtIndex:5], @"header second", @"Second entry message", nil);
+
+        // The fixed width format sorts by time, and the monotonic clock never goes backwards.
+
+        STAssertTrue([[[second objectAtIndex:0] stringByAppendingString:[second objectAtIndex:1]] compare:[[first objectAtIndex:0] stringByAppendingString:[first objectAtIndex:1]]] != NSOrderedAscending, @"Precise timestamps should not go backwards", nil);
+
+        // The monotonic clock is anchored to the wall clock, so the time should be about now.
+
+        formatter = [[[NSDateFormatter alloc] init] autorelease];
+        [formatter setLocale:[[[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"] autorelease]];
+        [formatter setDateFormat:@"yyyy-MM-dd HH:mm:ss"];
+        date = [formatter dateFromString:[second objectAtIndex:0]];
+        STAssertNotNil(date, @"Date should parse", nil);
+        STAssertTrue(fabs([date timeIntervalSinceNow]) < 5.0, @"Precise timestamp should be close to now", nil);
+    }
+
+    // Otherwise entries get milliseconds, like NSLog.
+
+    [userDefaults setBool:NO  forKey:@"qlogPreciseTimestamps"];
+    STAssertFalse([SGQLog log].preciseTimestamps, @"Preference should have been applied", nil);
+    [[SGQLog log] logWithFormat:@"header coarse"];
+    [[SGQLog log] flush];
+    coarse = HeaderFields([[SGQLog log].logEntries lastObject]);
+    STAssertNotNil(coarse, @"Coarse entry header should be well formed", nil);
+    STAssertEquals([[coarse objectAtIndex:1] length], (NSUInteger) 3, @"Coarse entries should have milliseconds", nil);
+    STAssertEqualObjects([coarse objectAtIndex:5], @"header coarse", @"Coarse entry message", nil);
+
+    [userDefaults removeObjectForKey:@"qlogPreciseTimestamps"];
+    [userDefaults removeObjectForKey:@"qlogDeferredFormatting"];
+    [userDefaults removeObjectForKey:@"qlogLoggingToStdErr"];
+    [userDefaults removeObjectForKey:@"qlogEnabled"];
+    [[SGQLog log] clear];
+}
+
+@end
+
+// Everything below this point is compiled with debug entries compiled out.
+
+#undef  SGQLOG_COMPILED_MINIMUM_LEVEL
+#define SGQLOG_COMPILED_MINIMUM_LEVEL kSGQLogLevelInfo
+
+static void ElidedDebugCall(void)
+{
+    SGQLogDebug(@"bench", @"value %@", CountedArgument());
+}
@@ -5,11 +5,27 @@
 
 */
 
+// If QLog is logging to a file, the viewer pages through that file, rather than 
+// showing just the in-memory entries.  The file is read with SGQLogFileReader, 
+// so opening the viewer is cheap regardless of how big the log file is.  In that 
+// case the viewer also has a search bar, backed by SGQLogSearchIndex; see 
+// +[SGQLogSearchQuery queryWithString:] for the query syntax.
+
 #import <UIKit/UIKit.h>
 
+@class SGQLogFileReader;
+@class SGQLogSearchIndex;
+@class SGQLogSearchQuery;
+
 @interface SGQLogViewer : UITableViewController
 {
-    int                 _logEntriesDummy;
+    int                 _lineCountDummy;
+    SGQLogFileReader *  _logFileReader;
+    SGQLogSearchIndex * _searchIndex;
+    SGQLogSearchQuery * _query;
+    NSData *            _matchingLines;
+    BOOL                _searching;
+    BOOL                _searchNeedsRerun;
     UIActionSheet *     _actionSheet;
     UIAlertView *       _alertView;
 }
@@ -7,12 +7,14 @@
 #import "SGQLogViewer.h"
 
 #import "SGQLog.h"
+#import "SGQLogFileReader.h"
+#import "SGQLogSearchIndex.h"
 
 #import <MessageUI/MessageUI.h>
 
 #include "zlib.h"
 
-@interface SGQLogViewer () <UIActionSheetDelegate, UIAlertViewDelegate, MFMailComposeViewControllerDelegate>
+@interface SGQLogViewer () <UIActionSheetDelegate, UIAlertViewDelegate, MFMailComposeViewControllerDelegate, UISearchBarDelegate>
 
 // private properties
 
@@ -22,6 +24,8 @@
 // forward declarations
 
 - (void)dismissActionsAndAlerts;
+- (void)updateLogFileReader;
+- (void)startSearch;
 
 @end
 
@@ -31,7 +35,25 @@
 {
     self = [super initWithStyle:UITableViewStylePlain];
     if (self != nil) {
-        [[SGQLog log] addObserver:self forKeyPath:@"logEntries" options:0 context:&self->_logEntriesDummy];
+        NSString *  logFilePath;
+
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(logEntriesDidChange:) name:SGQLogEntriesDidChangeNotification object:[SGQLog log]];
+
+        // If we're logging to a file, page through that rather than displaying the 
+        // in-memory entries.
+
+        logFilePath = [[SGQLog log] pathToLogFileValidToLength:NULL];
+        if (logFilePath != nil) {
+            self->_logFileReader = [[SGQLogFileReader alloc] initWithPath:logFilePath];
+            assert(self->_logFileReader != nil);
+
+            self->_searchIndex = [[SGQLogSearchIndex alloc] init];
+            assert(self->_searchIndex != nil);
+            self->_logFileReader.searchIndex = self->_searchIndex;
+
+            [self->_logFileReader addObserver:self forKeyPath:@"lineCount" options:0 context:&self->_lineCountDummy];
+            [self updateLogFileReader];
+        }
         [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(willResignActive:) name:UIApplicationWillResignActiveNotification object:nil];
     }
     // You can enable the following to test how the QLog subsystem responds to entries being added; 
@@ -44,7 +66,14 @@
 
 - (void)dealloc
 {
-    [[SGQLog log] removeObserver:self forKeyPath:@"logEntries"];
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:SGQLogEntriesDidChangeNotification object:[SGQLog log]];
+    if (self->_logFileReader != nil) {
+        [self->_logFileReader removeObserver:self forKeyPath:@"lineCount"];
+        [self->_logFileReader release];
+    }
+    [self->_searchIndex release];
+    [self->_query release];
+    [self->_matchingLines release];
     [[NSNotificationCenter defaultCenter] removeObserver:self name:UIApplicationWillResignActiveNotification object:nil];
     assert(self->_actionSheet == nil);          // should be gone at this point
     assert(self->_alertView == nil);            // should be gone at this point
@@ -69,6 +98,23 @@
     
     self.tableView.allowsSelection = NO;
     self.tableView.rowHeight = 60.0f;
+
+    // If we're paging through the log file, add a search bar.
+
+    if (self->_searchIndex != nil) {
+        UISearchBar *   searchBar;
+
+        searchBar = [[[UISearchBar alloc] initWithFrame:CGRectMake(0.0f, 0.0f, self.tableView.bounds.size.width, 44.0f)] autorelease];
+        assert(searchBar != nil);
+
+        searchBar.autoresizingMask = UIViewAutoresizingFlexibleWidth;
+        searchBar.autocapitalizationType = UITextAutocapitalizationTypeNone;
+        searchBar.autocorrectionType = UITextAutocorrectionTypeNo;
+        searchBar.placeholder = @"Search, tid:, level:, opt:, after:, before:";
+        searchBar.delegate = self;
+
+        self.tableView.tableHeaderView = searchBar;
+    }
 }
 
 - (void)viewWillDisappear:(BOOL)animated
@@ -99,50 +145,192 @@
     return indexPaths;
 }
 
-- (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
+- (void)updateLogFileReader
+    // Tells the log file reader how much of the log file is now valid.
 {
-    if (context == &self->_logEntriesDummy) {
-    
-        // Respond to changes in the logEntries property of the QLog.
-    
-        assert([keyPath isEqual:@"logEntries"]);
-        assert(object = [SGQLog log]);
-        assert(change != nil);
+    NSString *  logFilePath;
+    off_t       logFileLength;
 
-        if (self.isViewLoaded) {
-            NSIndexSet *    indexes;
-            
-            indexes = [change objectForKey:NSKeyValueChangeIndexesKey];
-            assert( (indexes == nil) || [indexes isKindOfClass:[NSIndexSet class]] );
-            
-            assert([change objectForKey:NSKeyValueChangeKindKey] != nil);
-            switch ( [[change objectForKey:NSKeyValueChangeKindKey] intValue] ) {
-                default:
-                    assert(NO);
-                case NSKeyValueChangeSetting: {
-                    [self.tableView reloadData];
-                } break;
-                case NSKeyValueChangeInsertion: {
-                    assert(indexes != nil);
-                    [self.tableView insertRowsAtIndexPaths:[self indexPathsForSection:0 rowIndexSet:indexes] withRowAnimation:UITableViewRowAnimationNone];
-                    [self.tableView flashScrollIndicators];
-                } break;
-                case NSKeyValueChangeRemoval: {
-                    assert(indexes != nil);
-                    [self.tableView deleteRowsAtIndexPaths:[self indexPathsForSection:0 rowIndexSet:indexes] withRowAnimation:UITableViewRowAnimationNone];
-                    [self.tableView flashScrollIndicators];
-                } break;
-                case NSKeyValueChangeReplacement: {
-                    assert(indexes != nil);
-                    [self.tableView reloadRowsAtIndexPaths:[self indexPathsForSection:0 rowIndexSet:indexes] withRowAnimation:UITableViewRowAnimationNone];
-                } break;
-            }
+    assert(self->_logFileReader != nil);
+
+    // If logging to a file has been turned off, we just leave the reader 
+    // displaying what it's got.
+
+    logFilePath = [[SGQLog log] pathToLogFileValidToLength:&logFileLength];
+    if (logFilePath != nil) {
+        assert([logFilePath isEqual:self->_logFileReader.path]);
+        [self->_logFileReader updateToLength:logFileLength];
+    }
+}
+
+- (void)logEntriesDidChange:(NSNotification *)note
+    // Called in response to SGQLogEntriesDidChangeNotification.  We apply the 
+    // removals and additions as a single table view update.
+{
+    NSUInteger      removedCount;
+    NSUInteger      addedCount;
+    NSUInteger      rowCount;
+
+    assert([note object] == [SGQLog log]);
+
+    if (self->_logFileReader != nil) {
+
+        // The log entries have been written to the log file, so get the 
+        // reader to pick them up.  That will in turn change its lineCount, 
+        // which is how the table view finds out about them.
+
+        [self updateLogFileReader];
+    } else if (self.isViewLoaded) {
+        removedCount = [[[note userInfo] objectForKey:SGQLogEntriesRemovedCountKey] unsignedIntegerValue];
+        addedCount   = [[[note userInfo] objectForKey:SGQLogEntriesAddedCountKey]   unsignedIntegerValue];
+        rowCount     = [[SGQLog log].logEntries count];
+        assert(addedCount <= rowCount);
+
+        [self.tableView beginUpdates];
+        if (removedCount != 0) {
+            [self.tableView deleteRowsAtIndexPaths:[self indexPathsForSection:0 rowIndexSet:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, removedCount)]] withRowAnimation:UITableViewRowAnimationNone];
+        }
+        if (addedCount != 0) {
+            [self.tableView insertRowsAtIndexPaths:[self indexPathsForSection:0 rowIndexSet:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(rowCount - addedCount, addedCount)]] withRowAnimation:UITableViewRowAnimationNone];
+        }
+        [self.tableView endUpdates];
+        [self.tableView flashScrollIndicators];
+    }
+}
+
+- (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
+{
+    if (context == &self->_lineCountDummy) {
+        assert([keyPath isEqual:@"lineCount"]);
+        assert(object == self->_logFileReader);
+
+        // Only the visible rows are decoded, so reloading is cheap.  If we're 
+        // filtering, rerun the search to pick up any new matching lines; the 
+        // table gets reloaded when the search is done.
+
+        if (self->_query != nil) {
+            [self startSearch];
+        } else if (self.isViewLoaded) {
+            [self.tableView reloadData];
         }
     } else if (NO) {   // Disabled because the super class does nothing useful with it.
         [super observeValueForKeyPath:keyPath ofObject:object change:change context:context];
     }
 }
 
+#pragma mark * Searching
+
+- (void)startSearch
+    // Runs the current query on a background thread.  Only one search runs at a 
+    // time; if the query changes while a search is running, we run the search 
+    // again when it's done.
+{
+    assert([NSThread isMainThread]);
+    assert(self->_searchIndex != nil);
+
+    if (self->_query == nil) {
+        [self->_matchingLines release];
+        self->_matchingLines = nil;
+        if (self.isViewLoaded) {
+            [self.tableView reloadData];
+        }
+    } else if (self->_searching) {
+        self->_searchNeedsRerun = YES;
+    } else {
+        self->_searching = YES;
+        [self performSelectorInBackground:@selector(searchInBackground:) withObject:[NSDictionary dictionaryWithObjectsAndKeys:
+            self->_query,       @"query", 
+            self->_searchIndex, @"searchIndex", 
+            nil
+        ]];
+    }
+}
+
+- (void)searchInBackground:(NSDictionary *)request
+    // Runs on a background thread to run a query.
+{
+    NSAutoreleasePool *     pool;
+    SGQLogSearchQuery *     query;
+    NSData *                matchingLines;
+
+    pool = [[NSAutoreleasePool alloc] init];
+    assert(pool != nil);
+
+    query = [request objectForKey:@"query"];
+    assert(query != nil);
+
+    matchingLines = [[request objectForKey:@"searchIndex"] linesMatchingQuery:query];
+    assert(matchingLines != nil);
+
+    [self performSelectorOnMainThread:@selector(searchDidFinish:) withObject:[NSDictionary dictionaryWithObjectsAndKeys:
+        query,          @"query", 
+        matchingLines,  @"matchingLines", 
+        nil
+    ] waitUntilDone:NO];
+
+    [pool drain];
+}
+
+- (void)searchDidFinish:(NSDictionary *)result
+    // Called on the main thread when a search is done.
+{
+    assert([NSThread isMainThread]);
+    assert(self->_searching);
+
+    self->_searching = NO;
+
+    // Ignore the results if the query has changed since we started.
+
+    if ([result objectForKey:@"query"] == self->_query) {
+        [self->_matchingLines release];
+        self->_matchingLines = [[result objectForKey:@"matchingLines"] retain];
+        if (self.isViewLoaded) {
+            [self.tableView reloadData];
+        }
+    }
+    if (self->_searchNeedsRerun) {
+        self->_searchNeedsRerun = NO;
+        [self startSearch];
+    }
+}
+
+- (NSUInteger)matchingLineCount
+    // Returns the number of matching lines that the log file reader knows about.  
+    // The search index runs slightly ahead of the reader, so the last few matches 
+    // may not be displayable yet.
+{
+    const uint32_t *    lines;
+    NSUInteger          count;
+
+    assert(self->_matchingLines != nil);
+
+    lines = [self->_matchingLines bytes];
+    count = [self->_matchingLines length] / sizeof(uint32_t);
+    while ( (count != 0) && (lines[count - 1] >= self->_logFileReader.lineCount) ) {
+        count -= 1;
+    }
+    return count;
+}
+
+- (void)searchBar:(UISearchBar *)searchBar textDidChange:(NSString *)searchText
+{
+    #pragma unused(searchBar)
+    SGQLogSearchQuery * query;
+
+    query = [SGQLogSearchQuery queryWithString:searchText];
+    assert(query != nil);
+
+    [self->_query release];
+    self->_query = query.isEmpty ? nil : [query retain];
+
+    [self startSearch];
+}
+
+- (void)searchBarSearchButtonClicked:(UISearchBar *)searchBar
+{
+    [searchBar resignFirstResponder];
+}
+
 #pragma mark * Table view callbacks
 
 - (NSInteger)tableView:(UITableView *)tv numberOfRowsInSection:(NSInteger)section
@@ -152,6 +340,12 @@
     assert(tv == self.tableView);
     assert(section == 0);
 
+    if (self->_matchingLines != nil) {
+        return (NSInteger) [self matchingLineCount];
+    }
+    if (self->_logFileReader != nil) {
+        return (NSInteger) self->_logFileReader.lineCount;
+    }
     return (NSInteger)[[SGQLog log].logEntries count];
 }
 
@@ -164,7 +358,6 @@
     assert(tv == self.tableView);
     assert(indexPath != NULL);
     assert(indexPath.section == 0);
-    assert(indexPath.row < (NSInteger)[[SGQLog log].logEntries count]);
 
     cell = [self.tableView dequeueReusableCellWithIdentifier:@"cell"];
     if (cell == nil) {
@@ -180,7 +373,16 @@
         //
         // cell.accessoryType = UITableViewCellAccessoryDisclosureIndicator;
     }
-    cell.textLabel.text = [[SGQLog log].logEntries objectAtIndex:(NSUInteger)indexPath.row];
+    if (self->_matchingLines != nil) {
+        assert(indexPath.row < (NSInteger) [self matchingLineCount]);
+        cell.textLabel.text = [self->_logFileReader lineAtIndex:((const uint32_t *) [self->_matchingLines bytes])[indexPath.row]];
+    } else if (self->_logFileReader != nil) {
+        assert(indexPath.row < (NSInteger) self->_logFileReader.lineCount);
+        cell.textLabel.text = [self->_logFileReader lineAtIndex:(NSUInteger)indexPath.row];
+    } else {
+        assert(indexPath.row < (NSInteger)[[SGQLog log].logEntries count]);
+        cell.textLabel.text = [[SGQLog log].logEntries objectAtIndex:(NSUInteger)indexPath.row];
+    }
 
     return cell;
 }
@@ -243,7 +445,7 @@ static BOOL gzwrite_all(gzFile file, const uint8_t * buffer, size_t bytesToWrite
     compressedLogPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"CompressedLog.gz"];
     assert(compressedLogPath != NULL);
     
-    logStream = [[SGQLog log] streamForLogValidToLength:&logStreamLength];
+    logStream = [[SGQLog log] streamForLogIncludingArchives:YES validToLength:&logStreamLength];
     success = (logStream != nil);
     
     if (success) {
@@ -310,7 +512,7 @@ static BOOL gzwrite_all(gzFile file, const uint8_t * buffer, size_t bytesToWrite
     
     // Get a stream to the log data.
     
-    logStream = [[SGQLog log] streamForLogValidToLength:&logStreamLength];
+    logStream = [[SGQLog log] streamForLogIncludingArchives:YES validToLength:&logStreamLength];
     success = (logStream != nil);
     
     // Read the stream and write it to stderr.
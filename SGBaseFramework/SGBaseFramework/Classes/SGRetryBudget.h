@@ -0,0 +1,100 @@
+/*
+    File:       SGRetryBudget.h
+
+    Contains:   Limits the rate of retries to a host, and stops them while the host is failing.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+    SGRetryBudget decides whether a retry to a particular host may go out now. 
+    RetryingHTTPOperation asks it before each retry and tells it the outcome of 
+    each attempt.  It combines two mechanisms:
+
+    o A token bucket.  Each retry costs a token; the bucket holds up to capacity 
+      tokens and refills at refillRate tokens per second.  So however many 
+      operations are waiting, retries to the host go out in a burst of at most 
+      capacity and then at refillRate.  First attempts are free.
+
+    o A circuit breaker.  The budget keeps the outcomes of the last few attempts. 
+      If at least minimumSampleCount of them are known and more than 
+      maximumErrorRate of those failed, the circuit opens and no retries go out 
+      for openInterval.  After that it's half open: one retry (the probe) goes 
+      out.  If the probe succeeds, the circuit closes; if it fails, the circuit 
+      opens again.
+
+    When a retry isn't allowed, the budget says how long to wait before asking 
+    again; callers should add some jitter of their own.
+
+    +budgetForHost: returns a budget shared by everyone talking to that host.  All 
+    methods can be called from any thread.
+*/
+
+enum SGRetryBudgetCircuitState {
+    kSGRetryBudgetCircuitStateClosed, 
+    kSGRetryBudgetCircuitStateOpen, 
+    kSGRetryBudgetCircuitStateHalfOpen
+};
+typedef enum SGRetryBudgetCircuitState SGRetryBudgetCircuitState;
+
+@interface SGRetryBudget : NSObject
+{
+    NSString *                  _host;
+    double                      _capacity;
+    double                      _refillRate;
+    double                      _maximumErrorRate;
+    NSUInteger                  _minimumSampleCount;
+    NSTimeInterval              _openInterval;
+
+    // state, protected by @synchronized (self)
+
+    double                      _tokens;
+    NSTimeInterval              _refillTime;
+    void *                      _outcomes;
+    NSUInteger                  _outcomeCount;
+    NSUInteger                  _nextOutcome;
+    SGRetryBudgetCircuitState   _circuitState;
+    NSTimeInterval              _openTime;
+    NSTimeInterval              _probeTime;
+    uint64_t                    _grantedCount;
+    uint64_t                    _deniedCount;
+}
+
++ (SGRetryBudget *)budgetForHost:(NSString *)host;
+    // Returns the shared budget for host, creating it if necessary.  host is 
+    // compared case insensitively.
+
+- (id)initWithHost:(NSString *)host;
+    // Creates a budget that isn't shared.  This is mostly for tests.
+
+@property (nonatomic, copy,   readonly ) NSString *                 host;
+@property (atomic,    assign, readwrite) double                     capacity;           // default is 10 tokens
+@property (atomic,    assign, readwrite) double                     refillRate;         // default is 0.5 tokens per second
+@property (atomic,    assign, readwrite) double                     maximumErrorRate;   // default is 0.5
+@property (atomic,    assign, readwrite) NSUInteger                 minimumSampleCount; // default is 10, and at most 32
+@property (atomic,    assign, readwrite) NSTimeInterval             openInterval;       // default is 30 seconds
+
+@property (atomic,    assign, readonly ) SGRetryBudgetCircuitState  circuitState;
+@property (atomic,    assign, readonly ) uint64_t                   grantedCount;       // retries allowed so far
+@property (atomic,    assign, readonly ) uint64_t                   deniedCount;        // retries refused so far
+
+- (NSTimeInterval)reserveRetry;
+    // If a retry may go out now, takes a token and returns zero.  Otherwise 
+    // returns how long to wait before asking again.
+
+- (void)recordAttemptFailed:(BOOL)failed;
+    // Reports the outcome of an attempt, first or retry.  Only count failures 
+    // that say something about the host's health (network errors, say, but not 
+    // 404s).
+
+- (void)reset;
+    // Fills the bucket and closes the circuit, forgetting all outcomes.
+
+// These variants let you supply the current time, in seconds from any fixed point. 
+// They're for simulations and tests; times must not go backwards.
+
+- (NSTimeInterval)reserveRetryAtTime:(NSTimeInterval)now;
+- (void)recordAttemptFailed:(BOOL)failed atTime:(NSTimeInterval)now;
+
+@end
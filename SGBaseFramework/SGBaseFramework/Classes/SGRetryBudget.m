@@ -0,0 +1,331 @@
+/*
+    File:       SGRetryBudget.m
+
+    Contains:   Limits the rate of retries to a host, and stops them while the host is failing.
+
+*/
+
+#import "SGRetryBudget.h"
+
+#include <stdlib.h>
+#include <mach/mach_time.h>
+
+// The number of outcomes we keep for the circuit breaker.
+
+enum {
+    kOutcomeWindowSize = 32
+};
+
+// While a probe is out, other retries check back this often.  If the probe hasn't 
+// reported after openInterval (its operation was cancelled, say), we send another.
+
+static const NSTimeInterval kProbeCheckInterval = 1.0;
+
+@implementation SGRetryBudget
+
++ (SGRetryBudget *)budgetForHost:(NSString *)host
+    // See comment in header.
+{
+    static NSMutableDictionary *    sBudgets;
+    SGRetryBudget *                 result;
+    NSString *                      key;
+
+    // any thread
+    assert(host != nil);
+
+    key = [host lowercaseString];
+    @synchronized ([SGRetryBudget class]) {
+        if (sBudgets == nil) {
+            sBudgets = [[NSMutableDictionary alloc] init];
+            assert(sBudgets != nil);
+        }
+        result = [sBudgets objectForKey:key];
+        if (result == nil) {
+            result = [[[SGRetryBudget alloc] initWithHost:key] autorelease];
+            assert(result != nil);
+            [sBudgets setObject:result forKey:key];
+        }
+    }
+    return result;
+}
+
+- (id)initWithHost:(NSString *)host
+    // See comment in header.
+{
+    assert(host != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_host = [host copy];
+        self->_capacity = 10.0;
+        self->_refillRate = 0.5;
+        self->_maximumErrorRate = 0.5;
+        self->_minimumSampleCount = 10;
+        self->_openInterval = 30.0;
+        self->_tokens = self->_capacity;
+        self->_outcomes = calloc(kOutcomeWindowSize, sizeof(BOOL));
+        assert(self->_outcomes != NULL);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_host release];
+    free(self->_outcomes);
+    [super dealloc];
+}
+
+@synthesize host = _host;
+
+- (double)capacity
+{
+    @synchronized (self) {
+        return self->_capacity;
+    }
+}
+
+- (void)setCapacity:(double)newValue
+{
+    assert(newValue >= 1.0);
+    @synchronized (self) {
+        self->_capacity = newValue;
+        self->_tokens = MIN(self->_tokens, newValue);
+    }
+}
+
+- (double)refillRate
+{
+    @synchronized (self) {
+        return self->_refillRate;
+    }
+}
+
+- (void)setRefillRate:(double)newValue
+{
+    assert(newValue > 0.0);
+    @synchronized (self) {
+        self->_refillRate = newValue;
+    }
+}
+
+- (double)maximumErrorRate
+{
+    @synchronized (self) {
+        return self->_maximumErrorRate;
+    }
+}
+
+- (void)setMaximumErrorRate:(double)newValue
+{
+    assert( (newValue >= 0.0) && (newValue <= 1.0) );
+    @synchronized (self) {
+        self->_maximumErrorRate = newValue;
+    }
+}
+
+- (NSUInteger)minimumSampleCount
+{
+    @synchronized (self) {
+        return self->_minimumSampleCount;
+    }
+}
+
+- (void)setMinimumSampleCount:(NSUInteger)newValue
+{
+    assert( (newValue >= 1) && (newValue <= kOutcomeWindowSize) );
+    @synchronized (self) {
+        self->_minimumSampleCount = newValue;
+    }
+}
+
+- (NSTimeInterval)openInterval
+{
+    @synchronized (self) {
+        return self->_openInterval;
+    }
+}
+
+- (void)setOpenInterval:(NSTimeInterval)newValue
+{
+    assert(newValue > 0.0);
+    @synchronized (self) {
+        self->_openInterval = newValue;
+    }
+}
+
+- (SGRetryBudgetCircuitState)circuitState
+{
+    @synchronized (self) {
+        return self->_circuitState;
+    }
+}
+
+- (uint64_t)grantedCount
+{
+    @synchronized (self) {
+        return self->_grantedCount;
+    }
+}
+
+- (uint64_t)deniedCount
+{
+    @synchronized (self) {
+        return self->_deniedCount;
+    }
+}
+
+- (void)clearOutcomes
+    // Forgets the outcomes.  Must be called with @synchronized (self).
+{
+    self->_outcomeCount = 0;
+    self->_nextOutcome = 0;
+}
+
+- (void)reset
+    // See comment in header.
+{
+    @synchronized (self) {
+        self->_tokens = self->_capacity;
+        self->_refillTime = 0.0;
+        self->_circuitState = kSGRetryBudgetCircuitStateClosed;
+        [self clearOutcomes];
+    }
+}
+
+- (void)refillAtTime:(NSTimeInterval)now
+    // Adds the tokens earned since the last refill.  Must be called with @synchronized (self).
+{
+    if (self->_refillTime != 0.0) {
+        self->_tokens = MIN(self->_capacity, self->_tokens + ((now - self->_refillTime) * self->_refillRate));
+    }
+    self->_refillTime = now;
+}
+
+- (NSTimeInterval)reserveRetryAtTime:(NSTimeInterval)now
+    // See comment in header.
+{
+    NSTimeInterval  result;
+
+    // any thread
+    @synchronized (self) {
+        [self refillAtTime:now];
+
+        result = 0.0;
+        switch (self->_circuitState) {
+            default:
+                assert(NO);
+                // fall through
+            case kSGRetryBudgetCircuitStateClosed: {
+                if (self->_tokens >= 1.0) {
+                    self->_tokens -= 1.0;
+                } else {
+                    result = (1.0 - self->_tokens) / self->_refillRate;
+                }
+            } break;
+            case kSGRetryBudgetCircuitStateOpen: {
+                if ( (now - self->_openTime) < self->_openInterval ) {
+                    result = self->_openInterval - (now - self->_openTime);
+                } else {
+                    self->_circuitState = kSGRetryBudgetCircuitStateHalfOpen;
+                    self->_probeTime = now;
+                }
+            } break;
+            case kSGRetryBudgetCircuitStateHalfOpen: {
+                if ( (now - self->_probeTime) < self->_openInterval ) {
+                    result = kProbeCheckInterval;
+                } else {
+                    self->_probeTime = now;
+                }
+            } break;
+        }
+
+        // The probe doesn't need a token; it's already rate limited by openInterval.
+
+        if (result == 0.0) {
+            self->_grantedCount += 1;
+        } else {
+            assert(result > 0.0);
+            self->_deniedCount += 1;
+        }
+    }
+    return result;
+}
+
+static NSTimeInterval MonotonicTime(void)
+    // Returns the time, in seconds, since some arbitrary point.  We measure tokens and 
+    // open intervals against mach_absolute_time, rather than the wall clock, because 
+    // it never jumps, whereas the wall clock moves whenever the user or the network 
+    // time service sets it.
+{
+    mach_timebase_info_data_t   timebase;
+
+    (void) mach_timebase_info(&timebase);
+    return ((double) mach_absolute_time() * timebase.numer / timebase.denom) / 1.0e9;
+}
+
+- (NSTimeInterval)reserveRetry
+    // See comment in header.
+{
+    return [self reserveRetryAtTime:MonotonicTime()];
+}
+
+- (void)recordAttemptFailed:(BOOL)failed atTime:(NSTimeInterval)now
+    // See comment in header.
+{
+    // any thread
+    @synchronized (self) {
+        switch (self->_circuitState) {
+            default:
+                assert(NO);
+                // fall through
+            case kSGRetryBudgetCircuitStateClosed: {
+                NSUInteger  failures;
+
+                ((BOOL *) self->_outcomes)[self->_nextOutcome] = failed;
+                self->_nextOutcome = (self->_nextOutcome + 1) % kOutcomeWindowSize;
+                if (self->_outcomeCount < kOutcomeWindowSize) {
+                    self->_outcomeCount += 1;
+                }
+
+                if (self->_outcomeCount >= self->_minimumSampleCount) {
+                    failures = 0;
+                    for (NSUInteger i = 0; i < self->_outcomeCount; i++) {
+                        if ( ((BOOL *) self->_outcomes)[i] ) {
+                            failures += 1;
+                        }
+                    }
+                    if ( ((double) failures / (double) self->_outcomeCount) > self->_maximumErrorRate ) {
+                        self->_circuitState = kSGRetryBudgetCircuitStateOpen;
+                        self->_openTime = now;
+                    }
+                }
+            } break;
+            case kSGRetryBudgetCircuitStateOpen: {
+                // Outcomes of attempts that started before the circuit opened tell us 
+                // nothing new.
+            } break;
+            case kSGRetryBudgetCircuitStateHalfOpen: {
+                
+                // We can't tell the probe's outcome from any other attempt's, but any 
+                // attempt that gets through is good news, and any failure is bad news.
+                
+                if (failed) {
+                    self->_circuitState = kSGRetryBudgetCircuitStateOpen;
+                    self->_openTime = now;
+                } else {
+                    self->_circuitState = kSGRetryBudgetCircuitStateClosed;
+                    self->_tokens = MAX(self->_tokens, 1.0);
+                    [self clearOutcomes];
+                }
+            } break;
+        }
+    }
+}
+
+- (void)recordAttemptFailed:(BOOL)failed
+    // See comment in header.
+{
+    [self recordAttemptFailed:failed atTime:MonotonicTime()];
+}
+
+@end
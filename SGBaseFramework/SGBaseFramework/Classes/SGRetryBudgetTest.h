@@ -0,0 +1,19 @@
+//
+//  SGRetryBudgetTest.h
+//  SGBaseFramework
+//
+//  Unit tests for SGRetryBudget, and a simulation of retries against a recovering server.
+
+#define USE_APPLICATION_UNIT_TEST 0
+
+#import <SenTestingKit/SenTestingKit.h>
+#import <UIKit/UIKit.h>
+
+
+@interface SGRetryBudgetTest : SenTestCase {
+}
+
+- (void)testBucketLimitsRetriesAndBreakerStopsThem;
+- (void)testBudgetedRetriesSpareRecoveringServer;
+
+@end
@@ -0,0 +1,230 @@
+//
+//  SGRetryBudgetTest.m
+//  SGBaseFramework
+//
+
+#import "SGRetryBudgetTest.h"
+#import "SGRetryBudget.h"
+#import "SGNetworkManager.h"
+#import "RetryingHTTPOperation.h"
+#import "SGTestHTTPServer.h"
+
+static const NSTimeInterval kSGRecoveringServerOutage   = 2.0;
+static const NSTimeInterval kSGSimulationBucketInterval = 0.1;
+static const NSUInteger     kSGSimulationClientCount    = 40;
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SGTestHTTPServer * StartRecoveringServer(CFAbsoluteTime recoveryTime)
+    // Starts a loopback server that's down until recoveryTime (it hangs up on every request
+    // without answering, which clients see as a network error) and then answers every
+    // request with a small 200.  It notes the time of every request, so that the test can
+    // see how the load was spread.
+{
+    SGTestHTTPResponse * response;
+    SGTestHTTPServer * server;
+
+    response = [SGTestHTTPResponse responseWithStatusCode:200 headers:[NSDictionary dictionaryWithObjectsAndKeys:
+        @"text/plain", @"Content-Type",
+        @"no-store", @"Cache-Control",
+        nil
+    ] body:[@"OK" dataUsingEncoding:NSASCIIStringEncoding]];
+    server = [[[SGTestHTTPServer alloc] initWithResponder:^(NSString * request, NSUInteger requestIndex) {
+        #pragma unused(request, requestIndex)
+        return (CFAbsoluteTimeGetCurrent() >= recoveryTime) ? response : nil;
+    }] autorelease];
+    server.recordsRequests = YES;
+    [server start];
+    return server;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@implementation SGRetryBudgetTest
+
+
+- (void)testBucketLimitsRetriesAndBreakerStopsThem {
+    SGRetryBudget * budget = [[[SGRetryBudget alloc] initWithHost:@"example.com"] autorelease];
+    NSTimeInterval now = 1000.0;
+    NSUInteger granted;
+
+    budget.capacity = 3.0;
+    budget.refillRate = 1.0;
+    budget.openInterval = 10.0;
+    budget.minimumSampleCount = 4;
+
+    // A burst of retries gets the bucket's worth, then has to wait for it to refill.
+
+    granted = 0;
+    for (NSUInteger i = 0; i < 10; i++) {
+        if ([budget reserveRetryAtTime:now] == 0.0) {
+            granted += 1;
+        }
+    }
+    STAssertEquals(granted, (NSUInteger) 3, @"A burst should get the bucket's capacity", nil);
+    STAssertEqualsWithAccuracy([budget reserveRetryAtTime:now], 1.0, 0.001, @"The next token is a second away", nil);
+    STAssertEquals([budget reserveRetryAtTime:now + 1.0], 0.0, @"The bucket should refill", nil);
+
+    // Mostly failures open the circuit; nothing gets through until openInterval is up.
+
+    for (NSUInteger i = 0; i < 4; i++) {
+        [budget recordAttemptFailed:(i != 0) atTime:now + 2.0];
+    }
+    STAssertEquals(budget.circuitState, (SGRetryBudgetCircuitState) kSGRetryBudgetCircuitStateOpen, nil, nil);
+    STAssertEqualsWithAccuracy([budget reserveRetryAtTime:now + 10.0], 2.0, 0.001, @"An open circuit should refuse retries", nil);
+
+    // Then one probe goes out, and only one.
+
+    STAssertEquals([budget reserveRetryAtTime:now + 12.0], 0.0, @"The probe should go out", nil);
+    STAssertEquals(budget.circuitState, (SGRetryBudgetCircuitState) kSGRetryBudgetCircuitStateHalfOpen, nil, nil);
+    STAssertTrue([budget reserveRetryAtTime:now + 12.5] > 0.0, @"Only the probe should go out", nil);
+
+    // A failed probe opens the circuit again; a good one closes it.
+
+    [budget recordAttemptFailed:YES atTime:now + 13.0];
+    STAssertEquals(budget.circuitState, (SGRetryBudgetCircuitState) kSGRetryBudgetCircuitStateOpen, nil, nil);
+    STAssertEquals([budget reserveRetryAtTime:now + 23.0], 0.0, nil, nil);
+    [budget recordAttemptFailed:NO atTime:now + 24.0];
+    STAssertEquals(budget.circuitState, (SGRetryBudgetCircuitState) kSGRetryBudgetCircuitStateClosed, nil, nil);
+    STAssertEquals([budget reserveRetryAtTime:now + 24.0], 0.0, nil, nil);
+}
+
+
+- (NSDictionary *)simulateWithBudget:(SGRetryBudget *)budget {
+    CFAbsoluteTime recoveryTime = CFAbsoluteTimeGetCurrent() + kSGRecoveringServerOutage;
+    SGTestHTTPServer * server = StartRecoveringServer(recoveryTime);
+    NSOperationQueue * queue = [[[NSOperationQueue alloc] init] autorelease];
+    NSMutableArray * operations = [NSMutableArray array];
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:60.0];
+    NSURL * url;
+    BOOL allFinished;
+    NSUInteger failedCount;
+    NSUInteger retryCount;
+    NSUInteger outageRequests;
+    NSUInteger peakRequests;
+    NSMutableDictionary * buckets;
+    CFAbsoluteTime startTime;
+    CFAbsoluteTime finishTime;
+
+    STAssertNotNil(server, @"Could not start the stub server", nil);
+    startTime = CFAbsoluteTimeGetCurrent();
+
+    // Everyone fails together at the start of the outage.
+
+    for (NSUInteger i = 0; i < kSGSimulationClientCount; i++) {
+        url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/item?i=%lu", (unsigned) server.port, (unsigned long) i]];
+        RetryingHTTPOperation * op = [[[RetryingHTTPOperation alloc] initWithRequest:[NSURLRequest requestWithURL:url]] autorelease];
+        op.minimumRetryDelay = 0.2;
+        op.maximumRetryDelay = 3.0;
+        op.retryBudget = budget;
+        [operations addObject:op];
+        [queue addOperation:op];
+    }
+    do {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+        allFinished = YES;
+        for (RetryingHTTPOperation * op in operations) {
+            allFinished = allFinished && [op isFinished];
+        }
+    } while (!allFinished && [deadline timeIntervalSinceNow] > 0);
+    finishTime = CFAbsoluteTimeGetCurrent();
+    [server stop];
+
+    failedCount = 0;
+    retryCount = 0;
+    for (RetryingHTTPOperation * op in operations) {
+        if (![op isFinished] || op.error != nil) {
+            failedCount += 1;
+        }
+        retryCount += op.retryCount;
+    }
+    STAssertEquals(failedCount, (NSUInteger) 0, @"Every operation should get through once the server recovers", nil);
+
+    // Every retry had to be granted by the budget first.
+
+    STAssertEquals((uint64_t) retryCount, budget.grantedCount, @"Each retry should be granted by the budget", nil);
+
+    // Load while the server was down, and the busiest interval after it came back.
+
+    outageRequests = 0;
+    buckets = [NSMutableDictionary dictionary];
+    for (NSNumber * time in server.requestTimes) {
+        if ([time doubleValue] < recoveryTime) {
+            outageRequests += 1;
+        } else {
+            NSNumber * bucket = [NSNumber numberWithLong:(long) (([time doubleValue] - recoveryTime) / kSGSimulationBucketInterval)];
+            [buckets setObject:[NSNumber numberWithUnsignedInteger:[[buckets objectForKey:bucket] unsignedIntegerValue] + 1] forKey:bucket];
+        }
+    }
+    peakRequests = 0;
+    for (NSNumber * count in [buckets allValues]) {
+        peakRequests = MAX(peakRequests, [count unsignedIntegerValue]);
+    }
+
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+        [NSNumber numberWithUnsignedInteger:[server.requestTimes count]], @"total",
+        [NSNumber numberWithUnsignedInteger:outageRequests], @"outage",
+        [NSNumber numberWithUnsignedInteger:peakRequests], @"peak",
+        [NSNumber numberWithDouble:finishTime - recoveryTime], @"recovery",
+        [NSNumber numberWithDouble:finishTime - startTime], @"duration",
+        nil
+    ];
+}
+
+
+- (void)testBudgetedRetriesSpareRecoveringServer {
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    NSUInteger savedMaximumTransfers = manager.maximumTransfers;
+    NSUInteger savedMaximumTransfersPerHost = manager.maximumTransfersPerHost;
+    SGRetryBudget * unlimited = [[[SGRetryBudget alloc] initWithHost:@"127.0.0.1"] autorelease];
+    SGRetryBudget * budget = [[[SGRetryBudget alloc] initWithHost:@"127.0.0.1"] autorelease];
+    NSDictionary * unlimitedResults;
+    NSDictionary * budgetResults;
+    NSTimeInterval duration;
+
+    // Let every attempt go straight to the server, so that it sees the clients' real
+    // behaviour rather than the manager's queueing.
+
+    manager.maximumTransfers = kSGSimulationClientCount;
+    manager.maximumTransfersPerHost = kSGSimulationClientCount;
+
+    // Jitter alone: a budget that never says no.
+
+    unlimited.capacity = 1000.0;
+    unlimited.refillRate = 1000.0;
+    unlimited.maximumErrorRate = 1.0;
+    unlimitedResults = [self simulateWithBudget:unlimited];
+
+    budget.capacity = 5.0;
+    budget.refillRate = 10.0;
+    budget.openInterval = 0.5;
+    budgetResults = [self simulateWithBudget:budget];
+
+    manager.maximumTransfers = savedMaximumTransfers;
+    manager.maximumTransfersPerHost = savedMaximumTransfersPerHost;
+
+    NSLog(@"%lu clients, %.1f s outage; jitter only: %@ requests (%@ during outage), peak %@ per %.0f ms, done %.1f s after recovery; "
+          "with budget: %@ requests (%@ during outage), peak %@ per %.0f ms, done %.1f s after recovery; %llu retries granted, %llu refused",
+          (unsigned long) kSGSimulationClientCount, kSGRecoveringServerOutage,
+          [unlimitedResults objectForKey:@"total"], [unlimitedResults objectForKey:@"outage"], [unlimitedResults objectForKey:@"peak"],
+          kSGSimulationBucketInterval * 1000.0, [[unlimitedResults objectForKey:@"recovery"] doubleValue],
+          [budgetResults objectForKey:@"total"], [budgetResults objectForKey:@"outage"], [budgetResults objectForKey:@"peak"],
+          kSGSimulationBucketInterval * 1000.0, [[budgetResults objectForKey:@"recovery"] doubleValue],
+          budget.grantedCount, budget.deniedCount);
+
+    // The load figures above depend on timing, so they're only logged.  What the budget
+    // hands out doesn't: it can't grant more than its capacity plus what it earned while
+    // the simulation ran, plus a probe per openInterval and the token each good probe
+    // leaves behind.
+
+    STAssertEquals(unlimited.deniedCount, (uint64_t) 0, @"The unlimited budget should never refuse", nil);
+    STAssertTrue(budget.deniedCount > 0, @"The budget should refuse the rush of retries", nil);
+    duration = [[budgetResults objectForKey:@"duration"] doubleValue];
+    STAssertTrue((double) budget.grantedCount <= budget.capacity + (duration * budget.refillRate) + 2.0 * ((duration / budget.openInterval) + 1.0),
+                 @"The budget should grant no more than its tokens allow", nil);
+}
+
+@end
@@ -0,0 +1,86 @@
+/*
+    File:       SGRunLoopThreadPool.h
+
+    Contains:   A small pool of threads that run run loops, for run loop based operations.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+    SGRunLoopThreadPool owns a fixed set of threads, each of which just runs its run 
+    loop.  It hands them out to run loop based operations (QRunLoopOperation and its 
+    subclasses) via their runLoopThread property, so that the callbacks for many 
+    concurrent operations are spread across several threads rather than all being 
+    serialised on one.  Some important points:
+
+    o An operation is assigned a thread once, before it starts, and keeps it for its 
+      whole life; all the callbacks for its connection run on that thread.  So the 
+      operation itself needs no extra locking.
+
+    o The pool picks a thread according to its policy.  kSGRunLoopThreadPoolPolicyLeastLoad 
+      (the default) picks the thread with the fewest unfinished operations, taking 
+      threads in turn when there's a tie; kSGRunLoopThreadPoolPolicyRoundRobin just 
+      takes them in turn.
+
+    o You must tell the pool when each operation it assigned has finished, by calling 
+      -operationDidFinish:.  SGNetworkManager does this for you.
+
+    o An operation that spends most of its life waiting, like a RetryingHTTPOperation 
+      between attempts, shouldn't count against its thread.  -nextThread picks a thread 
+      without counting anything, and -recordOperation:usingThread: counts an operation 
+      whose thread was picked some other way, like a transfer that inherits its thread 
+      from the operation that started it.  SGNetworkManager uses these to count only 
+      the transfers that are actually running.
+
+    o The threads live forever, like SGNetworkManager's single network thread used to.
+
+    All methods can be called from any thread.
+*/
+
+enum SGRunLoopThreadPoolPolicy {
+    kSGRunLoopThreadPoolPolicyLeastLoad, 
+    kSGRunLoopThreadPoolPolicyRoundRobin
+};
+typedef enum SGRunLoopThreadPoolPolicy SGRunLoopThreadPoolPolicy;
+
+@interface SGRunLoopThreadPool : NSObject
+{
+    NSArray *                   _threads;
+    SGRunLoopThreadPoolPolicy   _policy;
+
+    // state, protected by @synchronized (self)
+
+    void *                      _loads;
+    CFMutableDictionaryRef      _assignments;
+    NSUInteger                  _nextThreadIndex;
+}
+
+- (id)initWithThreadCount:(NSUInteger)threadCount name:(NSString *)name threadPriority:(double)threadPriority;
+    // Creates and starts threadCount threads, named after name.  threadCount must 
+    // be at least one.
+
+@property (nonatomic, copy,   readonly ) NSArray *                  threads;
+@property (atomic,    assign, readwrite) SGRunLoopThreadPoolPolicy  policy;
+
+- (NSThread *)assignThreadForOperation:(id)operation;
+    // Picks a thread for operation and records that operation is using it.  The pool 
+    // doesn't retain operation.  It's the caller's job to actually set the operation's 
+    // runLoopThread.
+
+- (NSThread *)nextThread;
+    // Picks a thread, just as -assignThreadForOperation: does, but doesn't count 
+    // anything against it.
+
+- (void)recordOperation:(id)operation usingThread:(NSThread *)thread;
+    // Records that operation is using thread, as if -assignThreadForOperation: had 
+    // picked it.  Does nothing if thread is nil or isn't one of the pool's threads.
+
+- (void)operationDidFinish:(id)operation;
+    // Records that operation is no longer using its thread.  Does nothing if the pool 
+    // didn't assign a thread to operation.
+
+- (NSUInteger)loadOfThread:(NSThread *)thread;
+    // Returns the number of unfinished operations assigned to thread.
+
+@end
@@ -0,0 +1,219 @@
+/*
+    File:       SGRunLoopThreadPool.m
+
+    Contains:   A small pool of threads that run run loops, for run loop based operations.
+
+*/
+
+#import "SGRunLoopThreadPool.h"
+
+#include <stdlib.h>
+
+@implementation SGRunLoopThreadPool
+
+- (id)initWithThreadCount:(NSUInteger)threadCount name:(NSString *)name threadPriority:(double)threadPriority
+    // See comment in header.
+{
+    assert(threadCount >= 1);
+    assert(name != nil);
+    self = [super init];
+    if (self != nil) {
+        NSMutableArray *    threads;
+
+        self->_loads = calloc(threadCount, sizeof(NSUInteger));
+        assert(self->_loads != NULL);
+
+        // The keys are operations, which we neither retain nor copy.
+
+        self->_assignments = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+        assert(self->_assignments != NULL);
+
+        threads = [NSMutableArray arrayWithCapacity:threadCount];
+        assert(threads != nil);
+        for (NSUInteger i = 0; i < threadCount; i++) {
+            NSThread *  thread;
+
+            thread = [[[NSThread alloc] initWithTarget:self selector:@selector(runLoopThreadEntry) object:nil] autorelease];
+            assert(thread != nil);
+
+            if (threadCount == 1) {
+                [thread setName:name];
+            } else {
+                [thread setName:[NSString stringWithFormat:@"%@ %lu", name, (unsigned long) (i + 1)]];
+            }
+            if ( [thread respondsToSelector:@selector(setThreadPriority:)] ) {
+                [thread setThreadPriority:threadPriority];
+            }
+            [threads addObject:thread];
+        }
+        self->_threads = [threads copy];
+
+        for (NSThread * thread in self->_threads) {
+            [thread start];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // The threads retain us, so this can't happen.
+    assert(NO);
+    [super dealloc];
+}
+
+@synthesize threads = _threads;
+
+- (SGRunLoopThreadPoolPolicy)policy
+{
+    @synchronized (self) {
+        return self->_policy;
+    }
+}
+
+- (void)setPolicy:(SGRunLoopThreadPoolPolicy)newValue
+{
+    @synchronized (self) {
+        self->_policy = newValue;
+    }
+}
+
+- (void)runLoopThreadEntry
+    // Each of our threads just runs its run loop.
+{
+    assert( ! [NSThread isMainThread] );
+
+    // A run loop with no input sources returns from -run immediately, so give it one 
+    // that never fires; otherwise an idle thread would spin.
+
+    [[NSRunLoop currentRunLoop] addPort:[NSMachPort port] forMode:NSDefaultRunLoopMode];
+    while (YES) {
+        NSAutoreleasePool * pool;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+
+        [[NSRunLoop currentRunLoop] run];
+
+        [pool drain];
+    }
+    assert(NO);
+}
+
+- (NSUInteger)pickThreadIndex
+    // Picks a thread according to the policy and returns its index.  Must be called 
+    // with @synchronized (self).
+{
+    NSUInteger *    loads;
+    NSUInteger      threadCount;
+    NSUInteger      threadIndex;
+
+    loads = (NSUInteger *) self->_loads;
+    threadCount = [self->_threads count];
+
+    // Start looking at the next thread in turn, so that ties are broken round robin.
+
+    threadIndex = self->_nextThreadIndex;
+    if (self->_policy == kSGRunLoopThreadPoolPolicyLeastLoad) {
+        for (NSUInteger i = 1; i < threadCount; i++) {
+            NSUInteger  candidate;
+
+            candidate = (self->_nextThreadIndex + i) % threadCount;
+            if (loads[candidate] < loads[threadIndex]) {
+                threadIndex = candidate;
+            }
+        }
+    }
+    self->_nextThreadIndex = (threadIndex + 1) % threadCount;
+    return threadIndex;
+}
+
+- (void)recordOperation:(id)operation usingThreadIndex:(NSUInteger)threadIndex
+    // Counts operation against the thread at threadIndex.  Must be called with 
+    // @synchronized (self).
+{
+    assert(operation != nil);
+    assert(threadIndex < [self->_threads count]);
+    assert( ! CFDictionaryContainsKey(self->_assignments, operation) );
+
+    ((NSUInteger *) self->_loads)[threadIndex] += 1;
+    CFDictionarySetValue(self->_assignments, operation, (const void *) (uintptr_t) threadIndex);
+}
+
+- (NSThread *)assignThreadForOperation:(id)operation
+    // See comment in header.
+{
+    NSUInteger      threadIndex;
+
+    // any thread
+    assert(operation != nil);
+
+    @synchronized (self) {
+        threadIndex = [self pickThreadIndex];
+        [self recordOperation:operation usingThreadIndex:threadIndex];
+    }
+    return [self->_threads objectAtIndex:threadIndex];
+}
+
+- (NSThread *)nextThread
+    // See comment in header.
+{
+    NSUInteger      threadIndex;
+
+    // any thread
+    @synchronized (self) {
+        threadIndex = [self pickThreadIndex];
+    }
+    return [self->_threads objectAtIndex:threadIndex];
+}
+
+- (void)recordOperation:(id)operation usingThread:(NSThread *)thread
+    // See comment in header.
+{
+    NSUInteger      threadIndex;
+
+    // any thread
+    assert(operation != nil);
+
+    threadIndex = (thread == nil) ? NSNotFound : [self->_threads indexOfObjectIdenticalTo:thread];
+    if (threadIndex != NSNotFound) {
+        @synchronized (self) {
+            [self recordOperation:operation usingThreadIndex:threadIndex];
+        }
+    }
+}
+
+- (void)operationDidFinish:(id)operation
+    // See comment in header.
+{
+    const void *    value;
+
+    // any thread
+    assert(operation != nil);
+
+    @synchronized (self) {
+        if ( CFDictionaryGetValueIfPresent(self->_assignments, operation, &value) ) {
+            NSUInteger *    loads;
+
+            loads = (NSUInteger *) self->_loads;
+            assert(loads[(uintptr_t) value] != 0);
+            loads[(uintptr_t) value] -= 1;
+            CFDictionaryRemoveValue(self->_assignments, operation);
+        }
+    }
+}
+
+- (NSUInteger)loadOfThread:(NSThread *)thread
+    // See comment in header.
+{
+    NSUInteger  threadIndex;
+
+    // any thread
+    threadIndex = [self->_threads indexOfObjectIdenticalTo:thread];
+    assert(threadIndex != NSNotFound);
+    @synchronized (self) {
+        return ((NSUInteger *) self->_loads)[threadIndex];
+    }
+}
+
+@end
@@ -0,0 +1,24 @@
+//
+//  SGRunLoopThreadPoolTest.h
+//  SGBaseFramework
+//
+//  Unit tests and a throughput benchmark for SGRunLoopThreadPool.
+
+#define USE_APPLICATION_UNIT_TEST 0
+
+#import <SenTestingKit/SenTestingKit.h>
+#import <UIKit/UIKit.h>
+
+
+@interface SGRunLoopThreadPoolTest : SenTestCase {
+    NSUInteger _finishedCount;
+    NSUInteger _failedCount;
+    NSMutableSet * _workThreads;        // protected by @synchronized (self)
+    unsigned long long _bytesConsumed;  // protected by @synchronized (self)
+}
+
+- (void)testThreadsAreAssignedByLeastLoadAndRoundRobin;
+- (void)testOnlyRecordedOperationsCountAsLoad;
+- (void)testBulkTransfersAreSpreadOverEveryPoolThread;
+
+@end
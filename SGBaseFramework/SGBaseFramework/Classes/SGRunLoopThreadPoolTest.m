@@ -0,0 +1,209 @@
+//
+//  SGRunLoopThreadPoolTest.m
+//  SGBaseFramework
+//
+
+#import "SGRunLoopThreadPoolTest.h"
+#import "SGRunLoopThreadPool.h"
+#import "SGNetworkManager.h"
+#import "QHTTPOperation.h"
+#import "QHTTPResponseConsumer.h"
+#import "SGTestHTTPServer.h"
+
+static const NSUInteger kSGBulkServerBodyLength        = 2 * 1024 * 1024;
+
+static const NSUInteger kSGThreadBenchmarkRequestCount = 64;
+static const NSUInteger kSGThreadBenchmarkConcurrency  = 16;
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SGTestHTTPServer * StartBulkServer(void)
+    // Starts a loopback server that answers every request with the same large body, as
+    // fast as it can.  It honours keep-alive.
+{
+    SGTestHTTPServer * server;
+
+    server = [[[SGTestHTTPServer alloc] initWithStatusCode:200 headers:[NSDictionary dictionaryWithObjectsAndKeys:
+        @"application/octet-stream", @"Content-Type",
+        @"no-store", @"Cache-Control",
+        nil
+    ] body:[NSMutableData dataWithLength:kSGBulkServerBodyLength]] autorelease];
+    server.keepAlive = YES;
+    [server start];
+    return server;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@implementation SGRunLoopThreadPoolTest
+
+
+- (void)testThreadsAreAssignedByLeastLoadAndRoundRobin {
+    SGRunLoopThreadPool * pool = [[SGRunLoopThreadPool alloc] initWithThreadCount:3 name:@"SGRunLoopThreadPoolTest" threadPriority:0.5];
+    NSObject * ops[6];
+    NSThread * threads[6];
+
+    // The pool's threads retain it, so it's never deallocated; we don't release it either.
+
+    for (NSUInteger i = 0; i < 6; i++) {
+        ops[i] = [[[NSObject alloc] init] autorelease];
+    }
+
+    // With nothing running, least load takes the threads in turn.
+
+    for (NSUInteger i = 0; i < 3; i++) {
+        threads[i] = [pool assignThreadForOperation:ops[i]];
+        STAssertEquals(threads[i], [pool.threads objectAtIndex:i], nil, nil);
+    }
+
+    // Once the second thread's operation finishes, it's the least loaded.
+
+    [pool operationDidFinish:ops[1]];
+    STAssertEquals([pool loadOfThread:threads[1]], (NSUInteger) 0, nil, nil);
+    threads[3] = [pool assignThreadForOperation:ops[3]];
+    STAssertEquals(threads[3], threads[1], @"Least load should pick the idle thread", nil);
+
+    // Round robin ignores the load.
+
+    pool.policy = kSGRunLoopThreadPoolPolicyRoundRobin;
+    [pool operationDidFinish:ops[0]];
+    threads[4] = [pool assignThreadForOperation:ops[4]];
+    threads[5] = [pool assignThreadForOperation:ops[5]];
+    STAssertEquals(threads[4], [pool.threads objectAtIndex:2], @"Round robin should take the next thread", nil);
+    STAssertEquals(threads[5], [pool.threads objectAtIndex:0], nil, nil);
+    STAssertEquals([pool loadOfThread:[pool.threads objectAtIndex:2]], (NSUInteger) 2, nil, nil);
+
+    // The threads really do run their run loops.
+
+    STAssertFalse([threads[0] isEqual:[NSThread mainThread]], nil, nil);
+    STAssertTrue([threads[0] isExecuting], nil, nil);
+}
+
+
+- (void)testOnlyRecordedOperationsCountAsLoad {
+    SGRunLoopThreadPool * pool = [[SGRunLoopThreadPool alloc] initWithThreadCount:2 name:@"SGRunLoopThreadPoolTest uncounted" threadPriority:0.5];
+    NSObject * waiting = [[[NSObject alloc] init] autorelease];
+    NSObject * transfer = [[[NSObject alloc] init] autorelease];
+    NSThread * thread;
+
+    // A thread handed out by -nextThread carries no load, like a retrying operation
+    // that's backing off.
+
+    thread = [pool nextThread];
+    STAssertEquals(thread, [pool.threads objectAtIndex:0], nil, nil);
+    STAssertEquals([pool loadOfThread:thread], (NSUInteger) 0, nil, nil);
+    [pool operationDidFinish:waiting];
+    STAssertEquals([pool loadOfThread:thread], (NSUInteger) 0, @"Finishing an uncounted operation changes nothing", nil);
+
+    // A transfer that inherits the thread counts while it runs, and steers the next
+    // pick away from it.
+
+    [pool recordOperation:transfer usingThread:thread];
+    STAssertEquals([pool loadOfThread:thread], (NSUInteger) 1, nil, nil);
+    STAssertEquals([pool nextThread], [pool.threads objectAtIndex:1], nil, nil);
+    STAssertEquals([pool nextThread], [pool.threads objectAtIndex:1], @"Least load should avoid the busy thread", nil);
+    [pool operationDidFinish:transfer];
+    STAssertEquals([pool loadOfThread:thread], (NSUInteger) 0, nil, nil);
+
+    // Threads that aren't the pool's are ignored.
+
+    [pool recordOperation:transfer usingThread:[NSThread mainThread]];
+    [pool operationDidFinish:transfer];
+}
+
+
+- (void)transferDidFinish:(QHTTPOperation *)op {
+    _finishedCount += 1;
+    if (op.error != nil) {
+        _failedCount += 1;
+    }
+}
+
+
+- (double)throughputWithPool:(SGRunLoopThreadPool *)pool port:(in_port_t)port {
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:120.0];
+    CFAbsoluteTime start;
+    double result;
+
+    _finishedCount = 0;
+    _failedCount = 0;
+    _workThreads = [[NSMutableSet alloc] init];
+    _bytesConsumed = 0;
+
+    // Each body is hashed as it arrives, on the operation's run loop thread; that's the
+    // work that one thread would serialise.  The tap notes which thread that was.
+
+    start = CFAbsoluteTimeGetCurrent();
+    for (NSUInteger i = 0; i < kSGThreadBenchmarkRequestCount; i++) {
+        NSURL * url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/bulk?i=%lu", port, (unsigned long) i]];
+        QHTTPOperation * op = [[[QHTTPOperation alloc] initWithRequest:[manager requestToGetURL:url]] autorelease];
+
+        QHTTPBlockResponseConsumer * tap = [[[QHTTPBlockResponseConsumer alloc] initWithDataBlock:^(NSData * data, NSError ** errorPtr) {
+            #pragma unused(errorPtr)
+            @synchronized (self) {
+                [self->_workThreads addObject:[NSThread currentThread]];
+                self->_bytesConsumed += [data length];
+            }
+            return YES;
+        } finishBlock:nil] autorelease];
+
+        op.responseConsumer = [QHTTPResponseConsumer chainWithConsumers:[NSArray arrayWithObjects:tap, [[[QHTTPDigestResponseConsumer alloc] init] autorelease], nil]];
+        op.runLoopThread = [pool assignThreadForOperation:op];
+        [manager addNetworkTransferOperation:op finishedTarget:self action:@selector(transferDidFinish:)];
+        [pool operationDidFinish:op];       // the manager doesn't know about our pool; load doesn't matter here
+    }
+    while (_finishedCount < kSGThreadBenchmarkRequestCount && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    }
+    STAssertEquals(_finishedCount, kSGThreadBenchmarkRequestCount, @"All transfers should finish", nil);
+    STAssertEquals(_failedCount, (NSUInteger) 0, @"All transfers should succeed", nil);
+    result = (double) (kSGThreadBenchmarkRequestCount * kSGBulkServerBodyLength) / (CFAbsoluteTimeGetCurrent() - start);
+
+    // Every body went through the tap, and only the pool's threads did the work.  Ties in
+    // load are broken round robin, so every thread got its share.
+
+    @synchronized (self) {
+        STAssertEquals(_bytesConsumed, (unsigned long long) (kSGThreadBenchmarkRequestCount * kSGBulkServerBodyLength), nil, nil);
+        STAssertEqualObjects(_workThreads, [NSSet setWithArray:pool.threads], @"The pool's threads should share the work", nil);
+        [_workThreads release];
+        _workThreads = nil;
+    }
+    return result;
+}
+
+
+- (void)testBulkTransfersAreSpreadOverEveryPoolThread {
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    SGTestHTTPServer * server = StartBulkServer();
+    NSUInteger savedMaximumTransfers = manager.maximumTransfers;
+    NSUInteger savedMaximumTransfersPerHost = manager.maximumTransfersPerHost;
+    NSUInteger coreCount = MAX([[NSProcessInfo processInfo] activeProcessorCount], (NSUInteger) 1);
+    SGRunLoopThreadPool * singlePool;
+    SGRunLoopThreadPool * corePool;
+    double singleThroughput;
+    double coreThroughput;
+
+    STAssertNotNil(server, @"Could not start the stub server", nil);
+    manager.maximumTransfers = kSGThreadBenchmarkConcurrency;
+    manager.maximumTransfersPerHost = kSGThreadBenchmarkConcurrency;
+
+    singlePool = [[SGRunLoopThreadPool alloc] initWithThreadCount:1 name:@"SGRunLoopThreadPoolTest single" threadPriority:0.5];
+    corePool = [[SGRunLoopThreadPool alloc] initWithThreadCount:coreCount name:@"SGRunLoopThreadPoolTest cores" threadPriority:0.5];
+    singleThroughput = [self throughputWithPool:singlePool port:server.port];
+    coreThroughput = [self throughputWithPool:corePool port:server.port];
+
+    manager.maximumTransfers = savedMaximumTransfers;
+    manager.maximumTransfersPerHost = savedMaximumTransfersPerHost;
+    [server stop];
+
+    NSLog(@"%lu transfers of %lu KB, %lu at once: 1 thread %.1f MB/s; %lu threads %.1f MB/s",
+          (unsigned long) kSGThreadBenchmarkRequestCount, (unsigned long) (kSGBulkServerBodyLength / 1024),
+          (unsigned long) kSGThreadBenchmarkConcurrency, singleThroughput / (1024.0 * 1024.0),
+          (unsigned long) coreCount, coreThroughput / (1024.0 * 1024.0));
+}
+
+@end
@@ -0,0 +1,107 @@
+//
+//  SGTestHTTPServer.h
+//  SGBaseFramework
+//
+//  A loopback HTTP server for the unit tests and benchmarks.
+
+#import <Foundation/Foundation.h>
+
+#include <netinet/in.h>
+
+@class SGTestHTTPResponse;
+
+typedef SGTestHTTPResponse * (^SGTestHTTPServerResponder)(NSString * request, NSUInteger requestIndex);
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+/**
+ * One response from SGTestHTTPServer: a status code, some headers and a body.  The server
+ * adds Content-Length (except to a 304) and Connection itself.  If bodyLengthToSend is less
+ * than the length of the body, the server hangs up after sending that much of it, which
+ * clients see as a dropped connection.
+ */
+@interface SGTestHTTPResponse : NSObject {
+    NSInteger _statusCode;
+    NSDictionary * _headers;
+    NSData * _body;
+    NSUInteger _bodyLengthToSend;
+}
+
++ (SGTestHTTPResponse *)responseWithStatusCode:(NSInteger)statusCode headers:(NSDictionary *)headers body:(NSData *)body;
+
+@property (nonatomic, assign) NSInteger statusCode;
+@property (nonatomic, copy) NSDictionary * headers;
+@property (nonatomic, copy) NSData * body;
+@property (nonatomic, assign) NSUInteger bodyLengthToSend;     // default is NSUIntegerMax, implying the whole body
+
+@end
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+/**
+ * A minimal HTTP server on the loopback interface, on an ephemeral port.  Each connection
+ * gets its own thread.  The server reads each request up to the end of its headers (our
+ * clients only send GETs) and answers it with either a fixed response or whatever the
+ * responder block returns.  The responder can be called on several threads at once; if it
+ * returns nil, the server hangs up without answering, which clients see as a network error.
+ * Some other things you can configure before calling -start:
+ *
+ * o keepAlive -- answer any number of requests on a connection, rather than closing it
+ *   after the first
+ *
+ * o firstByteDelay, chunkLength and chunkDelay -- wait before answering, and then trickle
+ *   the body out chunkLength bytes at a time, chunkDelay apart, like a slow, far away server
+ *
+ * o maximumClientCount -- answer 503 straight away to any request that arrives while that
+ *   many others are being answered
+ *
+ * o recordsRequests -- keep the text of each request and the time it arrived, so that the
+ *   test can check them; off by default, so that a benchmark's requests don't pile up
+ */
+@interface SGTestHTTPServer : NSObject {
+    int _listener;
+    in_port_t _port;
+    SGTestHTTPServerResponder _responder;
+    BOOL _keepAlive;
+    useconds_t _firstByteDelay;
+    NSUInteger _chunkLength;
+    useconds_t _chunkDelay;
+    NSUInteger _maximumClientCount;
+    BOOL _recordsRequests;
+    NSUInteger _clientCount;            // protected by @synchronized (self)
+    NSUInteger _requestCount;           // protected by @synchronized (self)
+    unsigned long long _bodyBytesSent;  // protected by @synchronized (self)
+    NSMutableArray * _requests;         // protected by @synchronized (self)
+    NSMutableArray * _requestTimes;     // protected by @synchronized (self)
+}
+
+// designated
+- (id)initWithResponder:(SGTestHTTPServerResponder)responder;
+
+// convenience, answers every request with the same response
+- (id)initWithStatusCode:(NSInteger)statusCode headers:(NSDictionary *)headers body:(NSData *)body;
+
+@property (nonatomic, readonly) in_port_t port;
+
+@property (nonatomic, assign) BOOL keepAlive;                   // default is NO
+@property (nonatomic, assign) useconds_t firstByteDelay;        // default is 0
+@property (nonatomic, assign) NSUInteger chunkLength;           // default is 0, implying the whole body at once
+@property (nonatomic, assign) useconds_t chunkDelay;            // default is 0
+@property (nonatomic, assign) NSUInteger maximumClientCount;    // default is 0, implying no limit
+@property (nonatomic, assign) BOOL recordsRequests;             // default is NO
+
+- (void)start;
+- (void)stop;
+
+// Things you can look at while the server is running, or after it's stopped.
+
+@property (nonatomic, readonly) NSUInteger requestCount;
+@property (nonatomic, readonly) unsigned long long bodyBytesSent;
+@property (nonatomic, readonly) NSArray * requests;             // NSString, empty unless recordsRequests is set
+@property (nonatomic, readonly) NSArray * requestTimes;         // NSNumber of CFAbsoluteTime, likewise
+
+@end
@@ -0,0 +1,311 @@
+//
+//  SGTestHTTPServer.m
+//  SGBaseFramework
+//
+
+#import "SGTestHTTPServer.h"
+
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@implementation SGTestHTTPResponse
+
+@synthesize statusCode = _statusCode;
+@synthesize headers = _headers;
+@synthesize body = _body;
+@synthesize bodyLengthToSend = _bodyLengthToSend;
+
++ (SGTestHTTPResponse *)responseWithStatusCode:(NSInteger)statusCode headers:(NSDictionary *)headers body:(NSData *)body {
+    SGTestHTTPResponse * result = [[[self alloc] init] autorelease];
+
+    result.statusCode = statusCode;
+    result.headers = headers;
+    result.body = body;
+    return result;
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        _statusCode = 200;
+        _bodyLengthToSend = NSUIntegerMax;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [_headers release];
+    [_body release];
+    [super dealloc];
+}
+
+@end
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static NSString * SGReasonPhraseForStatusCode(NSInteger statusCode) {
+    switch (statusCode) {
+        case 200: return @"OK";
+        case 206: return @"Partial Content";
+        case 304: return @"Not Modified";
+        case 404: return @"Not Found";
+        case 416: return @"Requested Range Not Satisfiable";
+        case 503: return @"Service Unavailable";
+        default:  return @"Unknown";
+    }
+}
+
+
+static BOOL SGWriteAll(int fd, const uint8_t * bytes, NSUInteger length) {
+    while (length != 0) {
+        ssize_t bytesWritten = write(fd, bytes, length);
+        if (bytesWritten > 0) {
+            bytes += bytesWritten;
+            length -= (NSUInteger) bytesWritten;
+        } else if (bytesWritten < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@implementation SGTestHTTPServer
+
+@synthesize port = _port;
+@synthesize keepAlive = _keepAlive;
+@synthesize firstByteDelay = _firstByteDelay;
+@synthesize chunkLength = _chunkLength;
+@synthesize chunkDelay = _chunkDelay;
+@synthesize maximumClientCount = _maximumClientCount;
+@synthesize recordsRequests = _recordsRequests;
+
+- (id)initWithResponder:(SGTestHTTPServerResponder)responder {
+    assert(responder != nil);
+    self = [super init];
+    if (self) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_len = sizeof(addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+
+        _listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (_listener < 0
+            || bind(_listener, (const struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(_listener, 128) != 0
+            || getsockname(_listener, (struct sockaddr *) &addr, &addrLen) != 0) {
+            [self release];
+            return nil;
+        }
+        _port = ntohs(addr.sin_port);
+        _responder = [responder copy];
+        _requests = [[NSMutableArray alloc] init];
+        _requestTimes = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (id)initWithStatusCode:(NSInteger)statusCode headers:(NSDictionary *)headers body:(NSData *)body {
+    SGTestHTTPResponse * response = [SGTestHTTPResponse responseWithStatusCode:statusCode headers:headers body:body];
+
+    return [self initWithResponder:^(NSString * request, NSUInteger requestIndex) {
+        #pragma unused(request, requestIndex)
+        return response;
+    }];
+}
+
+- (void)dealloc {
+    [self stop];
+    [_responder release];
+    [_requests release];
+    [_requestTimes release];
+    [super dealloc];
+}
+
+- (NSUInteger)requestCount {
+    @synchronized (self) {
+        return _requestCount;
+    }
+}
+
+- (unsigned long long)bodyBytesSent {
+    @synchronized (self) {
+        return _bodyBytesSent;
+    }
+}
+
+- (NSArray *)requests {
+    @synchronized (self) {
+        return [[_requests copy] autorelease];
+    }
+}
+
+- (NSArray *)requestTimes {
+    @synchronized (self) {
+        return [[_requestTimes copy] autorelease];
+    }
+}
+
+- (void)start {
+    [NSThread detachNewThreadSelector:@selector(acceptConnections) toTarget:self withObject:nil];
+}
+
+- (void)stop {
+    if (_listener >= 0) {
+        shutdown(_listener, SHUT_RDWR);
+        close(_listener);
+        _listener = -1;
+    }
+}
+
+- (void)acceptConnections {
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    int fd;
+
+    [self retain];
+    while ((fd = accept(_listener, NULL, NULL)) >= 0) {
+        [NSThread detachNewThreadSelector:@selector(serveConnection:)
+                                 toTarget:self
+                               withObject:[NSNumber numberWithInt:fd]];
+    }
+    [self release];
+    [pool drain];
+}
+
+- (NSString *)readRequestFromSocket:(int)fd buffer:(NSMutableData *)pending {
+    NSData * endOfHeaders = [NSData dataWithBytes:"\r\n\r\n" length:4];
+    NSRange end = [pending rangeOfData:endOfHeaders options:0 range:NSMakeRange(0, pending.length)];
+    NSString * result;
+
+    // Anything after the end of the headers belongs to the next request, so it stays
+    // in pending.
+
+    while (end.location == NSNotFound) {
+        char buffer[4096];
+        ssize_t bytesRead = read(fd, buffer, sizeof(buffer));
+        if (bytesRead <= 0) {
+            return nil;
+        }
+        [pending appendBytes:buffer length:(NSUInteger) bytesRead];
+        end = [pending rangeOfData:endOfHeaders options:0 range:NSMakeRange(0, pending.length)];
+    }
+    result = [[[NSString alloc] initWithBytes:[pending bytes] length:NSMaxRange(end) encoding:NSISOLatin1StringEncoding] autorelease];
+    [pending replaceBytesInRange:NSMakeRange(0, NSMaxRange(end)) withBytes:NULL length:0];
+    return result;
+}
+
+- (BOOL)sendResponse:(SGTestHTTPResponse *)response toSocket:(int)fd keepAlive:(BOOL)keepAlive {
+    NSData * body = response.body;
+    NSUInteger bodyLength = MIN(response.bodyLengthToSend, [body length]);
+    NSMutableString * header;
+    NSData * headerData;
+    NSUInteger sent;
+    BOOL success;
+
+    header = [NSMutableString stringWithFormat:@"HTTP/1.1 %ld %@\r\n", (long) response.statusCode, SGReasonPhraseForStatusCode(response.statusCode)];
+    for (NSString * name in response.headers) {
+        [header appendFormat:@"%@: %@\r\n", name, [response.headers objectForKey:name]];
+    }
+    if (response.statusCode != 304) {
+        [header appendFormat:@"Content-Length: %lu\r\n", (unsigned long) [body length]];
+    }
+    [header appendString:keepAlive ? @"Connection: keep-alive\r\n\r\n" : @"Connection: close\r\n\r\n"];
+    headerData = [header dataUsingEncoding:NSASCIIStringEncoding];
+
+    success = SGWriteAll(fd, [headerData bytes], [headerData length]);
+    sent = 0;
+    while (success && sent < bodyLength) {
+        NSUInteger chunk = (_chunkLength == 0) ? bodyLength - sent : MIN(_chunkLength, bodyLength - sent);
+
+        if (_chunkDelay != 0) {
+            usleep(_chunkDelay);
+        }
+        success = SGWriteAll(fd, ((const uint8_t *) [body bytes]) + sent, chunk);
+        if (success) {
+            sent += chunk;
+        }
+    }
+    @synchronized (self) {
+        _bodyBytesSent += sent;
+    }
+
+    // A deliberately short body means we have to hang up.
+
+    return success && (bodyLength == [body length]);
+}
+
+- (void)serveConnection:(NSNumber *)fdNumber {
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    int fd = [fdNumber intValue];
+    int one = 1;
+    NSMutableData * pending = [NSMutableData data];
+    BOOL keepGoing;
+
+    // Don't let Nagle hold back the tail of a response on a keep-alive connection, and
+    // don't let a client that hangs up early kill the test with SIGPIPE.
+
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    (void) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+
+    do {
+        NSAutoreleasePool * innerPool = [[NSAutoreleasePool alloc] init];
+        NSString * request;
+        NSUInteger requestIndex;
+        BOOL overloaded;
+        SGTestHTTPResponse * response;
+
+        keepGoing = NO;
+        request = [self readRequestFromSocket:fd buffer:pending];
+        if (request != nil) {
+            @synchronized (self) {
+                requestIndex = _requestCount;
+                _requestCount += 1;
+                if (_recordsRequests) {
+                    [_requests addObject:request];
+                    [_requestTimes addObject:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent()]];
+                }
+                overloaded = (_maximumClientCount != 0) && (_clientCount >= _maximumClientCount);
+                if (!overloaded) {
+                    _clientCount += 1;
+                }
+            }
+
+            if (overloaded) {
+                response = [SGTestHTTPResponse responseWithStatusCode:503 headers:nil body:nil];
+                (void) [self sendResponse:response toSocket:fd keepAlive:NO];
+            } else {
+                response = _responder(request, requestIndex);
+                if (response != nil) {
+                    if (_firstByteDelay != 0) {
+                        usleep(_firstByteDelay);
+                    }
+                    keepGoing = [self sendResponse:response toSocket:fd keepAlive:_keepAlive] && _keepAlive;
+                }
+                @synchronized (self) {
+                    _clientCount -= 1;
+                }
+            }
+        }
+        [innerPool drain];
+    } while (keepGoing);
+    close(fd);
+    [pool drain];
+}
+
+@end
@@ -0,0 +1,84 @@
+/*
+    File:       SGTransferWindowController.h
+
+    Contains:   Tunes the number of concurrent network transfers from their measured performance.
+
+*/
+
+#import <Foundation/Foundation.h>
+
+/*
+    SGTransferWindowController decides how many network transfers should run at 
+    once, which we call the window.  SGNetworkManager reports each finished transfer 
+    to it and, if the controller is installed, uses its window as maximumTransfers. 
+    The rules are the classic AIMD (additive increase, multiplicative decrease) ones 
+    that TCP uses, applied per epoch rather than per transfer:
+
+    o An epoch ends once window transfers have finished since the last one, so 
+      the controller reacts at roughly the rate at which the window turns over.
+
+    o If the epoch looks congested, the window shrinks by multiplicativeDecrease 
+      (but never below minimumWidth).  An epoch is congested if more than 
+      maximumErrorRate of its transfers failed, if its mean time to first byte is 
+      more than latencyTolerance times the best mean seen recently (requests are 
+      queueing up at the server or in the network), or if its aggregate throughput 
+      fell noticeably after the last increase (the extra transfers are just 
+      fighting over the same bandwidth).
+
+    o Otherwise the window grows by one (but never above maximumWidth).
+
+    The best mean time to first byte slowly decays towards the current one, so 
+    that a change of network (say, from Wi-Fi to 3G) doesn't leave the controller 
+    comparing against a baseline it can never meet again.
+
+    All methods can be called from any thread.
+*/
+
+@interface SGTransferWindowController : NSObject
+{
+    NSUInteger          _minimumWidth;
+    NSUInteger          _maximumWidth;
+    NSUInteger          _width;
+    double              _multiplicativeDecrease;
+    double              _maximumErrorRate;
+    double              _latencyTolerance;
+
+    // epoch state, protected by @synchronized (self)
+
+    NSTimeInterval      _epochStartTime;
+    NSUInteger          _epochTransferCount;
+    NSUInteger          _epochErrorCount;
+    long long           _epochBytes;
+    NSTimeInterval      _epochTimeToFirstByteTotal;
+    NSUInteger          _epochTimeToFirstByteCount;
+    double              _lastThroughput;
+    BOOL                _lastChangeWasIncrease;
+    NSTimeInterval      _baselineTimeToFirstByte;
+    NSUInteger          _epochCount;
+}
+
+- (id)initWithMinimumWidth:(NSUInteger)minimumWidth maximumWidth:(NSUInteger)maximumWidth initialWidth:(NSUInteger)initialWidth;
+    // Creates a controller whose window starts at initialWidth and stays within 
+    // the bounds.  minimumWidth must be at least one.
+
+@property (nonatomic, assign, readonly ) NSUInteger     minimumWidth;
+@property (nonatomic, assign, readonly ) NSUInteger     maximumWidth;
+@property (nonatomic, assign, readonly ) NSUInteger     width;
+
+@property (nonatomic, assign, readwrite) double         multiplicativeDecrease;     // default is 0.5
+@property (nonatomic, assign, readwrite) double         maximumErrorRate;           // default is 0.25
+@property (nonatomic, assign, readwrite) double         latencyTolerance;           // default is 2.0
+
+@property (nonatomic, assign, readonly ) NSUInteger     epochCount;                 // number of epochs evaluated so far
+
+- (void)recordTransferWithBytes:(long long)bytes timeToFirstByte:(NSTimeInterval)timeToFirstByte failed:(BOOL)failed;
+    // Reports a finished transfer.  Pass a timeToFirstByte of zero if the transfer 
+    // never got a response.  Returns when the window has been updated, if this 
+    // transfer ended an epoch.
+
+- (void)recordTransferWithBytes:(long long)bytes timeToFirstByte:(NSTimeInterval)timeToFirstByte failed:(BOOL)failed atTime:(NSTimeInterval)now;
+    // As above, but lets you supply the time at which the transfer finished, in 
+    // seconds from any fixed point.  This is for simulations and tests; times must 
+    // not go backwards.
+
+@end
@@ -0,0 +1,220 @@
+/*
+    File:       SGTransferWindowController.m
+
+    Contains:   Tunes the number of concurrent network transfers from their measured performance.
+
+*/
+
+#import "SGTransferWindowController.h"
+
+#include <mach/mach_time.h>
+
+// Throughput has to fall by more than this fraction after an increase before we 
+// blame the increase; transfers vary too much for anything tighter.
+
+static const double kThroughputDropTolerance = 0.1;
+
+// Each epoch, the latency baseline moves this fraction of the way towards the 
+// current epoch's mean, if that's worse.
+
+static const double kBaselineDecay = 0.05;
+
+@implementation SGTransferWindowController
+
+- (id)initWithMinimumWidth:(NSUInteger)minimumWidth maximumWidth:(NSUInteger)maximumWidth initialWidth:(NSUInteger)initialWidth
+    // See comment in header.
+{
+    assert(minimumWidth >= 1);
+    assert(minimumWidth <= maximumWidth);
+    self = [super init];
+    if (self != nil) {
+        self->_minimumWidth = minimumWidth;
+        self->_maximumWidth = maximumWidth;
+        self->_width = MAX(minimumWidth, MIN(initialWidth, maximumWidth));
+        self->_multiplicativeDecrease = 0.5;
+        self->_maximumErrorRate = 0.25;
+        self->_latencyTolerance = 2.0;
+    }
+    return self;
+}
+
+@synthesize minimumWidth = _minimumWidth;
+@synthesize maximumWidth = _maximumWidth;
+
+- (NSUInteger)width
+{
+    @synchronized (self) {
+        return self->_width;
+    }
+}
+
+- (double)multiplicativeDecrease
+{
+    @synchronized (self) {
+        return self->_multiplicativeDecrease;
+    }
+}
+
+- (void)setMultiplicativeDecrease:(double)newValue
+{
+    assert( (newValue > 0.0) && (newValue < 1.0) );
+    @synchronized (self) {
+        self->_multiplicativeDecrease = newValue;
+    }
+}
+
+- (double)maximumErrorRate
+{
+    @synchronized (self) {
+        return self->_maximumErrorRate;
+    }
+}
+
+- (void)setMaximumErrorRate:(double)newValue
+{
+    assert( (newValue >= 0.0) && (newValue <= 1.0) );
+    @synchronized (self) {
+        self->_maximumErrorRate = newValue;
+    }
+}
+
+- (double)latencyTolerance
+{
+    @synchronized (self) {
+        return self->_latencyTolerance;
+    }
+}
+
+- (void)setLatencyTolerance:(double)newValue
+{
+    assert(newValue >= 1.0);
+    @synchronized (self) {
+        self->_latencyTolerance = newValue;
+    }
+}
+
+- (NSUInteger)epochCount
+{
+    @synchronized (self) {
+        return self->_epochCount;
+    }
+}
+
+- (void)endEpochAtTime:(NSTimeInterval)now
+    // Evaluates the epoch that's just ended and adjusts the window.  Must be called 
+    // with @synchronized (self).
+{
+    NSTimeInterval  elapsed;
+    double          throughput;
+    double          errorRate;
+    NSTimeInterval  timeToFirstByte;
+    BOOL            congested;
+
+    assert(self->_epochTransferCount != 0);
+
+    elapsed = now - self->_epochStartTime;
+    if (elapsed < 0.001) {
+        elapsed = 0.001;
+    }
+    throughput = (double) self->_epochBytes / elapsed;
+    errorRate = (double) self->_epochErrorCount / (double) self->_epochTransferCount;
+    timeToFirstByte = 0.0;
+    if (self->_epochTimeToFirstByteCount != 0) {
+        timeToFirstByte = self->_epochTimeToFirstByteTotal / (double) self->_epochTimeToFirstByteCount;
+    }
+
+    // Look for signs of congestion.
+
+    congested = (errorRate > self->_maximumErrorRate);
+    if ( ! congested && (timeToFirstByte > 0.0) && (self->_baselineTimeToFirstByte > 0.0) ) {
+        congested = (timeToFirstByte > (self->_baselineTimeToFirstByte * self->_latencyTolerance));
+    }
+    if ( ! congested && self->_lastChangeWasIncrease && (self->_lastThroughput > 0.0) ) {
+        congested = (throughput < (self->_lastThroughput * (1.0 - kThroughputDropTolerance)));
+    }
+
+    // Adjust the window.
+
+    if (congested) {
+        self->_width = MAX(self->_minimumWidth, (NSUInteger) ((double) self->_width * self->_multiplicativeDecrease));
+        self->_lastChangeWasIncrease = NO;
+    } else if (self->_width < self->_maximumWidth) {
+        self->_width += 1;
+        self->_lastChangeWasIncrease = YES;
+    } else {
+        self->_lastChangeWasIncrease = NO;
+    }
+
+    // Update the baselines.  A failed epoch tells us nothing about latency, so 
+    // we leave the latency baseline alone.
+
+    if ( (timeToFirstByte > 0.0) && (errorRate <= self->_maximumErrorRate) ) {
+        if ( (self->_baselineTimeToFirstByte == 0.0) || (timeToFirstByte < self->_baselineTimeToFirstByte) ) {
+            self->_baselineTimeToFirstByte = timeToFirstByte;
+        } else {
+            self->_baselineTimeToFirstByte += (timeToFirstByte - self->_baselineTimeToFirstByte) * kBaselineDecay;
+        }
+    }
+    // The first epoch starts at the first completion, not at the first request, so 
+    // its throughput is meaningless.
+
+    if (self->_epochCount != 0) {
+        self->_lastThroughput = throughput;
+    }
+
+    // Start the next epoch.
+
+    self->_epochStartTime = now;
+    self->_epochTransferCount = 0;
+    self->_epochErrorCount = 0;
+    self->_epochBytes = 0;
+    self->_epochTimeToFirstByteTotal = 0.0;
+    self->_epochTimeToFirstByteCount = 0;
+    self->_epochCount += 1;
+}
+
+static NSTimeInterval MonotonicTime(void)
+    // Returns the time, in seconds, from mach_absolute_time.  Epochs are timed with 
+    // this rather than the wall clock, which can be set backwards or forwards under 
+    // us and so would make nonsense of an epoch's throughput.
+{
+    mach_timebase_info_data_t   timebase;
+
+    (void) mach_timebase_info(&timebase);
+    return ((double) mach_absolute_time() * timebase.numer / timebase.denom) / 1.0e9;
+}
+
+- (void)recordTransferWithBytes:(long long)bytes timeToFirstByte:(NSTimeInterval)timeToFirstByte failed:(BOOL)failed
+    // See comment in header.
+{
+    // any thread
+    [self recordTransferWithBytes:bytes timeToFirstByte:timeToFirstByte failed:failed atTime:MonotonicTime()];
+}
+
+- (void)recordTransferWithBytes:(long long)bytes timeToFirstByte:(NSTimeInterval)timeToFirstByte failed:(BOOL)failed atTime:(NSTimeInterval)now
+    // See comment in header.
+{
+    // any thread
+    assert(bytes >= 0);
+    assert(timeToFirstByte >= 0.0);
+
+    @synchronized (self) {
+        if (self->_epochStartTime == 0.0) {
+            self->_epochStartTime = now;
+        }
+        self->_epochTransferCount += 1;
+        self->_epochBytes += bytes;
+        if (failed) {
+            self->_epochErrorCount += 1;
+        }
+        if (timeToFirstByte > 0.0) {
+            self->_epochTimeToFirstByteTotal += timeToFirstByte;
+            self->_epochTimeToFirstByteCount += 1;
+        }
+        if (self->_epochTransferCount >= self->_width) {
+            [self endEpochAtTime:now];
+        }
+    }
+}
+
+@end
@@ -0,0 +1,21 @@
+//
+//  SGTransferWindowControllerTest.h
+//  SGBaseFramework
+//
+//  Unit tests and a throughput benchmark for SGTransferWindowController.
+
+#define USE_APPLICATION_UNIT_TEST 0
+
+#import <SenTestingKit/SenTestingKit.h>
+#import <UIKit/UIKit.h>
+
+
+@interface SGTransferWindowControllerTest : SenTestCase {
+    NSUInteger _finishedCount;
+    long long _succeededBytes;
+}
+
+- (void)testWindowGrowsWhileThroughputScalesAndBacksOffOnErrors;
+- (void)testAdaptiveWidthBacksOffFromThrottledServer;
+
+@end
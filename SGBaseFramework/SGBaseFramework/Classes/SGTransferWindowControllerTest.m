@@ -0,0 +1,161 @@
+//
+//  SGTransferWindowControllerTest.m
+//  SGBaseFramework
+//
+
+#import "SGTransferWindowControllerTest.h"
+#import "SGTransferWindowController.h"
+#import "SGNetworkManager.h"
+#import "QHTTPOperation.h"
+#import "SGTestHTTPServer.h"
+
+static const NSUInteger kSGThrottledServerBodyLength       = 64 * 1024;
+static const NSUInteger kSGThrottledServerChunkLength      = 8 * 1024;
+static const useconds_t kSGThrottledServerChunkDelay       = 25 * 1000;     // so 320 KB/s per connection
+static const useconds_t kSGThrottledServerFirstByteDelay   = 200 * 1000;
+static const NSUInteger kSGThrottledServerMaximumClients   = 10;
+
+static const NSUInteger kSGBenchmarkRequestCount = 60;
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SGTestHTTPServer * StartThrottledServer(void)
+    // Starts a loopback server that behaves like a slow, far away one.  Each connection
+    // waits kSGThrottledServerFirstByteDelay before answering, and then trickles the body
+    // out at a fixed rate, so a single connection can't use much bandwidth.  The server has
+    // room for kSGThrottledServerMaximumClients connections; beyond that it answers 503
+    // straight away, which is what a client that opens too many connections deserves.
+{
+    SGTestHTTPServer * server;
+
+    server = [[[SGTestHTTPServer alloc] initWithStatusCode:200 headers:[NSDictionary dictionaryWithObjectsAndKeys:
+        @"application/octet-stream", @"Content-Type",
+        @"no-store", @"Cache-Control",
+        nil
+    ] body:[NSMutableData dataWithLength:kSGThrottledServerBodyLength]] autorelease];
+    server.firstByteDelay = kSGThrottledServerFirstByteDelay;
+    server.chunkLength = kSGThrottledServerChunkLength;
+    server.chunkDelay = kSGThrottledServerChunkDelay;
+    server.maximumClientCount = kSGThrottledServerMaximumClients;
+    [server start];
+    return server;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@implementation SGTransferWindowControllerTest
+
+
+- (void)testWindowGrowsWhileThroughputScalesAndBacksOffOnErrors {
+    SGTransferWindowController * controller;
+    NSTimeInterval now = 1000.0;
+
+    controller = [[[SGTransferWindowController alloc] initWithMinimumWidth:1 maximumWidth:8 initialWidth:2] autorelease];
+    STAssertEquals(controller.width, (NSUInteger) 2, nil, nil);
+
+    // Every transfer takes a second no matter how many run at once, so throughput
+    // scales with the window and the window should open all the way.
+
+    for (NSUInteger epoch = 0; epoch < 10; epoch++) {
+        NSUInteger width = controller.width;
+        now += 1.0;
+        for (NSUInteger i = 0; i < width; i++) {
+            [controller recordTransferWithBytes:10000 timeToFirstByte:0.1 failed:NO atTime:now];
+        }
+    }
+    STAssertEquals(controller.width, (NSUInteger) 8, @"Window should reach its maximum", nil);
+
+    // Now half the transfers fail; the window should halve.
+
+    now += 1.0;
+    for (NSUInteger i = 0; i < 8; i++) {
+        [controller recordTransferWithBytes:(i % 2) ? 0 : 10000 timeToFirstByte:0.1 failed:(i % 2) != 0 atTime:now];
+    }
+    STAssertEquals(controller.width, (NSUInteger) 4, @"Errors should halve the window", nil);
+
+    // And the transfers start queueing at the server; the window should halve again.
+
+    now += 1.0;
+    for (NSUInteger i = 0; i < 4; i++) {
+        [controller recordTransferWithBytes:10000 timeToFirstByte:0.5 failed:NO atTime:now];
+    }
+    STAssertEquals(controller.width, (NSUInteger) 2, @"Inflated latency should halve the window", nil);
+}
+
+
+- (void)transferDidFinish:(QHTTPOperation *)op {
+    _finishedCount += 1;
+    if (op.error == nil) {
+        _succeededBytes += (long long) [op.responseBody length];
+    }
+}
+
+
+- (double)throughputOfRunWithController:(SGTransferWindowController *)controller port:(in_port_t)port {
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    CFAbsoluteTime start;
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:60.0];
+
+    _finishedCount = 0;
+    _succeededBytes = 0;
+    manager.transferWindowController = controller;
+    manager.maximumTransfers = 4;
+
+    // Distinct URLs, so that nothing is coalesced.
+
+    start = CFAbsoluteTimeGetCurrent();
+    for (NSUInteger i = 0; i < kSGBenchmarkRequestCount; i++) {
+        NSURL * url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/blob?i=%lu", port, (unsigned long) i]];
+        QHTTPOperation * op = [[[QHTTPOperation alloc] initWithRequest:[manager requestToGetURL:url]] autorelease];
+        [manager addNetworkTransferOperation:op finishedTarget:self action:@selector(transferDidFinish:)];
+    }
+    while (_finishedCount < kSGBenchmarkRequestCount && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    }
+    STAssertEquals(_finishedCount, kSGBenchmarkRequestCount, @"All transfers should finish", nil);
+
+    return (double) _succeededBytes / (CFAbsoluteTimeGetCurrent() - start);
+}
+
+
+- (void)testAdaptiveWidthBacksOffFromThrottledServer {
+    SGNetworkManager * manager = [SGNetworkManager sharedManager];
+    SGTestHTTPServer * server = StartThrottledServer();
+    SGURLCache * savedCache = [[manager.URLCache retain] autorelease];
+    NSUInteger savedMaximumTransfers = manager.maximumTransfers;
+    NSUInteger savedMaximumTransfersPerHost = manager.maximumTransfersPerHost;
+    SGTransferWindowController * controller;
+    double fixedThroughput;
+    double adaptiveThroughput;
+
+    STAssertNotNil(server, @"Could not start the stub server", nil);
+
+    // Everything goes to one host, so take the per-host cap out of the picture, and
+    // keep the cache from adding conditional headers.
+
+    manager.URLCache = nil;
+    manager.maximumTransfersPerHost = 64;
+
+    fixedThroughput = [self throughputOfRunWithController:nil port:server.port];
+
+    controller = [[[SGTransferWindowController alloc] initWithMinimumWidth:2 maximumWidth:16 initialWidth:4] autorelease];
+    adaptiveThroughput = [self throughputOfRunWithController:controller port:server.port];
+
+    manager.transferWindowController = nil;
+    manager.maximumTransfers = savedMaximumTransfers;
+    manager.maximumTransfersPerHost = savedMaximumTransfersPerHost;
+    manager.URLCache = savedCache;
+    [server stop];
+
+    NSLog(@"fixed width 4: %.0f KB/s; adaptive: %.0f KB/s, final width %lu after %lu epochs",
+          fixedThroughput / 1024.0, adaptiveThroughput / 1024.0,
+          (unsigned long) controller.width, (unsigned long) controller.epochCount);
+    STAssertTrue(controller.epochCount > 0, @"The window should have been adjusted", nil);
+    STAssertTrue(controller.width >= controller.minimumWidth && controller.width <= controller.maximumWidth, nil, nil);
+    STAssertTrue(controller.width <= kSGThrottledServerMaximumClients + 2, @"The window should back off from the server's limit", nil);
+}
+
+@end
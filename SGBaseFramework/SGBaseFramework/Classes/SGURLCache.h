@@ -8,16 +8,99 @@
 
 #import <Foundation/Foundation.h>
 
+@class UIImage;
+
 extern NSString * const kSGCEtagCacheDirectoryName;
 
+/**
+ * Keys of the validators dictionary, named after the response headers they come from.
+ */
+extern NSString * const kSGCValidatorETagKey;
+extern NSString * const kSGCValidatorLastModifiedKey;
+
+/**
+ * Posted on the main thread when a background revalidation started by
+ * dataForURL:revalidateIfStale: succeeds.  The object is the cache; the user info holds the
+ * URL, under SGURLCacheURLKey, and the current data, under SGURLCacheDataKey, which is the
+ * same data as before if the server said it hadn't changed.
+ */
+extern NSString * const SGURLCacheDidRevalidateNotification;
+extern NSString * const SGURLCacheURLKey;
+extern NSString * const SGURLCacheDataKey;
+
+@class SGURLCacheEntry;
+
+/**
+ * The block passed to lookUpDataAndValidatorsForURL:completionBlock:.  Either argument may
+ * be nil.
+ */
+typedef void (^SGURLCacheLookupBlock)(NSData * data, NSDictionary * validators);
+
+/**
+ * A two tier cache for downloaded data.
+ *
+ * The memory tier keeps the most recently used data in memory, up to memoryCapacity bytes,
+ * and evicts the least recently used data first.
+ *
+ * The disk tier stores each item in its own file under cachePath.  File names are the MD5
+ * hash of the key, sharded into 256 subdirectories by the first byte of the hash, so that
+ * no single directory gets too big.  Files are written atomically, so a reader never sees
+ * a partial file.  Reading an item bumps its modification date; when the disk tier grows
+ * past diskCapacity bytes, a background pass deletes the least recently used files until
+ * it's back under the budget.
+ *
+ * Alongside the data, an image tier keeps decoded images, keyed by URL, so that scrolling
+ * back to an image doesn't mean decoding it again.  It's bounded by the total number of
+ * pixels, which is what a decoded image actually costs, rather than by the number of images,
+ * and also evicts the least recently used images first.  SGImageDecodeOperation fills it
+ * from a background queue.
+ *
+ * Each entry on disk can also have validators, the ETag and Last-Modified values of the
+ * response it came from, which are kept in a parallel tree under etagCachePath.  They let
+ * QHTTPOperation revalidate an entry with a conditional GET rather than downloading it
+ * again.  Validators are deleted along with the data they describe.
+ *
+ * Entries on disk also go stale.  An entry is fresh for invalidationAge seconds after it
+ * was stored or last revalidated, or until it's explicitly invalidated.  Stale data is still
+ * returned by dataForURL:; dataForURL:revalidateIfStale: returns it too, but also refreshes
+ * it in the background and posts SGURLCacheDidRevalidateNotification when that's done, so
+ * that a screen can show what it has straight away and update when the network catches up.
+ *
+ * All methods can be called from any thread.  The disk methods do file I/O on the calling
+ * thread, so avoid calling them on the main thread for large items.  The exceptions are
+ * lookUpDataAndValidatorsForURL:completionBlock:, storeDataInBackground:validators:forURL:
+ * and storeValidatorsInBackground:forURL:, which do their file I/O on the cache's own serial
+ * disk queue; QHTTPOperation uses them so that it never blocks its run loop thread.
+ */
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 @interface SGURLCache : NSObject {
     NSString * _cachePath;
     NSString * _name;
-    
+
     BOOL _diskCacheEnabled;
     BOOL _imageCacheEnabled;
+
+    NSUInteger _memoryCapacity;
+    NSMutableDictionary * _memoryEntries;       // protected by @synchronized (self)
+    SGURLCacheEntry * _mostRecentEntry;         // protected by @synchronized (self)
+    SGURLCacheEntry * _leastRecentEntry;        // protected by @synchronized (self)
+    NSUInteger _memoryUsage;                    // protected by @synchronized (self)
+
+    NSUInteger _maxPixelCount;
+    NSMutableDictionary * _imageEntries;        // protected by @synchronized (self)
+    SGURLCacheEntry * _mostRecentImageEntry;    // protected by @synchronized (self)
+    SGURLCacheEntry * _leastRecentImageEntry;   // protected by @synchronized (self)
+    NSUInteger _pixelCount;                     // protected by @synchronized (self)
+
+    unsigned long long _diskCapacity;
+    unsigned long long _diskUsage;              // protected by @synchronized (self)
+    BOOL _evictionScheduled;                    // protected by @synchronized (self)
+
+    NSTimeInterval _invalidationAge;            // protected by @synchronized (self)
+    NSMutableSet * _revalidatingURLs;           // protected by @synchronized (self)
+    NSOperationQueue * _diskQueue;
 }
 
 /**
@@ -26,7 +109,8 @@ extern NSString * const kSGCEtagCacheDirectoryName;
 @property (nonatomic, assign) BOOL diskCacheEnabled;
 
 /**
- * Disables the in-memory cache for images.
+ * Disables the in-memory cache for images.  Images that are already cached stay there until
+ * they're evicted or removed.
  */
 @property (nonatomic) BOOL imageCacheEnabled;
 
@@ -40,19 +124,255 @@ extern NSString * const kSGCEtagCacheDirectoryName;
  */
 @property (nonatomic, readonly) NSString * etagCachePath;
 
+/**
+ * The maximum number of bytes of data to keep in memory.
+ *
+ * Items bigger than this are never kept in memory.  Setting this to zero disables the memory
+ * tier.  The default is 2 MB.
+ */
+@property (nonatomic) NSUInteger memoryCapacity;
+
+/**
+ * The number of bytes of data currently kept in memory.
+ */
+@property (nonatomic, readonly) NSUInteger memoryUsage;
+
+/**
+ * The maximum number of bytes of data to keep on disk.
+ *
+ * The disk tier may briefly exceed this while the background eviction pass is running.  The
+ * default is 20 MB.
+ */
+@property (nonatomic) unsigned long long diskCapacity;
+
+/**
+ * The number of bytes of data currently kept on disk.  This is approximate until the first
+ * eviction pass, which runs shortly after the cache is created, has finished.
+ */
+@property (nonatomic, readonly) unsigned long long diskUsage;
+
 /**
  * The maximum number of pixels to keep in memory for cached images.
  *
- * Setting this to zero will allow an unlimited number of images to be cached.  The default
- * is zero.
+ * Images bigger than this are never cached.  Setting this to zero will allow an unlimited
+ * number of images to be cached.  The default is 2 million pixels, about 8 MB of bitmaps.
+ */
+@property (nonatomic) NSUInteger maxPixelCount;
+
+/**
+ * The number of pixels currently kept in memory for cached images.
  */
-//@property (nonatomic) NSUInteger maxPixelCount;
+@property (nonatomic, readonly) NSUInteger pixelCount;
 
 /**
- * The amount of time to set back the modification timestamp on files when invalidating them.
+ * The number of seconds after which an entry on disk is stale.
+ *
+ * Setting this to zero means entries never go stale unless they're invalidated explicitly.
+ * The default is zero.
  */
-//@property (nonatomic) NSTimeInterval invalidationAge;
+@property (nonatomic) NSTimeInterval invalidationAge;
 
+/**
+ * Gets the shared cache, whose files live in the "SGURLCache" directory of the caches directory.
+ */
 + (SGURLCache *)instance;
 
+/**
+ * Returns YES if a response may be kept in a cache, which is shared by every user of the
+ * app.  Only a 200 to a GET without Range or Authorization headers qualifies; a 304 does
+ * too, since storing it just renews the existing entry.  no-store, in either the request or
+ * the response, or private, in the response, rules it out.  request may be nil, in which
+ * case only the response is checked.
+ */
++ (BOOL)canStoreResponse:(NSHTTPURLResponse *)response toRequest:(NSURLRequest *)request;
+
+/**
+ * Creates a cache whose files live in the named directory of the caches directory.  The
+ * directory is created if necessary.
+ */
+- (id)initWithName:(NSString *)name;
+
+/**
+ * Gets the key that would be used to cache a URL.
+ */
+- (NSString *)keyForURL:(NSString *)URL;
+
+/**
+ * Gets the path in the disk cache where a URL would be stored.
+ */
+- (NSString *)cachePathForURL:(NSString *)URL;
+
+/**
+ * Gets the path in the disk cache where a key would be stored.
+ */
+- (NSString *)cachePathForKey:(NSString *)key;
+
+/**
+ * Gets the path in the disk cache where the validators for a key would be stored.
+ */
+- (NSString *)etagCachePathForKey:(NSString *)key;
+
+/**
+ * Determines if there is a cache entry for a URL, in memory or on disk.
+ */
+- (BOOL)hasDataForURL:(NSString *)URL;
+
+/**
+ * Determines if there is a cache entry for a key, in memory or on disk.
+ */
+- (BOOL)hasDataForKey:(NSString *)key;
+
+/**
+ * Gets the data for a URL from the cache, or nil if there is none.
+ */
+- (NSData *)dataForURL:(NSString *)URL;
+
+/**
+ * Gets the data for a key from the cache, or nil if there is none.  Data found on disk is
+ * promoted to the memory tier.
+ */
+- (NSData *)dataForKey:(NSString *)key;
+
+/**
+ * Gets the data for a URL from the cache, or nil if there is none.  If the data is stale and
+ * revalidate is set, it's still returned, but a background RetryingHTTPOperation also asks
+ * the server for a fresh copy, with a conditional GET if the entry has validators.  Only one
+ * revalidation per URL runs at a time.
+ */
+- (NSData *)dataForURL:(NSString *)URL revalidateIfStale:(BOOL)revalidate;
+
+/**
+ * Determines if the entry on disk for a URL is stale.  Missing entries are not stale.
+ */
+- (BOOL)isStaleURL:(NSString *)URL;
+
+/**
+ * Determines if the entry on disk for a key is stale.  Missing entries are not stale.
+ */
+- (BOOL)isStaleKey:(NSString *)key;
+
+/**
+ * Makes the entry for a URL stale, regardless of its age.  The data stays in the cache.
+ */
+- (void)invalidateURL:(NSString *)URL;
+
+/**
+ * Makes the entry for a key stale, regardless of its age.  The data stays in the cache.
+ */
+- (void)invalidateKey:(NSString *)key;
+
+/**
+ * Stores data for a URL in the cache.
+ */
+- (void)storeData:(NSData *)data forURL:(NSString *)URL;
+
+/**
+ * Stores data for a key in the memory tier and, if diskCacheEnabled is set, the disk tier.
+ * The entry is fresh, and any validators it had are removed, since they described the old
+ * data.
+ */
+- (void)storeData:(NSData *)data forKey:(NSString *)key;
+
+/**
+ * Stores data and its validators for a URL as one fresh entry.  The memory tier is updated
+ * at once, so dataForURL: sees the new data straight away; the disk writes are queued on the
+ * disk queue.
+ */
+- (void)storeDataInBackground:(NSData *)data validators:(NSDictionary *)validators forURL:(NSString *)URL;
+
+/**
+ * Moves a file into the disk tier as the data for a URL.
+ */
+- (BOOL)storeFileAtPath:(NSString *)path forURL:(NSString *)URL;
+
+/**
+ * Moves a file into the disk tier as the data for a key, without reading it into memory.
+ * This is for large bodies that were streamed to disk as they arrived.  Any memory tier
+ * entry for the key is removed, since it describes the old data.  As with storeData, the
+ * entry is fresh and its validators are removed.  Returns NO, and leaves the file alone,
+ * if diskCacheEnabled is not set or the move fails.
+ */
+- (BOOL)storeFileAtPath:(NSString *)path forKey:(NSString *)key;
+
+/**
+ * Like storeFileAtPath:forURL: followed, if that works, by storeValidators:forURL:, but
+ * queued on the disk queue.  The cache takes over the file; if it can't be stored, it's
+ * deleted.
+ */
+- (void)storeFileInBackgroundAtPath:(NSString *)path validators:(NSDictionary *)validators forURL:(NSString *)URL;
+
+/**
+ * Gets the decoded image for a URL from the image tier, or nil if there is none.
+ */
+- (UIImage *)imageForURL:(NSString *)URL;
+
+/**
+ * Stores a decoded image for a URL in the image tier, evicting the least recently used
+ * images if that takes the tier over maxPixelCount.  Does nothing if imageCacheEnabled is
+ * not set.
+ */
+- (void)storeImage:(UIImage *)image forURL:(NSString *)URL;
+
+/**
+ * Removes the decoded image for a URL from the image tier.
+ */
+- (void)removeImageForURL:(NSString *)URL;
+
+/**
+ * Gets the validators stored for a URL, or nil if there are none.
+ */
+- (NSDictionary *)validatorsForURL:(NSString *)URL;
+
+/**
+ * Gets the validators stored for a key, or nil if there are none.  The dictionary holds
+ * strings under kSGCValidatorETagKey and/or kSGCValidatorLastModifiedKey.
+ */
+- (NSDictionary *)validatorsForKey:(NSString *)key;
+
+/**
+ * Stores validators for a URL.
+ */
+- (void)storeValidators:(NSDictionary *)validators forURL:(NSString *)URL;
+
+/**
+ * Stores validators for a key, replacing any existing ones, and marks the entry as freshly
+ * validated.  Passing nil, or a dictionary with neither validator, removes the validators.
+ * Does nothing if diskCacheEnabled is not set.
+ */
+- (void)storeValidators:(NSDictionary *)validators forKey:(NSString *)key;
+
+/**
+ * Like storeValidators:forURL:, but the write is queued on the disk queue.
+ */
+- (void)storeValidatorsInBackground:(NSDictionary *)validators forURL:(NSString *)URL;
+
+/**
+ * Gets the data for a URL, as dataForURL: does, and, if there is data, its validators, on
+ * the disk queue, and then calls the block on that queue.  The block is called after any
+ * earlier background stores have been written.
+ */
+- (void)lookUpDataAndValidatorsForURL:(NSString *)URL completionBlock:(SGURLCacheLookupBlock)block;
+
+/**
+ * Removes the data and image for a URL from memory and, if fromDisk is set, the disk tier.
+ */
+- (void)removeURL:(NSString *)URL fromDisk:(BOOL)fromDisk;
+
+/**
+ * Removes the data for a key from the memory tier and, if fromDisk is set, the disk tier
+ * along with its validators.
+ */
+- (void)removeKey:(NSString *)key fromDisk:(BOOL)fromDisk;
+
+/**
+ * Erases the memory and image tiers and, if fromDisk is set, the disk tier.
+ */
+- (void)removeAll:(BOOL)fromDisk;
+
+/**
+ * Erases the memory and image tiers only.  This is called automatically in response to a
+ * memory warning.
+ */
+- (void)removeAllFromMemory;
+
 @end
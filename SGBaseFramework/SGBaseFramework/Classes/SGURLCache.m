@@ -8,17 +8,176 @@
 
 #import "SGURLCache.h"
 
+#import "RetryingHTTPOperation.h"
+#import "SGNetworkManager.h"
+
+#import <UIKit/UIKit.h>
+#import <CommonCrypto/CommonDigest.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
 NSString * const kSGCEtagCacheDirectoryName = @"etag";
+NSString * const kSGCValidatorETagKey = @"ETag";
+NSString * const kSGCValidatorLastModifiedKey = @"Last-Modified";
+
+NSString * const SGURLCacheDidRevalidateNotification = @"SGURLCacheDidRevalidateNotification";
+NSString * const SGURLCacheURLKey = @"URL";
+NSString * const SGURLCacheDataKey = @"data";
+
+// The sidecar file of each entry also records when the entry was last validated.
+static NSString * const kSGCValidationDateKey = @"Date";
+
+static NSString * const kSGCDefaultCacheName = @"SGURLCache";
+
+static const NSUInteger kSGCDefaultMemoryCapacity = 2 * 1024 * 1024;
+
+// Decoded images take four bytes per pixel, so this is about 8 MB of bitmaps; enough for a
+// couple of screens' worth of full screen photos or a few hundred thumbnails.
+static const NSUInteger kSGCDefaultMaxPixelCount = 2 * 1024 * 1024;
+static const unsigned long long kSGCDefaultDiskCapacity = 20 * 1024 * 1024;
+
+// When the disk tier is over budget, the eviction pass trims it to this fraction of
+// diskCapacity, so that it doesn't have to run again after the very next store.
+static const double kSGCDiskTrimRatio = 0.8;
+
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-@interface SGURLCache (Private) 
+/**
+ * A node in one of the memory LRU lists: the data tier's, which holds NSData, or the image
+ * tier's, which holds decoded UIImages.  Each list is doubly linked, from the most recently
+ * used entry to the least recently used one, so that touching, adding and evicting entries
+ * are all constant time.  The entries are retained by the tier's dictionary; the links are
+ * not retained.
+ *
+ * A data tier entry also caches the validation date from its sidecar file, so that isStaleKey:
+ * doesn't read the sidecar every time.  It's nil until it's been read or written.
+ */
+@interface SGURLCacheEntry : NSObject {
+    NSString * _key;
+    NSData * _data;
+    UIImage * _image;
+    NSDate * _validationDate;
+    SGURLCacheEntry * _newer;
+    SGURLCacheEntry * _older;
+}
+
+@property (nonatomic, copy) NSString * key;
+@property (nonatomic, retain) NSData * data;
+@property (nonatomic, retain) UIImage * image;
+@property (nonatomic, retain) NSDate * validationDate;
+@property (nonatomic, assign) SGURLCacheEntry * newer;
+@property (nonatomic, assign) SGURLCacheEntry * older;
+
+@end
+
+@implementation SGURLCacheEntry
+
+@synthesize key = _key;
+@synthesize data = _data;
+@synthesize image = _image;
+@synthesize validationDate = _validationDate;
+@synthesize newer = _newer;
+@synthesize older = _older;
+
+- (void)dealloc {
+    [_key release];
+    [_data release];
+    [_image release];
+    [_validationDate release];
+    [super dealloc];
+}
+
+@end
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void UnlinkEntry(SGURLCacheEntry * entry, SGURLCacheEntry ** mostRecent, SGURLCacheEntry ** leastRecent) {
+    if (entry.newer != nil) {
+        entry.newer.older = entry.older;
+    } else {
+        *mostRecent = entry.older;
+    }
+    if (entry.older != nil) {
+        entry.older.newer = entry.newer;
+    } else {
+        *leastRecent = entry.newer;
+    }
+    entry.newer = nil;
+    entry.older = nil;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void LinkEntryAsMostRecent(SGURLCacheEntry * entry, SGURLCacheEntry ** mostRecent, SGURLCacheEntry ** leastRecent) {
+    entry.newer = nil;
+    entry.older = *mostRecent;
+    if (*mostRecent != nil) {
+        (*mostRecent).newer = entry;
+    }
+    *mostRecent = entry;
+    if (*leastRecent == nil) {
+        *leastRecent = entry;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static NSUInteger PixelCountOfImage(UIImage * image) {
+    CGImageRef cgImage = image.CGImage;
+    return (cgImage == NULL) ? 0 : CGImageGetWidth(cgImage) * CGImageGetHeight(cgImage);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@interface SGURLCache (Private)
 
 /**
  * Creates paths as necessary and returns the cache path for the given name.
  */
 + (NSString*)cachePathWithName:(NSString*)name;
 
+/**
+ * Returns the hex encoded MD5 hash of a string.
+ */
++ (NSString *)md5HashOfString:(NSString *)string;
+
+/**
+ * The following must be called with @synchronized (self).
+ */
+- (void)removeMemoryEntry:(SGURLCacheEntry *)entry;
+- (void)trimMemoryToCapacity:(NSUInteger)capacity;
+- (void)removeImageEntry:(SGURLCacheEntry *)entry;
+- (void)trimImagesToPixelCount:(NSUInteger)pixelCount;
+- (void)scheduleDiskTrim;
+
+/**
+ * Runs on the disk queue.
+ */
+- (void)trimDiskCache;
+
+/**
+ * The two halves of storeData:forKey:.  writeData:forKey: returns YES if the data made it to
+ * disk.
+ */
+- (void)storeDataInMemory:(NSData *)data forKey:(NSString *)key;
+- (BOOL)writeData:(NSData *)data forKey:(NSString *)key;
+
+/**
+ * Writes the sidecar file for a key: the validators, if any, and the validation date.
+ */
+- (void)writeValidators:(NSDictionary *)validators validationDate:(NSDate *)date forKey:(NSString *)key;
+
+/**
+ * Runs on the main thread.
+ */
+- (void)startRevalidationOfURL:(NSString *)URL;
+- (void)revalidationDone:(RetryingHTTPOperation *)operation;
+
 @end
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -26,7 +185,222 @@ NSString * const kSGCEtagCacheDirectoryName = @"etag";
 @implementation SGURLCache (Private)
 
 + (NSString*)cachePathWithName:(NSString*)name {
-    return @"";
+    NSString * cachesPath = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0];
+    NSString * cachePath = [cachesPath stringByAppendingPathComponent:name];
+
+    [[NSFileManager defaultManager] createDirectoryAtPath:cachePath withIntermediateDirectories:YES attributes:nil error:NULL];
+    return cachePath;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
++ (NSString *)md5HashOfString:(NSString *)string {
+    const char * str = [string UTF8String];
+    unsigned char digest[CC_MD5_DIGEST_LENGTH];
+
+    CC_MD5(str, (CC_LONG)strlen(str), digest);
+
+    NSMutableString * result = [NSMutableString stringWithCapacity:CC_MD5_DIGEST_LENGTH * 2];
+    for (int i = 0; i < CC_MD5_DIGEST_LENGTH; i++) {
+        [result appendFormat:@"%02x", digest[i]];
+    }
+    return result;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)removeMemoryEntry:(SGURLCacheEntry *)entry {
+    UnlinkEntry(entry, &_mostRecentEntry, &_leastRecentEntry);
+    _memoryUsage -= entry.data.length;
+
+    // The dictionary holds the only reference to the entry, so this must come last.
+    [_memoryEntries removeObjectForKey:entry.key];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)trimMemoryToCapacity:(NSUInteger)capacity {
+    while (_memoryUsage > capacity && _leastRecentEntry != nil) {
+        [self removeMemoryEntry:_leastRecentEntry];
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)removeImageEntry:(SGURLCacheEntry *)entry {
+    UnlinkEntry(entry, &_mostRecentImageEntry, &_leastRecentImageEntry);
+    _pixelCount -= PixelCountOfImage(entry.image);
+
+    // The dictionary holds the only reference to the entry, so this must come last.
+    [_imageEntries removeObjectForKey:entry.key];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)trimImagesToPixelCount:(NSUInteger)pixelCount {
+    while (_pixelCount > pixelCount && _leastRecentImageEntry != nil) {
+        [self removeImageEntry:_leastRecentImageEntry];
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)scheduleDiskTrim {
+    if (!_evictionScheduled) {
+        _evictionScheduled = YES;
+
+        NSInvocationOperation * op = [[NSInvocationOperation alloc] initWithTarget:self selector:@selector(trimDiskCache) object:nil];
+        [_diskQueue addOperation:op];
+        [op release];
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static NSInteger CompareModificationDates(id file1, id file2, void * context) {
+    return [[file1 objectForKey:NSFileModificationDate] compare:[file2 objectForKey:NSFileModificationDate]];
+}
+
+- (void)trimDiskCache {
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    NSFileManager * fm = [[[NSFileManager alloc] init] autorelease];
+    NSMutableArray * files = [NSMutableArray array];
+    unsigned long long totalSize = 0;
+    unsigned long long capacity;
+
+    // Find every file in the disk tier.  The etag directory belongs to the etag cache,
+    // which is tiny and is kept in step with the data it describes, so we leave it alone.
+
+    NSDirectoryEnumerator * enumerator = [fm enumeratorAtPath:_cachePath];
+    NSString * relativePath;
+    while ((relativePath = [enumerator nextObject]) != nil) {
+        NSDictionary * attributes = [enumerator fileAttributes];
+
+        if ([[attributes fileType] isEqual:NSFileTypeDirectory]) {
+            if ([relativePath isEqual:kSGCEtagCacheDirectoryName]) {
+                [enumerator skipDescendents];
+            }
+        } else if ([[attributes fileType] isEqual:NSFileTypeRegular]) {
+            NSMutableDictionary * file = [NSMutableDictionary dictionaryWithDictionary:attributes];
+            [file setObject:[_cachePath stringByAppendingPathComponent:relativePath] forKey:@"path"];
+            [files addObject:file];
+            totalSize += [attributes fileSize];
+        }
+    }
+
+    // If we're over budget, delete the least recently used files until we're comfortably
+    // under it.
+
+    @synchronized (self) {
+        capacity = _diskCapacity;
+    }
+    if (totalSize > capacity) {
+        unsigned long long targetSize = (unsigned long long)(capacity * kSGCDiskTrimRatio);
+
+        [files sortUsingFunction:CompareModificationDates context:NULL];
+        for (NSDictionary * file in files) {
+            if (totalSize <= targetSize) {
+                break;
+            }
+            NSString * path = [file objectForKey:@"path"];
+            if ([fm removeItemAtPath:path error:NULL]) {
+                totalSize -= [file fileSize];
+
+                // Validators without data are useless, so they go too.
+                NSString * shard = [[path stringByDeletingLastPathComponent] lastPathComponent];
+                NSString * etagPath = [[self.etagCachePath stringByAppendingPathComponent:shard]
+                                       stringByAppendingPathComponent:[path lastPathComponent]];
+                (void) unlink([etagPath fileSystemRepresentation]);
+            }
+        }
+    }
+
+    @synchronized (self) {
+        _diskUsage = totalSize;
+        _evictionScheduled = NO;
+    }
+
+    [pool drain];
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)writeValidators:(NSDictionary *)validators validationDate:(NSDate *)date forKey:(NSString *)key {
+    if (!_diskCacheEnabled) {
+        return;
+    }
+
+    NSString * filePath = [self etagCachePathForKey:key];
+    NSMutableDictionary * plist = [NSMutableDictionary dictionaryWithCapacity:3];
+    for (NSString * validatorKey in [NSArray arrayWithObjects:kSGCValidatorETagKey, kSGCValidatorLastModifiedKey, nil]) {
+        id value = [validators objectForKey:validatorKey];
+        if ([value isKindOfClass:[NSString class]] && [value length] != 0) {
+            [plist setObject:value forKey:validatorKey];
+        }
+    }
+    [plist setObject:date forKey:kSGCValidationDateKey];
+
+    if (![plist writeToFile:filePath atomically:YES]) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:[filePath stringByDeletingLastPathComponent]
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:NULL];
+        [plist writeToFile:filePath atomically:YES];
+    }
+
+    @synchronized (self) {
+        [[_memoryEntries objectForKey:key] setValidationDate:date];
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)startRevalidationOfURL:(NSString *)URL {
+    assert([NSThread isMainThread]);
+
+    NSURL * url = [NSURL URLWithString:URL];
+    if (url == nil) {
+        @synchronized (self) {
+            [_revalidatingURLs removeObject:URL];
+        }
+        return;
+    }
+
+    // The request comes with the user agent, and the operation's network operation
+    // makes it conditional, so an unchanged entry costs a 304 and nothing more.
+    NSURLRequest * request = [[SGNetworkManager sharedManager] requestToGetURL:url];
+    RetryingHTTPOperation * op = [[[RetryingHTTPOperation alloc] initWithRequest:request] autorelease];
+    op.cache = self;
+    op.transferPriority = kSGNetworkTransferPriorityBackground;
+
+    [[SGNetworkManager sharedManager] addNetworkManagementOperation:op
+                                                     finishedTarget:self
+                                                             action:@selector(revalidationDone:)];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)revalidationDone:(RetryingHTTPOperation *)operation {
+    assert([NSThread isMainThread]);
+
+    NSString * URL = [[operation.request URL] absoluteString];
+
+    @synchronized (self) {
+        [_revalidatingURLs removeObject:URL];
+    }
+
+    // The network operation has already stored the response in the cache.  On failure,
+    // the stale entry stays put, and the next read will try again.
+    if (operation.error == nil && operation.responseContent != nil) {
+        NSDictionary * userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
+                                   URL, SGURLCacheURLKey,
+                                   operation.responseContent, SGURLCacheDataKey,
+                                   nil];
+        [[NSNotificationCenter defaultCenter] postNotificationName:SGURLCacheDidRevalidateNotification
+                                                            object:self
+                                                          userInfo:userInfo];
+    }
 }
 
 @end
@@ -47,11 +421,145 @@ NSString * const kSGCEtagCacheDirectoryName = @"etag";
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 
-GTMOBJECT_SINGLETON_BOILERPLATE(SGURLCache, instance)
+// We don't use GTMOBJECT_SINGLETON_BOILERPLATE here because it prevents the creation of
+// separately named caches.
++ (SGURLCache *)instance {
+    static SGURLCache * sInstance = nil;
+
+    @synchronized (self) {
+        if (sInstance == nil) {
+            sInstance = [[SGURLCache alloc] initWithName:kSGCDefaultCacheName];
+        }
+    }
+    return sInstance;
+}
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-#pragma mark - Public
+#pragma mark - Storability
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+// Header names are case insensitive, but allHeaderFields keeps whatever case the server
+// used, so we can't just look the name up.
+static NSString * ResponseHeaderValue(NSHTTPURLResponse * response, NSString * name) {
+    NSDictionary * headers = [response allHeaderFields];
+
+    for (NSString * key in headers) {
+        if ([key caseInsensitiveCompare:name] == NSOrderedSame) {
+            return [headers objectForKey:key];
+        }
+    }
+    return nil;
+}
+
+
+// Returns YES if the Cache-Control header value contains the directive, ignoring case and
+// any argument (as in private="Set-Cookie").
+static BOOL CacheControlHasDirective(NSString * cacheControl, NSString * directive) {
+    for (NSString * item in [cacheControl componentsSeparatedByString:@","]) {
+        NSString * name = [[[item componentsSeparatedByString:@"="] objectAtIndex:0] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+
+        if ([name caseInsensitiveCompare:directive] == NSOrderedSame) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
++ (BOOL)canStoreResponse:(NSHTTPURLResponse *)response toRequest:(NSURLRequest *)request {
+    NSString * responseCacheControl;
+
+    assert(response != nil);
+
+    // A 206, or any other status a client happens to accept, isn't the whole resource.
+
+    if (response.statusCode != 200 && response.statusCode != 304) {
+        return NO;
+    }
+
+    // A request with credentials gets a response meant for one user.
+
+    if (request != nil) {
+        if (![[request HTTPMethod] isEqual:@"GET"]
+         || [request valueForHTTPHeaderField:@"Range"] != nil
+         || [request valueForHTTPHeaderField:@"Authorization"] != nil
+         || CacheControlHasDirective([request valueForHTTPHeaderField:@"Cache-Control"], @"no-store")) {
+            return NO;
+        }
+    }
+
+    responseCacheControl = ResponseHeaderValue(response, @"Cache-Control");
+    return !CacheControlHasDirective(responseCacheControl, @"no-store")
+        && !CacheControlHasDirective(responseCacheControl, @"private");
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#pragma mark - Initialization
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (id)initWithName:(NSString *)name {
+    self = [super init];
+    if (self) {
+        _name = [name copy];
+        _cachePath = [[SGURLCache cachePathWithName:name] retain];
+        _diskCacheEnabled = YES;
+        _imageCacheEnabled = YES;
+
+        _memoryCapacity = kSGCDefaultMemoryCapacity;
+        _memoryEntries = [[NSMutableDictionary alloc] init];
+
+        _maxPixelCount = kSGCDefaultMaxPixelCount;
+        _imageEntries = [[NSMutableDictionary alloc] init];
+
+        _revalidatingURLs = [[NSMutableSet alloc] init];
+
+        _diskCapacity = kSGCDefaultDiskCapacity;
+        _diskQueue = [[NSOperationQueue alloc] init];
+        [_diskQueue setMaxConcurrentOperationCount:1];
+
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(removeAllFromMemory)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+
+        // Measure the disk tier, left over from previous runs, and trim it if need be.
+        @synchronized (self) {
+            [self scheduleDiskTrim];
+        }
+    }
+    return self;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (id)init {
+    return [self initWithName:kSGCDefaultCacheName];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+
+    // The disk queue retains us while a trim is pending, so by now it's idle.
+    [_diskQueue release];
+    [_memoryEntries release];
+    [_imageEntries release];
+    [_revalidatingURLs release];
+    [_cachePath release];
+    [_name release];
+    [super dealloc];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#pragma mark - Properties
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 
@@ -61,18 +569,661 @@ GTMOBJECT_SINGLETON_BOILERPLATE(SGURLCache, instance)
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSUInteger)memoryCapacity {
+    @synchronized (self) {
+        return _memoryCapacity;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)setMemoryCapacity:(NSUInteger)memoryCapacity {
+    @synchronized (self) {
+        _memoryCapacity = memoryCapacity;
+        [self trimMemoryToCapacity:_memoryCapacity];
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSUInteger)memoryUsage {
+    @synchronized (self) {
+        return _memoryUsage;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSUInteger)maxPixelCount {
+    @synchronized (self) {
+        return _maxPixelCount;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)setMaxPixelCount:(NSUInteger)maxPixelCount {
+    @synchronized (self) {
+        _maxPixelCount = maxPixelCount;
+        if (_maxPixelCount != 0) {
+            [self trimImagesToPixelCount:_maxPixelCount];
+        }
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSUInteger)pixelCount {
+    @synchronized (self) {
+        return _pixelCount;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSTimeInterval)invalidationAge {
+    @synchronized (self) {
+        return _invalidationAge;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)setInvalidationAge:(NSTimeInterval)invalidationAge {
+    @synchronized (self) {
+        _invalidationAge = invalidationAge;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (unsigned long long)diskCapacity {
+    @synchronized (self) {
+        return _diskCapacity;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)setDiskCapacity:(unsigned long long)diskCapacity {
+    @synchronized (self) {
+        _diskCapacity = diskCapacity;
+        if (_diskUsage > _diskCapacity) {
+            [self scheduleDiskTrim];
+        }
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (unsigned long long)diskUsage {
+    @synchronized (self) {
+        return _diskUsage;
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#pragma mark - Public
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSString *)keyForURL:(NSString *)URL {
+    return [SGURLCache md5HashOfString:URL];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSString *)cachePathForURL:(NSString *)URL {
+    return [self cachePathForKey:[self keyForURL:URL]];
+}
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 - (NSString *)cachePathForKey:(NSString *)key {
-    return [_cachePath stringByAppendingPathComponent:key];
+    // Keys can contain anything, including slashes, so we never use them as file names
+    // directly.  The first byte of the hash picks one of 256 shard directories.
+    NSString * hash = [SGURLCache md5HashOfString:key];
+    NSString * shard = [_cachePath stringByAppendingPathComponent:[hash substringToIndex:2]];
+    return [shard stringByAppendingPathComponent:hash];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSString *)etagCachePathForKey:(NSString *)key {
+    // Same layout as the data files, so that an eviction can find the validators of the
+    // file it deletes without hashing anything.
+    NSString * hash = [SGURLCache md5HashOfString:key];
+    NSString * shard = [self.etagCachePath stringByAppendingPathComponent:[hash substringToIndex:2]];
+    return [shard stringByAppendingPathComponent:hash];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (BOOL)hasDataForURL:(NSString *)URL {
+    return [self hasDataForKey:[self keyForURL:URL]];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (BOOL)hasDataForKey:(NSString *)key {
+    @synchronized (self) {
+        if ([_memoryEntries objectForKey:key] != nil) {
+            return YES;
+        }
+    }
+    if (_diskCacheEnabled) {
+        struct stat sb;
+        return stat([[self cachePathForKey:key] fileSystemRepresentation], &sb) == 0;
+    }
+    return NO;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSData *)dataForURL:(NSString *)URL {
+    return [self dataForKey:[self keyForURL:URL]];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSData *)dataForKey:(NSString *)key {
+    NSData * data = nil;
+
+    @synchronized (self) {
+        SGURLCacheEntry * entry = [_memoryEntries objectForKey:key];
+        if (entry != nil) {
+            UnlinkEntry(entry, &_mostRecentEntry, &_leastRecentEntry);
+            LinkEntryAsMostRecent(entry, &_mostRecentEntry, &_leastRecentEntry);
+            data = [[entry.data retain] autorelease];
+        }
+    }
+
+    if (data == nil && _diskCacheEnabled) {
+        NSString * filePath = [self cachePathForKey:key];
+
+        data = [NSData dataWithContentsOfFile:filePath];
+        if (data != nil) {
+            // Bump the modification date, which is what the eviction pass uses to find
+            // the least recently used files.
+            (void) utimes([filePath fileSystemRepresentation], NULL);
+
+            @synchronized (self) {
+                if ([_memoryEntries objectForKey:key] == nil && data.length <= _memoryCapacity) {
+                    SGURLCacheEntry * entry = [[SGURLCacheEntry alloc] init];
+                    entry.key = key;
+                    entry.data = data;
+                    [_memoryEntries setObject:entry forKey:key];
+                    LinkEntryAsMostRecent(entry, &_mostRecentEntry, &_leastRecentEntry);
+                    _memoryUsage += data.length;
+                    [entry release];
+
+                    [self trimMemoryToCapacity:_memoryCapacity];
+                }
+            }
+        }
+    }
+
+    return data;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)storeData:(NSData *)data forURL:(NSString *)URL {
+    [self storeData:data forKey:[self keyForURL:URL]];
 }
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 - (void)storeData:(NSData *)data forKey:(NSString *)key {
+    [self storeDataInMemory:data forKey:key];
+    [self writeData:data forKey:key];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)storeDataInBackground:(NSData *)data validators:(NSDictionary *)validators forURL:(NSString *)URL {
+    NSString * key = [self keyForURL:URL];
+
+    [self storeDataInMemory:data forKey:key];
+
+    // The block retains data, validators and us until it has run.
+
+    if (_diskCacheEnabled) {
+        [_diskQueue addOperationWithBlock:^{
+            if ([self writeData:data forKey:key]) {
+                [self writeValidators:validators validationDate:[NSDate date] forKey:key];
+            }
+        }];
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)storeDataInMemory:(NSData *)data forKey:(NSString *)key {
+    // Replace any existing entry, then evict from the cold end.
+
+    @synchronized (self) {
+        SGURLCacheEntry * existing = [_memoryEntries objectForKey:key];
+        if (existing != nil) {
+            [self removeMemoryEntry:existing];
+        }
+        if (data.length <= _memoryCapacity) {
+            SGURLCacheEntry * entry = [[SGURLCacheEntry alloc] init];
+            entry.key = key;
+            entry.data = data;
+            entry.validationDate = [NSDate date];       // new data is fresh; see writeData:forKey:
+            [_memoryEntries setObject:entry forKey:key];
+            LinkEntryAsMostRecent(entry, &_mostRecentEntry, &_leastRecentEntry);
+            _memoryUsage += data.length;
+            [entry release];
+
+            [self trimMemoryToCapacity:_memoryCapacity];
+        }
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (BOOL)writeData:(NSData *)data forKey:(NSString *)key {
+    BOOL success = NO;
+
+    // NSDataWritingAtomic writes to a temporary file and renames it into place, so readers
+    // see either the old data or the new, never a mixture.
+
+    if (_diskCacheEnabled) {
+        NSString * filePath = [self cachePathForKey:key];
+        struct stat sb;
+        unsigned long long oldSize = 0;
+
+        if (stat([filePath fileSystemRepresentation], &sb) == 0) {
+            oldSize = (unsigned long long)sb.st_size;
+        }
+
+        success = [data writeToFile:filePath options:NSDataWritingAtomic error:NULL];
+        if (!success) {
+            // Most likely the shard directory doesn't exist yet.
+            [[NSFileManager defaultManager] createDirectoryAtPath:[filePath stringByDeletingLastPathComponent]
+                                      withIntermediateDirectories:YES
+                                                       attributes:nil
+                                                            error:NULL];
+            success = [data writeToFile:filePath options:NSDataWritingAtomic error:NULL];
+        }
+
+        if (success) {
+            // Any validators described the old data, and the new data is fresh.
+            (void) unlink([[self etagCachePathForKey:key] fileSystemRepresentation]);
+
+            @synchronized (self) {
+                [[_memoryEntries objectForKey:key] setValidationDate:[NSDate date]];
+                _diskUsage = ((_diskUsage > oldSize) ? (_diskUsage - oldSize) : 0) + data.length;
+                if (_diskUsage > _diskCapacity) {
+                    [self scheduleDiskTrim];
+                }
+            }
+        }
+    }
+    return success;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (BOOL)storeFileAtPath:(NSString *)path forURL:(NSString *)URL {
+    return [self storeFileAtPath:path forKey:[self keyForURL:URL]];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (BOOL)storeFileAtPath:(NSString *)path forKey:(NSString *)key {
+    if (!_diskCacheEnabled) {
+        return NO;
+    }
+
+    @synchronized (self) {
+        SGURLCacheEntry * existing = [_memoryEntries objectForKey:key];
+        if (existing != nil) {
+            [self removeMemoryEntry:existing];
+        }
+    }
+
+    NSString * filePath = [self cachePathForKey:key];
+    struct stat sb;
+    unsigned long long oldSize = 0;
+    unsigned long long newSize;
+
+    if (stat([path fileSystemRepresentation], &sb) != 0) {
+        return NO;
+    }
+    newSize = (unsigned long long)sb.st_size;
+    if (stat([filePath fileSystemRepresentation], &sb) == 0) {
+        oldSize = (unsigned long long)sb.st_size;
+    }
+
+    // rename is atomic, like NSDataWritingAtomic, but only works within a volume.
+
+    BOOL success = (rename([path fileSystemRepresentation], [filePath fileSystemRepresentation]) == 0);
+    if (!success && errno == ENOENT) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:[filePath stringByDeletingLastPathComponent]
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:NULL];
+        success = (rename([path fileSystemRepresentation], [filePath fileSystemRepresentation]) == 0);
+    }
+    if (!success && errno == EXDEV) {
+        (void) unlink([filePath fileSystemRepresentation]);
+        success = [[NSFileManager defaultManager] moveItemAtPath:path toPath:filePath error:NULL];
+    }
+
+    if (success) {
+        (void) unlink([[self etagCachePathForKey:key] fileSystemRepresentation]);
+
+        @synchronized (self) {
+            _diskUsage = ((_diskUsage > oldSize) ? (_diskUsage - oldSize) : 0) + newSize;
+            if (_diskUsage > _diskCapacity) {
+                [self scheduleDiskTrim];
+            }
+        }
+    }
+    return success;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)storeFileInBackgroundAtPath:(NSString *)path validators:(NSDictionary *)validators forURL:(NSString *)URL {
+    NSString * key = [self keyForURL:URL];
+    NSDate * date = [NSDate date];
+
+    // The block retains path, validators and us until it has run.
+
+    [_diskQueue addOperationWithBlock:^{
+        if ([self storeFileAtPath:path forKey:key]) {
+            if ([validators count] != 0) {
+                [self writeValidators:validators validationDate:date forKey:key];
+            }
+        } else {
+            (void) unlink([path fileSystemRepresentation]);
+        }
+    }];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (UIImage *)imageForURL:(NSString *)URL {
+    @synchronized (self) {
+        SGURLCacheEntry * entry = [_imageEntries objectForKey:URL];
+        if (entry != nil) {
+            UnlinkEntry(entry, &_mostRecentImageEntry, &_leastRecentImageEntry);
+            LinkEntryAsMostRecent(entry, &_mostRecentImageEntry, &_leastRecentImageEntry);
+            return [[entry.image retain] autorelease];
+        }
+    }
+    return nil;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)storeImage:(UIImage *)image forURL:(NSString *)URL {
+    NSUInteger pixelCount = PixelCountOfImage(image);
+
+    @synchronized (self) {
+        SGURLCacheEntry * existing = [_imageEntries objectForKey:URL];
+        if (existing != nil) {
+            [self removeImageEntry:existing];
+        }
+        if (_imageCacheEnabled && (_maxPixelCount == 0 || pixelCount <= _maxPixelCount)) {
+            SGURLCacheEntry * entry = [[SGURLCacheEntry alloc] init];
+            entry.key = URL;
+            entry.image = image;
+            [_imageEntries setObject:entry forKey:URL];
+            LinkEntryAsMostRecent(entry, &_mostRecentImageEntry, &_leastRecentImageEntry);
+            _pixelCount += pixelCount;
+            [entry release];
+
+            if (_maxPixelCount != 0) {
+                [self trimImagesToPixelCount:_maxPixelCount];
+            }
+        }
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)removeImageForURL:(NSString *)URL {
+    @synchronized (self) {
+        SGURLCacheEntry * entry = [_imageEntries objectForKey:URL];
+        if (entry != nil) {
+            [self removeImageEntry:entry];
+        }
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSDictionary *)validatorsForURL:(NSString *)URL {
+    return [self validatorsForKey:[self keyForURL:URL]];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSDictionary *)validatorsForKey:(NSString *)key {
     if (!_diskCacheEnabled) {
-        NSString* filePath = [self cachePathForKey:key];
-        NSFileManager* fm = [NSFileManager defaultManager];
-        [fm createFileAtPath:filePath contents:data attributes:nil];
+        return nil;
+    }
+
+    NSMutableDictionary * validators = [NSMutableDictionary dictionaryWithContentsOfFile:[self etagCachePathForKey:key]];
+    [validators removeObjectForKey:kSGCValidationDateKey];
+    return (validators.count == 0) ? nil : validators;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)storeValidators:(NSDictionary *)validators forURL:(NSString *)URL {
+    [self storeValidators:validators forKey:[self keyForURL:URL]];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)storeValidators:(NSDictionary *)validators forKey:(NSString *)key {
+    [self writeValidators:validators validationDate:[NSDate date] forKey:key];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)storeValidatorsInBackground:(NSDictionary *)validators forURL:(NSString *)URL {
+    NSString * key = [self keyForURL:URL];
+    NSDate * date = [NSDate date];
+
+    if (_diskCacheEnabled) {
+        [_diskQueue addOperationWithBlock:^{
+            [self writeValidators:validators validationDate:date forKey:key];
+        }];
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)lookUpDataAndValidatorsForURL:(NSString *)URL completionBlock:(SGURLCacheLookupBlock)block {
+    NSString * key = [self keyForURL:URL];
+
+    assert(block != nil);
+
+    // The disk queue is serial, so the lookup sees everything stored in the background
+    // before it was queued.  Copying the operation's block copies ours too.
+
+    [_diskQueue addOperationWithBlock:^{
+        NSData * data = [self dataForKey:key];
+        NSDictionary * validators = (data != nil) ? [self validatorsForKey:key] : nil;
+
+        block(data, validators);
+    }];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSDate *)validationDateForKey:(NSString *)key {
+    if (!_diskCacheEnabled) {
+        return nil;
+    }
+
+    // If the entry is in memory, and we've already read its date, we're done.  Everything
+    // that writes or removes the sidecar file updates the memory entry too.
+
+    @synchronized (self) {
+        NSDate * date = [[_memoryEntries objectForKey:key] validationDate];
+        if (date != nil) {
+            return [[date retain] autorelease];
+        }
+    }
+
+    // The sidecar file, if any, records when the entry was last validated.  Otherwise,
+    // the entry is as old as its data file.  Reads bump the modification date, for the
+    // LRU eviction, but not the creation date, and each store creates a new file.
+
+    NSDate * date = [[NSDictionary dictionaryWithContentsOfFile:[self etagCachePathForKey:key]] objectForKey:kSGCValidationDateKey];
+    if (date == nil) {
+        struct stat sb;
+        if (stat([[self cachePathForKey:key] fileSystemRepresentation], &sb) == 0) {
+            date = [NSDate dateWithTimeIntervalSince1970:(NSTimeInterval) sb.st_birthtimespec.tv_sec];
+        }
+    }
+
+    // Remember it, unless a write got in while we were reading; its date is newer.
+
+    if (date != nil) {
+        @synchronized (self) {
+            SGURLCacheEntry * entry = [_memoryEntries objectForKey:key];
+            if (entry != nil && entry.validationDate == nil) {
+                entry.validationDate = date;
+            }
+        }
+    }
+    return date;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (BOOL)isStaleURL:(NSString *)URL {
+    return [self isStaleKey:[self keyForURL:URL]];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (BOOL)isStaleKey:(NSString *)key {
+    NSDate * date = [self validationDateForKey:key];
+    NSTimeInterval invalidationAge = self.invalidationAge;
+
+    if (date == nil) {
+        return NO;
+    }
+    if ([date timeIntervalSince1970] <= 0.0) {
+        return YES;                 // explicitly invalidated
+    }
+    return (invalidationAge > 0.0) && (-[date timeIntervalSinceNow] > invalidationAge);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)invalidateURL:(NSString *)URL {
+    [self invalidateKey:[self keyForURL:URL]];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)invalidateKey:(NSString *)key {
+    if ([self hasDataForKey:key]) {
+        [self writeValidators:[self validatorsForKey:key] validationDate:[NSDate dateWithTimeIntervalSince1970:0.0] forKey:key];
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (NSData *)dataForURL:(NSString *)URL revalidateIfStale:(BOOL)revalidate {
+    NSData * data = [self dataForURL:URL];
+
+    if (data != nil && revalidate && [self isStaleURL:URL]) {
+        BOOL start = NO;
+
+        @synchronized (self) {
+            if (![_revalidatingURLs containsObject:URL]) {
+                [_revalidatingURLs addObject:URL];
+                start = YES;
+            }
+        }
+
+        // The network manager calls us back on the thread that queued the operation,
+        // which has to run its run loop, so we always queue from the main thread.
+        if (start) {
+            [self performSelectorOnMainThread:@selector(startRevalidationOfURL:) withObject:URL waitUntilDone:NO];
+        }
+    }
+    return data;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)removeURL:(NSString *)URL fromDisk:(BOOL)fromDisk {
+    [self removeImageForURL:URL];
+    [self removeKey:[self keyForURL:URL] fromDisk:fromDisk];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)removeKey:(NSString *)key fromDisk:(BOOL)fromDisk {
+    @synchronized (self) {
+        SGURLCacheEntry * entry = [_memoryEntries objectForKey:key];
+        if (entry != nil) {
+            [self removeMemoryEntry:entry];
+        }
+    }
+
+    if (fromDisk) {
+        NSString * filePath = [self cachePathForKey:key];
+        struct stat sb;
+
+        if (stat([filePath fileSystemRepresentation], &sb) == 0 && unlink([filePath fileSystemRepresentation]) == 0) {
+            @synchronized (self) {
+                _diskUsage -= MIN((unsigned long long)sb.st_size, _diskUsage);
+            }
+        }
+        (void) unlink([[self etagCachePathForKey:key] fileSystemRepresentation]);
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)removeAll:(BOOL)fromDisk {
+    [self removeAllFromMemory];
+
+    if (fromDisk) {
+        NSFileManager * fm = [[[NSFileManager alloc] init] autorelease];
+
+        // Let any eviction pass finish first, so that it doesn't resurrect the old size.
+        [_diskQueue waitUntilAllOperationsAreFinished];
+
+        [fm removeItemAtPath:_cachePath error:NULL];
+        [fm createDirectoryAtPath:_cachePath withIntermediateDirectories:YES attributes:nil error:NULL];
+
+        @synchronized (self) {
+            _diskUsage = 0;
+        }
+    }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+- (void)removeAllFromMemory {
+    @synchronized (self) {
+        [_memoryEntries removeAllObjects];
+        _mostRecentEntry = nil;
+        _leastRecentEntry = nil;
+        _memoryUsage = 0;
+
+        [_imageEntries removeAllObjects];
+        _mostRecentImageEntry = nil;
+        _leastRecentImageEntry = nil;
+        _pixelCount = 0;
     }
 }
 
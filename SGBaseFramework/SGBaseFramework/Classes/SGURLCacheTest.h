@@ -0,0 +1,29 @@
+//
+//  SGURLCacheTest.h
+//  SGBaseFramework
+//
+//  Unit tests for SGURLCache.
+
+#define USE_APPLICATION_UNIT_TEST 0
+
+#import <SenTestingKit/SenTestingKit.h>
+#import <UIKit/UIKit.h>
+
+
+@interface SGURLCacheTest : SenTestCase {
+    NSNotification * _revalidation;
+    volatile BOOL _consumerPaused;
+}
+
+- (void)testMemoryTierEvictsLeastRecentlyUsed;
+- (void)testDiskTierStoresUnderHashedPaths;
+- (void)testConditionalGetServesCachedBodyOnNotModified;
+- (void)testImageTierEvictsByPixelCount;
+- (void)testStaleEntryIsServedWhileRevalidating;
+- (void)testStalenessIsRememberedWithMemoryEntry;
+- (void)testPrivateAuthorizedAndPartialResponsesAreNotStored;
+- (void)testResponseConsumersStreamBodyIntoCache;
+- (void)testFileConsumerWritesInOrderAndResumes;
+- (void)testFileDownloadOfCachedURLIsUnconditional;
+
+@end
@@ -0,0 +1,612 @@
+//
+//  SGURLCacheTest.m
+//  SGBaseFramework
+//
+
+#import "SGURLCacheTest.h"
+#import "SGURLCache.h"
+#import "QHTTPOperation.h"
+#import "SGNetworkManager.h"
+#import "SGImageDecodeOperation.h"
+#import "QHTTPResponseConsumer.h"
+#import "SGTestHTTPServer.h"
+
+#import <CommonCrypto/CommonDigest.h>
+
+#include <unistd.h>
+
+@interface SGURLCacheTest () <QHTTPResponseConsumerFlowControl>
+@end
+
+
+static NSData * DataOfLength(NSUInteger length, char fill)
+{
+    NSMutableData * result;
+
+    result = [NSMutableData dataWithLength:length];
+    memset([result mutableBytes], fill, length);
+    return result;
+}
+
+
+
+static NSString * const kSGURLCacheTestBody = @"Hello from the loopback stub server.";
+
+
+static SGTestHTTPServer * StartValidatingServer(void)
+    // Starts a loopback server for one resource, whose ETag is always "v1": a request with
+    // a matching If-None-Match gets a 304, a request with a Range header gets a 206 with
+    // the first byte of the body, and anything else gets a 200 with the body.  The 200
+    // is marked Cache-Control: private if the path starts with /private, and no-cache,
+    // which keeps NSURLCache from answering for us, otherwise.  The server keeps the
+    // headers of each request so that the test can check them.
+{
+    NSData * body = [kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding];
+    SGTestHTTPServer * server;
+
+    server = [[[SGTestHTTPServer alloc] initWithResponder:^(NSString * request, NSUInteger requestIndex) {
+        #pragma unused(requestIndex)
+        if ([[request lowercaseString] rangeOfString:@"\r\nif-none-match: \"v1\"\r\n"].location != NSNotFound) {
+            return [SGTestHTTPResponse responseWithStatusCode:304 headers:[NSDictionary dictionaryWithObject:@"\"v1\"" forKey:@"ETag"] body:nil];
+        }
+        if ([[request lowercaseString] rangeOfString:@"\r\nrange: "].location != NSNotFound) {
+            return [SGTestHTTPResponse responseWithStatusCode:206 headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                @"text/plain", @"Content-Type",
+                @"\"v1\"", @"ETag",
+                [NSString stringWithFormat:@"bytes 0-0/%u", (unsigned) [body length]], @"Content-Range",
+                @"no-cache", @"Cache-Control",
+                nil
+            ] body:[body subdataWithRange:NSMakeRange(0, 1)]];
+        }
+        return [SGTestHTTPResponse responseWithStatusCode:200 headers:[NSDictionary dictionaryWithObjectsAndKeys:
+            @"text/plain", @"Content-Type",
+            @"\"v1\"", @"ETag",
+            @"Sat, 26 Nov 2011 10:00:00 GMT", @"Last-Modified",
+            [request hasPrefix:@"GET /private"] ? @"private" : @"no-cache", @"Cache-Control",
+            nil
+        ] body:body];
+    }] autorelease];
+    server.recordsRequests = YES;
+    [server start];
+    return server;
+}
+
+
+static NSData * PNGDataOfSize(size_t width, size_t height)
+{
+    CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
+    CGContextRef context = CGBitmapContextCreate(NULL, width, height, 8, 0, colorSpace, kCGImageAlphaPremultipliedLast);
+    CGImageRef cgImage;
+    NSData * result;
+
+    CGContextSetRGBFillColor(context, 1.0f, 0.0f, 0.0f, 1.0f);
+    CGContextFillRect(context, CGRectMake(0.0f, 0.0f, (CGFloat) width, (CGFloat) height));
+    cgImage = CGBitmapContextCreateImage(context);
+    result = UIImagePNGRepresentation([UIImage imageWithCGImage:cgImage]);
+    CGImageRelease(cgImage);
+    CGContextRelease(context);
+    CGColorSpaceRelease(colorSpace);
+    return result;
+}
+
+
+static void WaitForCacheWrites(SGURLCache * cache, NSString * URL)
+    // Returns once the stores that cache has queued for the disk are written, or after
+    // ten seconds.  The disk queue is serial, so that's when a lookup comes back.
+{
+    __block volatile BOOL done = NO;
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:10.0];
+
+    [cache lookUpDataAndValidatorsForURL:URL completionBlock:^(NSData * data, NSDictionary * validators) {
+        #pragma unused(data)
+        #pragma unused(validators)
+        done = YES;
+    }];
+    while (!done && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+}
+
+
+static void RunPreparedOperation(QHTTPOperation * op)
+    // Runs op and returns when it's finished, and anything it stored in its cache is on
+    // disk, or after ten seconds.
+{
+    NSOperationQueue * queue = [[[NSOperationQueue alloc] init] autorelease];
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:10.0];
+
+    // The connection runs on this thread's run loop, so spin it until we're done.
+
+    [queue addOperation:op];
+    while (![op isFinished] && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    }
+    if (op.cache != nil) {
+        WaitForCacheWrites(op.cache, [op.URL absoluteString]);
+    }
+}
+
+
+static QHTTPOperation * RunOperation(NSURL * url, SGURLCache * cache)
+    // Runs a GET for url, revalidating against cache, and returns the finished operation.
+{
+    QHTTPOperation * op = [[[QHTTPOperation alloc] initWithURL:url] autorelease];
+
+    op.cache = cache;
+    RunPreparedOperation(op);
+    return op;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+@implementation SGURLCacheTest
+
+
+- (void)testMemoryTierEvictsLeastRecentlyUsed {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    cache.diskCacheEnabled = NO;
+    cache.memoryCapacity = 300;
+
+    [cache storeData:DataOfLength(100, 'a') forKey:@"a"];
+    [cache storeData:DataOfLength(100, 'b') forKey:@"b"];
+    [cache storeData:DataOfLength(100, 'c') forKey:@"c"];
+    STAssertEquals(cache.memoryUsage, (NSUInteger) 300, @"Memory usage should count every byte", nil);
+
+    // Touch "a", so that "b" is now the least recently used.
+
+    STAssertNotNil([cache dataForKey:@"a"], @"Entry should be in memory", nil);
+    [cache storeData:DataOfLength(100, 'd') forKey:@"d"];
+
+    STAssertTrue([cache hasDataForKey:@"a"], @"Recently used entry should survive", nil);
+    STAssertFalse([cache hasDataForKey:@"b"], @"Least recently used entry should be evicted", nil);
+    STAssertTrue([cache hasDataForKey:@"c"], nil, nil);
+    STAssertTrue([cache hasDataForKey:@"d"], nil, nil);
+    STAssertEquals(cache.memoryUsage, (NSUInteger) 300, @"Memory usage should stay within capacity", nil);
+
+    // Items bigger than the memory tier are not kept in memory at all.
+
+    [cache storeData:DataOfLength(301, 'e') forKey:@"e"];
+    STAssertFalse([cache hasDataForKey:@"e"], @"Oversized entry should not be kept in memory", nil);
+
+    [cache removeAllFromMemory];
+    STAssertEquals(cache.memoryUsage, (NSUInteger) 0, nil, nil);
+}
+
+
+- (void)testDiskTierStoresUnderHashedPaths {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    NSString * URL = @"http://example.com/feed?page=1&size=20";
+    NSString * path;
+    NSData * data;
+
+    [cache removeAll:YES];
+
+    data = DataOfLength(1000, 'x');
+    [cache storeData:data forURL:URL];
+
+    path = [cache cachePathForURL:URL];
+    STAssertTrue([path hasPrefix:cache.cachePath], @"Files should live in the cache directory", nil);
+    STAssertEquals([[path lastPathComponent] length], (NSUInteger) 32, @"File names should be hashes", nil);
+    STAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:path], @"Data should be written to disk", nil);
+    STAssertEquals(cache.diskUsage, (unsigned long long) 1000, nil, nil);
+
+    // With the memory tier empty, the data must come back from disk.
+
+    [cache removeAllFromMemory];
+    STAssertEqualObjects([cache dataForURL:URL], data, @"Data should be read back from disk", nil);
+
+    [cache removeURL:URL fromDisk:YES];
+    STAssertFalse([cache hasDataForURL:URL], @"Data should be gone from both tiers", nil);
+    STAssertEquals(cache.diskUsage, (unsigned long long) 0, nil, nil);
+
+    [cache removeAll:YES];
+}
+
+
+- (void)testConditionalGetServesCachedBodyOnNotModified {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    SGTestHTTPServer * server = StartValidatingServer();
+    NSData * body = [kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding];
+    QHTTPOperation * op;
+    NSURL * url;
+
+    STAssertNotNil(server, @"Stub server should start", nil);
+    [cache removeAll:YES];
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/feed", (unsigned) server.port]];
+
+    // The first fetch is unconditional, and stores the body and its validators.
+
+    op = RunOperation(url, cache);
+    STAssertTrue([op isFinished], @"Operation should finish", nil);
+    STAssertNil(op.error, nil, nil);
+    STAssertEquals([op.lastResponse statusCode], (NSInteger) 200, nil, nil);
+    STAssertFalse(op.isResponseFromCache, nil, nil);
+    STAssertEqualObjects(op.responseBody, body, nil, nil);
+    STAssertEqualObjects([cache dataForURL:[url absoluteString]], body, @"Body should be cached", nil);
+    STAssertEqualObjects([[cache validatorsForURL:[url absoluteString]] objectForKey:kSGCValidatorETagKey], @"\"v1\"", nil, nil);
+    STAssertEqualObjects([[cache validatorsForURL:[url absoluteString]] objectForKey:kSGCValidatorLastModifiedKey],
+                         @"Sat, 26 Nov 2011 10:00:00 GMT", nil, nil);
+
+    // The second is conditional; the server says 304 and the body comes from the cache.
+
+    op = RunOperation(url, cache);
+    STAssertTrue([op isFinished], @"Operation should finish", nil);
+    STAssertNil(op.error, @"A 304 should count as success", nil);
+    STAssertEquals([op.lastResponse statusCode], (NSInteger) 304, nil, nil);
+    STAssertTrue(op.isResponseFromCache, nil, nil);
+    STAssertEqualObjects(op.responseBody, body, @"Cached body should be served", nil);
+
+    STAssertEquals(server.requests.count, (NSUInteger) 2, nil, nil);
+    STAssertTrue([[[server.requests objectAtIndex:0] lowercaseString] rangeOfString:@"if-none-match"].location == NSNotFound,
+                 @"First request should be unconditional", nil);
+    STAssertTrue([[[server.requests objectAtIndex:1] lowercaseString] rangeOfString:@"if-modified-since: sat, 26 nov 2011"].location != NSNotFound,
+                 @"Second request should carry Last-Modified", nil);
+
+    // Requests built by the network manager are left unconditional; the operation
+    // decides.
+
+    SGURLCache * savedCache = [[[SGNetworkManager sharedManager].URLCache retain] autorelease];
+    [SGNetworkManager sharedManager].URLCache = cache;
+    STAssertNil([[[SGNetworkManager sharedManager] requestToGetURL:url] valueForHTTPHeaderField:@"If-None-Match"], nil, nil);
+    [SGNetworkManager sharedManager].URLCache = savedCache;
+
+    [cache removeAll:YES];
+    [server stop];
+}
+
+
+- (void)testImageTierEvictsByPixelCount {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    NSOperationQueue * queue = [[[NSOperationQueue alloc] init] autorelease];
+    NSArray * URLs = [NSArray arrayWithObjects:@"http://example.com/a.png", @"http://example.com/b.png", @"http://example.com/c.png", nil];
+
+    // Room for two 100 x 100 images, but not three.
+
+    cache.maxPixelCount = 25000;
+
+    for (NSString * URL in URLs) {
+        SGImageDecodeOperation * op = [[[SGImageDecodeOperation alloc] initWithImageData:PNGDataOfSize(100, 100) URL:URL] autorelease];
+        op.cache = cache;
+        [queue addOperation:op];
+        [queue waitUntilAllOperationsAreFinished];
+
+        STAssertNotNil(op.image, @"Image should decode", nil);
+        STAssertEquals(op.image.size, CGSizeMake(100.0f, 100.0f), nil, nil);
+        STAssertEquals([cache imageForURL:URL], op.image, @"Decoded image should be cached", nil);
+    }
+
+    STAssertNil([cache imageForURL:[URLs objectAtIndex:0]], @"Least recently used image should be evicted", nil);
+    STAssertNotNil([cache imageForURL:[URLs objectAtIndex:1]], nil, nil);
+    STAssertNotNil([cache imageForURL:[URLs objectAtIndex:2]], nil, nil);
+    STAssertEquals(cache.pixelCount, (NSUInteger) 20000, @"Only two images should be counted", nil);
+
+    // Images bigger than the whole budget aren't cached, and a memory warning purges the rest.
+
+    [cache storeImage:[UIImage imageWithData:PNGDataOfSize(200, 200)] forURL:@"http://example.com/big.png"];
+    STAssertNil([cache imageForURL:@"http://example.com/big.png"], nil, nil);
+
+    [[NSNotificationCenter defaultCenter] postNotificationName:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+    STAssertNil([cache imageForURL:[URLs objectAtIndex:2]], @"Memory warning should purge images", nil);
+    STAssertEquals(cache.pixelCount, (NSUInteger) 0, nil, nil);
+}
+
+
+
+- (void)cacheDidRevalidate:(NSNotification *)note {
+    [_revalidation release];
+    _revalidation = [note retain];
+}
+
+
+- (void)testStaleEntryIsServedWhileRevalidating {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    SGTestHTTPServer * server = StartValidatingServer();
+    NSData * staleBody = [@"Stale" dataUsingEncoding:NSASCIIStringEncoding];
+    NSData * freshBody = [kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding];
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:10.0];
+    NSString * URL;
+
+    STAssertNotNil(server, @"Stub server should start", nil);
+    [cache removeAll:YES];
+    URL = [NSString stringWithFormat:@"http://127.0.0.1:%u/feed", (unsigned) server.port];
+
+    // A new entry is fresh until its age passes invalidationAge, or it's invalidated.
+
+    cache.invalidationAge = 60.0;
+    [cache storeData:staleBody forURL:URL];
+    [cache storeValidators:[NSDictionary dictionaryWithObject:@"\"v0\"" forKey:kSGCValidatorETagKey] forURL:URL];
+    STAssertFalse([cache isStaleURL:URL], nil, nil);
+    [cache invalidateURL:URL];
+    STAssertTrue([cache isStaleURL:URL], nil, nil);
+    STAssertEqualObjects([[cache validatorsForURL:URL] objectForKey:kSGCValidatorETagKey], @"\"v0\"",
+                         @"Invalidating should keep the validators", nil);
+
+    // The stale data comes back straight away, and the fresh data follows.
+
+    [[NSNotificationCenter defaultCenter] addObserver:self
+                                             selector:@selector(cacheDidRevalidate:)
+                                                 name:SGURLCacheDidRevalidateNotification
+                                               object:cache];
+    STAssertEqualObjects([cache dataForURL:URL revalidateIfStale:YES], staleBody, @"Stale data should be served", nil);
+    while (_revalidation == nil && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    }
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:SGURLCacheDidRevalidateNotification object:cache];
+
+    WaitForCacheWrites(cache, URL);
+
+    STAssertNotNil(_revalidation, @"Revalidation should be notified", nil);
+    STAssertEqualObjects([[_revalidation userInfo] objectForKey:SGURLCacheURLKey], URL, nil, nil);
+    STAssertEqualObjects([[_revalidation userInfo] objectForKey:SGURLCacheDataKey], freshBody, nil, nil);
+    STAssertEqualObjects([cache dataForURL:URL], freshBody, @"Fresh data should replace the stale data", nil);
+    STAssertFalse([cache isStaleURL:URL], nil, nil);
+    STAssertTrue([[[server.requests objectAtIndex:0] lowercaseString] rangeOfString:@"if-none-match: \"v0\""].location != NSNotFound,
+                 @"Revalidation should be conditional", nil);
+
+    [_revalidation release];
+    _revalidation = nil;
+    [cache removeAll:YES];
+    [server stop];
+}
+
+
+- (void)testStalenessIsRememberedWithMemoryEntry {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    NSString * URL = @"http://example.com/stale";
+    NSString * sidecarPath;
+
+    [cache removeAll:YES];
+    cache.invalidationAge = 60.0;
+    [cache storeData:[kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding] forURL:URL];
+    [cache invalidateURL:URL];
+    sidecarPath = [cache etagCachePathForKey:[cache keyForURL:URL]];
+
+    // Once the validation date is known, the memory entry answers for it, so removing the
+    // sidecar behind the cache's back makes no difference.
+
+    STAssertTrue([cache isStaleURL:URL], nil, nil);
+    STAssertEquals(unlink([sidecarPath fileSystemRepresentation]), 0, nil, nil);
+    STAssertTrue([cache isStaleURL:URL], @"The memory entry should remember the date", nil);
+
+    // Without the memory entry, the date comes from the disk, where the data file is new.
+
+    [cache removeAllFromMemory];
+    STAssertFalse([cache isStaleURL:URL], @"The date should be read from the disk", nil);
+
+    [cache removeAll:YES];
+}
+
+
+- (void)testPrivateAuthorizedAndPartialResponsesAreNotStored {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    SGTestHTTPServer * server = StartValidatingServer();
+    NSData * body = [kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding];
+    NSMutableURLRequest * request;
+    QHTTPOperation * op;
+    NSURL * url;
+
+    STAssertNotNil(server, @"Stub server should start", nil);
+    [cache removeAll:YES];
+
+    // The server marks this response private, so it's meant for one user.
+
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/private", (unsigned) server.port]];
+    op = RunOperation(url, cache);
+    STAssertNil(op.error, nil, nil);
+    STAssertEqualObjects(op.responseBody, body, nil, nil);
+    STAssertFalse([cache hasDataForURL:[url absoluteString]], @"A private response should not be cached", nil);
+
+    // This one is storable, but the request carried credentials.
+
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/feed", (unsigned) server.port]];
+    request = [NSMutableURLRequest requestWithURL:url];
+    [request setValue:@"Basic dXNlcjpwYXNz" forHTTPHeaderField:@"Authorization"];
+    op = [[[QHTTPOperation alloc] initWithRequest:request] autorelease];
+    op.cache = cache;
+    RunPreparedOperation(op);
+    STAssertNil(op.error, nil, nil);
+    STAssertEqualObjects(op.responseBody, body, nil, nil);
+    STAssertFalse([cache hasDataForURL:[url absoluteString]], @"An authorized response should not be cached", nil);
+
+    // A 206 is an acceptable status, but it's only part of the resource.
+
+    request = [NSMutableURLRequest requestWithURL:url];
+    [request setValue:@"bytes=0-0" forHTTPHeaderField:@"Range"];
+    op = [[[QHTTPOperation alloc] initWithRequest:request] autorelease];
+    op.cache = cache;
+    RunPreparedOperation(op);
+    STAssertNil(op.error, nil, nil);
+    STAssertEquals(op.lastResponse.statusCode, (NSInteger) 206, nil, nil);
+    STAssertEquals([op.responseBody length], (NSUInteger) 1, nil, nil);
+    STAssertFalse([cache hasDataForURL:[url absoluteString]], @"A partial response should not be cached", nil);
+
+    [cache removeAll:YES];
+    [server stop];
+}
+
+
+- (void)testResponseConsumersStreamBodyIntoCache {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    SGTestHTTPServer * server = StartValidatingServer();
+    NSData * body = [kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding];
+    NSMutableData * seen = [NSMutableData data];
+    unsigned char expectedDigest[CC_SHA1_DIGEST_LENGTH];
+    QHTTPDigestResponseConsumer * digester = [[[QHTTPDigestResponseConsumer alloc] init] autorelease];
+    QHTTPBlockResponseConsumer * tap;
+    QHTTPCacheResponseConsumer * writer;
+    QHTTPOperation * op;
+    NSURL * url;
+
+    STAssertNotNil(server, @"Stub server should start", nil);
+    [cache removeAll:YES];
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/large", (unsigned) server.port]];
+
+    // Hash the body, watch it go by, and write it to the cache, without ever
+    // accumulating it in the operation.
+
+    tap = [[[QHTTPBlockResponseConsumer alloc] initWithDataBlock:^BOOL(NSData * data, NSError ** errorPtr) {
+        #pragma unused(errorPtr)
+        [seen appendData:data];
+        return YES;
+    } finishBlock:nil] autorelease];
+    writer = [[[QHTTPCacheResponseConsumer alloc] initWithCache:cache URL:[url absoluteString]] autorelease];
+    CC_SHA1([body bytes], (CC_LONG) [body length], expectedDigest);
+    digester.expectedDigest = [NSData dataWithBytes:expectedDigest length:sizeof(expectedDigest)];
+
+    op = [[[QHTTPOperation alloc] initWithURL:url] autorelease];
+    op.responseConsumer = [QHTTPResponseConsumer chainWithConsumers:[NSArray arrayWithObjects:digester, tap, writer, nil]];
+    RunPreparedOperation(op);
+    WaitForCacheWrites(cache, [url absoluteString]);
+
+    STAssertTrue([op isFinished], @"Operation should finish", nil);
+    STAssertNil(op.error, nil, nil);
+    STAssertEquals([op.responseBody length], (NSUInteger) 0, @"The body should not be accumulated", nil);
+    STAssertEqualObjects(seen, body, @"Every chunk should pass through the chain", nil);
+    STAssertEqualObjects(digester.digest, digester.expectedDigest, nil, nil);
+    STAssertEqualObjects([cache dataForURL:[url absoluteString]], body, @"Body should be moved into the cache", nil);
+    STAssertEqualObjects([[cache validatorsForURL:[url absoluteString]] objectForKey:kSGCValidatorETagKey], @"\"v1\"", nil, nil);
+
+    // The writer follows the same rules as the operation's own cache, so a private 
+    // response is swallowed but not stored.
+
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/private/large", (unsigned) server.port]];
+    writer = [[[QHTTPCacheResponseConsumer alloc] initWithCache:cache URL:[url absoluteString]] autorelease];
+    op = [[[QHTTPOperation alloc] initWithURL:url] autorelease];
+    op.responseConsumer = writer;
+    RunPreparedOperation(op);
+    WaitForCacheWrites(cache, [url absoluteString]);
+
+    STAssertNil(op.error, nil, nil);
+    STAssertFalse([cache hasDataForURL:[url absoluteString]], @"A private response should not be streamed into the cache", nil);
+
+    [cache removeAll:YES];
+    [server stop];
+}
+
+
+- (void)responseConsumerDidPause:(QHTTPResponseConsumer *)consumer {
+    #pragma unused(consumer)
+    STAssertFalse(_consumerPaused, @"Pauses should not nest", nil);
+    _consumerPaused = YES;
+}
+
+
+- (void)responseConsumerDidResume:(QHTTPResponseConsumer *)consumer {
+    #pragma unused(consumer)
+    _consumerPaused = NO;
+}
+
+
+- (void)testFileConsumerWritesInOrderAndResumes {
+    NSString * path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"SGURLCacheTest-file"];
+    NSURL * url = [NSURL URLWithString:@"http://127.0.0.1/file"];
+    NSMutableData * expected = [NSMutableData data];
+    QHTTPFileResponseConsumer * consumer;
+    NSHTTPURLResponse * response;
+    NSError * error;
+
+    // A full response, in many small chunks, with so little room in flight that the
+    // consumer has to pause us, as it would an operation, while the writes catch up.
+
+    consumer = [[[QHTTPFileResponseConsumer alloc] initWithPath:path] autorelease];
+    consumer.maximumBytesInFlight = 3000;
+    consumer.flowControl = self;
+    _consumerPaused = NO;
+    response = [[[NSHTTPURLResponse alloc] initWithURL:url statusCode:200 HTTPVersion:@"HTTP/1.1" headerFields:
+                 [NSDictionary dictionaryWithObject:@"60000" forKey:@"Content-Length"]] autorelease];
+    STAssertTrue([consumer startWithResponse:response error:&error], nil, nil);
+    for (NSUInteger i = 0; i < 60; i++) {
+        NSData * chunk = DataOfLength(1000, (char) ('a' + (i % 26)));
+        NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow:10.0];
+
+        while (_consumerPaused && [deadline timeIntervalSinceNow] > 0) {
+            usleep(1000);
+        }
+        STAssertFalse(_consumerPaused, @"The consumer should resume once the writes catch up", nil);
+        [expected appendData:chunk];
+        STAssertTrue([consumer consumeData:chunk error:&error], nil, nil);
+    }
+
+    // Fail part way through; what's been written stays, and the consumer isn't left paused.
+
+    [consumer abortConsuming];
+    STAssertFalse(_consumerPaused, nil, nil);
+    STAssertEquals(consumer.fileLength, (unsigned long long) 60000, nil, nil);
+    STAssertEqualObjects([NSData dataWithContentsOfFile:path], expected, @"Chunks should land in order", nil);
+
+    // Resume with a 206 for the rest.
+
+    consumer = [[[QHTTPFileResponseConsumer alloc] initWithPath:path] autorelease];
+    consumer.resumeOffset = 60000;
+    response = [[[NSHTTPURLResponse alloc] initWithURL:url statusCode:206 HTTPVersion:@"HTTP/1.1" headerFields:
+                 [NSDictionary dictionaryWithObject:@"bytes 60000-60999/61000" forKey:@"Content-Range"]] autorelease];
+    STAssertTrue([consumer startWithResponse:response error:&error], nil, nil);
+    [expected appendData:DataOfLength(1000, 'z')];
+    STAssertTrue([consumer consumeData:DataOfLength(1000, 'z') error:&error], nil, nil);
+    STAssertTrue([consumer finishConsuming:&error], nil, nil);
+    STAssertEqualObjects([NSData dataWithContentsOfFile:path], expected, @"The rest should be appended", nil);
+
+    // A 206 for the wrong range is rejected, and a 200 starts again.
+
+    consumer = [[[QHTTPFileResponseConsumer alloc] initWithPath:path] autorelease];
+    consumer.resumeOffset = 61000;
+    STAssertFalse([consumer startWithResponse:response error:&error], @"Mismatched Content-Range should fail", nil);
+    [consumer abortConsuming];
+
+    consumer = [[[QHTTPFileResponseConsumer alloc] initWithPath:path] autorelease];
+    consumer.resumeOffset = 61000;
+    response = [[[NSHTTPURLResponse alloc] initWithURL:url statusCode:200 HTTPVersion:@"HTTP/1.1" headerFields:nil] autorelease];
+    STAssertTrue([consumer startWithResponse:response error:&error], nil, nil);
+    STAssertTrue([consumer consumeData:[kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding] error:&error], nil, nil);
+    STAssertTrue([consumer finishConsuming:&error], nil, nil);
+    STAssertEqualObjects([NSData dataWithContentsOfFile:path], [kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding], @"A 200 should replace the file", nil);
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+
+- (void)testFileDownloadOfCachedURLIsUnconditional {
+    SGURLCache * cache = [[[SGURLCache alloc] initWithName:@"SGURLCacheTest"] autorelease];
+    SGTestHTTPServer * server = StartValidatingServer();
+    NSData * body = [kSGURLCacheTestBody dataUsingEncoding:NSASCIIStringEncoding];
+    NSString * path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"SGURLCacheTest-download"];
+    SGURLCache * savedCache = [[[SGNetworkManager sharedManager].URLCache retain] autorelease];
+    QHTTPOperation * op;
+    NSURL * url;
+
+    STAssertNotNil(server, @"Stub server should start", nil);
+    [cache removeAll:YES];
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+    url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/feed", (unsigned) server.port]];
+
+    // Put the body and its validators in the cache.
+
+    op = RunOperation(url, cache);
+    STAssertNil(op.error, nil, nil);
+    STAssertEqualObjects([cache dataForURL:[url absoluteString]], body, @"Body should be cached", nil);
+
+    // A download to a file can't be answered from the cache, so it mustn't be made
+    // conditional, even though the cache has the URL; a 304 would leave it with nothing.
+
+    [SGNetworkManager sharedManager].URLCache = cache;
+    op = [[[QHTTPOperation alloc] initWithRequest:[[SGNetworkManager sharedManager] requestToGetURL:url]] autorelease];
+    [SGNetworkManager sharedManager].URLCache = savedCache;
+    op.cache = cache;
+    op.responseConsumer = [[[QHTTPFileResponseConsumer alloc] initWithPath:path] autorelease];
+    RunPreparedOperation(op);
+
+    STAssertTrue([op isFinished], @"Operation should finish", nil);
+    STAssertNil(op.error, @"The download should not get a 304", nil);
+    STAssertEquals([op.lastResponse statusCode], (NSInteger) 200, nil, nil);
+    STAssertEqualObjects([NSData dataWithContentsOfFile:path], body, @"The body should be in the file", nil);
+    STAssertEquals(server.requests.count, (NSUInteger) 2, nil, nil);
+    STAssertTrue([[[server.requests objectAtIndex:1] lowercaseString] rangeOfString:@"if-none-match"].location == NSNotFound,
+                 @"The download should be unconditional", nil);
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+    [cache removeAll:YES];
+    [server stop];
+}
+
+@end
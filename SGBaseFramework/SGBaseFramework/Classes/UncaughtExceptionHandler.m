@@ -13,6 +13,7 @@
 //
 
 #import "UncaughtExceptionHandler.h"
+#import "SGQLog.h"
 #include <libkern/OSAtomic.h>
 #include <execinfo.h>
 
@@ -133,6 +134,10 @@ void HandleException(NSException *exception)
 		return;
 	}
 	
+	// Goes straight into the QLog crash ring, so it survives even if we never
+	// get as far as flushing the log.
+	SGQLogFault(@"crash", @"Uncaught exception %@: %@", [exception name], [exception reason]);
+	
 	NSArray *callStack = [UncaughtExceptionHandler backtrace];
 	NSMutableDictionary *userInfo =
 		[NSMutableDictionary dictionaryWithDictionary:[exception userInfo]];
@@ -158,6 +163,8 @@ void SignalHandler(int signal)
 		return;
 	}
 	
+	SGQLogFault(@"crash", @"Signal %d was raised", signal);
+	
 	NSMutableDictionary *userInfo =
 		[NSMutableDictionary
 			dictionaryWithObject:[NSNumber numberWithInt:signal]
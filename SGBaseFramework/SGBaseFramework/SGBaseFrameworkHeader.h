@@ -41,6 +41,14 @@
 #import "Classes/SGNetworkManager.h"
 #import "Classes/QHTTPOperation.h"
 #import "Classes/RetryingHTTPOperation.h"
+#import "Classes/QHTTPResponseConsumer.h"
+#import "Classes/SGURLCache.h"
+#import "Classes/SGImageDecodeOperation.h"
+#import "Classes/SGTransferWindowController.h"
+#import "Classes/SGOperationRegistry.h"
+#import "Classes/SGBufferPool.h"
+#import "Classes/SGRetryBudget.h"
+#import "Classes/SGRunLoopThreadPool.h"
 
 // CoreData
 #import "Classes/SGCoreDataController.h"